@@ -0,0 +1,271 @@
+#include "utils.h"
+#include "flaggedarrayset.h"
+#include "relayprocess.h"
+#include "syntheticblock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+/*
+ * Benchmark suite, run with relaynetworktest bench [options] (see usage() below).
+ * Blocks are generated rather than read from block.txt, so sizes/relay ratios can be
+ * swept freely, and the results are written as JSON for tracking between releases.
+ */
+
+/*****************
+ **** Harness ****
+ *****************/
+struct BenchOptions {
+	uint32_t iterations;
+	std::string filter;
+	std::string json_path;
+};
+
+static std::vector<std::string> results;
+
+// Runs setup (untimed) and then run (timed) iterations times. ops and bytes are the
+// work done by each run, and are used to report per-op times and throughput.
+static void bench(const BenchOptions& options, const std::string& name, const std::string& params, uint64_t ops, uint64_t bytes,
+		const std::function<void (void)>& setup, const std::function<void (void)>& run) {
+	if (name.find(options.filter) == std::string::npos)
+		return;
+
+	std::vector<double> ns;
+	for (uint32_t i = 0; i < options.iterations; i++) {
+		setup();
+		auto start = std::chrono::steady_clock::now();
+		run();
+		ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+	}
+	std::sort(ns.begin(), ns.end());
+	double mean = 0;
+	for (double t : ns)
+		mean += t / ns.size();
+	double median = ns[ns.size() / 2];
+
+	char buf[1024];
+	snprintf(buf, sizeof(buf), "{\"name\": \"%s\", \"params\": %s, \"iterations\": %u, \"ops\": %lu, \"bytes\": %lu, "
+			"\"ns_min\": %.0f, \"ns_median\": %.0f, \"ns_mean\": %.0f, \"ns_max\": %.0f, \"ns_per_op\": %.2f, \"mb_per_sec\": %.2f}",
+			name.c_str(), params.c_str(), options.iterations, (unsigned long)ops, (unsigned long)bytes,
+			ns.front(), median, mean, ns.back(), median / ops, bytes ? bytes / (median / 1000) : 0.0);
+	results.push_back(buf);
+	fprintf(stderr, "%-28s %-80s median %12.3f ms  %10.2f ns/op\n", name.c_str(), params.c_str(), median / 1000000, median / ops);
+}
+
+
+
+/********************
+ **** Benchmarks ****
+ ********************/
+static void bench_sha256(const BenchOptions& options) {
+	std::mt19937_64 rand(1);
+	std::vector<unsigned char> data(1024 * 1024);
+	for (unsigned char& c : data)
+		c = rand();
+
+	sha256_for_each_implementation([&](const char* name, void (*transform)(void*, uint32_t[8], uint64_t)) {
+		uint32_t state[8] = {0};
+		bench(options, "sha256_transform", std::string("{\"implementation\": \"") + name + "\", \"blocks\": 16384}", 16384, data.size(),
+			[]() {}, [&]() { transform(&data[0], state, data.size() / 64); });
+	});
+
+	const size_t count = 4096, len = 250;
+	std::vector<const unsigned char*> inputs(count);
+	std::vector<uint64_t> lens(count, len);
+	std::vector<unsigned char> hashes(32 * count);
+	std::vector<unsigned char*> res(count);
+	for (size_t i = 0; i < count; i++) {
+		inputs[i] = &data[i * len];
+		res[i] = &hashes[32 * i];
+	}
+	bench(options, "double_sha256", "{\"messages\": 4096, \"message_size\": 250}", count, count * len,
+		[]() {}, [&]() {
+			for (size_t i = 0; i < count; i++)
+				double_sha256(inputs[i], res[i], len);
+		});
+	bench(options, "double_sha256_multi", "{\"messages\": 4096, \"message_size\": 250, \"lanes\": " + std::to_string(double_sha256_lanes()) + "}", count, count * len,
+		[]() {}, [&]() { double_sha256_multi(&inputs[0], &lens[0], &res[0], count); });
+	bench(options, "double_sha256_64_multi", "{\"messages\": 4096, \"lanes\": " + std::to_string(double_sha256_lanes()) + "}", count, count * 64,
+		[]() {}, [&]() { double_sha256_64_multi(&data[0], &hashes[0], count / 2); });
+}
+
+static void bench_fas(const BenchOptions& options, const SyntheticBlockParams& params, const SyntheticBlock& block) {
+	const std::vector<std::shared_ptr<std::vector<unsigned char> > >& txn = block.prerelayed;
+	if (txn.empty())
+		return;
+	const std::string json = params.json();
+	std::unique_ptr<FlaggedArraySet> fas;
+	auto fill = [&]() {
+		fas.reset(new FlaggedArraySet(65000, MAX_FAS_TOTAL_SIZE));
+		for (const auto& tx : txn)
+			fas->add(tx, tx->size());
+	};
+
+	bench(options, "fas_add", json, txn.size(), 0,
+		[&]() { fas.reset(new FlaggedArraySet(65000, MAX_FAS_TOTAL_SIZE)); },
+		[&]() {
+			for (const auto& tx : txn)
+				fas->add(tx, tx->size());
+		});
+	// Not every transaction may fit, if the block is larger than MAX_FAS_TOTAL_SIZE
+	size_t found = 0;
+	bench(options, "fas_contains", json, txn.size(), 0, fill,
+		[&]() {
+			for (const auto& tx : txn)
+				found += fas->contains(tx);
+		});
+	// In block order, as maybe_compress_block does it
+	bench(options, "fas_remove_by_tx", json, block.txn.size(), 0, fill,
+		[&]() {
+			for (const auto& tx : block.txn)
+				fas->remove(block.block.begin() + tx.first, block.block.begin() + tx.first + tx.second);
+		});
+	fill();
+	const size_t fas_size = fas->size();
+	bench(options, "fas_remove_by_index", json, fas_size, 0, fill,
+		[&]() {
+			std::shared_ptr<std::vector<unsigned char> > tx;
+			unsigned char hash[32];
+			for (size_t i = 0; i < fas_size; i++)
+				ALWAYS_ASSERT(fas->remove((i * 7919) % (fas_size - i), tx, hash));
+		});
+}
+
+static void bench_merkle(const BenchOptions& options, const SyntheticBlockParams& params, const SyntheticBlock& block) {
+	const unsigned char* root = &block.block[sizeof(struct bitcoin_msg_header) + 4 + 32];
+	bench(options, "merkle_tree_builder", params.json(), block.txn.size(), block.block.size(), []() {},
+		[&]() {
+			MerkleTreeBuilder builder(block.txn.size());
+			for (size_t i = 0; i < block.txn.size(); i++)
+				builder.queueTxHash(i, block.block, block.txn[i].first, block.txn[i].second);
+			builder.hashQueued(block.block);
+			ALWAYS_ASSERT(builder.merkleRootMatches(root));
+		});
+}
+
+static void bench_compression(const BenchOptions& options, const SyntheticBlockParams& params, const SyntheticBlock& block) {
+	for (int coding = 0; coding < 2; coding++) {
+		const bool delta = coding;
+		const std::string json = params.json().substr(0, params.json().size() - 1) + ", \"delta_indexes\": " + (delta ? "true" : "false") + "}";
+
+		std::unique_ptr<RelayNodeCompressor> sender, receiver;
+		auto fill_sender = [&]() {
+			sender.reset(new RelayNodeCompressor(false, delta));
+			for (const auto& tx : block.prerelayed)
+				sender->get_relay_transaction(tx);
+		};
+		auto fill_receiver = [&]() {
+			receiver.reset(new RelayNodeCompressor(false, delta));
+			for (const auto& tx : block.prerelayed)
+				receiver->recv_tx(tx);
+		};
+
+		std::shared_ptr<std::vector<unsigned char> > compressed;
+		bench(options, "maybe_compress_block", json, block.txn.size(), block.block.size(), fill_sender,
+			[&]() {
+				auto res = sender->maybe_compress_block(block.hash, block.block, true);
+				ALWAYS_ASSERT(!std::get<1>(res));
+				compressed = std::get<0>(res);
+			});
+		if (!compressed) {
+			fill_sender();
+			compressed = std::get<0>(sender->maybe_compress_block(block.hash, block.block, true));
+		}
+
+		// check_merkle is off as the decompressed block's real hash has no proof-of-work
+		// (MerkleTreeBuilder is benchmarked on its own above)
+		bench(options, "decompress_relay_block", json, block.txn.size(), compressed->size(), fill_receiver,
+			[&]() {
+				size_t readpos = sizeof(struct relay_msg_header);
+				BufferedReader reader([&](size_t min_bytes, size_t& avail) {
+						ALWAYS_ASSERT(readpos + min_bytes <= compressed->size());
+						avail = compressed->size() - readpos;
+						return &(*compressed)[readpos];
+					}, [&](size_t nbyte) { readpos += nbyte; });
+				auto res = receiver->decompress_relay_block(reader, block.txn.size(), false);
+				ALWAYS_ASSERT(!std::get<2>(res));
+			});
+	}
+}
+
+
+
+static void usage(const char* argv0) {
+	printf("USAGE: %s bench [--iterations=N] [--filter=NAME] [--json=FILE] [--txcount=N] [--tx-size=BYTES] [--tx-size-sigma=S] [--tx-size-max=BYTES] [--prerelay=FRACTION] [--seed=N]\n", argv0);
+	printf("Without --txcount, a sweep of 1MB and 4MB blocks at several pre-relay ratios is run\n");
+}
+
+int run_benchmarks(int argc, const char** argv) {
+	BenchOptions options { 20, "", "" };
+	SyntheticBlockParams custom { 0, 250, 60, MAX_RELAY_TRANSACTION_BYTES, 1.0, 0.9, 42 };
+
+	for (int i = 2; i < argc; i++) {
+		const char* eq = strchr(argv[i], '=');
+		std::string arg(argv[i], eq ? eq - argv[i] : strlen(argv[i]));
+		const char* value = eq ? eq + 1 : "";
+		if (arg == "--iterations")
+			options.iterations = std::max(1, atoi(value));
+		else if (arg == "--filter")
+			options.filter = value;
+		else if (arg == "--json")
+			options.json_path = value;
+		else if (arg == "--txcount")
+			custom.tx_count = std::min(100000, std::max(1, atoi(value)));
+		else if (arg == "--tx-size")
+			custom.tx_size = std::max(1, atoi(value));
+		else if (arg == "--tx-size-sigma")
+			custom.tx_size_sigma = atof(value);
+		else if (arg == "--tx-size-max")
+			custom.tx_size_max = std::max(1, atoi(value));
+		else if (arg == "--prerelay")
+			custom.prerelay = atof(value);
+		else if (arg == "--seed")
+			custom.seed = atoll(value);
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+#ifndef NDEBUG
+	fprintf(stderr, "WARNING: asserts are enabled (which makes FlaggedArraySet quadratic), build with variant=bench for real numbers\n");
+#endif
+
+	std::vector<SyntheticBlockParams> blocks;
+	if (custom.tx_count)
+		blocks.push_back(custom);
+	else {
+		for (uint32_t tx_count : { 2400, 9600 }) // ~1MB and ~4MB
+			for (double prerelay : { 0.0, 0.5, 0.9, 1.0 })
+				blocks.push_back(SyntheticBlockParams { tx_count, 250, 60, MAX_RELAY_TRANSACTION_BYTES, 1.0, prerelay, 42 });
+	}
+
+	bench_sha256(options);
+	for (const SyntheticBlockParams& params : blocks) {
+		SyntheticBlock block = generate_block(params);
+		fprintf(stderr, "Generated %lu byte block with %u transactions, %lu pre-relayed\n", (unsigned long)block.block.size() - sizeof(struct bitcoin_msg_header), params.tx_count, (unsigned long)block.prerelayed.size());
+		// The FAS and merkle benchmarks don't depend on the pre-relay ratio, so only run them once per size
+		if (params.prerelay == blocks.back().prerelay) {
+			bench_fas(options, params, block);
+			bench_merkle(options, params, block);
+		}
+		bench_compression(options, params, block);
+	}
+
+	FILE* out = options.json_path.empty() ? stdout : fopen(options.json_path.c_str(), "w");
+	if (!out) {
+		fprintf(stderr, "Failed to open %s\n", options.json_path.c_str());
+		return 1;
+	}
+	fprintf(out, "{\"sha256_implementation\": \"%s\", \"benchmarks\": [\n", sha256_implementation().c_str());
+	for (size_t i = 0; i < results.size(); i++)
+		fprintf(out, "\t%s%s\n", results[i].c_str(), i == results.size() - 1 ? "" : ",");
+	fprintf(out, "]}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -18,6 +18,7 @@
 
 #include "crypto/sha2.h"
 #include "mruset.h"
+#include "log.h"
 #include "utils.h"
 #include "connection.h"
 
@@ -35,8 +36,8 @@ private:
 	const std::function<void (P2PConnection*, std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
 
 	std::mutex seen_mutex;
-	mruset<std::vector<unsigned char> > txnAlreadySeen;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
+	hashmruset txnAlreadySeen;
+	hashmruset blocksAlreadySeen;
 
 public:
 	P2PConnection(int sockIn, std::string hostIn,
@@ -63,7 +64,7 @@ private:
 			if (header.length > 5000000)
 				return disconnect("got message too large");
 
-			auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct bitcoin_msg_header) + uint32_t(header.length));
+			auto msg = pooled_buffer(sizeof(struct bitcoin_msg_header) + uint32_t(header.length));
 			{
 				uint32_t hash[8];
 				double_sha256_init(hash);
@@ -94,7 +95,7 @@ private:
 					return disconnect("got short version");
 				struct bitcoin_version_start *their_version = (struct bitcoin_version_start*) &(*msg)[sizeof(struct bitcoin_msg_header)];
 
-				printf("%s Protocol version %u\n", host.c_str(), le32toh(their_version->protocol_version));
+				LOG("%s Protocol version %u\n", host.c_str(), le32toh(their_version->protocol_version));
 
 				struct bitcoin_version_with_header version_msg;
 				version_msg.version.start.timestamp = htole64(time(0));
@@ -122,7 +123,7 @@ private:
 			if (!strncmp(header.command, "ping", strlen("ping"))) {
 				memcpy(&header.command, "pong", sizeof("pong"));
 				memcpy(&(*msg)[0], &header, sizeof(struct bitcoin_msg_header));
-				do_send_bytes((char*)&(*msg)[0], sizeof(struct bitcoin_msg_header) + header.length);
+				do_send_bytes((char*)&(*msg)[0], sizeof(struct bitcoin_msg_header) + header.length, 0, OUTBOUND_CONTROL);
 				continue;
 			} else if (!strncmp(header.command, "inv", strlen("inv"))) {
 				std::lock_guard<std::mutex> lock(seen_mutex);
@@ -146,11 +147,11 @@ private:
 
 						const uint32_t type = (*(it-(1+32)) << 24) | (*(it-(2+32)) << 16) | (*(it-(3+32)) << 8) | *(it-(4+32));
 						if (type == MSG_TX) {
-							if (!txnAlreadySeen.insert(hash).second)
+							if (!txnAlreadySeen.insert(hash))
 								continue;
 							setRequestTxn.insert(hash);
 						} else if (type == MSG_BLOCK) {
-							if (!blocksAlreadySeen.insert(hash).second)
+							if (!blocksAlreadySeen.insert(hash))
 								continue;
 							setRequestBlocks.insert(hash);
 						} else
@@ -176,9 +177,7 @@ private:
 						for (auto& hash : setRequestBlocks) {
 							struct timeval tv;
 							gettimeofday(&tv, NULL);
-							for (unsigned int i = 0; i < hash.size(); i++)
-								printf("%02x", hash[hash.size() - i - 1]);
-							printf(" requested from %s at %lu\n", host.c_str(), uint64_t(tv.tv_sec) * 1000 + uint64_t(tv.tv_usec) / 1000);
+							LOG(HASH_FORMAT" requested from %s at %lu\n", HASH_PRINT(&hash[0]), host.c_str(), uint64_t(tv.tv_sec) * 1000 + uint64_t(tv.tv_usec) / 1000);
 						}
 					}
 
@@ -226,10 +225,10 @@ public:
 
 		{
 			std::lock_guard<std::mutex> lock(seen_mutex);
-			if (!blocksAlreadySeen.insert(hash).second)
+			if (!blocksAlreadySeen.insert(hash))
 				return;
 		}
-		do_send_bytes(block);
+		do_send_bytes(block, 0, OUTBOUND_BLOCK);
 	}
 };
 
@@ -238,7 +237,7 @@ public:
 
 int main(int argc, char** argv) {
 	if (argc != 2 || strlen(argv[1]) != 7) {
-		printf("USAGE %s 7-char-LOCATION\n", argv[0]);
+		LOG("USAGE %s 7-char-LOCATION\n", argv[0]);
 		return -1;
 	}
 	location = argv[1];
@@ -251,7 +250,7 @@ int main(int argc, char** argv) {
 
 	if ((blockonly_fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0 ||
 		     (txes_fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
-		printf("Failed to create socket\n");
+		LOG("Failed to create socket\n");
 		return -1;
 	}
 
@@ -265,7 +264,7 @@ int main(int argc, char** argv) {
 	if (setsockopt(blockonly_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ||
 			bind(blockonly_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
 			listen(blockonly_fd, 3) < 0) {
-		printf("Failed to bind 8334: %s\n", strerror(errno));
+		LOG("Failed to bind 8334: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -273,7 +272,7 @@ int main(int argc, char** argv) {
 	if (setsockopt(txes_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ||
 			bind(txes_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
 			listen(txes_fd, 3) < 0) {
-		printf("Failed to bind 8335: %s\n", strerror(errno));
+		LOG("Failed to bind 8335: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -306,9 +305,7 @@ int main(int argc, char** argv) {
 			}
 
 			gettimeofday(&finish_send, NULL);
-			for (unsigned int i = 0; i < fullhash.size(); i++)
-				printf("%02x", fullhash[fullhash.size() - i - 1]);
-			printf(" BLOCK %lu %s %s %u / %u TIMES: %ld %ld\n", uint64_t(start_send.tv_sec) * 1000 + uint64_t(start_send.tv_usec) / 1000, from->host.c_str(),
+			LOG(HASH_FORMAT" BLOCK %lu %s %s %u / %u TIMES: %ld %ld\n", HASH_PRINT(&fullhash[0]), uint64_t(start_send.tv_sec) * 1000 + uint64_t(start_send.tv_usec) / 1000, from->host.c_str(),
 					localSet.count(from) ? "LOCALRELAY" : "REMOTEP2P", (unsigned)bytes->size(), (unsigned)bytes->size(),
 					int64_t(start_send.tv_sec - start_recv.tv_sec)*1000 + (int64_t(start_send.tv_usec) - start_recv.tv_usec)/1000,
 					int64_t(finish_send.tv_sec - start_send.tv_sec)*1000 + (int64_t(finish_send.tv_usec) - start_send.tv_usec)/1000);
@@ -330,7 +327,7 @@ int main(int argc, char** argv) {
 			}
 		};
 
-	printf("Awaiting connections\n");
+	LOG("Awaiting connections\n");
 
 	while (true) {
 		FD_SET(blockonly_fd, &twofds);
@@ -340,7 +337,7 @@ int main(int argc, char** argv) {
 		timeout.tv_usec = 0;
 
 		if (select(FD_SETSIZE, &twofds, NULL, NULL, &timeout) < 0) {
-			printf("Failed to select (%s)\n", strerror(errno));
+			LOG("Failed to select (%s)\n", strerror(errno));
 			return -1;
 		}
 
@@ -349,7 +346,7 @@ int main(int argc, char** argv) {
 		std::string droppostfix(".uptimerobot.com");
 		if (FD_ISSET(blockonly_fd, &twofds)) {
 			if ((new_fd = accept(blockonly_fd, (struct sockaddr *) &addr, &addr_size)) < 0) {
-				printf("Failed to accept\n");
+				LOG("Failed to accept\n");
 				return -1;
 			}
 
@@ -367,7 +364,7 @@ int main(int argc, char** argv) {
 		}
 		if (FD_ISSET(txes_fd, &twofds)) {
 			if ((new_fd = accept(txes_fd, (struct sockaddr *) &addr, &addr_size)) < 0) {
-				printf("Failed to accept\n");
+				LOG("Failed to accept\n");
 				return -1;
 			}
 
@@ -404,6 +401,6 @@ int main(int argc, char** argv) {
 			} else
 				it++;
 		}
-		fprintf(stderr, "Have %lu local connection(s), %lu block connection(s) and %lu txes conenction(s)\n", localSet.size(), blockSet.size() - txesSet.size(), txesSet.size());
+		LOG_STDERR("Have %lu local connection(s), %lu block connection(s) and %lu txes conenction(s)\n", localSet.size(), blockSet.size() - txesSet.size(), txesSet.size());
 	}
 }
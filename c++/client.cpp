@@ -25,8 +25,10 @@
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
 #include "relayprocess.h"
+#include "log.h"
 #include "utils.h"
 #include "p2pclient.h"
+#include "udprelay.h"
 
 
 
@@ -46,6 +48,13 @@ private:
 	std::atomic_bool connected;
 
 	RelayNodeCompressor compressor;
+	BlockSequencer sequencer;
+
+	// If RELAY_UDP is set, blocks are asked for over UDP, and any which never turn up are
+	// asked for again over TCP (as resend_id, while sequencer is stalled on it)
+	bool udp_enabled;
+	std::shared_ptr<UDPBlockReceiver> udp;
+	uint64_t resend_id;
 
 public:
 	RelayNetworkClient(const char* serverHostIn,
@@ -54,7 +63,8 @@ public:
 						const std::function<bool ()>& bitcoind_connected_in)
 		// Ping time(out) is 40 seconds (5000000/250*2 msec) - first ping will only happen, at the quickest, at half that
 			: KeepaliveOutboundPersistentConnection(serverHostIn, 8336, MAX_FAS_TOTAL_SIZE / OUTBOUND_THROTTLE_BYTES_PER_MS * 2), RELAY_DECLARE_CONSTRUCTOR_EXTENDS,
-			provide_block(provide_block_in), provide_transaction(provide_transaction_in), bitcoind_connected(bitcoind_connected_in), connected(false), compressor(false) {
+			provide_block(provide_block_in), provide_transaction(provide_transaction_in), bitcoind_connected(bitcoind_connected_in), connected(false), compressor(false, true),
+			udp_enabled(getenv("RELAY_UDP") && atoi(getenv("RELAY_UDP"))), resend_id(0) {
 		construction_done();
 	}
 
@@ -63,12 +73,131 @@ private:
 		connected = false;
 	}
 
+	// Takes a BLOCK message's payload (of message_size transactions) from reader, returning an error or NULL
+	const char* recv_block(BufferedReader& reader, uint32_t message_size) {
+		auto res = compressor.decompress_relay_block(reader, message_size, false);
+		reader.release();
+		if (std::get<2>(res))
+			return std::get<2>(res);
+
+		provide_block(*std::get<1>(res));
+
+		auto fullhash = *std::get<3>(res).get();
+		LOG_STAMPED(HASH_FORMAT" recv'd, size %lu with %u bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)std::get<1>(res)->size() - sizeof(bitcoin_msg_header), std::get<0>(res));
+		return NULL;
+	}
+
+	// Takes a UDP_BLOCK message's payload from reader and then the block it points to off UDP,
+	// or asks for it over TCP and sets stalled if that never comes
+	const char* recv_udp_block(BufferedReader& reader, uint32_t message_size, bool& stalled) {
+		unsigned char marker[UDP_BLOCK_MARKER_SIZE];
+		if (message_size != UDP_BLOCK_MARKER_SIZE || !reader.read(marker, UDP_BLOCK_MARKER_SIZE))
+			return "failed to read UDP block";
+		reader.release();
+		if (!udp)
+			return "got UDP block without asking for UDP";
+
+		uint64_t id;
+		uint32_t length;
+		unsigned char hash[32];
+		std::vector<unsigned char> msg;
+		if (!UDPBlockReceiver::parse_marker(marker, id, length, hash))
+			return "got bad UDP block";
+		bool got_block = udp->wait_block(id, length, msg, std::chrono::seconds(UDP_BLOCK_TIMEOUT_SECS));
+
+		bool usable = got_block && msg.size() >= sizeof(relay_msg_header);
+		if (usable) {
+			unsigned char msg_hash[32];
+			double_sha256(&msg[0], msg_hash, msg.size());
+			// A BLOCK's length is its transaction count, recv_held checks it took up exactly msg
+			const relay_msg_header* block_header = (const relay_msg_header*)&msg[0];
+			usable = !memcmp(hash, msg_hash, 32) && block_header->magic == RELAY_MAGIC_BYTES && block_header->type == BLOCK_TYPE;
+		}
+		if (!usable) {
+			LOG_STAMPED("%s UDP block, asking for it over TCP\n", got_block ? "Got corrupt" : "Timed out waiting for");
+			uint64_t id_le = htole64(id);
+			maybe_do_send_bytes(relay_msg(UDP_RESEND_TYPE, &id_le, 8), 0, OUTBOUND_CONTROL);
+			resend_id = id;
+			stalled = true;
+			return NULL;
+		}
+		return recv_held(msg, stalled);
+	}
+
+	// Takes a TRANSACTION or TRANSACTIONS message's payload from reader
+	const char* recv_txn(uint32_t type, BufferedReader& reader, uint32_t message_size) {
+		if (type == TRANSACTION_TYPE) {
+			if (!compressor.maybe_recv_tx_of_size(message_size, true))
+				return "got freely relayed transaction too large";
+
+			auto tx = pooled_buffer(message_size);
+			if (!reader.read(tx->data(), message_size))
+				return "failed to read loose transaction data";
+			reader.release();
+
+			if (bitcoind_connected())
+				LOG("Received transaction of size %u from relay server\n", message_size);
+			else
+				LOG("ERROR: bitcoind is not (yet) connected!\n");
+
+			compressor.recv_tx(tx);
+			provide_transaction(tx);
+		} else {
+			std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+			const char* error = compressor.recv_tx_batch(reader, message_size, txn);
+			reader.release();
+			if (error)
+				return error;
+
+			if (bitcoind_connected())
+				LOG("Received %lu transactions totalling %u bytes from relay server\n", (unsigned long)txn.size(), message_size);
+			else
+				LOG("ERROR: bitcoind is not (yet) connected!\n");
+
+			for (auto& tx : txn)
+				provide_transaction(tx);
+		}
+		return NULL;
+	}
+
+	// Takes a whole (already-checked) BLOCK, UDP_BLOCK, TRANSACTION or TRANSACTIONS message
+	// out of msg, eg one the sequencer held (see BlockSequencer::apply_func)
+	const char* recv_held(const std::vector<unsigned char>& msg, bool& stalled) {
+		const relay_msg_header* header = (const relay_msg_header*)&msg[0];
+		size_t readpos = sizeof(relay_msg_header);
+		BufferedReader reader([&](size_t min_bytes, size_t& avail) {
+				if (readpos + min_bytes > msg.size())
+					return (const unsigned char*)NULL;
+				avail = msg.size() - readpos;
+				return (const unsigned char*)&msg[readpos];
+			}, [&](size_t nbyte) { readpos += nbyte; });
+		const char* error;
+		if (header->type == BLOCK_TYPE)
+			error = recv_block(reader, ntohl(header->length));
+		else if (header->type == UDP_BLOCK_TYPE)
+			error = recv_udp_block(reader, ntohl(header->length), stalled);
+		else
+			error = recv_txn(header->type, reader, ntohl(header->length));
+		reader.release();
+		if (!error && readpos != msg.size())
+			return "held message had trailing data";
+		return error;
+	}
+
 	void net_process(const std::function<void(std::string)>& disconnect) {
 		compressor.reset();
+		if (udp) {
+			udp->stop();
+			udp.reset();
+		}
+
+		sequencer.reset();
+		const BlockSequencer::apply_func apply_held = [&](const std::vector<unsigned char>& msg, bool& stalled) { return recv_held(msg, stalled); };
 
-		relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(strlen(VERSION_STRING)) };
-		maybe_do_send_bytes((char*)&version_header, sizeof(version_header));
-		maybe_do_send_bytes(VERSION_STRING, strlen(VERSION_STRING));
+		static const char version[] = VERSION_STRING "\0" VERSION_FEATURE_TX_BATCH " " VERSION_FEATURE_BLOCK_SEQ;
+		maybe_do_send_bytes(relay_msg(VERSION_TYPE, version, sizeof(version) - 1));
+		if (udp_enabled)
+			maybe_do_send_bytes(relay_msg(UDP_REQUEST_TYPE, NULL, 0));
 
 		connected = true;
 
@@ -82,7 +211,7 @@ private:
 
 			uint32_t message_size = ntohl(header.length);
 
-			if (message_size > 1000000)
+			if (message_size > 1000000 + (header.type == BLOCK_SEQ_TYPE || header.type == UDP_RESEND_TYPE ? BLOCK_SEQ_HEADER_SIZE : 0))
 				return disconnect("got message too large");
 
 			if (header.type == VERSION_TYPE) {
@@ -93,51 +222,107 @@ private:
 				if (strncmp(VERSION_STRING, data, std::min(sizeof(VERSION_STRING), size_t(message_size))))
 					return disconnect("unknown version string");
 				else {
-					STAMPOUT();
-					printf("Connected to relay node with protocol version %s\n", VERSION_STRING);
+					LOG_STAMPED("Connected to relay node with protocol version %s\n", VERSION_STRING);
 				}
 			} else if (header.type == SPONSOR_TYPE) {
 				char data[message_size];
 				if (read_all(data, message_size) < (int64_t)(message_size))
 					return disconnect("failed to read sponsor string");
 
-				printf("This node sponsored by: %s\n", asciifyString(std::string(data, data + message_size)).c_str());
+				LOG("This node sponsored by: %s\n", asciifyString(std::string(data, data + message_size)).c_str());
 			} else if (header.type == MAX_VERSION_TYPE) {
 				char data[message_size];
 				if (read_all(data, message_size) < (int64_t)(message_size))
 					return disconnect("failed to read max_version string");
 
 				if (strncmp(VERSION_STRING, data, std::min(sizeof(VERSION_STRING), size_t(message_size))))
-					printf("Relay network is using a later version (PLEASE UPGRADE)\n");
+					LOG("Relay network is using a later version (PLEASE UPGRADE)\n");
 				else
 					return disconnect("got MAX_VERSION of same version as us");
 			} else if (header.type == BLOCK_TYPE) {
-				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) { return this->read_all(buf, count); };
-				auto res = compressor.decompress_relay_block(do_read, message_size, false);
-				if (std::get<2>(res))
-					return disconnect(std::get<2>(res));
-
-				provide_block(*std::get<1>(res));
-
-				auto fullhash = *std::get<3>(res).get();
-				STAMPOUT();
-				printf(HASH_FORMAT" recv'd, size %lu with %u bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)std::get<1>(res)->size() - sizeof(bitcoin_msg_header), std::get<0>(res));
+				BufferedReader reader([&](size_t min_bytes, size_t& avail) { return this->peek(min_bytes, avail); }, [&](size_t nbyte) { this->consume(nbyte); });
+				const char* error = recv_block(reader, message_size);
+				if (error)
+					return disconnect(error);
+			} else if (header.type == UDP_OFFER_TYPE) {
+				unsigned char offer[UDP_OFFER_SIZE];
+				if (message_size != UDP_OFFER_SIZE || read_all((char*)offer, UDP_OFFER_SIZE) < UDP_OFFER_SIZE)
+					return disconnect("failed to read UDP offer");
+				if (!udp_enabled || udp)
+					return disconnect("got unrequested UDP offer");
+
+				uint64_t token;
+				memcpy(&token, offer, 8);
+				sockaddr_in6 addr;
+				if (!lookup_address(serverHost.c_str(), &addr))
+					continue;
+				memcpy(&addr.sin6_port, offer + 8, 2);
+				udp = UDPBlockReceiver::start(addr, le64toh(token));
+				if (udp)
+					LOG_STAMPED("Receiving blocks over UDP\n");
+			} else if (header.type == BLOCK_SEQ_TYPE || header.type == UDP_RESEND_TYPE) {
+				unsigned char seq_header[BLOCK_SEQ_HEADER_SIZE];
+				if (message_size < BLOCK_SEQ_HEADER_SIZE || read_all((char*)seq_header, BLOCK_SEQ_HEADER_SIZE) < (int64_t)BLOCK_SEQ_HEADER_SIZE)
+					return disconnect("failed to read BLOCK_SEQ header");
+
+				// seq is the block id for a UDP_RESEND
+				uint64_t seq;
+				relay_msg_header block_header;
+				memcpy(&seq, seq_header, 8);
+				memcpy(&block_header, seq_header + 8, sizeof(block_header));
+				seq = le64toh(seq);
+				uint32_t block_size = message_size - BLOCK_SEQ_HEADER_SIZE;
+				if (block_header.magic != RELAY_MAGIC_BYTES || (block_header.type != BLOCK_TYPE &&
+						(block_header.type != UDP_BLOCK_TYPE || header.type == UDP_RESEND_TYPE)))
+					return disconnect("got bad BLOCK_SEQ");
+				if (header.type == UDP_RESEND_TYPE && (!sequencer.stalled() || seq != resend_id))
+					return disconnect("got UDP_RESEND we did not ask for");
+
+				const char* error;
+				if (header.type == BLOCK_SEQ_TYPE && sequencer.can_apply_block(seq)) {
+					size_t consumed = 0;
+					bool stalled = false;
+					BufferedReader reader([&](size_t min_bytes, size_t& avail) { return this->peek(min_bytes, avail); }, [&](size_t nbyte) { consumed += nbyte; this->consume(nbyte); });
+					if (block_header.type == BLOCK_TYPE)
+						error = recv_block(reader, ntohl(block_header.length));
+					else
+						error = recv_udp_block(reader, ntohl(block_header.length), stalled);
+					reader.release();
+					if (!error && consumed != block_size)
+						error = "BLOCK_SEQ block had the wrong length";
+					if (!error && stalled)
+						sequencer.hold_stalled(seq);
+				} else {
+					std::vector<unsigned char> msg(sizeof(block_header) + block_size);
+					memcpy(&msg[0], &block_header, sizeof(block_header));
+					if (read_all((char*)&msg[sizeof(block_header)], block_size) < (int64_t)block_size)
+						return disconnect("failed to read BLOCK_SEQ block");
+					if (header.type == UDP_RESEND_TYPE)
+						error = sequencer.resume(std::move(msg), apply_held);
+					else
+						error = sequencer.hold_block(seq, std::move(msg));
+				}
+				if (error)
+					return disconnect(error);
 			} else if (header.type == END_BLOCK_TYPE) {
-			} else if (header.type == TRANSACTION_TYPE) {
-				if (!compressor.maybe_recv_tx_of_size(message_size, true))
-					return disconnect("got freely relayed transaction too large");
-
-				auto tx = std::make_shared<std::vector<unsigned char> > (message_size);
-				if (read_all((char*)&(*tx)[0], message_size) < (int64_t)(message_size))
-					return disconnect("failed to read loose transaction data");
-
-				if (bitcoind_connected())
-					printf("Received transaction of size %u from relay server\n", message_size);
-				else
-					printf("ERROR: bitcoind is not (yet) connected!\n");
-
-				compressor.recv_tx(tx);
-				provide_transaction(tx);
+			} else if (header.type == TRANSACTION_TYPE || header.type == TRANSACTIONS_TYPE) {
+				const char* error;
+				if (sequencer.can_apply_tx()) {
+					BufferedReader reader([&](size_t min_bytes, size_t& avail) { return this->peek(min_bytes, avail); }, [&](size_t nbyte) { this->consume(nbyte); });
+					error = recv_txn(header.type, reader, message_size);
+					sequencer.tx_applied();
+					if (!error)
+						error = sequencer.drain(apply_held);
+				} else {
+					std::vector<unsigned char> msg(sizeof(header) + message_size);
+					memcpy(&msg[0], &header, sizeof(header));
+					if (read_all((char*)&msg[sizeof(header)], message_size) < (int64_t)(message_size))
+						return disconnect("failed to read held transaction data");
+					sequencer.hold_tx(std::move(msg));
+					error = NULL;
+				}
+				if (error)
+					return disconnect(error);
 			} else if (header.type == PING_TYPE) {
 				char data[8 + sizeof(relay_msg_header)];
 				if (message_size != 8 || read_all(&data[sizeof(relay_msg_header)], 8) < 8)
@@ -145,7 +330,7 @@ private:
 
 				relay_msg_header pong_msg_header = { RELAY_MAGIC_BYTES, PONG_TYPE, htonl(8) };
 				memcpy(data, &pong_msg_header, sizeof(pong_msg_header));
-				maybe_do_send_bytes(data, 8 + sizeof(relay_msg_header));
+				maybe_do_send_bytes(data, 8 + sizeof(relay_msg_header), 0, OUTBOUND_CONTROL);
 			} else if (header.type == PONG_TYPE) {
 				uint64_t nonce;
 				if (message_size != 8 || read_all((char*)&nonce, 8) < 8)
@@ -163,7 +348,7 @@ protected:
 		std::vector<unsigned char> *msg = new std::vector<unsigned char>((unsigned char*)&pong_msg_header, ((unsigned char*)&pong_msg_header) + sizeof(pong_msg_header));
 		msg->resize(msg->size() + 8);
 		memcpy(&(*msg)[sizeof(pong_msg_header)], &nonce, 8);
-		maybe_do_send_bytes(std::shared_ptr<std::vector<unsigned char> >(msg));
+		maybe_do_send_bytes(std::shared_ptr<std::vector<unsigned char> >(msg), 0, OUTBOUND_CONTROL);
 	}
 
 public:
@@ -183,7 +368,7 @@ public:
 
 		maybe_do_send_bytes((char*)&msg[0], msg.size());
 		if (bitcoind_connected())
-			printf("Sent transaction of size %lu%s to relay server\n", (unsigned long)tx->size(), send_oob ? " (out-of-band)" : "");
+			LOG("Sent transaction of size %lu%s to relay server\n", (unsigned long)tx->size(), send_oob ? " (out-of-band)" : "");
 	}
 
 	void receive_block(const std::vector<unsigned char>& block) {
@@ -195,7 +380,7 @@ public:
 
 		auto tuple = compressor.maybe_compress_block(fullhash, block, false);
 		if (std::get<1>(tuple)) {
-			printf("Failed to process block from bitcoind (%s)\n", std::get<1>(tuple));
+			LOG("Failed to process block from bitcoind (%s)\n", std::get<1>(tuple));
 			return;
 		}
 		auto compressed_block = std::get<0>(tuple);
@@ -205,8 +390,7 @@ public:
 		memcpy(&(*compressed_block)[compressed_block->size() - sizeof(header)], &header, sizeof(header));
 		maybe_do_send_bytes((char*)&(*compressed_block)[0], compressed_block->size());
 
-		STAMPOUT();
-		printf(HASH_FORMAT" sent, size %lu with %lu bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)block.size(), (unsigned long)compressed_block->size());
+		LOG_STAMPED(HASH_FORMAT" sent, size %lu with %lu bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)block.size(), (unsigned long)compressed_block->size());
 	}
 };
 
@@ -264,8 +448,8 @@ int main(int argc, char** argv) {
 	bool validPort = false;
 	try { std::stoul(argv[2]); validPort = true; } catch (std::exception& e) {}
 	if ((argc != 3 && argc != 4) || !validPort) {
-		printf("USAGE: %s BITCOIND_ADDRESS BITCOIND_PORT [ server ]\n", argv[0]);
-		printf("Relay server is automatically selected by pinging available servers, unless one is specified\n");
+		LOG("USAGE: %s BITCOIND_ADDRESS BITCOIND_PORT [ server ]\n", argv[0]);
+		LOG("Relay server is automatically selected by pinging available servers, unless one is specified\n");
 		return -1;
 	}
 
@@ -274,6 +458,7 @@ int main(int argc, char** argv) {
 	if (WSAStartup(MAKEWORD(2,2), &wsaData))
 		return -1;
 #endif
+	LOG("Using SHA256 implementation %s\n", sha256_implementation().c_str());
 
 	const char* relay = "public.%02d.relay.mattcorallo.com";
 	char host[std::max(argc == 3 ? 0 : strlen(argv[3]), strlen(relay))];
@@ -292,7 +477,7 @@ int main(int argc, char** argv) {
 				if (connect_durations[i] != std::chrono::milliseconds::max()) {
 					std::string aka;
 					sprintf(host, relay, i);
-					printf("Server %d (%s) took %lld ms to respond %d times.\n", i, lookup_cname(host, aka) ? aka.c_str() : "", (long long int)connect_durations[i].count(), CONNECT_TESTS);
+					LOG("Server %d (%s) took %lld ms to respond %d times.\n", i, lookup_cname(host, aka) ? aka.c_str() : "", (long long int)connect_durations[i].count(), CONNECT_TESTS);
 				}
 				if (connect_durations[i] < min_duration) {
 					min_duration = connect_durations[i];
@@ -302,7 +487,7 @@ int main(int argc, char** argv) {
 
 			std::this_thread::sleep_for(std::chrono::seconds(10)); // Wait for server to open up our slot again
 			if (min == -1) {
-				printf("No servers responded\n");
+				LOG("No servers responded\n");
 				continue;
 			}
 
@@ -311,8 +496,7 @@ int main(int argc, char** argv) {
 		}
 	} else
 		memcpy(host, argv[3], strlen(argv[3]) + 1);
-	STAMPOUT();
-	printf("Using server %s\n", host);
+	LOG_STAMPED("Using server %s\n", host);
 
 	RelayNetworkClient* relayClient;
 	P2PClient p2p(argv[1], std::stoul(argv[2]),
@@ -321,7 +505,7 @@ int main(int argc, char** argv) {
 						//TODO: Re-enable (see issue #11): relayClient->receive_transaction(bytes, true);
 					});
 	relayClient = new RelayNetworkClient(host,
-										[&](std::vector<unsigned char>& bytes) { p2p.receive_block(bytes); },
+										[&](std::vector<unsigned char>& bytes) { p2p.receive_block(bytes, true); },
 										[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 											p2p.receive_transaction(bytes);
 											relayClient->receive_transaction(bytes, false);
@@ -1,205 +1,839 @@
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 
 #ifdef WIN32
 	#include <winsock2.h>
 	#include <ws2tcpip.h>
 	#define SHUT_RDWR SD_BOTH
+	#define SOCK_WOULD_BLOCK(err) ((err) == WSAEWOULDBLOCK)
 #else // WIN32
 	#include <sys/socket.h>
 	#include <netinet/in.h>
 	#include <netinet/tcp.h>
 	#include <netdb.h>
 	#include <fcntl.h>
+	#include <sys/uio.h>
+	#include <limits.h>
+	#define SOCK_WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+	#ifndef IOV_MAX
+		#define IOV_MAX 1024
+	#endif
 #endif // !WIN32
 
+// Messages smaller than this are cheaper to copy than to pin
+#define ZEROCOPY_MIN_BYTES 16384
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	#define NET_ZEROCOPY
+	#include <linux/errqueue.h>
+	// Opt-in with RELAY_ZEROCOPY=1, used for large (ie block) messages only
+	static const bool zerocopy_enabled = getenv("RELAY_ZEROCOPY") && atoi(getenv("RELAY_ZEROCOPY"));
+#endif
+
+#if defined(WIN32)
+	#define NET_BACKEND_SELECT
+#elif defined(__linux__)
+	#define NET_BACKEND_EPOLL
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+#elif defined(X86_BSD) || defined(__FreeBSD__) || defined(__APPLE__)
+	#define NET_BACKEND_KQUEUE
+	#include <sys/types.h>
+	#include <sys/event.h>
+	#include <sys/time.h>
+#else
+	#define NET_BACKEND_SELECT
+#endif
+
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
 #include <set>
 
 #include "connection.h"
 
+#include "log.h"
+#include "metrics.h"
 #include "utils.h"
 
-class GlobalNetProcess {
+// Burst size of the initial outbound throttle's token bucket (see Connection::initial_outbound_throttle)
+static int64_t get_throttle_burst_bytes() {
+	const char* env = getenv("RELAY_THROTTLE_BURST_BYTES");
+	if (env) {
+		try {
+			return std::stoul(env);
+		} catch (std::exception& e) {}
+	}
+	return OUTBOUND_THROTTLE_BURST_BYTES;
+}
+static const int64_t throttle_burst_bytes = get_throttle_burst_bytes();
+
+// Opt-in low-latency mode: with RELAY_BUSY_POLL_US set, sockets get SO_BUSY_POLL, and both the
+// net threads and the threads reading from them spin for up to that long waiting for more
+// work before going to sleep. Only worth it with cores to spare (see RELAY_NET_CPUS).
+static unsigned long get_busy_poll_usec() {
+	const char* env = getenv("RELAY_BUSY_POLL_US");
+	if (env) {
+		try {
+			return std::min(std::stoul(env), 1000000ul);
+		} catch (std::exception& e) {}
+	}
+	return 0;
+}
+static const unsigned long busy_poll_usec = get_busy_poll_usec();
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// The error from the last socket call, which Winsock only reports through WSAGetLastError()
+static inline int sock_errno() {
+#ifdef WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+static const char* outbound_class_names[OUTBOUND_CLASS_COUNT] = { "control", "block", "tx", "bulk" };
+
+/*********************************************************
+ **** Socket readiness backends (epoll/kqueue/select) ****
+ *********************************************************/
+// epoll and kqueue are used edge-triggered: an fd is reported once each time it
+// becomes readable/writable, so the caller must track readiness until it sees
+// EAGAIN. select is level-triggered, which the same caller logic handles fine.
+// Interest is only changed through modify(), which the NetProcess calls
+// when a connection's read/write conditions actually change.
+class NetBackend {
+private:
+#ifdef NET_BACKEND_EPOLL
+	int epoll_fd;
+	struct epoll_event events[256];
+#elif defined(NET_BACKEND_KQUEUE)
+	int kqueue_fd;
+	struct kevent events[256];
+#else
+	fd_set read_set, write_set;
+	std::set<int> fds;
+#endif
+
 public:
-	std::mutex fd_map_mutex;
-	std::unordered_map<int, Connection*> fd_map;
-	std::map<uint64_t, std::function<void (void)> > actions_map;
+	NetBackend() {
+#ifdef NET_BACKEND_EPOLL
+		epoll_fd = epoll_create1(0);
+		ALWAYS_ASSERT(epoll_fd >= 0);
+#elif defined(NET_BACKEND_KQUEUE)
+		kqueue_fd = kqueue();
+		ALWAYS_ASSERT(kqueue_fd >= 0);
+#else
+		FD_ZERO(&read_set); FD_ZERO(&write_set);
+#endif
+	}
+
+	void add(int fd, bool read, bool write) {
+#ifdef NET_BACKEND_EPOLL
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLET | (read ? EPOLLIN : 0) | (write ? EPOLLOUT : 0);
+		ev.data.fd = fd;
+		ALWAYS_ASSERT(!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev));
+#elif defined(NET_BACKEND_KQUEUE)
+		struct kevent ev[2];
+		EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR | (read ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+		EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR | (write ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+		ALWAYS_ASSERT(!kevent(kqueue_fd, ev, 2, NULL, 0, NULL));
+#else
+		ALWAYS_ASSERT(fds.size() < FD_SETSIZE);
 #ifndef WIN32
-	int pipe_write;
+		ALWAYS_ASSERT(fd < FD_SETSIZE);
 #endif
+		fds.insert(fd);
+		modify(fd, read, write);
+#endif
+	}
+
+	void modify(int fd, bool read, bool write) {
+#ifdef NET_BACKEND_EPOLL
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLET | (read ? EPOLLIN : 0) | (write ? EPOLLOUT : 0);
+		ev.data.fd = fd;
+		ALWAYS_ASSERT(!epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev));
+#elif defined(NET_BACKEND_KQUEUE)
+		struct kevent ev[2];
+		EV_SET(&ev[0], fd, EVFILT_READ, read ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+		EV_SET(&ev[1], fd, EVFILT_WRITE, write ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+		ALWAYS_ASSERT(!kevent(kqueue_fd, ev, 2, NULL, 0, NULL));
+#else
+		if (read) FD_SET(fd, &read_set); else FD_CLR(fd, &read_set);
+		if (write) FD_SET(fd, &write_set); else FD_CLR(fd, &write_set);
+#endif
+	}
 
-	static void do_net_process(GlobalNetProcess* me) {
-		fd_set fd_set_read, fd_set_write;
+	void remove(int fd) {
+#ifdef NET_BACKEND_EPOLL
+		struct epoll_event ev;
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+#elif defined(NET_BACKEND_KQUEUE)
+		struct kevent ev[2];
+		EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(kqueue_fd, ev, 2, NULL, 0, NULL);
+#else
+		FD_CLR(fd, &read_set); FD_CLR(fd, &write_set);
+		fds.erase(fd);
+#endif
+	}
+
+	// Calls ready(fd, readable, writable) for each fd which became ready within timeout_usec.
+	// Errors and hangups are reported as readable so that the following recv() picks them up.
+	template<typename Callback>
+	void wait(uint64_t timeout_usec, const Callback& ready) {
+#ifdef NET_BACKEND_EPOLL
+		int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), std::min<uint64_t>((timeout_usec + 999) / 1000, 86400 * 1000));
+		if (count < 0) {
+			ALWAYS_ASSERT(errno == EINTR);
+			return;
+		}
+		for (int i = 0; i < count; i++)
+			ready(events[i].data.fd, (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0, (events[i].events & EPOLLOUT) != 0);
+#elif defined(NET_BACKEND_KQUEUE)
+		struct timespec timeout;
+		timeout.tv_sec = timeout_usec / 1000000;
+		timeout.tv_nsec = (timeout_usec % 1000000) * 1000;
+		int count = kevent(kqueue_fd, NULL, 0, events, sizeof(events) / sizeof(events[0]), &timeout);
+		if (count < 0) {
+			ALWAYS_ASSERT(errno == EINTR);
+			return;
+		}
+		for (int i = 0; i < count; i++) {
+			bool error = (events[i].flags & (EV_EOF | EV_ERROR)) != 0;
+			ready(events[i].ident, events[i].filter == EVFILT_READ || error, events[i].filter == EVFILT_WRITE);
+		}
+#else
+		if (fds.empty()) {
+			std::this_thread::sleep_for(std::chrono::microseconds(std::min<uint64_t>(timeout_usec, 1000)));
+			return;
+		}
+
+		fd_set fd_set_read = read_set, fd_set_write = write_set;
 		struct timeval timeout;
+		timeout.tv_sec = timeout_usec / 1000000;
+		timeout.tv_usec = timeout_usec % 1000000;
+		ALWAYS_ASSERT(select(*fds.rbegin() + 1, &fd_set_read, &fd_set_write, NULL, &timeout) >= 0);
+		for (int fd : fds) {
+			bool readable = FD_ISSET(fd, &fd_set_read), writable = FD_ISSET(fd, &fd_set_write);
+			if (readable || writable)
+				ready(fd, readable, writable);
+		}
+#endif
+	}
+};
+
+// A single net thread. Each Connection is pinned to one NetProcess in do_setup_and_read and
+// all socket I/O for it then happens on that thread.
+class NetProcess {
+private:
+	// Only touched by this NetProcess' thread
+	NetBackend backend;
+	std::unordered_map<int, Connection*> fd_map;
+	std::set<Connection*> throttled;
+
+	// Connections registered with any net thread, for collect_metrics
+	static std::mutex live_mutex;
+	static std::unordered_set<Connection*> live_connections;
+	static std::string connection_labels(Connection* conn) {
+		return "host=\"" + conn->host + "\",fd=\"" + std::to_string(conn->sock) + "\"";
+	}
+
+	std::mutex actions_mutex;
+	std::map<uint64_t, std::function<void (void)> > actions_map;
 
+	std::mutex wake_mutex;
+	std::vector<int> wake_fds;
+	std::vector<Connection*> new_connections;
+	bool spinning; // The net thread is busy-polling and will see wakeups without being signalled
 #ifndef WIN32
-		int pipefd[2];
-		ALWAYS_ASSERT(!pipe(pipefd));
-		fcntl(pipefd[1], F_SETFL, fcntl(pipefd[1], F_GETFL) | O_NONBLOCK);
-		fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
-		me->pipe_write = pipefd[1];
+	// An eventfd (both the same fd) on Linux, a self-pipe elsewhere
+	int wake_read_fd, wake_write_fd;
 #endif
 
+	// Called with wake_mutex held when wake_fds or new_connections become non-empty
+	void signal() {
+#ifndef WIN32
+		if (spinning)
+			return;
+#ifdef NET_BACKEND_EPOLL
+		uint64_t one = 1;
+		ALWAYS_ASSERT(write(wake_write_fd, &one, sizeof(one)) == sizeof(one));
+#else
+		ALWAYS_ASSERT(write(wake_write_fd, "1", 1) == 1);
+#endif
+#endif
+	}
+
+public:
+	std::atomic<size_t> connection_count;
+
+	// Asks the net thread to re-check the read/write conditions of the connection on fd
+	// (or just to recompute its timeout if fd is not one of its connections)
+	void wake(int fd) {
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		wake_fds.push_back(fd);
+		if (wake_fds.size() + new_connections.size() == 1)
+			signal();
+	}
+
+	void add_connection(Connection* conn) {
+		connection_count++;
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		new_connections.push_back(conn);
+		if (wake_fds.size() + new_connections.size() == 1)
+			signal();
+	}
+
+	// Runs action on this thread at time (in epoch_millis_lu(steady_clock) terms)
+	void add_action(uint64_t time, const std::function<void (void)>& action) {
+		{
+			std::lock_guard<std::mutex> lock(actions_mutex);
+			while (actions_map.count(time))
+				time++;
+			actions_map[time] = action;
+		}
+		wake(-1);
+	}
+
+private:
+	void update_interest(Connection* conn, const std::chrono::steady_clock::time_point& now) {
+		bool want_read = size_t(conn->total_inbound_size) < conn->inbound_buffer.size() || conn->disconnectFlags & DISCONNECT_READS_DONE;
+		bool want_write = false;
+		if (conn->total_waiting_size > 0) {
+			if (now < conn->earliest_next_write && conn->writing_class < 0 && !conn->class_waiting_size[OUTBOUND_CONTROL])
+				throttled.insert(conn);
+			else {
+				throttled.erase(conn);
+				want_write = true;
+			}
+		} else
+			throttled.erase(conn);
+
+		if (!conn->net_registered) {
+			backend.add(conn->sock, want_read, want_write);
+			conn->net_registered = true;
+		} else if (want_read != conn->read_registered || want_write != conn->write_registered)
+			backend.modify(conn->sock, want_read, want_write);
+		conn->read_registered = want_read;
+		conn->write_registered = want_write;
+	}
+
+	// Called with read_mutex held, only from the net thread
+	void resize_inbound(Connection* conn, size_t new_size) {
+		std::vector<unsigned char> new_buffer(new_size);
+		size_t size = conn->total_inbound_size, cap = conn->inbound_buffer.size();
+		assert(size <= new_size);
+		size_t first = std::min(size, cap - conn->readpos);
+		memcpy(&new_buffer[0], &conn->inbound_buffer[conn->readpos], first);
+		memcpy(&new_buffer[first], &conn->inbound_buffer[0], size - first);
+		conn->inbound_buffer.swap(new_buffer);
+		conn->readpos = 0;
+	}
+
+	// Returns false if the connection errored
+	bool do_read(Connection* conn) {
+		unsigned char dropbuf[4096];
+		size_t read_this_pass = 0;
 		while (true) {
+			unsigned char* readbuf;
+			size_t readlen;
+			{
+				std::lock_guard<std::mutex> lock(conn->read_mutex);
+				if (conn->disconnectFlags & DISCONNECT_READS_DONE) {
+					readbuf = dropbuf;
+					readlen = sizeof(dropbuf);
+				} else {
+					size_t size = conn->total_inbound_size, cap = conn->inbound_buffer.size();
+					if (size == cap) {
+						// If we filled the whole ring without seeing EAGAIN, the sender is
+						// bursting faster than we're getting called, so give it more room
+						if (read_this_pass >= cap && cap < INBOUND_BUFFER_MAX_SIZE && !conn->inbound_pinned) {
+							resize_inbound(conn, std::min(cap * 2, size_t(INBOUND_BUFFER_MAX_SIZE)));
+							cap = conn->inbound_buffer.size();
+						} else
+							return true;
+					}
+					if (size == 0)
+						conn->readpos = 0;
+					size_t end = (conn->readpos + size) % cap;
+					readbuf = &conn->inbound_buffer[end];
+					readlen = end < conn->readpos ? conn->readpos - end : cap - end;
+				}
+			}
+
+			// The reader only touches unread bytes, so we can fill free space without the lock
+			ssize_t count = recv(conn->sock, (char*)readbuf, readlen, 0);
+			int err = count < 0 ? sock_errno() : 0;
+
+			std::lock_guard<std::mutex> lock(conn->read_mutex);
+			if (count < 0 && SOCK_WOULD_BLOCK(err)) {
+				conn->read_ready = false;
+				if (conn->total_inbound_size == 0 && conn->inbound_buffer.size() > conn->inbound_buffer_initial_size)
+					resize_inbound(conn, conn->inbound_buffer_initial_size);
+				return true;
+			} else if (count <= 0) {
+				conn->sock_errno = err;
+				return false;
+			} else if (readbuf != dropbuf) {
+				conn->total_inbound_size += count;
+				read_this_pass += count;
+				conn->read_cv.notify_all();
+			}
+		}
+	}
+
 #ifndef WIN32
-			timeout.tv_sec = 86400;
-			timeout.tv_usec = 999999;
+	std::vector<struct iovec> write_iovs;
+	std::vector<const std::shared_ptr<std::vector<unsigned char> >*> write_msgs;
+
+	// Gathers up to max_msgs queued messages into write_iovs, in the same order the
+	// write loop would pick them one at a time: the partially-written message, if any,
+	// and then each class' queue in priority order.
+	size_t build_write_batch(Connection* conn, size_t max_msgs) {
+		write_iovs.clear();
+		write_msgs.clear();
+		size_t large_msgs = 0;
+		auto add = [&](const std::shared_ptr<std::vector<unsigned char> >& msg, size_t writepos) {
+			write_iovs.push_back({&(*msg)[writepos], msg->size() - writepos});
+			write_msgs.push_back(&msg);
+			if (msg->size() >= ZEROCOPY_MIN_BYTES)
+				large_msgs++;
+			return write_iovs.size() < max_msgs;
+		};
+
+		if (conn->writing_class >= 0)
+			if (!add(conn->outbound_queues[conn->writing_class].front(), conn->writepos))
+				return large_msgs;
+		for (int cls = 0; cls < OUTBOUND_CLASS_COUNT; cls++) {
+			auto it = conn->outbound_queues[cls].begin();
+			if (cls == conn->writing_class)
+				it++;
+			for (; it != conn->outbound_queues[cls].end(); it++)
+				if (!add(*it, 0))
+					return large_msgs;
+		}
+		return large_msgs;
+	}
+#endif
+
+#ifdef NET_ZEROCOPY
+	// Called when a connection's socket may have zerocopy completions on its error queue
+	void reap_zerocopy(Connection* conn) {
+		while (!conn->zerocopy_pending.empty()) {
+			char control[128];
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(conn->sock, &msg, MSG_ERRQUEUE) < 0)
+				return;
+
+			for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+				if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+					continue;
+				// Kernel reports an inclusive range [ee_info, ee_data] of completed send calls
+				uint32_t lo = serr->ee_info, hi = serr->ee_data;
+				for (auto it = conn->zerocopy_pending.begin(); it != conn->zerocopy_pending.end();) {
+					if (it->first - lo <= hi - lo)
+						it = conn->zerocopy_pending.erase(it);
+					else
+						it++;
+				}
+			}
+		}
+	}
+#endif
+
+	// Called with send_bytes_mutex, picks the class the next message is written from
+	static int next_write_class(Connection* conn) {
+		if (conn->writing_class >= 0)
+			return conn->writing_class;
+		for (int cls = 0; cls < OUTBOUND_CLASS_COUNT; cls++)
+			if (!conn->outbound_queues[cls].empty())
+				return cls;
+		assert(false);
+		return OUTBOUND_BULK;
+	}
+
+	// Refills the throttle's token bucket, returns false (and sets earliest_next_write) if
+	// it is still in debt
+	static bool throttle_allows_write(Connection* conn) {
+		auto now = std::chrono::steady_clock::now();
+		if (conn->throttle_tokens_time == std::chrono::steady_clock::time_point()) {
+			conn->throttle_tokens = throttle_burst_bytes;
+			conn->throttle_tokens_time = now;
+		}
+		int64_t added = to_micros_lu(now - conn->throttle_tokens_time) * OUTBOUND_THROTTLE_BYTES_PER_MS / 1000;
+		if (conn->throttle_tokens + added >= throttle_burst_bytes) {
+			conn->throttle_tokens = throttle_burst_bytes;
+			conn->throttle_tokens_time = now;
+		} else {
+			conn->throttle_tokens += added;
+			conn->throttle_tokens_time += std::chrono::microseconds(added * 1000 / OUTBOUND_THROTTLE_BYTES_PER_MS);
+		}
+		if (conn->throttle_tokens >= 0)
+			return true;
+		conn->earliest_next_write = now + std::chrono::microseconds(1 + -conn->throttle_tokens * 1000 / OUTBOUND_THROTTLE_BYTES_PER_MS);
+		return false;
+	}
+
+	// Returns false if the connection errored
+	bool do_write(Connection* conn) {
+		bool got_send_mutex = conn->send_mutex.try_lock();
+		std::lock_guard<std::mutex> lock(conn->send_bytes_mutex);
+		bool res = true;
+		while (conn->total_waiting_size > 0) {
+			bool throttle = conn->initial_outbound_throttle;
+			int cls = next_write_class(conn);
+			// Messages are only ever held back before they are started
+			if (throttle && conn->writing_class < 0 && cls != OUTBOUND_CONTROL && !throttle_allows_write(conn))
+				break;
+
+			assert(conn->outbound_queues[cls].front()->size() - (cls == conn->writing_class ? conn->writepos : 0) > 0);
+#ifdef WIN32
+			auto& msg = conn->outbound_queues[cls].front();
+			size_t writepos = cls == conn->writing_class ? conn->writepos : 0;
+			ssize_t count = send(conn->sock, (char*) &(*msg)[writepos], msg->size() - writepos, MSG_NOSIGNAL);
 #else
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 1000;
+			// The throttle is paced per-message, so only batch when it is off
+			size_t large_msgs = build_write_batch(conn, throttle ? 1 : IOV_MAX);
+			struct msghdr hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_iov = &write_iovs[0];
+			hdr.msg_iovlen = write_iovs.size();
+			int flags = MSG_NOSIGNAL;
+#ifdef NET_ZEROCOPY
+			if (conn->zerocopy && large_msgs)
+				flags |= MSG_ZEROCOPY;
+#else
+			(void)large_msgs;
+#endif
+			ssize_t count = sendmsg(conn->sock, &hdr, flags);
+#ifdef NET_ZEROCOPY
+			if (count < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) // Out of optmem for pinning, just copy
+				count = sendmsg(conn->sock, &hdr, flags & ~MSG_ZEROCOPY);
+			else if (count >= 0 && (flags & MSG_ZEROCOPY)) {
+				// Keep every buffer in this batch alive until the kernel says it is done with them
+				std::vector<std::shared_ptr<std::vector<unsigned char> > > held;
+				for (const auto* m : write_msgs)
+					held.push_back(*m);
+				conn->zerocopy_pending.emplace_back(conn->zerocopy_next_seq++, std::move(held));
+			}
 #endif
+#endif
+			int err = count < 0 ? sock_errno() : 0;
+			if (count < 0 && SOCK_WOULD_BLOCK(err)) {
+				conn->write_ready = false;
+				break;
+			} else if (count <= 0) {
+				conn->sock_errno = err;
+				res = false;
+				break;
+			}
+
+			// Walk the queues in the same order the batch was built, retiring whole messages
+			size_t left = count;
+			while (left) {
+				int cls = next_write_class(conn);
+				conn->writing_class = cls;
+				auto& queue = conn->outbound_queues[cls];
+				auto& msg = queue.front();
+				size_t written = std::min(left, msg->size() - conn->writepos);
+				left -= written;
+				conn->writepos += written;
+				if (throttle && cls != OUTBOUND_CONTROL)
+					conn->throttle_tokens -= written;
+				if (conn->writepos == msg->size()) {
+					conn->writepos = 0;
+					conn->writing_class = -1;
+					conn->total_waiting_size -= msg->size();
+					conn->class_waiting_size[cls] -= msg->size();
+					queue.pop_front();
+				}
+			}
+		}
+		if (got_send_mutex) {
+			if (!conn->total_waiting_size)
+				conn->initial_outbound_throttle = false;
+			conn->send_mutex.unlock();
+		}
+		return res;
+	}
 
-			FD_ZERO(&fd_set_read); FD_ZERO(&fd_set_write);
+	static void do_net_process(NetProcess* me, size_t index) {
+		pin_thread("RELAY_NET_CPUS", index, "net");
 #ifndef WIN32
-			int max = pipefd[0];
-			FD_SET(pipefd[0], &fd_set_read);
+		const int wake_read_fd = me->wake_read_fd;
+#endif
+		auto last_work = std::chrono::steady_clock::now();
+
+		std::vector<std::tuple<int, bool, bool> > ready_fds;
+		std::vector<int> woken_fds;
+		std::vector<Connection*> added_connections;
+		std::vector<std::function<void (void)> > actions_to_run;
+		std::unordered_set<Connection*> pending;
+		MetricHistogram& loop_ns = metrics_histogram("relay_net_loop_ns");
+		while (true) {
+#ifndef WIN32
+			uint64_t timeout = 86400 * 1000000ULL;
 #else
-			int max = -1;
+			uint64_t timeout = 1000;
 #endif
+
 			auto now = std::chrono::steady_clock::now();
+			for (Connection* conn : me->throttled)
+				timeout = std::min<uint64_t>(timeout, now < conn->earliest_next_write ? to_micros_lu(conn->earliest_next_write - now) : 0);
+
 			{
-				std::lock_guard<std::mutex> lock(me->fd_map_mutex);
-				for (const auto& e : me->fd_map) {
-					ALWAYS_ASSERT(e.first < FD_SETSIZE);
-					if (e.second->total_inbound_size < 65536 || e.second->disconnectFlags & DISCONNECT_READS_DONE)
-						FD_SET(e.first, &fd_set_read);
-					if (e.second->total_waiting_size > 0) {
-						if (now < e.second->earliest_next_write) {
-							timeout.tv_sec = 0;
-							timeout.tv_usec = std::min((long unsigned)timeout.tv_usec, to_micros_lu(e.second->earliest_next_write - now));
-						} else
-							FD_SET(e.first, &fd_set_write);
-					}
-					max = std::max(e.first, max);
+				std::unique_lock<std::mutex> lock(me->actions_mutex);
+				uint64_t now = epoch_millis_lu(std::chrono::steady_clock::now());
+				while (me->actions_map.size() && me->actions_map.begin()->first < now + 5) {
+					actions_to_run.emplace_back(std::move(me->actions_map.begin()->second));
+					me->actions_map.erase(me->actions_map.begin());
 				}
+				if (me->actions_map.size())
+					timeout = std::min<uint64_t>(timeout, (me->actions_map.begin()->first - now) * 1000);
+			}
+			if (actions_to_run.size()) {
+				// Actions may schedule new actions (or send), so have to be run without actions_mutex
+				for (const auto& action : actions_to_run)
+					action();
+				actions_to_run.clear();
+				last_work = std::chrono::steady_clock::now();
+				continue;
+			}
 
-				if (me->actions_map.size()) {
-					uint64_t now = epoch_millis_lu(std::chrono::steady_clock::now());
-					while (me->actions_map.size() && me->actions_map.begin()->first < now + 5) {
-						me->actions_map.begin()->second();
-						me->actions_map.erase(me->actions_map.begin());
-					}
-					if (me->actions_map.size()) {
-						uint64_t msec_out = me->actions_map.begin()->first - now;
-						timeout.tv_sec = std::min<long unsigned>(timeout.tv_sec, msec_out / 1000);
-						timeout.tv_usec = std::min<long unsigned>(timeout.tv_usec, (msec_out % 1000) * 1000);
-					}
-				}
+			if (busy_poll_usec && timeout) {
+				// Poll without sleeping until we've been idle for busy_poll_usec. Wakers don't
+				// signal us while we spin, so anything they queued has to be picked up before
+				// we go back to sleeping.
+				std::lock_guard<std::mutex> lock(me->wake_mutex);
+				me->spinning = to_micros_lu(now - last_work) < busy_poll_usec;
+				if (me->spinning || me->wake_fds.size() || me->new_connections.size())
+					timeout = 0;
 			}
 
-			if (max < 0)
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
-			else
-				ALWAYS_ASSERT(select(max + 1, &fd_set_read, &fd_set_write, NULL, &timeout) >= 0);
+			ready_fds.clear();
+			me->backend.wait(timeout, [&](int fd, bool readable, bool writable) {
+#ifndef WIN32
+				// Drain the wakeup fd before grabbing wake_fds so that we cannot eat a wakeup we didn't process
+				if (fd == wake_read_fd) {
+#ifdef NET_BACKEND_EPOLL
+					uint64_t count;
+					while (read(wake_read_fd, &count, sizeof(count)) > 0);
+#else
+					char buf[4096];
+					while (read(wake_read_fd, buf, 4096) > 0);
+#endif
+					return;
+				}
+#endif
+				ready_fds.emplace_back(fd, readable, writable);
+			});
 
-			now = std::chrono::steady_clock::now();
-			unsigned char buf[4096];
 			{
-				std::set<int> remove_set;
-				std::lock_guard<std::mutex> lock(me->fd_map_mutex);
-				for (const auto& e : me->fd_map) {
-					Connection* conn = e.second;
-
-					if (FD_ISSET(e.first, &fd_set_read)) {
-						ssize_t count = recv(conn->sock, (char*)buf, 4096, 0);
-
-						std::lock_guard<std::mutex> lock(conn->read_mutex);
-						if (count <= 0) {
-							remove_set.insert(e.first);
-							conn->sock_errno = errno;
-						} else if (!(conn->disconnectFlags & DISCONNECT_READS_DONE)) {
-							conn->inbound_queue.emplace_back(new std::vector<unsigned char>(buf, buf + count));
-							conn->total_inbound_size += count;
-							conn->read_cv.notify_all();
-						}
-					}
-					if (FD_ISSET(e.first, &fd_set_write)) {
-						if (now < conn->earliest_next_write)
-							continue;
-						bool got_send_mutex = conn->send_mutex.try_lock();
-						std::lock_guard<std::mutex> lock(conn->send_bytes_mutex);
-						size_t message_written_size = 0;
-						if (!conn->secondary_writepos && conn->outbound_primary_queue.size()) {
-							auto& msg = conn->outbound_primary_queue.front();
-							assert(msg->size() - conn->primary_writepos > 0);
-							message_written_size = msg->size();
-							ssize_t count = send(conn->sock, (char*) &(*msg)[conn->primary_writepos], msg->size() - conn->primary_writepos, MSG_NOSIGNAL);
-							if (count <= 0) {
-								remove_set.insert(e.first);
-								conn->sock_errno = errno;
-							} else {
-								conn->primary_writepos += count;
-								if (conn->primary_writepos == msg->size()) {
-									conn->primary_writepos = 0;
-									conn->total_waiting_size -= msg->size();
-									conn->outbound_primary_queue.pop_front();
-								}
-							}
-						} else {
-							assert(conn->outbound_secondary_queue.size() && !conn->primary_writepos);
-							auto& msg = conn->outbound_secondary_queue.front();
-							assert(msg->size() - conn->secondary_writepos > 0);
-							message_written_size = msg->size();
-							ssize_t count = send(conn->sock, (char*) &(*msg)[conn->secondary_writepos], msg->size() - conn->secondary_writepos, MSG_NOSIGNAL);
-							if (count <= 0) {
-								remove_set.insert(e.first);
-								conn->sock_errno = errno;
-							} else {
-								conn->secondary_writepos += count;
-								if (conn->secondary_writepos == msg->size()) {
-									conn->secondary_writepos = 0;
-									conn->total_waiting_size -= msg->size();
-									conn->outbound_secondary_queue.pop_front();
-								}
-							}
-						}
-						if (got_send_mutex) {
-							if (!conn->total_waiting_size)
-								conn->initial_outbound_throttle = false;
-							conn->send_mutex.unlock();
-						}
-						if (!conn->primary_writepos && !conn->secondary_writepos && conn->initial_outbound_throttle)
-							conn->earliest_next_write = std::chrono::steady_clock::now() + std::chrono::microseconds(1000 * message_written_size / OUTBOUND_THROTTLE_BYTES_PER_MS);
-					}
-				}
+				std::lock_guard<std::mutex> lock(me->wake_mutex);
+				woken_fds.swap(me->wake_fds);
+				added_connections.swap(me->new_connections);
+			}
 
-				for (const int fd : remove_set) {
-					Connection* conn = me->fd_map[fd];
-					std::lock_guard<std::mutex> lock(conn->read_mutex);
-					conn->inbound_queue.emplace_back((std::nullptr_t)NULL);
-					conn->read_cv.notify_all();
-					if (conn->sock_errno == EAGAIN || conn->sock_errno == EWOULDBLOCK)
-						conn->sock_errno = ENOTCONN;
-					conn->disconnectFlags |= DISCONNECT_GLOBAL_THREAD_DONE;
-					me->fd_map.erase(fd);
+			now = std::chrono::steady_clock::now();
+			if (!ready_fds.empty() || !woken_fds.empty() || !added_connections.empty())
+				last_work = now;
+			std::set<int> remove_set;
+
+			pending.clear();
+			for (Connection* conn : added_connections) {
+				me->fd_map[conn->sock] = conn;
+				pending.insert(conn);
+			}
+			if (!added_connections.empty()) {
+				std::lock_guard<std::mutex> lock(live_mutex);
+				live_connections.insert(added_connections.begin(), added_connections.end());
+			}
+			added_connections.clear();
+			for (const auto& ready : ready_fds) {
+				auto it = me->fd_map.find(std::get<0>(ready));
+				if (it == me->fd_map.end())
+					continue;
+				if (std::get<1>(ready))
+					it->second->read_ready = true;
+				if (std::get<2>(ready))
+					it->second->write_ready = true;
+				pending.insert(it->second);
+			}
+			for (int fd : woken_fds) {
+				auto it = me->fd_map.find(fd);
+				if (it != me->fd_map.end())
+					pending.insert(it->second);
+			}
+			woken_fds.clear();
+			for (Connection* conn : me->throttled)
+				if (now >= conn->earliest_next_write)
+					pending.insert(conn);
+
+			for (Connection* conn : pending) {
+				me->update_interest(conn, now);
+#ifdef NET_ZEROCOPY
+				me->reap_zerocopy(conn);
+#endif
+				bool ok = true;
+				if (conn->read_registered && conn->read_ready)
+					ok = me->do_read(conn);
+				if (ok && conn->write_registered && conn->write_ready)
+					ok = me->do_write(conn);
+				if (ok)
+					me->update_interest(conn, std::chrono::steady_clock::now());
+				else
+					remove_set.insert(conn->sock);
+			}
+
+			for (const int fd : remove_set) {
+				Connection* conn = me->fd_map[fd];
+				me->backend.remove(fd);
+				me->throttled.erase(conn);
+				me->fd_map.erase(fd);
+				me->connection_count--;
+				{
+					std::lock_guard<std::mutex> lock(live_mutex);
+					live_connections.erase(conn);
 				}
+
+				std::lock_guard<std::mutex> lock(conn->read_mutex);
+				conn->inbound_done = true;
+				conn->read_cv.notify_all();
+				if (SOCK_WOULD_BLOCK(conn->sock_errno))
+					conn->sock_errno = ENOTCONN;
+				conn->disconnectFlags |= DISCONNECT_GLOBAL_THREAD_DONE;
 			}
-#ifndef WIN32
-			if (FD_ISSET(pipefd[0], &fd_set_read))
-				while (read(pipefd[0], buf, 4096) > 0);
+
+			loop_ns.record_since(now);
+		}
+	}
+
+public:
+	static void collect_metrics(std::string& out) {
+		std::lock_guard<std::mutex> lock(live_mutex);
+		out += "# TYPE relay_connection_waiting_bytes gauge\n";
+		for (Connection* conn : live_connections)
+			metrics_append(out, "relay_connection_waiting_bytes", connection_labels(conn), conn->total_waiting_size);
+		out += "# TYPE relay_connection_class_waiting_bytes gauge\n";
+		for (Connection* conn : live_connections)
+			for (int cls = 0; cls < OUTBOUND_CLASS_COUNT; cls++)
+				metrics_append(out, "relay_connection_class_waiting_bytes", connection_labels(conn) + ",class=\"" + outbound_class_names[cls] + "\"", conn->class_waiting_size[cls]);
+		out += "# TYPE relay_connection_inbound_bytes gauge\n";
+		for (Connection* conn : live_connections)
+			metrics_append(out, "relay_connection_inbound_bytes", connection_labels(conn), conn->total_inbound_size);
+	}
+
+	NetProcess(size_t index) : spinning(false), connection_count(0) {
+#ifdef NET_BACKEND_EPOLL
+		wake_read_fd = wake_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ALWAYS_ASSERT(wake_read_fd >= 0);
+		backend.add(wake_read_fd, true, false);
+#elif !defined(WIN32)
+		int pipefd[2];
+		ALWAYS_ASSERT(!pipe(pipefd));
+		fcntl(pipefd[1], F_SETFL, fcntl(pipefd[1], F_GETFL) | O_NONBLOCK);
+		fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+		wake_read_fd = pipefd[0];
+		wake_write_fd = pipefd[1];
+		backend.add(wake_read_fd, true, false);
 #endif
+		std::thread(do_net_process, this, index).detach();
+	}
+};
+
+std::mutex NetProcess::live_mutex;
+std::unordered_set<Connection*> NetProcess::live_connections;
+
+// The pool of net threads, sized by the RELAY_NET_THREADS environment variable (default 1)
+class GlobalNetProcess {
+private:
+	std::vector<NetProcess*> threads;
+	std::atomic<size_t> next_action_thread;
+
+public:
+	GlobalNetProcess() : next_action_thread(0) {
+		unsigned long count = 1;
+		const char* env = getenv("RELAY_NET_THREADS");
+		if (env) {
+			try {
+				count = std::stoul(env);
+			} catch (std::exception& e) {}
 		}
+		count = std::max(1ul, std::min(count, 64ul));
+		for (unsigned long i = 0; i < count; i++)
+			threads.push_back(new NetProcess(i));
+		metrics_add_collector(NetProcess::collect_metrics);
 	}
 
-	GlobalNetProcess() {
-		std::thread(do_net_process, this).detach();
+	// Picks the net thread with the fewest connections for a new connection
+	NetProcess* pick_thread() {
+		NetProcess* res = threads[0];
+		for (NetProcess* thread : threads)
+			if (thread->connection_count < res->connection_count)
+				res = thread;
+		return res;
+	}
+
+	void add_action(uint64_t time, const std::function<void (void)>& action) {
+		threads[next_action_thread++ % threads.size()]->add_action(time, action);
 	}
 };
 static GlobalNetProcess processor;
 
 
 
+void Connection::wake_net_thread() {
+	NetProcess* thread = net_thread;
+	if (thread)
+		thread->wake(sock);
+}
+
+void Connection::construction_done() {
+	if (Fiber::enabled()) {
+		user_fiber = new Fiber([this]() { do_setup_and_read(this); });
+		user_fiber->start();
+	} else
+		user_thread = new std::thread(do_setup_and_read, this);
+}
+
 Connection::~Connection() {
 	assert(disconnectFlags & DISCONNECT_COMPLETE);
-	user_thread->join();
+	if (user_fiber)
+		delete user_fiber;
+	else {
+		user_thread->join();
+		delete user_thread;
+	}
 	close(sock);
-	delete user_thread;
 }
 
 
-void Connection::do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token) {
+// Called with send_bytes_mutex, returns the disconnect reason if we've queued too much
+const char* Connection::check_outbound_limits(OutboundClass cls) {
+	bool throttle = initial_outbound_throttle;
+	if (total_waiting_size - (throttle ? initial_outbound_bytes : 0) > max_outbound_buffer_size)
+		return "total_waiting_size blew up :(";
+	if (class_waiting_size[cls] - (throttle ? class_initial_outbound_bytes[cls] : 0) > class_max_outbound_buffer_size[cls])
+		return "outbound class queue blew up :(";
+	return NULL;
+}
+
+void Connection::do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token, OutboundClass cls) {
 	if (!send_mutex_token)
 		send_mutex.lock();
 	else
@@ -207,27 +841,28 @@ void Connection::do_send_bytes(const std::shared_ptr<std::vector<unsigned char>
 
 	std::lock_guard<std::mutex> bytes_lock(send_bytes_mutex);
 
-	if (initial_outbound_throttle && send_mutex_token)
+	if (initial_outbound_throttle && send_mutex_token) {
 		initial_outbound_bytes += bytes->size();
+		class_initial_outbound_bytes[cls] += bytes->size();
+	}
 
-	if (total_waiting_size - (initial_outbound_throttle ? initial_outbound_bytes : 0) > max_outbound_buffer_size) {
+	const char* limit_error = check_outbound_limits(cls);
+	if (limit_error) {
 		if (!send_mutex_token)
 			send_mutex.unlock();
-		return disconnect_from_outside("total_waiting_size blew up :(");
+		return disconnect_from_outside(limit_error);
 	}
 
-	outbound_primary_queue.push_back(bytes);
-	total_waiting_size += bytes->size();
-#ifndef WIN32
-	if (total_waiting_size == (ssize_t)bytes->size())
-		ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
+	outbound_queues[cls].push_back(bytes);
+	class_waiting_size[cls] += bytes->size();
+	if ((total_waiting_size += bytes->size()) == (ssize_t)bytes->size() || cls == OUTBOUND_CONTROL)
+		wake_net_thread();
 
 	if (!send_mutex_token)
 		send_mutex.unlock();
 }
 
-void Connection::maybe_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token) {
+void Connection::maybe_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token, OutboundClass cls) {
 	if (!send_mutex_token) {
 		if (!send_mutex.try_lock())
 			return;
@@ -236,18 +871,17 @@ void Connection::maybe_send_bytes(const std::shared_ptr<std::vector<unsigned cha
 
 	std::lock_guard<std::mutex> bytes_lock(send_bytes_mutex);
 
-	if (total_waiting_size - (initial_outbound_throttle ? initial_outbound_bytes : 0) > max_outbound_buffer_size) {
+	const char* limit_error = check_outbound_limits(cls);
+	if (limit_error) {
 		if (!send_mutex_token)
 			send_mutex.unlock();
-		return disconnect_from_outside("total_waiting_size blew up :(");
+		return disconnect_from_outside(limit_error);
 	}
 
-	outbound_secondary_queue.push_back(bytes);
-	total_waiting_size += bytes->size();
-#ifndef WIN32
-	if (total_waiting_size == (ssize_t)bytes->size())
-		ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
+	outbound_queues[cls].push_back(bytes);
+	class_waiting_size[cls] += bytes->size();
+	if ((total_waiting_size += bytes->size()) == (ssize_t)bytes->size() || cls == OUTBOUND_CONTROL)
+		wake_net_thread();
 
 	if (!send_mutex_token)
 		send_mutex.unlock();
@@ -268,24 +902,24 @@ void Connection::disconnect_from_outside(const char* reason) {
 	if (disconnectFlags.fetch_or(DISCONNECT_PRINT_AND_CLOSE) & DISCONNECT_PRINT_AND_CLOSE)
 		return;
 
-	STAMPOUT();
-	printf("%s Disconnect: %s (%s)\n", host.c_str(), reason, strerror(errno));
+	LOG_STAMPED("%s Disconnect: %s (%s)\n", host.c_str(), reason, strerror(errno));
 	shutdown(sock, SHUT_RDWR);
 }
 
 void Connection::disconnect(std::string reason) {
-	assert(std::this_thread::get_id() == user_thread->get_id());
+	assert(on_user_thread());
 
 	if (disconnectFlags.fetch_or(DISCONNECT_STARTED) & DISCONNECT_STARTED)
 		return;
 
 	if (!(disconnectFlags.fetch_or(DISCONNECT_PRINT_AND_CLOSE) & DISCONNECT_PRINT_AND_CLOSE)) {
-		STAMPOUT();
-		printf("%s Disconnect: %s (%s)\n", host.c_str(), reason.c_str(), strerror(sock_errno));
+		LOG_STAMPED("%s Disconnect: %s (%s)\n", host.c_str(), reason.c_str(), strerror(sock_errno));
 		shutdown(sock, SHUT_RDWR);
 	}
 
 	disconnectFlags |= DISCONNECT_READS_DONE;
+	wake_net_thread(); // Make sure the net thread starts reading (and dropping) again
+
 
 	std::unique_lock<std::mutex> lock(read_mutex);
 	while (!(disconnectFlags & DISCONNECT_GLOBAL_THREAD_DONE))
@@ -318,13 +952,29 @@ void Connection::do_setup_and_read(Connection* me) {
 		return me->disconnect("error during connect");
 	}
 
-	{
-		std::lock_guard<std::mutex> lock(processor.fd_map_mutex);
-		processor.fd_map[me->sock] = me;
-#ifndef WIN32
-		ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
+#ifdef SO_BUSY_POLL
+	// Needs CAP_NET_ADMIN to go above net.core.busy_read, in which case this just fails
+	int busy_poll = busy_poll_usec;
+	if (busy_poll)
+		setsockopt(me->sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
 #endif
-	}
+
+#ifdef NET_ZEROCOPY
+	int zerocopy = 1;
+	if (zerocopy_enabled && !setsockopt(me->sock, SOL_SOCKET, SO_ZEROCOPY, &zerocopy, sizeof(zerocopy)))
+		me->zerocopy = true;
+#endif
+
+	int rcvbuf = 0;
+	socklen_t rcvbuf_len = sizeof(rcvbuf);
+	if (getsockopt(me->sock, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, &rcvbuf_len))
+		rcvbuf = 0;
+	me->inbound_buffer_initial_size = std::max(size_t(INBOUND_BUFFER_MIN_SIZE), std::min(size_t(rcvbuf), size_t(INBOUND_BUFFER_MAX_SIZE)));
+	me->inbound_buffer.resize(me->inbound_buffer_initial_size);
+
+	NetProcess* thread = processor.pick_thread();
+	me->net_thread = thread;
+	thread->add_connection(me);
 
 	try {
 		me->net_process([&](std::string reason) { me->disconnect(reason); });
@@ -333,8 +983,26 @@ void Connection::do_setup_and_read(Connection* me) {
 	}
 }
 
+// In low-latency mode, readers spin for up to busy_poll_usec for the net thread to hand them
+// min_bytes before they go to sleep on read_cv. Fibers share their worker thread, so never do.
+static void spin_for_inbound(const std::atomic<int64_t>& inbound_size, size_t min_bytes, const std::chrono::system_clock::time_point& stop_time) {
+	if (!busy_poll_usec || Fiber::current() || size_t(inbound_size) >= min_bytes)
+		return;
+	auto spin_stop = std::min(stop_time, std::chrono::system_clock::now() + std::chrono::microseconds(busy_poll_usec));
+	while (size_t(inbound_size) < min_bytes && std::chrono::system_clock::now() < spin_stop)
+		cpu_relax();
+}
+
 ssize_t Connection::read_all(char *buf, size_t nbyte, millis_lu_type max_sleep) {
-	assert(std::this_thread::get_id() == user_thread->get_id());
+	return read_bytes(buf, nbyte, max_sleep, true);
+}
+
+ssize_t Connection::read_some(char *buf, size_t nbyte, millis_lu_type max_sleep) {
+	return read_bytes(buf, nbyte, max_sleep, false);
+}
+
+ssize_t Connection::read_bytes(char *buf, size_t nbyte, millis_lu_type max_sleep, bool all) {
+	assert(on_user_thread());
 
 	size_t total = 0;
 	std::chrono::system_clock::time_point stop_time;
@@ -343,37 +1011,83 @@ ssize_t Connection::read_all(char *buf, size_t nbyte, millis_lu_type max_sleep)
 	else
 		stop_time = std::chrono::system_clock::now() + max_sleep;
 	while (total < nbyte) {
+		spin_for_inbound(total_inbound_size, 1, stop_time);
 		std::unique_lock<std::mutex> lock(read_mutex);
-		while (!inbound_queue.size() && std::chrono::system_clock::now() < stop_time)
+		while (!total_inbound_size && !inbound_done && std::chrono::system_clock::now() < stop_time)
 			read_cv.wait_until(lock, stop_time);
 
-		if (std::chrono::system_clock::now() >= stop_time)
+		if (!total_inbound_size && std::chrono::system_clock::now() >= stop_time)
 			return total;
 
-		if (!inbound_queue.front())
-			return -1;
+		if (!total_inbound_size)
+			return total ? total : -1;
 
-		size_t readamt = std::min(nbyte - total, inbound_queue.front()->size() - readpos);
-		memcpy(buf + total, &(*inbound_queue.front())[readpos], readamt);
-		if (readpos + readamt == inbound_queue.front()->size()) {
-#ifndef WIN32
-			int32_t old_size = total_inbound_size;
-#endif
-			total_inbound_size -= inbound_queue.front()->size();
-#ifndef WIN32
-			// If the old size is >= 64k, we may need to wakeup the select thread to get it to read more
-			if (old_size >= 65536)
-				ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
-
-			readpos = 0;
-			inbound_queue.pop_front();
-		} else
-			readpos += readamt;
+		size_t cap = inbound_buffer.size();
+		size_t readamt = std::min(nbyte - total, std::min(size_t(total_inbound_size), cap - readpos));
+		memcpy(buf + total, &inbound_buffer[readpos], readamt);
+		readpos = (readpos + readamt) % cap;
 		total += readamt;
+
+		int64_t old_size = total_inbound_size.fetch_sub(readamt);
+		// If the ring was full, the net thread stopped reading and needs a wakeup
+		if (old_size >= int64_t(cap))
+			wake_net_thread();
+
+		if (!all && old_size == int64_t(readamt))
+			break;
 	}
-	assert(total == nbyte);
-	return nbyte;
+	assert(all ? total == nbyte : total > 0);
+	return total;
+}
+
+const unsigned char* Connection::peek(size_t min_bytes, size_t& avail, millis_lu_type max_sleep) {
+	assert(on_user_thread());
+	assert(min_bytes > 0 && min_bytes <= INBOUND_BUFFER_MIN_SIZE);
+
+	std::chrono::system_clock::time_point stop_time;
+	if (max_sleep == millis_lu_type::max())
+		stop_time = std::chrono::system_clock::time_point::max();
+	else
+		stop_time = std::chrono::system_clock::now() + max_sleep;
+
+	// The ring is never smaller than INBOUND_BUFFER_MIN_SIZE, so min_bytes always fit
+	spin_for_inbound(total_inbound_size, min_bytes, stop_time);
+	std::unique_lock<std::mutex> lock(read_mutex);
+	while (size_t(total_inbound_size) < min_bytes && !inbound_done && std::chrono::system_clock::now() < stop_time)
+		read_cv.wait_until(lock, stop_time);
+
+	size_t size = total_inbound_size, cap = inbound_buffer.size();
+	if (size < min_bytes)
+		return NULL;
+
+	if (readpos + min_bytes <= cap) {
+		avail = std::min(size, cap - readpos);
+		inbound_pinned = true;
+		return &inbound_buffer[readpos];
+	}
+
+	size_t first = cap - readpos;
+	peek_buffer.resize(min_bytes);
+	memcpy(&peek_buffer[0], &inbound_buffer[readpos], first);
+	memcpy(&peek_buffer[first], &inbound_buffer[0], min_bytes - first);
+	avail = min_bytes;
+	return &peek_buffer[0];
+}
+
+void Connection::consume(size_t nbyte) {
+	assert(on_user_thread());
+
+	std::lock_guard<std::mutex> lock(read_mutex);
+	inbound_pinned = false;
+	if (!nbyte)
+		return;
+	assert(nbyte <= size_t(total_inbound_size));
+
+	size_t cap = inbound_buffer.size();
+	readpos = (readpos + nbyte) % cap;
+	int64_t old_size = total_inbound_size.fetch_sub(nbyte);
+	if (old_size >= int64_t(cap))
+		wake_net_thread();
 }
 
 int OutboundPersistentConnection::get_send_mutex() {
@@ -402,7 +1116,7 @@ void OutboundPersistentConnection::reconnect(std::string disconnectReason) {
 
 	std::this_thread::sleep_for(std::chrono::seconds(1));
 	while (old && !(old->getDisconnectFlags() & DISCONNECT_COMPLETE)) {
-		printf("Disconnect of outbound connection still not complete (status is %d)\n", old->getDisconnectFlags());
+		LOG("Disconnect of outbound connection still not complete (status is %d)\n", old->getDisconnectFlags());
 		std::this_thread::sleep_for(std::chrono::seconds(1));
 	}
 
@@ -434,10 +1148,7 @@ KeepaliveOutboundPersistentConnection::KeepaliveOutboundPersistentConnection(std
 void KeepaliveOutboundPersistentConnection::schedule() {
 	uint64_t time = epoch_millis_lu(std::chrono::steady_clock::now()) + ping_interval_msec;
 
-	while (processor.actions_map.count(time))
-		time++;
-
-	processor.actions_map[time] = [&]() {
+	processor.add_action(time, [&]() {
 		schedule();
 
 		{
@@ -452,12 +1163,11 @@ void KeepaliveOutboundPersistentConnection::schedule() {
 			ping_nonces_waiting.insert(next_nonce);
 		}
 		send_ping(next_nonce);
-	};
+	});
 }
 
 void KeepaliveOutboundPersistentConnection::on_connect_keepalive() {
-	std::lock_guard<std::mutex> lock(processor.fd_map_mutex); // Needed for schedule(), but locks before ping_mutex
-	std::lock_guard<std::mutex> lock2(ping_mutex);
+	std::lock_guard<std::mutex> lock(ping_mutex);
 	if (scheduled)
 		return;
 
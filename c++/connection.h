@@ -9,8 +9,10 @@
 #include <vector>
 #include <set>
 #include <assert.h>
+#include <string.h>
 
 #include "utils.h"
+#include "fiber.h"
 
 enum DisconnectFlags {
 	DISCONNECT_STARTED = 1,
@@ -20,6 +22,24 @@ enum DisconnectFlags {
 	DISCONNECT_COMPLETE = 16,
 };
 
+// Outbound messages are queued per class and written strictly in this order, so eg a block
+// can jump ahead of a backlog of bulk data. The net thread only switches classes between
+// whole buffers, so on connections which use more than one class each buffer passed to
+// do_send_bytes/maybe_send_bytes must hold only whole protocol messages. Anything which the
+// peer must see in order (eg compressor-tracked transactions and the blocks which reference
+// them) must go in the same class.
+enum OutboundClass {
+	OUTBOUND_CONTROL = 0, // Small and never throttled, eg PING/PONG
+	OUTBOUND_BLOCK,
+	OUTBOUND_TX,
+	OUTBOUND_BULK,
+	OUTBOUND_CLASS_COUNT,
+};
+
+class NetProcess;
+
+// Socket I/O is done by a pool of net threads, RELAY_NET_THREADS (default 1) of them.
+// Each Connection is pinned to one of them once it is set up.
 class Connection {
 private:
 	const int sock;
@@ -28,46 +48,83 @@ private:
 
 	std::function<void(void)> on_disconnect;
 
-	std::list<std::shared_ptr<std::vector<unsigned char> > > outbound_primary_queue, outbound_secondary_queue;
-	size_t primary_writepos, secondary_writepos;
+	// One queue per OutboundClass. Only one message is ever partially written, the front
+	// of outbound_queues[writing_class] (writepos bytes of it), and it is finished before
+	// anything else is started.
+	std::list<std::shared_ptr<std::vector<unsigned char> > > outbound_queues[OUTBOUND_CLASS_COUNT];
+	std::atomic<int64_t> class_waiting_size[OUTBOUND_CLASS_COUNT];
+	int writing_class;
+	size_t writepos;
 
-	// During initial_outbound_throttle, total_waiting_size is allowed to exceed the
-	// usual outbound buffer size but only by initial_outbound_bytes
+	// During initial_outbound_throttle, total_waiting_size (and each class's waiting size)
+	// is allowed to exceed the usual outbound buffer size but only by initial_outbound_bytes
 	//
 	// initial_outbound_bytes is defined as the quantity of bytes sent with send_mutex_token
 	// (not mabye_send, do_send), during initial_outbound_throttle
+	//
+	// While throttled, everything but OUTBOUND_CONTROL is paced by a token bucket which
+	// fills at OUTBOUND_THROTTLE_BYTES_PER_MS up to a burst of RELAY_THROTTLE_BURST_BYTES.
+	// Each message is started only once throttle_tokens is non-negative, and bytes are taken
+	// out as they are written, so earliest_next_write is when the bucket next gets back to zero.
 	std::atomic_bool initial_outbound_throttle;
 	std::atomic_flag initial_outbound_throttle_done;
-	int64_t initial_outbound_bytes;
+	int64_t initial_outbound_bytes, class_initial_outbound_bytes[OUTBOUND_CLASS_COUNT];
 	std::atomic<int64_t> total_waiting_size;
-	std::chrono::steady_clock::time_point earliest_next_write;
-	uint32_t max_outbound_buffer_size;
-
+	int64_t throttle_tokens;
+	std::chrono::steady_clock::time_point throttle_tokens_time, earliest_next_write;
+	uint32_t max_outbound_buffer_size, class_max_outbound_buffer_size[OUTBOUND_CLASS_COUNT];
+
+	// Inbound data lives in a ring which the net thread recv()s into directly.
+	// total_inbound_size is the number of unread bytes in the ring, and the net
+	// thread stops reading when it is full. Only the net thread may resize the
+	// ring or move readpos while the ring is empty, everything else is under read_mutex.
+	// While inbound_pinned, peek has handed out a view into the ring, so it isn't resized.
 	std::mutex read_mutex;
-	std::condition_variable read_cv;
+	FiberCondition read_cv;
+	std::vector<unsigned char> inbound_buffer;
+	size_t inbound_buffer_initial_size;
 	size_t readpos;
 	std::atomic<int64_t> total_inbound_size;
-	std::list<std::unique_ptr<std::vector<unsigned char> > > inbound_queue;
+	bool inbound_done, inbound_pinned;
+	std::vector<unsigned char> peek_buffer; // Only touched by the user thread
 
+	// net_process runs on user_thread, or as user_fiber if fibers are enabled (see fiber.h)
 	std::thread *user_thread;
+	Fiber *user_fiber;
 	int sock_errno;
 
+	std::atomic<NetProcess*> net_thread;
+
+	// MSG_ZEROCOPY state (RELAY_ZEROCOPY on Linux only), only touched by the net thread.
+	// zerocopy_pending holds sent buffers until the kernel reports it is done with them.
+	bool zerocopy;
+	uint32_t zerocopy_next_seq;
+	std::list<std::pair<uint32_t, std::vector<std::shared_ptr<std::vector<unsigned char> > > > > zerocopy_pending;
+
+	// Readiness state, only touched by the net thread
+	bool net_registered, read_registered, write_registered;
+	bool read_ready, write_ready;
+
 	std::atomic<int> disconnectFlags;
 public:
 	const std::string host;
 
 	Connection(int sockIn, std::string hostIn, std::function<void(void)> on_disconnect_in, uint32_t max_outbound_buffer_size_in=10000000) :
 			sock(sockIn), outside_send_mutex_token(0xdeadbeef * (unsigned long)this), on_disconnect(on_disconnect_in),
-			primary_writepos(0), secondary_writepos(0), initial_outbound_throttle(false), initial_outbound_throttle_done(false),
-			initial_outbound_bytes(0), total_waiting_size(0), earliest_next_write(std::chrono::steady_clock::time_point::min()),
-			max_outbound_buffer_size(max_outbound_buffer_size_in), readpos(0), total_inbound_size(0), sock_errno(0),
-			disconnectFlags(0), host(hostIn)
-		{}
+			writing_class(-1), writepos(0), initial_outbound_throttle(false), initial_outbound_throttle_done(false),
+			initial_outbound_bytes(0), total_waiting_size(0), throttle_tokens(0), earliest_next_write(std::chrono::steady_clock::time_point::min()),
+			max_outbound_buffer_size(max_outbound_buffer_size_in), inbound_buffer_initial_size(0), readpos(0), total_inbound_size(0), inbound_done(false), inbound_pinned(false), user_thread(NULL), user_fiber(NULL), sock_errno(0),
+			net_thread(NULL), zerocopy(false), zerocopy_next_seq(0), net_registered(false), read_registered(false), write_registered(false), read_ready(false), write_ready(false),
+			disconnectFlags(0), host(hostIn) {
+		for (int i = 0; i < OUTBOUND_CLASS_COUNT; i++) {
+			class_waiting_size[i] = 0;
+			class_initial_outbound_bytes[i] = 0;
+			class_max_outbound_buffer_size[i] = max_outbound_buffer_size;
+		}
+	}
 
 protected:
-	void construction_done() {
-		user_thread = new std::thread(do_setup_and_read, this);
-	}
+	void construction_done();
 
 public:
 	virtual ~Connection();
@@ -77,13 +134,26 @@ public:
 protected:
 	virtual void net_process(const std::function<void(std::string)>& disconnect)=0;
 	ssize_t read_all(char *buf, size_t nbyte, millis_lu_type max_sleep = millis_lu_type::max()); // Only allowed from within net_process
-
-	void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0) {
-		do_send_bytes(std::make_shared<std::vector<unsigned char> >((unsigned char*)buf, (unsigned char*)buf + nbyte), send_mutex_token);
+	// Like read_all, but returns whatever is available (at least one byte, at most nbyte) as soon as something is
+	ssize_t read_some(char *buf, size_t nbyte, millis_lu_type max_sleep = millis_lu_type::max()); // Only allowed from within net_process
+	// Views of unread bytes for parsing in place (see BufferedReader), only allowed from within net_process.
+	// The view usually points straight into the inbound ring, and is copied out only if min_bytes wrap around it.
+	const unsigned char* peek(size_t min_bytes, size_t& avail, millis_lu_type max_sleep = millis_lu_type::max());
+	void consume(size_t nbyte);
+
+	void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0, OutboundClass cls=OUTBOUND_TX) {
+		auto bytes = pooled_buffer(nbyte);
+		memcpy(bytes->data(), buf, nbyte);
+		do_send_bytes(bytes, send_mutex_token, cls);
 	}
 
-	void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0);
-	void maybe_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0);
+	void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0, OutboundClass cls=OUTBOUND_TX);
+	// Drops bytes if someone else has the send mutex
+	void maybe_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0, OutboundClass cls=OUTBOUND_BULK);
+
+	// Disconnects if more than max_bytes of cls are ever waiting (on top of the overall
+	// max_outbound_buffer_size limit, which is also the default for each class)
+	void set_outbound_limit(OutboundClass cls, uint32_t max_bytes) { class_max_outbound_buffer_size[cls] = max_bytes; }
 
 public:
 	// See the comment above initial_outbound_throttle for special meanings of the send_mutex_tokens
@@ -95,9 +165,13 @@ public:
 
 private:
 	void disconnect(std::string reason);
+	const char* check_outbound_limits(OutboundClass cls);
+	ssize_t read_bytes(char *buf, size_t nbyte, millis_lu_type max_sleep, bool all);
 	static void do_setup_and_read(Connection* me);
+	bool on_user_thread() const { return user_fiber ? Fiber::current() == user_fiber : std::this_thread::get_id() == user_thread->get_id(); }
+	void wake_net_thread();
 
-	friend class GlobalNetProcess;
+	friend class NetProcess;
 };
 
 class OutboundPersistentConnection {
@@ -117,8 +191,11 @@ private:
 			{ }
 
 		ssize_t read_all(char *buf, size_t nbyte, millis_lu_type max_sleep) { return Connection::read_all(buf, nbyte, max_sleep); }
-		void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token) { return Connection::do_send_bytes(buf, nbyte, send_mutex_token); }
-		void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token) { return Connection::do_send_bytes(bytes, send_mutex_token); }
+		ssize_t read_some(char *buf, size_t nbyte, millis_lu_type max_sleep) { return Connection::read_some(buf, nbyte, max_sleep); }
+		const unsigned char* peek(size_t min_bytes, size_t& avail, millis_lu_type max_sleep) { return Connection::peek(min_bytes, avail, max_sleep); }
+		void consume(size_t nbyte) { Connection::consume(nbyte); }
+		void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token, OutboundClass cls) { return Connection::do_send_bytes(buf, nbyte, send_mutex_token, cls); }
+		void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token, OutboundClass cls) { return Connection::do_send_bytes(bytes, send_mutex_token, cls); }
 		void construction_done() { Connection::construction_done(); }
 	};
 
@@ -153,19 +230,22 @@ protected:
 	virtual void on_disconnect()=0;
 	virtual void net_process(const std::function<void(std::string)>& disconnect)=0;
 	ssize_t read_all(char *buf, size_t nbyte, millis_lu_type max_sleep = millis_lu_type::max()) { return ((OutboundConnection*)connection.load())->read_all(buf, nbyte, max_sleep); } // Only allowed from within net_process
+	ssize_t read_some(char *buf, size_t nbyte, millis_lu_type max_sleep = millis_lu_type::max()) { return ((OutboundConnection*)connection.load())->read_some(buf, nbyte, max_sleep); } // Only allowed from within net_process
+	const unsigned char* peek(size_t min_bytes, size_t& avail, millis_lu_type max_sleep = millis_lu_type::max()) { return ((OutboundConnection*)connection.load())->peek(min_bytes, avail, max_sleep); } // Only allowed from within net_process
+	void consume(size_t nbyte) { ((OutboundConnection*)connection.load())->consume(nbyte); } // Only allowed from within net_process
 
-	void maybe_do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0) {
+	void maybe_do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0, OutboundClass cls=OUTBOUND_TX) {
 		OutboundConnection* conn = (OutboundConnection*)connection.load();
 		if (conn) {
 			assert(!mutex_valid || send_mutex_token == mutex_valid);
-			conn->do_send_bytes(buf, nbyte, mutex_valid == send_mutex_token ? send_mutex_token : 0);
+			conn->do_send_bytes(buf, nbyte, mutex_valid == send_mutex_token ? send_mutex_token : 0, cls);
 		}
 	}
-	void maybe_do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0) {
+	void maybe_do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0, OutboundClass cls=OUTBOUND_TX) {
 		OutboundConnection* conn = (OutboundConnection*)connection.load();
 		if (conn) {
 			assert(!mutex_valid || send_mutex_token == mutex_valid);
-			conn->do_send_bytes(bytes, mutex_valid == send_mutex_token ? send_mutex_token : 0);
+			conn->do_send_bytes(bytes, mutex_valid == send_mutex_token ? send_mutex_token : 0, cls);
 		}
 	}
 
@@ -0,0 +1,49 @@
+#ifndef _RELAY_CPUFEATURES_H
+#define _RELAY_CPUFEATURES_H
+
+// Runtime x86 feature detection, so that one binary can carry kernels for
+// several instruction sets and only use the ones the host supports
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CPU_FEATURES_X86
+
+#include <cpuid.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct CpuFeatures {
+	bool sse41, avx, avx2, bmi2, avx512f, sha;
+
+	CpuFeatures() : sse41(false), avx(false), avx2(false), bmi2(false), avx512f(false), sha(false) {
+		unsigned int a, b, c, d;
+		if (!__get_cpuid(1, &a, &b, &c, &d))
+			return;
+		bool ssse3 = c & (1 << 9);
+		sse41 = ssse3 && (c & (1 << 19));
+
+		// AVX state must also be enabled by the OS (OSXSAVE + XCR0)
+		uint64_t xcr0 = 0;
+		if (c & (1 << 27)) {
+			uint32_t xlo, xhi;
+			__asm__ ("xgetbv" : "=a"(xlo), "=d"(xhi) : "c"(0));
+			xcr0 = (uint64_t(xhi) << 32) | xlo;
+		}
+		avx = (c & (1 << 28)) && (xcr0 & 0x6) == 0x6;
+
+		if (__get_cpuid_max(0, NULL) < 7)
+			return;
+		__cpuid_count(7, 0, a, b, c, d);
+		avx2 = avx && (b & (1 << 5));
+		bmi2 = b & (1 << 8);
+		avx512f = avx2 && (b & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+		sha = sse41 && (b & (1 << 29));
+	}
+};
+
+static inline const CpuFeatures& cpu_features() {
+	static const CpuFeatures features;
+	return features;
+}
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+#include "crypto/sha256_multi.h"
+
+#include "crypto/common.h"
+#include "crypto/cpufeatures.h"
+
+#ifdef CPU_FEATURES_X86
+// GCC 12 warns about the _mm512_undefined_epi32() inside its own AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Each width is compiled for its own instruction set and picked at runtime
+#ifdef CPU_FEATURES_X86
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#define SHA256_MULTI_LANES 4
+#define SHA256_MULTI_NS sse2
+#include "crypto/sha256_multi_impl.h"
+#undef SHA256_MULTI_NS
+#undef SHA256_MULTI_LANES
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define SHA256_MULTI_LANES 8
+#define SHA256_MULTI_NS avx2
+#include "crypto/sha256_multi_impl.h"
+#undef SHA256_MULTI_NS
+#undef SHA256_MULTI_LANES
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+#define SHA256_MULTI_LANES 16
+#define SHA256_MULTI_NS avx512
+#include "crypto/sha256_multi_impl.h"
+#undef SHA256_MULTI_NS
+#undef SHA256_MULTI_LANES
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif // CPU_FEATURES_X86
+
+#define SHA256_MULTI_LANES 1
+#define SHA256_MULTI_NS scalar
+#include "crypto/sha256_multi_impl.h"
+#undef SHA256_MULTI_NS
+#undef SHA256_MULTI_LANES
+
+struct MultiImpl {
+	size_t lanes;
+	void (*transform)(uint32_t*, const unsigned char* const*);
+	const char* name;
+};
+
+MultiImpl select_impl() {
+#ifdef CPU_FEATURES_X86
+	const CpuFeatures& cpu = cpu_features();
+	if (cpu.avx512f)
+		return MultiImpl { 16, avx512::transform, "avx512" };
+	if (cpu.avx2)
+		return MultiImpl { 8, avx2::transform, "avx2" };
+#if defined(__x86_64__) || defined(__SSE2__)
+	return MultiImpl { 4, sse2::transform, "sse2" };
+#endif
+#endif
+	return MultiImpl { 1, scalar::transform, "scalar" };
+}
+
+const MultiImpl& impl() {
+	static const MultiImpl selected = select_impl();
+	return selected;
+}
+
+} // namespace
+
+size_t sha256_multi::lanes() {
+	return impl().lanes;
+}
+
+const char* sha256_multi::name() {
+	return impl().name;
+}
+
+void sha256_multi::transform(uint32_t* state, const unsigned char* const* blocks) {
+	impl().transform(state, blocks);
+}
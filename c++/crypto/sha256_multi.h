@@ -0,0 +1,21 @@
+#ifndef _RELAY_SHA256_MULTI_H
+#define _RELAY_SHA256_MULTI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Multi-buffer SHA-256 compression: runs one SHA-256 block transform on each of
+// lanes() independent blocks at once, one message per SIMD lane.
+// 16 lanes with AVX-512, 8 with AVX2, 4 with SSE2, otherwise 1, chosen at
+// runtime from what the CPU supports.
+#define SHA256_MULTI_MAX_LANES 16
+
+namespace sha256_multi {
+	size_t lanes();
+	const char* name();
+
+	// state is word-major, ie word w of lane l is state[w * lanes() + l]
+	void transform(uint32_t* state, const unsigned char* const* blocks);
+}
+
+#endif
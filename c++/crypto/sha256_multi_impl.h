@@ -0,0 +1,98 @@
+// Included once per SIMD width by sha256_multi.cpp, inside a target region
+// for that width, with SHA256_MULTI_LANES and SHA256_MULTI_NS defined.
+// The vec type and its helpers below hold one 32-bit word per lane.
+
+namespace SHA256_MULTI_NS {
+
+#if SHA256_MULTI_LANES == 16
+#define LANES 16
+typedef __m512i vec;
+inline vec Add(vec x, vec y) { return _mm512_add_epi32(x, y); }
+inline vec Xor(vec x, vec y) { return _mm512_xor_si512(x, y); }
+inline vec Or(vec x, vec y) { return _mm512_or_si512(x, y); }
+inline vec And(vec x, vec y) { return _mm512_and_si512(x, y); }
+template <int n> inline vec Shr(vec x) { return _mm512_srli_epi32(x, n); }
+template <int n> inline vec Ror(vec x) { return _mm512_ror_epi32(x, n); }
+inline vec Set1(uint32_t x) { return _mm512_set1_epi32(x); }
+inline vec Load(const uint32_t* p) { return _mm512_loadu_si512((const void*)p); }
+inline void Store(uint32_t* p, vec x) { _mm512_storeu_si512((void*)p, x); }
+#elif SHA256_MULTI_LANES == 8
+#define LANES 8
+typedef __m256i vec;
+inline vec Add(vec x, vec y) { return _mm256_add_epi32(x, y); }
+inline vec Xor(vec x, vec y) { return _mm256_xor_si256(x, y); }
+inline vec Or(vec x, vec y) { return _mm256_or_si256(x, y); }
+inline vec And(vec x, vec y) { return _mm256_and_si256(x, y); }
+template <int n> inline vec Shr(vec x) { return _mm256_srli_epi32(x, n); }
+template <int n> inline vec Ror(vec x) { return Or(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+inline vec Set1(uint32_t x) { return _mm256_set1_epi32(x); }
+inline vec Load(const uint32_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+inline void Store(uint32_t* p, vec x) { _mm256_storeu_si256((__m256i*)p, x); }
+#elif SHA256_MULTI_LANES == 4
+#define LANES 4
+typedef __m128i vec;
+inline vec Add(vec x, vec y) { return _mm_add_epi32(x, y); }
+inline vec Xor(vec x, vec y) { return _mm_xor_si128(x, y); }
+inline vec Or(vec x, vec y) { return _mm_or_si128(x, y); }
+inline vec And(vec x, vec y) { return _mm_and_si128(x, y); }
+template <int n> inline vec Shr(vec x) { return _mm_srli_epi32(x, n); }
+template <int n> inline vec Ror(vec x) { return Or(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+inline vec Set1(uint32_t x) { return _mm_set1_epi32(x); }
+inline vec Load(const uint32_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+inline void Store(uint32_t* p, vec x) { _mm_storeu_si128((__m128i*)p, x); }
+#elif SHA256_MULTI_LANES == 1
+#define LANES 1
+typedef uint32_t vec;
+inline vec Add(vec x, vec y) { return x + y; }
+inline vec Xor(vec x, vec y) { return x ^ y; }
+inline vec Or(vec x, vec y) { return x | y; }
+inline vec And(vec x, vec y) { return x & y; }
+template <int n> inline vec Shr(vec x) { return x >> n; }
+template <int n> inline vec Ror(vec x) { return (x >> n) | (x << (32 - n)); }
+inline vec Set1(uint32_t x) { return x; }
+inline vec Load(const uint32_t* p) { return *p; }
+inline void Store(uint32_t* p, vec x) { *p = x; }
+#else
+#error "Unsupported SHA256_MULTI_LANES"
+#endif
+
+inline vec Ch(vec x, vec y, vec z) { return Xor(z, And(x, Xor(y, z))); }
+inline vec Maj(vec x, vec y, vec z) { return Or(And(x, y), And(z, Or(x, y))); }
+inline vec Sigma0(vec x) { return Xor(Xor(Ror<2>(x), Ror<13>(x)), Ror<22>(x)); }
+inline vec Sigma1(vec x) { return Xor(Xor(Ror<6>(x), Ror<11>(x)), Ror<25>(x)); }
+inline vec sigma0(vec x) { return Xor(Xor(Ror<7>(x), Ror<18>(x)), Shr<3>(x)); }
+inline vec sigma1(vec x) { return Xor(Xor(Ror<17>(x), Ror<19>(x)), Shr<10>(x)); }
+
+void transform(uint32_t* state, const unsigned char* const* blocks) {
+	vec w[16];
+	for (int t = 0; t < 16; t++) {
+		uint32_t words[LANES];
+		for (int l = 0; l < LANES; l++)
+			words[l] = ReadBE32(blocks[l] + 4*t);
+		w[t] = Load(words);
+	}
+
+	vec a = Load(state + 0*LANES), b = Load(state + 1*LANES), c = Load(state + 2*LANES), d = Load(state + 3*LANES);
+	vec e = Load(state + 4*LANES), f = Load(state + 5*LANES), g = Load(state + 6*LANES), h = Load(state + 7*LANES);
+
+	for (int t = 0; t < 64; t++) {
+		if (t >= 16)
+			w[t & 15] = Add(Add(Add(sigma1(w[(t - 2) & 15]), w[(t - 7) & 15]), sigma0(w[(t - 15) & 15])), w[t & 15]);
+		vec t1 = Add(Add(Add(Add(h, Sigma1(e)), Ch(e, f, g)), Set1(K[t])), w[t & 15]);
+		vec t2 = Add(Sigma0(a), Maj(a, b, c));
+		h = g; g = f; f = e; e = Add(d, t1);
+		d = c; c = b; b = a; a = Add(t1, t2);
+	}
+
+	Store(state + 0*LANES, Add(a, Load(state + 0*LANES)));
+	Store(state + 1*LANES, Add(b, Load(state + 1*LANES)));
+	Store(state + 2*LANES, Add(c, Load(state + 2*LANES)));
+	Store(state + 3*LANES, Add(d, Load(state + 3*LANES)));
+	Store(state + 4*LANES, Add(e, Load(state + 4*LANES)));
+	Store(state + 5*LANES, Add(f, Load(state + 5*LANES)));
+	Store(state + 6*LANES, Add(g, Load(state + 6*LANES)));
+	Store(state + 7*LANES, Add(h, Load(state + 7*LANES)));
+}
+
+#undef LANES
+} // namespace SHA256_MULTI_NS
@@ -0,0 +1,14 @@
+#ifndef _RELAY_SHA256_SHANI_H
+#define _RELAY_SHA256_SHANI_H
+
+#include "crypto/cpufeatures.h"
+
+#ifdef CPU_FEATURES_X86
+#include <stdint.h>
+
+// SHA-256 block transform using the x86 SHA extensions, with the same
+// signature as the asm kernels. Only call it if cpu_features().sha
+void sha256_shani(void* input, uint32_t state[8], uint64_t blocks);
+#endif
+
+#endif
@@ -0,0 +1,208 @@
+#include "fec.h"
+
+#include <string.h>
+#include <assert.h>
+
+#include <algorithm>
+
+/*****************
+ **** GF(2^8) ****
+ *****************/
+// Multiplication is by table lookup, mul_table[a][b] == a * b (mod x^8 + x^4 + x^3 + x^2 + 1)
+static uint8_t mul_table[256][256], inv_table[256];
+
+class GFInit {
+public:
+	GFInit() {
+		uint8_t exp_table[255], log_table[256];
+		unsigned val = 1;
+		for (unsigned i = 0; i < 255; i++) {
+			exp_table[i] = val;
+			log_table[val] = i;
+			val <<= 1;
+			if (val & 0x100)
+				val ^= 0x11d;
+		}
+		for (unsigned a = 1; a < 256; a++) {
+			for (unsigned b = 1; b < 256; b++)
+				mul_table[a][b] = exp_table[(log_table[a] + log_table[b]) % 255];
+			inv_table[a] = exp_table[(255 - log_table[a]) % 255];
+		}
+	}
+};
+static GFInit gf_init;
+
+// dst ^= c * src
+static void mul_add(unsigned char* dst, const unsigned char* src, uint8_t c, size_t len) {
+	if (c == 0)
+		return;
+	if (c == 1) {
+		for (size_t i = 0; i < len; i++)
+			dst[i] ^= src[i];
+		return;
+	}
+	const uint8_t* row = mul_table[c];
+	for (size_t i = 0; i < len; i++)
+		dst[i] ^= row[src[i]];
+}
+
+// Repair chunk r (>= k) is sum(cauchy(r, j) * data[j]) over the group's k data chunks. As
+// r is never a data index, every square submatrix of this is invertible, so any k chunks
+// of a group (data or repair) determine the rest.
+static inline uint8_t cauchy(uint8_t r, uint8_t j) { return inv_table[r ^ j]; }
+
+/****************
+ **** Layout ****
+ ****************/
+FECLayout::FECLayout(size_t bytes_in) : bytes(bytes_in),
+		chunks((bytes_in + FEC_CHUNK_SIZE - 1) / FEC_CHUNK_SIZE),
+		groups((chunks + FEC_MAX_GROUP_CHUNKS - 1) / FEC_MAX_GROUP_CHUNKS) {}
+
+/******************
+ **** Encoding ****
+ ******************/
+FECEncoder::FECEncoder(const unsigned char* msg, size_t len) : layout(len), data(layout.chunks * FEC_CHUNK_SIZE) {
+	memcpy(&data[0], msg, len);
+}
+
+void FECEncoder::chunk(size_t group, uint8_t index, unsigned char out[FEC_CHUNK_SIZE]) const {
+	assert(group < layout.groups);
+	const unsigned char* group_data = &data[layout.group_start(group) * FEC_CHUNK_SIZE];
+	const size_t k = layout.group_chunks(group);
+	if (index < k) {
+		memcpy(out, group_data + index * FEC_CHUNK_SIZE, FEC_CHUNK_SIZE);
+		return;
+	}
+	memset(out, 0, FEC_CHUNK_SIZE);
+	for (size_t j = 0; j < k; j++)
+		mul_add(out, group_data + j * FEC_CHUNK_SIZE, cauchy(index, j), FEC_CHUNK_SIZE);
+}
+
+/******************
+ **** Decoding ****
+ ******************/
+FECDecoder::FECDecoder(size_t bytes) : layout(bytes), groups(layout.groups), groups_left(layout.groups) {
+	for (size_t i = 0; i < layout.groups; i++) {
+		groups[i].chunks.resize(layout.group_chunks(i) * FEC_CHUNK_SIZE);
+		groups[i].have.resize(layout.group_chunks(i), -1);
+		groups[i].count = 0;
+		groups[i].decoded = false;
+	}
+}
+
+bool FECDecoder::provide(size_t group, uint8_t index, const unsigned char chunk[FEC_CHUNK_SIZE]) {
+	if (group >= layout.groups || groups[group].decoded)
+		return false;
+	Group& g = groups[group];
+	const size_t k = g.have.size();
+
+	// Data goes in its own slot, repair chunks in any free one (moving out of the way of
+	// their slot's data chunk if it turns up later)
+	size_t slot = k;
+	for (size_t i = 0; i < k; i++) {
+		if (g.have[i] == index)
+			return false;
+		if (g.have[i] < 0 && (index >= k || i == index) && slot == k)
+			slot = i;
+	}
+	if (index < k && slot != index) {
+		for (size_t i = 0; i < k; i++) {
+			if (g.have[i] < 0) {
+				memcpy(&g.chunks[i * FEC_CHUNK_SIZE], &g.chunks[index * FEC_CHUNK_SIZE], FEC_CHUNK_SIZE);
+				g.have[i] = g.have[index];
+				break;
+			}
+		}
+		slot = index;
+	}
+	assert(slot < k);
+
+	memcpy(&g.chunks[slot * FEC_CHUNK_SIZE], chunk, FEC_CHUNK_SIZE);
+	g.have[slot] = index;
+	if (++g.count == k)
+		decode(group);
+	return true;
+}
+
+void FECDecoder::decode(size_t group) {
+	Group& g = groups[group];
+	const size_t k = g.have.size();
+	g.decoded = true;
+	groups_left--;
+
+	std::vector<uint8_t> missing;
+	for (size_t i = 0; i < k; i++)
+		if (g.have[i] != int16_t(i))
+			missing.push_back(i);
+	const size_t m = missing.size();
+	if (!m)
+		return;
+
+	// Take the data we have out of each repair chunk, leaving sum(cauchy(r, j) * data[j])
+	// over only the missing js, then solve for them
+	std::vector<unsigned char> syndromes(m * FEC_CHUNK_SIZE);
+	for (size_t a = 0; a < m; a++) {
+		unsigned char* syndrome = &syndromes[a * FEC_CHUNK_SIZE];
+		const uint8_t r = g.have[missing[a]];
+		memcpy(syndrome, &g.chunks[missing[a] * FEC_CHUNK_SIZE], FEC_CHUNK_SIZE);
+		for (size_t j = 0; j < k; j++)
+			if (g.have[j] == int16_t(j))
+				mul_add(syndrome, &g.chunks[j * FEC_CHUNK_SIZE], cauchy(r, j), FEC_CHUNK_SIZE);
+	}
+
+	// Gauss-Jordan on [matrix | inverse]
+	std::vector<uint8_t> matrix(m * m), inverse(m * m, 0);
+	for (size_t a = 0; a < m; a++) {
+		for (size_t b = 0; b < m; b++)
+			matrix[a * m + b] = cauchy(g.have[missing[a]], missing[b]);
+		inverse[a * m + a] = 1;
+	}
+	for (size_t col = 0; col < m; col++) {
+		size_t pivot = col;
+		while (matrix[pivot * m + col] == 0)
+			pivot++;
+		assert(pivot < m);
+		if (pivot != col) {
+			for (size_t b = 0; b < m; b++) {
+				std::swap(matrix[pivot * m + b], matrix[col * m + b]);
+				std::swap(inverse[pivot * m + b], inverse[col * m + b]);
+			}
+		}
+		const uint8_t scale = inv_table[matrix[col * m + col]];
+		for (size_t b = 0; b < m; b++) {
+			matrix[col * m + b] = mul_table[scale][matrix[col * m + b]];
+			inverse[col * m + b] = mul_table[scale][inverse[col * m + b]];
+		}
+		for (size_t a = 0; a < m; a++) {
+			const uint8_t factor = matrix[a * m + col];
+			if (a == col || factor == 0)
+				continue;
+			mul_add(&matrix[a * m], &matrix[col * m], factor, m);
+			mul_add(&inverse[a * m], &inverse[col * m], factor, m);
+		}
+	}
+
+	for (size_t b = 0; b < m; b++) {
+		unsigned char* out = &g.chunks[missing[b] * FEC_CHUNK_SIZE];
+		memset(out, 0, FEC_CHUNK_SIZE);
+		for (size_t a = 0; a < m; a++)
+			mul_add(out, &syndromes[a * FEC_CHUNK_SIZE], inverse[b * m + a], FEC_CHUNK_SIZE);
+		g.have[missing[b]] = missing[b];
+	}
+}
+
+size_t FECDecoder::needed(size_t group) const {
+	assert(group < layout.groups);
+	return groups[group].decoded ? 0 : groups[group].have.size() - groups[group].count;
+}
+
+void FECDecoder::take(std::vector<unsigned char>& msg) {
+	assert(done());
+	msg.resize(layout.bytes);
+	size_t pos = 0;
+	for (size_t i = 0; i < layout.groups && pos < layout.bytes; i++) {
+		size_t len = std::min(groups[i].chunks.size(), layout.bytes - pos);
+		memcpy(&msg[pos], &groups[i].chunks[0], len);
+		pos += len;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef _RELAY_FEC_H
+#define _RELAY_FEC_H
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+/* A systematic Reed-Solomon erasure code over GF(2^8), for sending messages over lossy links.
+ * A message is split into FEC_CHUNK_SIZE chunks (the last one zero-padded), which are split
+ * into groups of at most FEC_MAX_GROUP_CHUNKS, and each group of k chunks is extended with
+ * repair chunks. Chunk indexes [0, k) of a group are its data, [k, 256) are repair chunks,
+ * and any k distinct chunks of a group are enough to rebuild it. */
+#define FEC_CHUNK_SIZE 1152
+#define FEC_MAX_GROUP_CHUNKS 128
+#define FEC_MAX_CHUNK_INDEX 255
+
+class FECLayout {
+public:
+	const size_t bytes, chunks, groups;
+
+	FECLayout(size_t bytes_in);
+	// Chunks of group are [group_start(group), group_start(group + 1))
+	size_t group_start(size_t group) const { return group * chunks / groups; }
+	size_t group_chunks(size_t group) const { return group_start(group + 1) - group_start(group); }
+};
+
+class FECEncoder {
+private:
+	const FECLayout layout;
+	std::vector<unsigned char> data;
+
+public:
+	FECEncoder(const unsigned char* msg, size_t len);
+	const FECLayout& get_layout() const { return layout; }
+	// Writes chunk index of group (which need not be a repair chunk) into out
+	void chunk(size_t group, uint8_t index, unsigned char out[FEC_CHUNK_SIZE]) const;
+};
+
+class FECDecoder {
+private:
+	struct Group {
+		// Either the data chunk or, if have[i] is a repair index, that repair chunk
+		std::vector<unsigned char> chunks;
+		std::vector<int16_t> have;
+		size_t count;
+		bool decoded;
+	};
+	const FECLayout layout;
+	std::vector<Group> groups;
+	size_t groups_left;
+
+	void decode(size_t group);
+
+public:
+	FECDecoder(size_t bytes);
+	const FECLayout& get_layout() const { return layout; }
+
+	// Returns false if the chunk was a dup, out of range, or not needed anymore
+	bool provide(size_t group, uint8_t index, const unsigned char chunk[FEC_CHUNK_SIZE]);
+	// How many more chunks group needs
+	size_t needed(size_t group) const;
+	bool done() const { return groups_left == 0; }
+	// The whole message, once done()
+	void take(std::vector<unsigned char>& msg);
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "fiber.h"
+#include "utils.h"
+
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <string>
+
+#include <stdlib.h>
+#include <assert.h>
+
+#ifndef WIN32
+#include <ucontext.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef WIN32
+/***********************
+ **** Fiber workers ****
+ ***********************/
+static thread_local Fiber* current_fiber = NULL;
+
+class FiberWorker {
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Fiber*> ready;
+	std::multimap<std::chrono::system_clock::time_point, Fiber*> timers;
+
+	ucontext_t context;
+	// Set by a fiber switching out, as it can't let go of the lock it is waiting with until
+	// it is off its stack (otherwise it could be woken and run twice at once)
+	std::unique_lock<std::mutex>* unlock_after_switch;
+
+	void run() {
+		while (true) {
+			Fiber* fiber;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (true) {
+					auto now = std::chrono::system_clock::now();
+					while (!timers.empty() && timers.begin()->first <= now) {
+						Fiber* timed_out = timers.begin()->second;
+						timed_out->has_timer = false;
+						timers.erase(timers.begin());
+						if (timed_out->blocked.exchange(false))
+							ready.push_back(timed_out);
+					}
+					if (!ready.empty())
+						break;
+					if (timers.empty())
+						cv.wait(lock);
+					else
+						cv.wait_until(lock, timers.begin()->first);
+				}
+				fiber = ready.front();
+				ready.pop_front();
+			}
+
+			current_fiber = fiber;
+			swapcontext(&context, (ucontext_t*)fiber->context);
+			current_fiber = NULL;
+
+			if (unlock_after_switch) {
+				unlock_after_switch->unlock();
+				unlock_after_switch = NULL;
+			}
+			if (fiber->finished) {
+				// fiber may be freed as soon as done is set
+				std::lock_guard<std::mutex> lock(fiber->done_mutex);
+				fiber->done = true;
+				fiber->done_cv.notify_all();
+			}
+		}
+	}
+
+public:
+	FiberWorker() : unlock_after_switch(NULL) { std::thread(&FiberWorker::run, this).detach(); }
+
+	ucontext_t* get_context() { return &context; }
+
+	void make_ready(Fiber* fiber) {
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.push_back(fiber);
+		cv.notify_one();
+	}
+
+	// Only called by fibers on this worker
+	void add_timer(Fiber* fiber, const std::chrono::system_clock::time_point& time) {
+		std::lock_guard<std::mutex> lock(mutex);
+		fiber->timer = timers.emplace(time, fiber);
+		fiber->has_timer = true;
+	}
+	void remove_timer(Fiber* fiber) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (fiber->has_timer)
+			timers.erase(fiber->timer);
+		fiber->has_timer = false;
+	}
+
+	void switch_out(Fiber* fiber, std::unique_lock<std::mutex>* to_unlock) {
+		unlock_after_switch = to_unlock;
+		swapcontext((ucontext_t*)fiber->context, &context);
+	}
+};
+
+// RELAY_FIBERS worker threads (default 0, ie fibers are off), with fibers spread between them
+class FiberPool {
+private:
+	std::vector<FiberWorker*> workers;
+	std::atomic<size_t> next_worker;
+
+public:
+	size_t stack_size;
+
+	FiberPool() : next_worker(0), stack_size(2048 * 1024) {
+		size_t count = 0;
+		try {
+			const char* env = getenv("RELAY_FIBERS");
+			if (env)
+				count = std::stoul(env);
+			// Connections read messages into stack buffers of up to 1MB, so don't go too small
+			env = getenv("RELAY_FIBER_STACK_KB");
+			if (env)
+				stack_size = std::max(size_t(std::stoul(env)), size_t(64)) * 1024;
+		} catch (std::exception& e) {}
+		for (size_t i = 0; i < count; i++)
+			workers.push_back(new FiberWorker());
+	}
+
+	bool enabled() const { return !workers.empty(); }
+	FiberWorker* pick_worker() { return workers[next_worker++ % workers.size()]; }
+};
+
+static FiberPool& pool() {
+	static FiberPool* fiber_pool = new FiberPool();
+	return *fiber_pool;
+}
+
+/****************
+ **** Fibers ****
+ ****************/
+bool Fiber::enabled() { return pool().enabled(); }
+Fiber* Fiber::current() { return current_fiber; }
+
+void Fiber::entry() {
+	Fiber* me = current_fiber;
+	me->func();
+	me->func = std::function<void (void)>();
+	me->finished = true;
+	// Returning goes to uc_link, ie back to the worker
+}
+
+Fiber::Fiber(const std::function<void (void)>& func_in) : func(func_in), worker(pool().pick_worker()),
+		stack_size(pool().stack_size), blocked(false), has_timer(false), finished(false), done(false) {
+	// The lowest page is left unmapped so that overflowing the stack faults instead of
+	// scribbling on whatever is next to it
+	const size_t page = sysconf(_SC_PAGESIZE);
+	stack = (unsigned char*)mmap(NULL, stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	ALWAYS_ASSERT(stack != MAP_FAILED);
+	ALWAYS_ASSERT(!mprotect(stack, page, PROT_NONE));
+
+	ucontext_t* ctx = new ucontext_t;
+	ALWAYS_ASSERT(!getcontext(ctx));
+	ctx->uc_stack.ss_sp = stack + page;
+	ctx->uc_stack.ss_size = stack_size;
+	ctx->uc_link = worker->get_context();
+	makecontext(ctx, &Fiber::entry, 0);
+	context = ctx;
+}
+
+Fiber::~Fiber() {
+	join();
+	munmap(stack, stack_size + sysconf(_SC_PAGESIZE));
+	delete (ucontext_t*)context;
+}
+
+void Fiber::start() {
+	worker->make_ready(this);
+}
+
+void Fiber::join() {
+	assert(current_fiber != this);
+	std::unique_lock<std::mutex> lock(done_mutex);
+	while (!done)
+		done_cv.wait(lock);
+}
+
+/**************************
+ **** Fiber primitives ****
+ **************************/
+void FiberCondition::wait(std::unique_lock<std::mutex>& lock) {
+	if (!current_fiber)
+		return cv.wait(lock);
+	wait_until(lock, std::chrono::system_clock::time_point::max());
+}
+
+void FiberCondition::wait_until(std::unique_lock<std::mutex>& lock, const std::chrono::system_clock::time_point& stop_time) {
+	Fiber* me = current_fiber;
+	if (!me) {
+		cv.wait_until(lock, stop_time);
+		return;
+	}
+
+	waiting.push_back(me);
+	me->blocked = true;
+	if (stop_time != std::chrono::system_clock::time_point::max())
+		me->worker->add_timer(me, stop_time);
+	me->worker->switch_out(me, &lock);
+
+	me->worker->remove_timer(me);
+	lock.lock();
+	auto it = std::find(waiting.begin(), waiting.end(), me);
+	if (it != waiting.end())
+		waiting.erase(it);
+}
+
+void FiberCondition::notify_all() {
+	cv.notify_all();
+	for (Fiber* fiber : waiting)
+		if (fiber->blocked.exchange(false))
+			fiber->worker->make_ready(fiber);
+	waiting.clear();
+}
+#else // WIN32
+bool Fiber::enabled() { return false; }
+Fiber* Fiber::current() { return NULL; }
+void Fiber::entry() {}
+Fiber::Fiber(const std::function<void (void)>& func_in) { ALWAYS_ASSERT(!"Fibers are not supported on WIN32"); }
+Fiber::~Fiber() {}
+void Fiber::start() {}
+void Fiber::join() {}
+
+void FiberCondition::wait(std::unique_lock<std::mutex>& lock) { cv.wait(lock); }
+void FiberCondition::wait_until(std::unique_lock<std::mutex>& lock, const std::chrono::system_clock::time_point& stop_time) { cv.wait_until(lock, stop_time); }
+void FiberCondition::notify_all() { cv.notify_all(); }
+#endif // WIN32
+
+void FiberMutex::lock() {
+	std::unique_lock<std::mutex> lock(state_mutex);
+	while (locked)
+		released.wait(lock);
+	locked = true;
+}
+
+bool FiberMutex::try_lock() {
+	std::lock_guard<std::mutex> lock(state_mutex);
+	if (locked)
+		return false;
+	locked = true;
+	return true;
+}
+
+void FiberMutex::unlock() {
+	std::lock_guard<std::mutex> lock(state_mutex);
+	locked = false;
+	released.notify_all();
+}
@@ -0,0 +1,84 @@
+#ifndef _RELAY_FIBER_H
+#define _RELAY_FIBER_H
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <map>
+#include <atomic>
+
+/* Optionally runs blocking-style code (ie Connection::net_process) as fibers on a pool of
+ * RELAY_FIBERS worker threads instead of a thread each (by default, and always on WIN32,
+ * there are no workers and Fiber::enabled() is false).
+ *
+ * A fiber only gives up its worker while waiting on a FiberCondition (or FiberMutex), and
+ * always runs on the same worker, so it is free to hold ordinary mutexes while it waits as
+ * long as no other fiber wants them in the meantime. Locks which are held across waits and
+ * which others also take (eg RelayNodeCompressor's, held while a block is read) must be
+ * FiberMutexes, otherwise another fiber on the same worker would deadlock on them.
+ * Any other blocking (sleeping, joining threads, etc) simply stalls that worker's fibers. */
+
+class FiberWorker;
+
+class FiberCondition {
+private:
+	std::condition_variable cv;
+	std::vector<class Fiber*> waiting;
+
+public:
+	void wait(std::unique_lock<std::mutex>& lock);
+	void wait_until(std::unique_lock<std::mutex>& lock, const std::chrono::system_clock::time_point& stop_time);
+	// Must be called with the mutex the waiters used held
+	void notify_all();
+};
+
+class Fiber {
+private:
+	std::function<void (void)> func;
+	FiberWorker* worker;
+	void* context;
+	unsigned char* stack;
+	size_t stack_size;
+
+	// Only changed on worker's thread, or with worker's mutex held
+	std::atomic_bool blocked;
+	bool has_timer;
+	std::multimap<std::chrono::system_clock::time_point, Fiber*>::iterator timer;
+
+	std::mutex done_mutex;
+	FiberCondition done_cv;
+	bool finished, done;
+
+	static void entry();
+	friend class FiberWorker;
+	friend class FiberCondition;
+
+public:
+	static bool enabled();
+	// The fiber running on this thread, if any
+	static Fiber* current();
+
+	Fiber(const std::function<void (void)>& func_in);
+	~Fiber(); // Joins first
+	void start();
+	// Waits for func to return, from anywhere but this fiber
+	void join();
+};
+
+// A mutex whose waiters (and holders) can be fibers which wait while holding it
+class FiberMutex {
+private:
+	std::mutex state_mutex;
+	bool locked;
+	FiberCondition released;
+
+public:
+	FiberMutex() : locked(false) {}
+	void lock();
+	bool try_lock();
+	void unlock();
+};
+
+#endif
@@ -1,194 +1,130 @@
 #include "flaggedarrayset.h"
 
 #include <map>
-#include <set>
 #include <vector>
-#include <list>
 #include <thread>
 #include <mutex>
+#include <random>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 
-/******************************
- **** FlaggedArraySet util ****
- ******************************/
-struct PtrPair {
-	std::shared_ptr<std::vector<unsigned char> > elem;
-	std::shared_ptr<std::vector<unsigned char> > elemHash;
-	PtrPair(const std::shared_ptr<std::vector<unsigned char> >& elemIn, const std::shared_ptr<std::vector<unsigned char> >& elemHashIn) :
-		elem(elemIn), elemHash(elemHashIn) {}
-};
-
-struct SharedPtrElem {
-	PtrPair e;
-	bool operator==(const SharedPtrElem& o) const { return *e.elemHash == *o.e.elemHash; }
-	bool operator!=(const SharedPtrElem& o) const { return *e.elemHash != *o.e.elemHash; }
-	bool operator< (const SharedPtrElem& o) const { return *e.elemHash <  *o.e.elemHash; }
-	bool operator<=(const SharedPtrElem& o) const { return *e.elemHash <= *o.e.elemHash; }
-	bool operator> (const SharedPtrElem& o) const { return *e.elemHash >  *o.e.elemHash; }
-	bool operator>=(const SharedPtrElem& o) const { return *e.elemHash >= *o.e.elemHash; }
-	SharedPtrElem(const PtrPair& eIn) : e(eIn) {}
-};
-
-class Deduper {
-private:
-	std::mutex dedup_mutex;
-	std::set<FlaggedArraySet*> allArraySets;
-	std::thread dedup_thread;
-public:
-	Deduper()
-		: dedup_thread([&]() {
-#ifdef PRECISE_BENCH
-			return;
-#endif
-			while (true) {
-				bool haveMultipleSets = false;
-				{
-					std::lock_guard<std::mutex> lock(dedup_mutex);
-					haveMultipleSets = allArraySets.size() > 1;
-				}
-
-				if (haveMultipleSets) {
-					std::list<PtrPair> ptrlist;
-
-					{
-						std::lock_guard<std::mutex> lock(dedup_mutex);
-						for (FlaggedArraySet* fas : allArraySets) {
-							if (!fas->mutex.try_lock())
-								continue;
-							std::lock_guard<WaitCountMutex> lock(fas->mutex, std::adopt_lock);
-							for (const auto& e : fas->backingMap) {
-								if (fas->mutex.wait_count())
-									break;
-								assert(e.first.elem);
-								ptrlist.push_back(PtrPair(e.first.elem, e.first.elemHash));
-							}
-						}
-					}
-
-					std::set<SharedPtrElem> txset;
-					std::map<std::vector<unsigned char>*, PtrPair> duplicateMap;
-					std::list<PtrPair> deallocList;
-					for (const auto& ptr : ptrlist) {
-						assert(ptr.elemHash);
-						auto res = txset.insert(SharedPtrElem(ptr));
-						if (!res.second && res.first->e.elem != ptr.elem)
-							duplicateMap.insert(std::make_pair(&(*ptr.elem), res.first->e));
-					}
-
-					int dedups = 0;
-					{
-						std::lock_guard<std::mutex> lock(dedup_mutex);
-						for (FlaggedArraySet* fas : allArraySets) {
-							if (!fas->mutex.try_lock())
-								continue;
-							std::lock_guard<WaitCountMutex> lock(fas->mutex, std::adopt_lock);
-							for (auto& e : fas->backingMap) {
-								if (fas->mutex.wait_count())
-									break;
-								assert(e.first.elem);
-								auto it = duplicateMap.find(&(*e.first.elem));
-								if (it != duplicateMap.end()) {
-									assert(*it->second.elem == *e.first.elem);
-									assert(*it->second.elemHash == *e.first.elemHash);
-									deallocList.emplace_back(it->second);
-									const_cast<ElemAndFlag&>(e.first).elem.swap(deallocList.back().elem);
-									const_cast<ElemAndFlag&>(e.first).elemHash.swap(deallocList.back().elemHash);
-									dedups++;
-								}
-							}
-						}
-					}
-#ifdef FOR_TEST
-					if (dedups)
-						printf("Deduped %d txn\n", dedups);
-#endif
-				}
-#ifdef FOR_TEST
-				std::this_thread::sleep_for(std::chrono::milliseconds(5));
-#else
-				std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-#endif
-			}
-		})
-	{}
-
-	~Deduper() {
-		//TODO: close thread
+/**************************************
+ **** Process-wide transaction store ****
+ **************************************/
+// Salted so that peers can't grind txids into one long probe chain
+static const uint64_t hash_index_salt = (uint64_t(std::random_device()()) << 32) | std::random_device()();
+
+size_t TxStore::TxidHash::operator()(const InternedTx* t) const {
+	uint64_t v;
+	memcpy(&v, t->hash, sizeof(v));
+	return (v ^ hash_index_salt) * 0x9e3779b97f4a7c15ULL;
+}
+
+bool TxStore::TxidEqual::operator()(const InternedTx* a, const InternedTx* b) const {
+	return !memcmp(a->hash, b->hash, 32);
+}
+
+TxStore& TxStore::get() {
+	static TxStore* store = new TxStore();
+	return *store;
+}
+
+std::shared_ptr<InternedTx> TxStore::intern(const std::shared_ptr<std::vector<unsigned char> >& tx) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = by_bytes.find(&(*tx));
+		if (it != by_bytes.end()) {
+			std::shared_ptr<InternedTx> res = it->second->self.lock();
+			if (res)
+				return res;
+		}
 	}
 
-	void addFAS(FlaggedArraySet* fas) {
-		std::lock_guard<std::mutex> lock(dedup_mutex);
-		allArraySets.insert(fas);
+	InternedTx* t = new InternedTx;
+	t->tx = tx;
+	double_sha256(&(*tx)[0], t->hash, tx->size());
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = by_txid.find(t);
+	if (it != by_txid.end()) {
+		std::shared_ptr<InternedTx> res = (*it)->self.lock();
+		if (res) {
+			delete t;
+			return res;
+		}
+		// The old entry is waiting on us in release(), which will leave ours alone
+		by_bytes.erase((*it)->tx.get());
+		by_txid.erase(it);
 	}
 
-	void removeFAS(FlaggedArraySet* fas) {
-		std::lock_guard<std::mutex> lock(dedup_mutex);
-		allArraySets.erase(fas);
+	std::shared_ptr<InternedTx> res(t, [this](InternedTx* t) { release(t); });
+	t->self = res;
+	by_txid.insert(t);
+	by_bytes[t->tx.get()] = t;
+	return res;
+}
+
+void TxStore::release(InternedTx* t) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = by_txid.find(t);
+		if (it != by_txid.end() && *it == t)
+			by_txid.erase(it);
+		auto bit = by_bytes.find(t->tx.get());
+		if (bit != by_bytes.end() && bit->second == t)
+			by_bytes.erase(bit);
 	}
-};
+	delete t;
+}
+
+size_t TxStore::size() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return by_txid.size();
+}
 
-static Deduper* deduper;
 
+/******************************
+ **** FlaggedArraySet util ****
+ ******************************/
 FlaggedArraySet::FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn) :
 		maxSize(maxSizeIn), maxFlagCount(maxFlagCountIn), backingMap(maxSize) {
 	clear();
-	if (!deduper)
-		deduper = new Deduper();
-	deduper->addFAS(this);
-}
-
-FlaggedArraySet::~FlaggedArraySet() {
-	deduper->removeFAS(this);
-	assert(sanity_check());
 }
 
 
-ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint32_t flagIn, bool setHash) :
-	flag(flagIn), elem(elemIn)
-{
-	if (setHash) {
-		elemHash = std::make_shared<std::vector<unsigned char> >(32);
-		double_sha256(&(*elem)[0], &(*elemHash)[0], elem->size());
-	}
-}
-ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemHashIn, std::nullptr_t) :
-	elemHash(elemHashIn) {}
+ElemAndFlag::ElemAndFlag(const std::shared_ptr<InternedTx>& elemIn, uint32_t flagIn) :
+	flag(flagIn), elem(elemIn) {}
 ElemAndFlag::ElemAndFlag(const std::vector<unsigned char>::const_iterator& elemBeginIn, const std::vector<unsigned char>::const_iterator& elemEndIn, uint32_t flagIn) :
 	flag(flagIn), elemBegin(elemBeginIn), elemEnd(elemEndIn) {}
 
 bool ElemAndFlag::operator == (const ElemAndFlag& o) const {
-	if ((elem && o.elem) || (elemHash && o.elemHash)) {
-		bool hashSet = o.elemHash && elemHash;
-		return o.elem == elem ||
-			(hashSet && *o.elemHash == *elemHash) ||
-			(!hashSet && *o.elem == *elem);
+	if (elem && o.elem)
+		return o.elem == elem || !memcmp(o.elem->hash, elem->hash, 32);
+
+	std::vector<unsigned char>::const_iterator o_begin, o_end, e_begin, e_end;
+	if (elem) {
+		e_begin = elem->tx->begin();
+		e_end = elem->tx->end();
 	} else {
-		std::vector<unsigned char>::const_iterator o_begin, o_end, e_begin, e_end;
-		if (elem) {
-			e_begin = elem->begin();
-			e_end = elem->end();
-		} else {
-			e_begin = elemBegin;
-			e_end = elemEnd;
-		}
-		if (o.elem) {
-			o_begin = o.elem->begin();
-			o_end = o.elem->end();
-		} else {
-			o_begin = o.elemBegin;
-			o_end = o.elemEnd;
-		}
-		return o_end - o_begin == e_end - e_begin && !memcmp(&(*o_begin), &(*e_begin), o_end - o_begin);
+		e_begin = elemBegin;
+		e_end = elemEnd;
+	}
+	if (o.elem) {
+		o_begin = o.elem->tx->begin();
+		o_end = o.elem->tx->end();
+	} else {
+		o_begin = o.elemBegin;
+		o_end = o.elemEnd;
 	}
+	return o_end - o_begin == e_end - e_begin && !memcmp(&(*o_begin), &(*e_begin), o_end - o_begin);
 }
 
 size_t std::hash<ElemAndFlag>::operator()(const ElemAndFlag& e) const {
 	std::vector<unsigned char>::const_iterator it, end;
 	if (e.elem) {
-		it = e.elem->begin();
-		end = e.elem->end();
+		it = e.elem->tx->begin();
+		end = e.elem->tx->end();
 	} else {
 		it = e.elemBegin;
 		end = e.elemEnd;
@@ -203,33 +139,108 @@ size_t std::hash<ElemAndFlag>::operator()(const ElemAndFlag& e) const {
 	static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8, "Your size_t is neither 32-bit nor 64-bit?");
 	for (unsigned int i = 0; i < 8; i += sizeof(size_t)) {
 		for (unsigned int j = 0; j < sizeof(size_t); j++)
-			res ^= *(it + i + j) << 8*j;
+			res ^= size_t(*(it + i + j)) << 8*j;
 	}
 	return res;
 }
 
 
+/**************************
+ **** TxHashIndex util ****
+ **************************/
+static inline bool is_empty_key(const unsigned char* hash) {
+	for (int i = 0; i < 32; i++)
+		if (hash[i])
+			return false;
+	return true;
+}
+
+size_t TxHashIndex::bucket(const unsigned char* hash) const {
+	uint64_t v;
+	memcpy(&v, hash, sizeof(v));
+	return ((v ^ hash_index_salt) * 0x9e3779b97f4a7c15ULL) >> shift;
+}
+
+size_t TxHashIndex::find(const unsigned char* hash) const {
+	for (size_t i = bucket(hash); ; i = (i + 1) & (table.size() - 1)) {
+		if (!memcmp(table[i].hash, hash, 32))
+			return i;
+		if (is_empty_key(table[i].hash))
+			return table.size();
+	}
+}
+
+void TxHashIndex::resize(size_t new_size) {
+	std::vector<Key> old_table(new_size);
+	old_table.swap(table);
+	count = 0;
+	shift = 64;
+	for (size_t s = new_size; s > 1; s >>= 1)
+		shift--;
+	for (const Key& k : old_table)
+		if (!is_empty_key(k.hash))
+			insert(k.hash);
+}
+
+void TxHashIndex::insert(const unsigned char* hash) {
+	if ((count + 1) * 2 > table.size())
+		resize(std::max(table.size() * 2, size_t(64)));
+	size_t i = bucket(hash);
+	while (!is_empty_key(table[i].hash)) {
+		if (!memcmp(table[i].hash, hash, 32))
+			return;
+		i = (i + 1) & (table.size() - 1);
+	}
+	memcpy(table[i].hash, hash, 32);
+	count++;
+}
+
+void TxHashIndex::erase(const unsigned char* hash) {
+	if (table.empty())
+		return;
+	size_t i = find(hash);
+	if (i == table.size())
+		return;
+	// Shift later entries of the probe chain back so that lookups never need tombstones
+	const size_t mask = table.size() - 1;
+	for (size_t j = (i + 1) & mask; !is_empty_key(table[j].hash); j = (j + 1) & mask) {
+		size_t home = bucket(table[j].hash);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	memset(table[i].hash, 0, 32);
+	count--;
+}
+
 bool FlaggedArraySet::sanity_check() const {
-	size_t size = indexMap.size();
-	assert(backingMap.size() == size);
-	assert(this->size() == size - to_be_removed.size());
+	assert(slotTree.size() == slotMap.size() + 1);
+	assert(next_slot <= slotMap.size());
+	assert(index_of_slot(next_slot) == backingMap.size());
+	assert(this->size() == backingMap.size() - to_be_removed.size());
 
 	uint64_t expected_flag_count = 0;
-	for (uint64_t i = 0; i < size; i++) {
-		std::unordered_map<ElemAndFlag, uint64_t>::iterator it = indexMap.at(i);
-		assert(it != backingMap.end());
-		assert(it->second == i + offset);
-		assert(backingMap.find(it->first) == it);
-		assert(&backingMap.find(it->first)->first == &it->first);
-		expected_flag_count += it->first.flag;
+	size_t index = 0;
+	for (uint64_t slot = 0; slot < slotMap.size(); slot++) {
+		SlotElem* e = slotMap[slot];
+		if (!e)
+			continue;
+		assert(slot < next_slot);
+		assert(e->second == slot);
+		assert(index_of_slot(slot) == index);
+		assert(slot_of_index(index) == slot);
+		assert(&(*backingMap.find(e->first)) == e);
+		assert(hashIndex.contains(e->first.elem->hash));
+		expected_flag_count += e->first.flag;
+		index++;
 	}
+	assert(index == backingMap.size());
 	assert(expected_flag_count == flag_count);
 
 	uint64_t expected_flags_removed = 0;
-	for (size_t i = 0; i < to_be_removed.size(); i++) {
-		std::unordered_map<ElemAndFlag, uint64_t>::iterator it = indexMap.at(to_be_removed[i] + i);
-		expected_flags_removed += it->first.flag;
-	}
+	for (size_t i = 0; i < to_be_removed.size(); i++)
+		expected_flags_removed += slotMap[slot_of_index(to_be_removed[i] + i)]->first.flag;
 	assert(expected_flags_removed == flags_to_remove);
 
 	assert(this->size() <= maxSize);
@@ -238,29 +249,65 @@ bool FlaggedArraySet::sanity_check() const {
 	return expected_flags_removed == flags_to_remove && expected_flag_count == flag_count;
 }
 
-void FlaggedArraySet::remove_(size_t index) {
-	auto& rm = indexMap[index];
-	assert(index < indexMap.size());
-	flag_count -= rm->first.flag;
+size_t FlaggedArraySet::index_of_slot(uint64_t slot) const {
+	size_t res = 0;
+	for (uint64_t i = slot; i > 0; i -= i & (~i + 1))
+		res += slotTree[i];
+	return res;
+}
 
-	size_t size = backingMap.size();
+uint64_t FlaggedArraySet::slot_of_index(size_t index) const {
+	// slotMap.size() is always a power of two, so we can walk down the tree
+	uint64_t slot = 0;
+	for (uint64_t bit = slotMap.size(); bit; bit >>= 1) {
+		if (slot + bit <= slotMap.size() && size_t(slotTree[slot + bit]) <= index) {
+			slot += bit;
+			index -= slotTree[slot];
+		}
+	}
+	return slot;
+}
 
-	if (index < size/2) {
-		for (uint64_t i = 0; i < index; i++)
-			indexMap[i]->second++;
-		offset++;
-	} else
-		for (uint64_t i = index + 1; i < size; i++)
-			indexMap[i]->second--;
-	backingMap.erase(rm);
-	indexMap.erase(indexMap.begin() + index);
+void FlaggedArraySet::compact_slots(size_t new_capacity) {
+	std::vector<SlotElem*> live;
+	live.reserve(backingMap.size());
+	for (uint64_t slot = 0; slot < next_slot; slot++)
+		if (slotMap[slot])
+			live.push_back(slotMap[slot]);
+	assert(live.size() <= new_capacity);
+
+	slotMap.assign(new_capacity, NULL);
+	slotTree.assign(new_capacity + 1, 0);
+	for (size_t i = 0; i < live.size(); i++) {
+		slotMap[i] = live[i];
+		live[i]->second = i;
+		slotTree[i + 1] = 1;
+	}
+	for (size_t i = 1; i <= new_capacity; i++) {
+		size_t parent = i + (i & (~i + 1));
+		if (parent <= new_capacity)
+			slotTree[parent] += slotTree[i];
+	}
+	next_slot = live.size();
+}
+
+void FlaggedArraySet::remove_slot(uint64_t slot) {
+	SlotElem* rm = slotMap[slot];
+	assert(slot < next_slot && rm);
+	flag_count -= rm->first.flag;
+
+	for (uint64_t i = slot + 1; i <= slotMap.size(); i += i & (~i + 1))
+		slotTree[i]--;
+	slotMap[slot] = NULL;
+	hashIndex.erase(rm->first.elem->hash);
+	backingMap.erase(backingMap.find(rm->first));
 }
 
 void FlaggedArraySet::cleanup_late_remove() const {
 	assert(sanity_check());
 	if (to_be_removed.size()) {
 		for (unsigned int i = 0; i < to_be_removed.size(); i++) {
-			assert((unsigned int)to_be_removed[i] < indexMap.size());
+			assert((unsigned int)to_be_removed[i] < backingMap.size());
 			const_cast<FlaggedArraySet*>(this)->remove_(to_be_removed[i]);
 		}
 		to_be_removed.clear();
@@ -271,33 +318,35 @@ void FlaggedArraySet::cleanup_late_remove() const {
 }
 
 bool FlaggedArraySet::contains(const std::shared_ptr<std::vector<unsigned char> >& e) const {
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
-	return backingMap.count(ElemAndFlag(e, 0, false));
+	return backingMap.count(ElemAndFlag(e->begin(), e->end(), 0));
 }
 
 bool FlaggedArraySet::contains(const unsigned char* elemHash) const {
-	//TODO: Come up with a cheap way to optimize this?
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
-	ElemAndFlag e(std::make_shared<std::vector<unsigned char> >(elemHash, elemHash + 32), NULL);
-	for (const std::unordered_map<ElemAndFlag, uint64_t>::iterator& it : indexMap)
-		if (it->first == e)
-			return true;
-	return false;
+	return hashIndex.contains(elemHash);
 }
 
 void FlaggedArraySet::add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag) {
-	ElemAndFlag elem(e, flag, true);
-
-	std::lock_guard<WaitCountMutex> lock(mutex);
+	ElemAndFlag elem(TxStore::get().intern(e), flag);
 	cleanup_late_remove();
 
-	auto res = backingMap.insert(std::make_pair(elem, size() + offset));
+	if (next_slot == slotMap.size()) {
+		size_t new_capacity = 1024;
+		while (new_capacity < 2 * (backingMap.size() + 1))
+			new_capacity *= 2;
+		compact_slots(new_capacity);
+	}
+
+	auto res = backingMap.insert(std::make_pair(elem, next_slot));
 	if (!res.second)
 		return;
 
-	indexMap.push_back(res.first);
+	slotMap[next_slot] = &(*res.first);
+	hashIndex.insert(elem.elem->hash);
+	for (uint64_t i = next_slot + 1; i <= slotMap.size(); i += i & (~i + 1))
+		slotTree[i]++;
+	next_slot++;
 	flag_count += flag;
 
 	assert(size() <= maxSize + 1);
@@ -309,34 +358,59 @@ void FlaggedArraySet::add(const std::shared_ptr<std::vector<unsigned char> >& e,
 }
 
 int FlaggedArraySet::remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) {
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
 
 	auto it = backingMap.find(ElemAndFlag(start, end, 0));
 	if (it == backingMap.end())
 		return -1;
 
-	int res = it->second - offset;
-	remove_(res);
+	int res = index_of_slot(it->second);
+	remove_slot(it->second);
+
+	assert(sanity_check());
+	return res;
+}
+
+int64_t FlaggedArraySet::find_slot(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const {
+	assert(to_be_removed.empty());
+	auto it = backingMap.find(ElemAndFlag(start, end, 0));
+	if (it == backingMap.end())
+		return -1;
+	return it->second;
+}
+
+int FlaggedArraySet::remove_found(int64_t slot) {
+	assert(to_be_removed.empty());
+	if (slot < 0 || !slotMap[slot])
+		return -1;
+
+	int res = index_of_slot(slot);
+	remove_slot(slot);
 
 	assert(sanity_check());
 	return res;
 }
 
 bool FlaggedArraySet::remove(unsigned int index, std::vector<unsigned char>& elemRes, unsigned char* elemHashRes) {
-	std::lock_guard<WaitCountMutex> lock(mutex);
+	std::shared_ptr<std::vector<unsigned char> > elem;
+	if (!remove(index, elem, elemHashRes))
+		return false;
+	elemRes = *elem;
+	return true;
+}
 
+bool FlaggedArraySet::remove(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes) {
 	if (index < max_remove)
 		cleanup_late_remove();
 	int lookup_index = index + to_be_removed.size();
 
-	if ((unsigned int)lookup_index >= indexMap.size())
+	if ((unsigned int)lookup_index >= backingMap.size())
 		return false;
 
-	const ElemAndFlag& e = indexMap[lookup_index]->first;
-	assert(e.elem && e.elemHash);
-	memcpy(elemHashRes, &(*e.elemHash)[0], 32);
-	elemRes = *e.elem;
+	const ElemAndFlag& e = slotMap[slot_of_index(lookup_index)]->first;
+	assert(e.elem);
+	memcpy(elemHashRes, e.elem->hash, 32);
+	elemRes = e.elem->tx;
 
 	if (index >= max_remove) {
 		to_be_removed.push_back(index);
@@ -352,20 +426,47 @@ bool FlaggedArraySet::remove(unsigned int index, std::vector<unsigned char>& ele
 }
 
 void FlaggedArraySet::clear() {
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	if (!indexMap.empty() && !backingMap.empty())
+	if (!slotMap.empty() && !backingMap.empty())
 		assert(sanity_check());
 
-	flag_count = 0; offset = 0;
+	flag_count = 0; next_slot = 0;
 	flags_to_remove = 0; max_remove = 0;
-	backingMap.clear(); indexMap.clear(); to_be_removed.clear();
+	backingMap.clear(); to_be_removed.clear();
+	slotMap.clear(); slotTree.assign(1, 0);
+	hashIndex.clear();
+}
+
+FlaggedArraySet& FlaggedArraySet::operator=(const FlaggedArraySet& o) {
+	o.cleanup_late_remove();
+	clear();
+
+	maxSize = o.maxSize;
+	maxFlagCount = o.maxFlagCount;
+	flag_count = o.flag_count;
+
+	// o's slots point into o.backingMap, so rebuild them against ours
+	backingMap = o.backingMap;
+	std::vector<SlotElem*> old_slots(o.next_slot, NULL);
+	for (auto& e : backingMap) {
+		old_slots[e.second] = &e;
+		hashIndex.insert(e.first.elem->hash);
+	}
+	slotMap.swap(old_slots);
+	next_slot = o.next_slot;
+
+	size_t capacity = 1024;
+	while (capacity < 2 * (backingMap.size() + 1))
+		capacity *= 2;
+	compact_slots(capacity);
+	return *this;
 }
 
 void FlaggedArraySet::for_all_txn(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) const {
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
-	for (const auto& e : indexMap) {
-		assert(e->first.elem);
-		callback(e->first.elem);
+	for (uint64_t slot = 0; slot < next_slot; slot++) {
+		if (!slotMap[slot])
+			continue;
+		assert(slotMap[slot]->first.elem);
+		callback(slotMap[slot]->first.elem->tx);
 	}
 }
@@ -3,21 +3,55 @@
 
 #include <vector>
 #include <thread>
+#include <mutex>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <cstddef>
 
 #include "utils.h"
 
+/**************************************
+ **** Process-wide transaction store ****
+ **************************************/
+// Every FlaggedArraySet holds its transactions through the TxStore, so that a
+// transaction which is in many sets (eg each client's recv_tx_cache) has its
+// bytes and hash stored once. Entries go away when the last set drops them.
+struct InternedTx {
+	std::shared_ptr<std::vector<unsigned char> > tx;
+	unsigned char hash[32];
+private:
+	friend class TxStore;
+	std::weak_ptr<InternedTx> self;
+};
+
+class TxStore {
+private:
+	struct TxidHash { size_t operator()(const InternedTx* t) const; };
+	struct TxidEqual { bool operator()(const InternedTx* a, const InternedTx* b) const; };
+
+	std::mutex mutex;
+	std::unordered_set<InternedTx*, TxidHash, TxidEqual> by_txid;
+	// Lets us skip hashing when we're handed the same bytes again (eg for each compressor)
+	std::unordered_map<const std::vector<unsigned char>*, InternedTx*> by_bytes;
+
+	void release(InternedTx* t);
+
+public:
+	static TxStore& get();
+	std::shared_ptr<InternedTx> intern(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	size_t size();
+};
+
+
 /******************************
  **** FlaggedArraySet util ****
  ******************************/
 struct ElemAndFlag {
 	uint32_t flag;
-	std::shared_ptr<std::vector<unsigned char> > elem, elemHash;
+	std::shared_ptr<InternedTx> elem;
 	std::vector<unsigned char>::const_iterator elemBegin, elemEnd;
-	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint32_t flagIn, bool setHash);
-	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemHashIn, std::nullptr_t);
+	ElemAndFlag(const std::shared_ptr<InternedTx>& elemIn, uint32_t flagIn);
 	ElemAndFlag(const std::vector<unsigned char>::const_iterator& elemBegin, const std::vector<unsigned char>::const_iterator& elemEnd, uint32_t flagIn);
 	bool operator == (const ElemAndFlag& o) const;
 };
@@ -28,20 +62,45 @@ namespace std {
 }
 
 
+// Open-addressed (linear probing) set of 32-byte hashes for cheap membership
+// checks. The all-zero hash marks an empty bucket (it is not a real txid).
+class TxHashIndex {
+private:
+	struct Key { unsigned char hash[32]; };
+	std::vector<Key> table;
+	size_t count;
+	unsigned int shift; // 64 - log2(table.size())
+
+	size_t bucket(const unsigned char* hash) const;
+	size_t find(const unsigned char* hash) const;
+	void resize(size_t new_size);
+
+public:
+	TxHashIndex() : count(0), shift(64) {}
+	void clear() { table.clear(); count = 0; shift = 64; }
+	bool contains(const unsigned char* hash) const { return !table.empty() && find(hash) != table.size(); }
+	void insert(const unsigned char* hash);
+	void erase(const unsigned char* hash);
+};
 
 class FlaggedArraySet {
 private:
 	uint64_t maxSize, maxFlagCount, flag_count;
-	size_t offset;
+
+	// Each element is given the next slot when it is added (backingMap's value).
+	// An element's index is the number of live slots before it, tracked in a
+	// Fenwick tree (slotTree) so that index <-> slot is O(log n) both ways.
+	// Once we run out of slots, live elements are compacted back down to the start.
+	typedef std::unordered_map<ElemAndFlag, uint64_t>::value_type SlotElem;
 	std::unordered_map<ElemAndFlag, uint64_t> backingMap;
-	std::vector<std::unordered_map<ElemAndFlag, uint64_t>::iterator> indexMap;
+	std::vector<SlotElem*> slotMap;
+	std::vector<int32_t> slotTree;
+	uint64_t next_slot;
 
-	// The mutex is only used by memory deduper, FlaggedArraySet is not thread-safe
-	// It is taken by changes to backingMap, any touches to backingMap in the deduper thread, or any touches to elem
-	friend class Deduper;
-	friend class FASLockHint;
-	mutable WaitCountMutex mutex;
+	// Every element's hash, kept in sync with backingMap (including late removes)
+	TxHashIndex hashIndex;
 
+	// FlaggedArraySet is not thread-safe
 	mutable std::vector<int> to_be_removed;
 	mutable uint32_t max_remove;
 	mutable uint64_t flags_to_remove;
@@ -49,45 +108,40 @@ private:
 public:
 	void clear();
 	FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn);
-	~FlaggedArraySet();
+	~FlaggedArraySet() { assert(sanity_check()); }
 
 	size_t size() const { return backingMap.size() - to_be_removed.size(); }
 	uint64_t flagCount() const { return flag_count - flags_to_remove; }
 	bool contains(const std::shared_ptr<std::vector<unsigned char> >& e) const;
 	bool contains(const unsigned char* elemHash) const;
 
-	FlaggedArraySet& operator=(const FlaggedArraySet& o) {
-		o.cleanup_late_remove();
-		clear();
-
-		maxSize = o.maxSize;
-		maxFlagCount = o.maxFlagCount;
-		flag_count = o.flag_count;
-		offset = o.offset;
-		backingMap = o.backingMap;
-		indexMap = o.indexMap;
-		return *this;
-	}
+	FlaggedArraySet& operator=(const FlaggedArraySet& o);
 
 private:
 	bool sanity_check() const;
-	void remove_(size_t index);
+	size_t index_of_slot(uint64_t slot) const;
+	uint64_t slot_of_index(size_t index) const;
+	void compact_slots(size_t new_capacity);
+	void remove_slot(uint64_t slot);
+	void remove_(size_t index) { remove_slot(slot_of_index(index)); }
 	void cleanup_late_remove() const;
 
 public:
 	void add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag);
 	int remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end);
 	bool remove(unsigned int index, std::vector<unsigned char>& elemRes, unsigned char* elemHashRes);
+	bool remove(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes);
 
 	void for_all_txn(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) const;
-};
 
-class FASLockHint {
-private:
-	WaitCountHint* hint;
-public:
-	FASLockHint(FlaggedArraySet& fas) : hint(new WaitCountHint(fas.mutex)) {}
-	~FASLockHint() { delete hint; }
+	// Batched removal, for when the lookups are worth spreading over several threads:
+	// call start_lookups(), then find_slot() (which is safe from any number of threads at
+	// once, as long as nothing else touches the set), and finally remove_found() with each
+	// slot in the order their indexes should be assigned in.
+	void start_lookups() { cleanup_late_remove(); }
+	int64_t find_slot(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const;
+	// Returns the element's index (as remove() does), or -1 if the slot was already removed
+	int remove_found(int64_t slot);
 };
 
 #endif
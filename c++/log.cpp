@@ -0,0 +1,280 @@
+#include "log.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+#include <time.h>
+
+/******************************
+ **** Per-thread log rings ****
+ ******************************/
+// Single-producer (the owning thread), single-consumer (whoever holds drain_mutex)
+class LogRing {
+public:
+	static const size_t RECORDS = 64;
+
+	LogRecord records[RECORDS];
+	std::atomic<uint64_t> head, tail;
+	// Set while the owner holds a sequence number it has not yet published
+	std::atomic<bool> busy;
+	// Set once the owning thread has exited, after which the ring is freed when empty
+	std::atomic<bool> orphaned;
+
+	LogRing() : head(0), tail(0), busy(false), orphaned(false) {}
+};
+
+class Logger {
+public:
+	std::atomic<uint64_t> next_seq;
+
+	std::mutex rings_mutex;
+	std::vector<LogRing*> rings;
+
+	std::mutex drain_mutex;
+
+	std::mutex wake_mutex;
+	std::condition_variable wake_cv;
+	std::atomic<bool> wake_pending;
+
+	std::string out, err;
+
+	Logger() : next_seq(0), wake_pending(false) {
+		std::thread(flush_thread, this).detach();
+		atexit(log_flush);
+	}
+
+	void wake() {
+		if (!wake_pending.load(std::memory_order_relaxed) && !wake_pending.exchange(true))
+			wake_cv.notify_one();
+	}
+
+	void drain();
+
+	static void flush_thread(Logger* me) {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(me->wake_mutex);
+				// Wakeups aren't taken under wake_mutex, so may be missed, hence the timeout
+				me->wake_cv.wait_for(lock, std::chrono::milliseconds(10), [&]() { return me->wake_pending.load(); });
+			}
+			me->wake_pending = false;
+			me->drain();
+		}
+	}
+};
+
+static Logger& logger() {
+	static Logger* instance = new Logger();
+	return *instance;
+}
+
+class ThreadRing {
+public:
+	LogRing* ring;
+	ThreadRing() : ring(new LogRing()) {
+		Logger& log = logger();
+		std::lock_guard<std::mutex> lock(log.rings_mutex);
+		log.rings.push_back(ring);
+	}
+	~ThreadRing() { ring->orphaned = true; }
+};
+static thread_local ThreadRing thread_ring;
+
+LogRecord* log_begin(uint16_t flags, const char* format) {
+	LogRing* ring = thread_ring.ring;
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	while (head - ring->tail.load(std::memory_order_acquire) >= LogRing::RECORDS) {
+		logger().wake();
+		std::this_thread::yield();
+	}
+
+	LogRecord* record = &ring->records[head % LogRing::RECORDS];
+	ring->busy.store(true);
+	record->seq = logger().next_seq.fetch_add(1);
+	record->time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	record->format = format;
+	record->flags = flags;
+	record->args_len = 0;
+	return record;
+}
+
+void log_commit(LogRecord* record) {
+	LogRing* ring = thread_ring.ring;
+	ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	ring->busy.store(false, std::memory_order_release);
+	logger().wake();
+}
+
+
+
+/********************
+ **** Formatting ****
+ ********************/
+static void format_record(const LogRecord& record, std::string& out) {
+	char buf[512];
+
+	if (record.flags & LOG_FLAG_STAMP) {
+		time_t secs = record.time_us / 1000000;
+		struct tm tm;
+#ifdef WIN32
+		tm = *gmtime(&secs);
+#else
+		gmtime_r(&secs, &tm);
+#endif
+		snprintf(buf, sizeof(buf), "[%d-%02d-%02d %02d:%02d:%02d.%03d+00] ",
+				tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, int((record.time_us % 1000000) / 1000));
+		out += buf;
+	}
+
+	size_t argpos = 0;
+	for (const char* c = record.format; *c; c++) {
+		if (*c != '%') {
+			out += *c;
+			continue;
+		}
+		if (c[1] == '%') {
+			out += '%';
+			c++;
+			continue;
+		}
+
+		// Pull out flags, width and precision, dropping any length modifier
+		std::string spec("%");
+		const char* s = c + 1;
+		while (*s && strchr("-+ #0123456789.", *s))
+			spec += *s++;
+		while (*s && strchr("hlLqjzt", *s))
+			s++;
+		if (!*s)
+			break;
+		char conv = *s;
+		c = s;
+
+		if (argpos >= record.args_len) {
+			out += spec + conv;
+			continue;
+		}
+
+		unsigned char tag = record.args[argpos];
+		unsigned char kind = tag & 0xf0, len = tag & 0x0f;
+		const unsigned char* data = &record.args[argpos + 1];
+		if (kind == LogRecord::ARG_STRING) {
+			const char* str = (const char*)data;
+			argpos += 2 + strlen(str);
+			snprintf(buf, sizeof(buf), (spec + 's').c_str(), str);
+			out += buf;
+			continue;
+		}
+		argpos += 1 + len;
+
+		if (kind == LogRecord::ARG_DOUBLE) {
+			double d;
+			memcpy(&d, data, sizeof(d));
+			snprintf(buf, sizeof(buf), (spec + (strchr("eEfFgGaA", conv) ? conv : 'f')).c_str(), d);
+		} else if (kind == LogRecord::ARG_POINTER) {
+			void* p;
+			memcpy(&p, data, sizeof(p));
+			snprintf(buf, sizeof(buf), (spec + 'p').c_str(), p);
+		} else {
+			uint64_t u = 0;
+			memcpy(&u, data, len); // LE only, as is FORCE_LE
+			long long i = u;
+			if (kind == LogRecord::ARG_INT && len < 8 && (u >> (len * 8 - 1)) & 1)
+				i = (long long)(u | (~0ULL << (len * 8)));
+			if (conv == 'c')
+				snprintf(buf, sizeof(buf), (spec + 'c').c_str(), int(i));
+			else if (strchr("diouxX", conv))
+				snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), i);
+			else
+				snprintf(buf, sizeof(buf), "%lld", i);
+		}
+		out += buf;
+	}
+}
+
+/******************
+ **** Draining ****
+ ******************/
+void Logger::drain() {
+	std::lock_guard<std::mutex> drain_lock(drain_mutex);
+
+	std::vector<LogRing*> current;
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		current = rings;
+	}
+
+	// Anything before limit has been published, unless its ring is still busy with it
+	uint64_t limit = next_seq.load();
+	for (LogRing* ring : current)
+		while (ring->busy.load())
+			std::this_thread::yield();
+
+	// Each ring is in sequence order, so merge them by always taking the lowest next record
+	std::vector<LogRing*> pending;
+	for (LogRing* ring : current)
+		if (ring->tail.load(std::memory_order_relaxed) != ring->head.load(std::memory_order_acquire))
+			pending.push_back(ring);
+
+	while (!pending.empty()) {
+		size_t best = pending.size();
+		uint64_t best_seq = limit;
+		for (size_t i = 0; i < pending.size(); i++) {
+			LogRing* ring = pending[i];
+			const LogRecord& record = ring->records[ring->tail.load(std::memory_order_relaxed) % LogRing::RECORDS];
+			if (record.seq < best_seq) {
+				best = i;
+				best_seq = record.seq;
+			}
+		}
+		if (best == pending.size())
+			break;
+
+		LogRing* ring = pending[best];
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		const LogRecord& record = ring->records[tail % LogRing::RECORDS];
+		bool to_stderr = record.flags & LOG_FLAG_STDERR;
+		format_record(record, to_stderr ? err : out);
+		// The slot may be reused as soon as tail moves past it
+		ring->tail.store(tail + 1, std::memory_order_release);
+		if (tail + 1 == ring->head.load(std::memory_order_acquire))
+			pending.erase(pending.begin() + best);
+
+		// Keep stdout and stderr lines interleaved as they were logged
+		if (to_stderr ? !out.empty() : !err.empty()) {
+			FILE* other = to_stderr ? stdout : stderr;
+			std::string& other_buf = to_stderr ? out : err;
+			fwrite(other_buf.data(), 1, other_buf.size(), other);
+			fflush(other);
+			other_buf.clear();
+		}
+	}
+
+	fwrite(out.data(), 1, out.size(), stdout);
+	fwrite(err.data(), 1, err.size(), stderr);
+	fflush(stdout);
+	fflush(stderr);
+	out.clear();
+	err.clear();
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (size_t i = 0; i < rings.size();) {
+		LogRing* ring = rings[i];
+		if (ring->orphaned && ring->tail.load() == ring->head.load()) {
+			rings[i] = rings.back();
+			rings.pop_back();
+			delete ring;
+		} else
+			i++;
+	}
+}
+
+void log_flush() {
+	logger().drain();
+}
@@ -0,0 +1,93 @@
+#ifndef _RELAY_LOG_H
+#define _RELAY_LOG_H
+
+#include <algorithm>
+#include <type_traits>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Asynchronous logging: LOG() and friends take printf arguments, but only copy them (with
+ * a timestamp) into a fixed-size record in a per-thread ring. A background thread formats
+ * and writes them, so a slow stdout never stalls a relay thread. Records from all threads
+ * are written in the order they were logged, and LOG_STAMPED lines get the time at which
+ * they were logged (not written) as a prefix.
+ *
+ * Strings are copied into the record, and are truncated if a record fills up.
+ */
+
+#define LOG_FLAG_STDERR 1
+#define LOG_FLAG_STAMP 2
+
+// The if (0) printf gets us the compiler's format string checking
+#define LOG_WITH_FLAGS(flags, ...) do { if (0) printf(__VA_ARGS__); log_record(flags, __VA_ARGS__); } while (0)
+#define LOG(...) LOG_WITH_FLAGS(0, __VA_ARGS__)
+#define LOG_STAMPED(...) LOG_WITH_FLAGS(LOG_FLAG_STAMP, __VA_ARGS__)
+#define LOG_STDERR(...) LOG_WITH_FLAGS(LOG_FLAG_STDERR, __VA_ARGS__)
+
+struct LogRecord {
+	static const size_t SIZE = 512;
+
+	uint64_t seq;
+	int64_t time_us; // Since the epoch, in system_clock terms
+	const char* format; // Must be a literal (or otherwise live forever)
+	uint16_t flags;
+	uint16_t args_len;
+	unsigned char args[SIZE - 2*8 - sizeof(const char*) - 2*2];
+
+	// Each argument is a one-byte tag (the kind of argument | its size) followed by its bytes
+	enum ArgKind { ARG_INT = 0x10, ARG_UINT = 0x20, ARG_DOUBLE = 0x30, ARG_STRING = 0x40, ARG_POINTER = 0x50 };
+
+	void push_arg(ArgKind kind, const void* data, size_t len) {
+		if (size_t(args_len) + 1 + len > sizeof(args))
+			return;
+		args[args_len] = kind | len;
+		memcpy(&args[args_len + 1], data, len);
+		args_len += 1 + len;
+	}
+
+	template <typename T>
+	typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type push(T arg) {
+		push_arg(std::is_signed<T>::value ? ARG_INT : ARG_UINT, &arg, sizeof(arg));
+	}
+	void push(double arg) { push_arg(ARG_DOUBLE, &arg, sizeof(arg)); }
+	void push(const void* arg) { push_arg(ARG_POINTER, &arg, sizeof(arg)); }
+	void push(const char* arg) {
+		if (!arg)
+			arg = "(null)";
+		// Strings are stored as a tag (without a size), their bytes and a nul
+		if (size_t(args_len) + 2 > sizeof(args))
+			return;
+		size_t len = std::min(strlen(arg), sizeof(args) - args_len - 2);
+		args[args_len] = ARG_STRING;
+		memcpy(&args[args_len + 1], arg, len);
+		args[args_len + 1 + len] = 0;
+		args_len += 2 + len;
+	}
+	void push(char* arg) { push((const char*)arg); }
+
+	void push_all() {}
+	template <typename T, typename... Args>
+	void push_all(T arg, Args... args) {
+		push(arg);
+		push_all(args...);
+	}
+};
+
+// Reserves/publishes the next record in this thread's ring
+LogRecord* log_begin(uint16_t flags, const char* format);
+void log_commit(LogRecord* record);
+
+template <typename... Args>
+void log_record(uint16_t flags, const char* format, Args... args) {
+	LogRecord* record = log_begin(flags, format);
+	record->push_all(args...);
+	log_commit(record);
+}
+
+// Writes out everything logged before the call (blocking until it is done)
+void log_flush();
+
+#endif
@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "flaggedarrayset.h"
+#include "log.h"
+#include "metrics.h"
+#include "relayprocess.h"
+#include "syntheticblock.h"
+#include "utils.h"
+#include "connection.h"
+
+/*
+ * End-to-end block propagation benchmark: a relay server and a number of relay
+ * clients, all in this process, talking the real protocol over loopback TCP through
+ * the usual Connection/net thread machinery. bitcoind is stood in for by
+ * generate_block() on the server side and by a timestamp on the client side, so what
+ * is measured is the time from the server having a block to each client having fully
+ * reconstructed it, as the number of connected clients grows.
+ */
+
+static std::mutex progress_mutex;
+static std::condition_variable progress_cv;
+static std::atomic<bool> failed(false);
+
+static std::atomic<uint32_t> clients_connected(0);
+static std::atomic<uint32_t> blocks_received(0);
+static std::atomic<uint64_t> bytes_received(0);
+// steady_clock time (in ns) at which the server started compressing the current block
+static std::atomic<int64_t> block_start_ns(0);
+static std::atomic<MetricHistogram*> latency_ns(NULL);
+
+static int64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void notify_progress() {
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	progress_cv.notify_all();
+}
+
+// Waits (up to a minute) for done to become true, failing the whole run if it doesn't
+static bool wait_for(const std::function<bool ()>& done) {
+	std::unique_lock<std::mutex> lock(progress_mutex);
+	if (!progress_cv.wait_for(lock, std::chrono::seconds(60), [&]() { return done() || failed; }))
+		failed = true;
+	return !failed;
+}
+
+
+
+/***************************
+ **** Server-side peers ****
+ ***************************/
+class ServerPeer;
+
+// As in server.cpp, relay_mutex orders every change to compressor with the sending of
+// the matching message to peers
+static std::mutex relay_mutex;
+static RelayNodeCompressor server_compressor(false, true);
+static std::vector<ServerPeer*> ready_peers;
+
+class ServerPeer : public Connection {
+private:
+	RELAY_DECLARE_CLASS_VARS
+
+public:
+	bool tx_batches; // Set before the peer is ready
+
+	ServerPeer(int sockIn, const std::string& hostIn) : Connection(sockIn, hostIn, NULL), RELAY_DECLARE_CONSTRUCTOR_EXTENDS, tx_batches(false) { construction_done(); }
+
+	void send(const std::shared_ptr<std::vector<unsigned char> >& msg, int token=0) { do_send_bytes(msg, token); }
+
+	void send_block(const std::shared_ptr<std::vector<unsigned char> >& block) {
+		int token = get_send_mutex();
+		do_send_bytes(block, token);
+		struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
+		do_send_bytes((char*)&header, sizeof(header), token);
+		release_send_mutex(token);
+	}
+
+	void send_ping(uint64_t nonce) {
+		char data[sizeof(relay_msg_header) + 8];
+		relay_msg_header header = { RELAY_MAGIC_BYTES, PING_TYPE, htonl(8) };
+		memcpy(data, &header, sizeof(header));
+		memcpy(data + sizeof(header), &nonce, 8);
+		do_send_bytes(data, sizeof(data), 0, OUTBOUND_CONTROL);
+	}
+
+private:
+	void net_process(const std::function<void(std::string)>& disconnect) {
+		while (true) {
+			relay_msg_header header;
+			if (read_all((char*)&header, 4*3) != 4*3)
+				return disconnect("failed to read message header");
+
+			if (header.magic != RELAY_MAGIC_BYTES)
+				return disconnect("invalid magic bytes");
+
+			uint32_t message_size = ntohl(header.length);
+			if (message_size > 1000)
+				return disconnect("got message too large");
+
+			char data[message_size];
+			if (read_all(data, message_size) < (int64_t)(message_size))
+				return disconnect("failed to read message");
+
+			if (header.type == VERSION_TYPE) {
+				if (std::string(data, strnlen(data, message_size)) != VERSION_STRING)
+					return disconnect("unknown version string");
+				tx_batches = version_has_feature(data, message_size, VERSION_FEATURE_TX_BATCH);
+
+				do_send_bytes(relay_msg(VERSION_TYPE, data, message_size));
+
+				// Replay the send cache, as RelayNetworkCompressor::relay_node_connected does
+				std::lock_guard<std::mutex> lock(relay_mutex);
+				int token = get_send_mutex();
+				for (const auto& chunk : server_compressor.sent_tx_snapshot())
+					do_send_bytes(chunk, token);
+				release_send_mutex(token);
+				ready_peers.push_back(this);
+				notify_progress();
+			} else if (header.type != PONG_TYPE)
+				return disconnect("got unexpected message type");
+		}
+	}
+};
+
+static void accept_peers(int listen_fd) {
+	while (true) {
+		int new_fd = accept(listen_fd, NULL, NULL);
+		if (new_fd < 0) {
+			LOG("Failed to accept (%s)\n", strerror(errno));
+			failed = true;
+			return notify_progress();
+		}
+		static unsigned peer_count = 0;
+		new ServerPeer(new_fd, "loopback-" + std::to_string(peer_count++));
+	}
+}
+
+
+
+/****************************
+ **** Downstream clients ****
+ ****************************/
+class LoopbackClient : public OutboundPersistentConnection {
+private:
+	RELAY_DECLARE_CLASS_VARS
+
+	RelayNodeCompressor compressor;
+	bool was_connected;
+
+public:
+	std::atomic<uint64_t> last_ping;
+
+	LoopbackClient(uint16_t port) : OutboundPersistentConnection("::1", port), RELAY_DECLARE_CONSTRUCTOR_EXTENDS, compressor(false, true), was_connected(false), last_ping(0) { construction_done(); }
+
+private:
+	void on_disconnect() {
+		// Compressor state is only in sync with the server's for the one connection
+		if (was_connected) {
+			LOG("Client disconnected mid-benchmark\n");
+			failed = true;
+			notify_progress();
+		}
+	}
+
+	void net_process(const std::function<void(std::string)>& disconnect) {
+		compressor.reset();
+
+		static const char version[] = VERSION_STRING "\0" VERSION_FEATURE_TX_BATCH;
+		maybe_do_send_bytes(relay_msg(VERSION_TYPE, version, sizeof(version) - 1));
+
+		while (true) {
+			relay_msg_header header;
+			if (read_all((char*)&header, 4*3) != 4*3)
+				return disconnect("failed to read message header");
+
+			if (header.magic != RELAY_MAGIC_BYTES)
+				return disconnect("invalid magic bytes");
+
+			uint32_t message_size = ntohl(header.length);
+
+			if (header.type == BLOCK_TYPE) {
+				BufferedReader reader([&](size_t min_bytes, size_t& avail) { return this->peek(min_bytes, avail); }, [&](size_t nbyte) { this->consume(nbyte); });
+				auto res = compressor.decompress_relay_block(reader, message_size, false);
+				reader.release();
+				if (std::get<2>(res))
+					return disconnect(std::get<2>(res));
+
+				latency_ns.load()->record(now_ns() - block_start_ns);
+				bytes_received += std::get<1>(res)->size() - sizeof(struct bitcoin_msg_header);
+				blocks_received++;
+				notify_progress();
+			} else if (header.type == END_BLOCK_TYPE) {
+			} else if (header.type == TRANSACTION_TYPE) {
+				if (!compressor.maybe_recv_tx_of_size(message_size, false))
+					return disconnect("got freely relayed transaction too large");
+
+				auto tx = pooled_buffer(message_size);
+				if (read_all((char*)&(*tx)[0], message_size) < (int64_t)(message_size))
+					return disconnect("failed to read loose transaction data");
+
+				compressor.recv_tx(tx);
+			} else if (header.type == TRANSACTIONS_TYPE) {
+				std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+				BufferedReader reader([&](size_t min_bytes, size_t& avail) { return this->peek(min_bytes, avail); }, [&](size_t nbyte) { this->consume(nbyte); });
+				const char* error = compressor.recv_tx_batch(reader, message_size, txn);
+				reader.release();
+				if (error)
+					return disconnect(error);
+			} else if (header.type == VERSION_TYPE || header.type == PING_TYPE) {
+				if (message_size > 1000)
+					return disconnect("got message too large");
+				char data[message_size];
+				if (read_all(data, message_size) < (int64_t)(message_size))
+					return disconnect("failed to read message");
+
+				if (header.type == VERSION_TYPE) {
+					was_connected = true;
+					clients_connected++;
+				} else if (message_size == 8) {
+					// Pings are only sent after a batch of transactions, so once one arrives,
+					// we are known to be caught up
+					uint64_t nonce;
+					memcpy(&nonce, data, 8);
+					last_ping = nonce;
+				}
+				notify_progress();
+			} else
+				return disconnect("got unknown message type");
+		}
+	}
+};
+
+
+
+/*******************
+ **** Benchmark ****
+ *******************/
+struct PeerCountResult {
+	uint32_t peers;
+	MetricHistogram latency;
+	MetricHistogram all_peers_ns, compress_ns;
+	uint64_t wire_bytes = 0;
+	uint64_t bytes_delivered = 0, total_ns = 0;
+};
+
+static void usage(const char* argv0) {
+	LOG("USAGE: %s [--peers=N,N,...] [--blocks=N] [--txcount=N] [--tx-size=BYTES] [--tx-size-sigma=S] [--prerelay=FRACTION] [--seed=N] [--json=FILE]\n", argv0);
+	LOG("Peer counts must be ascending, as clients are added to the existing ones to reach each count\n");
+}
+
+int main(int argc, const char** argv) {
+	std::vector<uint32_t> peer_counts = { 1, 4, 16, 64 };
+	uint32_t block_count = 10;
+	std::string json_path;
+	SyntheticBlockParams params { 2400, 250, 60, MAX_RELAY_TRANSACTION_BYTES, 1.0, 0.9, 42 };
+
+	for (int i = 1; i < argc; i++) {
+		const char* eq = strchr(argv[i], '=');
+		std::string arg(argv[i], eq ? eq - argv[i] : strlen(argv[i]));
+		const char* value = eq ? eq + 1 : "";
+		if (arg == "--peers") {
+			peer_counts.clear();
+			for (const char* c = value; *c; c = strchr(c, ',') ? strchr(c, ',') + 1 : c + strlen(c))
+				peer_counts.push_back(std::max(1, atoi(c)));
+		} else if (arg == "--blocks")
+			block_count = std::max(1, atoi(value));
+		else if (arg == "--txcount")
+			params.tx_count = std::min(100000, std::max(1, atoi(value)));
+		else if (arg == "--tx-size")
+			params.tx_size = std::max(1, atoi(value));
+		else if (arg == "--tx-size-sigma")
+			params.tx_size_sigma = atof(value);
+		else if (arg == "--prerelay")
+			params.prerelay = atof(value);
+		else if (arg == "--seed")
+			params.seed = atoll(value);
+		else if (arg == "--json")
+			json_path = value;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (peer_counts.empty() || !std::is_sorted(peer_counts.begin(), peer_counts.end())) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_loopback;
+	socklen_t addr_size = sizeof(addr);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0 ||
+			getsockname(listen_fd, (struct sockaddr *) &addr, &addr_size) < 0) {
+		LOG("Failed to bind loopback listen socket: %s\n", strerror(errno));
+		return 1;
+	}
+	std::thread(accept_peers, listen_fd).detach();
+	uint16_t port = ntohs(addr.sin6_port);
+
+	LOG("Using SHA256 implementation %s\n", sha256_implementation().c_str());
+
+	std::vector<LoopbackClient*> clients;
+	std::vector<PeerCountResult*> results;
+	uint64_t next_nonce = 1, next_seed = params.seed;
+	for (uint32_t peers : peer_counts) {
+		while (clients.size() < peers)
+			clients.push_back(new LoopbackClient(port));
+		if (!wait_for([&]() { std::lock_guard<std::mutex> lock(relay_mutex); return clients_connected == peers && ready_peers.size() == peers; })) {
+			LOG("Timed out waiting for %u clients to connect\n", peers);
+			break;
+		}
+
+		PeerCountResult* result = new PeerCountResult();
+		result->peers = peers;
+		results.push_back(result);
+		latency_ns = &result->latency;
+
+		for (uint32_t i = 0; i < block_count && !failed; i++) {
+			SyntheticBlockParams block_params = params;
+			block_params.seed = next_seed++;
+			SyntheticBlock block = generate_block(block_params);
+
+			// Pre-relay the mempool, then make sure every client has caught up
+			const uint64_t nonce = next_nonce++;
+			{
+				std::lock_guard<std::mutex> lock(relay_mutex);
+				auto msgs = server_compressor.get_relay_transactions(block.prerelayed);
+				if (msgs.first)
+					for (ServerPeer* peer : ready_peers)
+						peer->send(peer->tx_batches ? msgs.second : msgs.first);
+				for (ServerPeer* peer : ready_peers)
+					peer->send_ping(nonce);
+			}
+			if (!wait_for([&]() { for (LoopbackClient* client : clients) if (client->last_ping != nonce) return false; return true; })) {
+				LOG("Timed out waiting for clients to receive transactions\n");
+				break;
+			}
+
+			const uint32_t received_before = blocks_received;
+			const uint64_t bytes_before = bytes_received;
+			const int64_t start = now_ns();
+			block_start_ns = start;
+			{
+				std::lock_guard<std::mutex> lock(relay_mutex);
+				auto res = server_compressor.maybe_compress_block(block.hash, block.block, false);
+				if (std::get<1>(res)) {
+					LOG("Failed to compress block (%s)\n", std::get<1>(res));
+					failed = true;
+					break;
+				}
+				result->compress_ns.record(now_ns() - start);
+				result->wire_bytes += std::get<0>(res)->size();
+				for (ServerPeer* peer : ready_peers)
+					peer->send_block(std::get<0>(res));
+			}
+			if (!wait_for([&]() { return blocks_received - received_before == peers; })) {
+				LOG("Timed out waiting for clients to receive block\n");
+				break;
+			}
+			const int64_t all_peers_ns = now_ns() - start;
+			result->all_peers_ns.record(all_peers_ns);
+			result->total_ns += all_peers_ns;
+			result->bytes_delivered += bytes_received - bytes_before;
+		}
+		if (failed)
+			break;
+
+		LOG("%4u peers: latency p50 %8.3f ms p99 %8.3f ms max %8.3f ms, all peers p50 %8.3f ms, compress p50 %7.3f ms, %8.1f MB/s delivered\n", peers,
+				result->latency.quantile(0.5) / 1e6, result->latency.quantile(0.99) / 1e6, result->latency.get_max() / 1e6,
+				result->all_peers_ns.quantile(0.5) / 1e6, result->compress_ns.quantile(0.5) / 1e6, result->bytes_delivered * 1e3 / result->total_ns);
+	}
+
+	if (!json_path.empty()) {
+		FILE* out = fopen(json_path.c_str(), "w");
+		if (!out) {
+			LOG("Failed to open %s\n", json_path.c_str());
+			failed = true;
+		} else {
+			std::string block_json = params.json();
+			fprintf(out, "{\"sha256_implementation\": \"%s\", \"block\": %s, \"blocks_per_peer_count\": %u, \"results\": [\n", sha256_implementation().c_str(), block_json.c_str(), block_count);
+			for (size_t i = 0; i < results.size(); i++) {
+				const PeerCountResult& r = *results[i];
+				fprintf(out, "\t{\"peers\": %u, \"latency_ns_p50\": %lu, \"latency_ns_p99\": %lu, \"latency_ns_max\": %lu, \"all_peers_ns_p50\": %lu, \"all_peers_ns_max\": %lu, "
+						"\"compress_ns_p50\": %lu, \"wire_bytes\": %lu, \"bytes_delivered\": %lu, \"mb_per_sec\": %.2f}%s\n", r.peers,
+						(unsigned long)r.latency.quantile(0.5), (unsigned long)r.latency.quantile(0.99), (unsigned long)r.latency.get_max(),
+						(unsigned long)r.all_peers_ns.quantile(0.5), (unsigned long)r.all_peers_ns.get_max(), (unsigned long)r.compress_ns.quantile(0.5),
+						(unsigned long)r.wire_bytes, (unsigned long)r.bytes_delivered, r.total_ns ? r.bytes_delivered * 1e3 / r.total_ns : 0.0,
+						i == results.size() - 1 ? "" : ",");
+			}
+			fprintf(out, "]}\n");
+			fclose(out);
+		}
+	}
+
+	// Connections are never torn down (just as in the daemons), so skip static destructors
+	// which would race with the net threads
+	log_flush();
+	_exit(failed ? 1 : 0);
+}
@@ -12,21 +12,30 @@
 #include <fcntl.h>
 
 #include "mruset.h"
+#include "log.h"
 #include "utils.h"
 #include "connection.h"
 #include "rpcclient.h"
 
 
 
+// The wire format is just back-to-back 32-byte hashes, so a batch is built once and the
+// same buffer is queued on every client instead of one 32-byte send per hash per client
+static std::shared_ptr<std::vector<unsigned char> > serialize_hashes(std::set<std::vector<unsigned char> >::const_iterator begin, const std::set<std::vector<unsigned char> >::const_iterator end, size_t count) {
+	auto buf = pooled_buffer(0, count * 32);
+	for (; begin != end; begin++) {
+		assert(begin->size() == 32);
+		buf->insert(buf->end(), begin->begin(), begin->end());
+	}
+	return buf;
+}
+
 class MempoolClient : public Connection {
 public:
 	MempoolClient(int fd_in, std::string hostIn) : Connection(fd_in, hostIn, NULL) { construction_done(); }
-	void send_pool(std::set<std::vector<unsigned char> >::const_iterator mempool_begin, const std::set<std::vector<unsigned char> >::const_iterator mempool_end, int send_mutex=0) {
-		while (mempool_begin != mempool_end) {
-			assert(mempool_begin->size() == 32);
-			do_send_bytes((const char*) &(*mempool_begin)[0], 32, send_mutex);
-			mempool_begin++;
-		}
+	void send_pool(const std::shared_ptr<std::vector<unsigned char> >& hashes, int send_mutex=0) {
+		if (!hashes->empty())
+			do_send_bytes(hashes, send_mutex);
 	}
 private:
 	void net_process(const std::function<void(std::string)>& disconnect) {
@@ -41,7 +50,7 @@ private:
 
 int main(int argc, char** argv) {
 	if (argc != 3 && argc != 4) {
-		printf("USAGE: %s listen_port local_port [::ffff:whitelisted prefix string]\n", argv[0]);
+		LOG("USAGE: %s listen_port local_port [::ffff:whitelisted prefix string]\n", argv[0]);
 		return -1;
 	}
 
@@ -49,7 +58,7 @@ int main(int argc, char** argv) {
 	struct sockaddr_in6 addr;
 
 	if ((listen_fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
-		printf("Failed to create socket\n");
+		LOG("Failed to create socket\n");
 		return -1;
 	}
 
@@ -62,7 +71,7 @@ int main(int argc, char** argv) {
 	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ||
 			bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
 			listen(listen_fd, 3) < 0) {
-		printf("Failed to bind port: %s\n", strerror(errno));
+		LOG("Failed to bind port: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -77,41 +86,50 @@ int main(int argc, char** argv) {
 	uint64_t bytes_sent = 0;
 	uint32_t txn_sent = 0;
 	std::chrono::steady_clock::time_point last_mempool_print(std::chrono::steady_clock::now());
-	RPCClient rpcTrustedP2P("127.0.0.1", std::stoul(argv[2]),
-					[&](std::vector<std::pair<std::vector<unsigned char>, size_t> >& txn_list, size_t total_mempool_size) {
-						std::set<std::vector<unsigned char> > new_txn;
-						{
-							std::lock_guard<std::mutex> lock(mempool_mutex);
-
-							// 62500 bytes per sec == 500Kbps
-							uint64_t size_gathered = 0, size_to_gather = 62500*to_millis_lu(std::chrono::steady_clock::now() - last_mempool_request)/1000;
-							last_mempool_request = std::chrono::steady_clock::now();
-
-							for (const auto& txn : txn_list) {
-								if (mempool.insert(txn.first).second) {
-									new_txn.insert(txn.first);
-									size_gathered += txn.second;
-									bytes_sent += txn.second;
-									txn_sent++;
-								}
-								if (size_gathered >= size_to_gather)
-									break;
-							}
-						}
-
-						if (++i == 0) {
-							printf("Sent %u (%lu bytes) txn over the past %lf ms, current total mempool size %lu\n", txn_sent, bytes_sent, to_millis_double(std::chrono::steady_clock::now() - last_mempool_print), total_mempool_size);
-							last_mempool_print = std::chrono::steady_clock::now();
-							bytes_sent = 0;
-							txn_sent = 0;
-						}
-
-						std::lock_guard<std::mutex> lock(map_mutex);
-						for (auto it = clientMap.begin(); it != clientMap.end(); it++) {
-							if (!it->second->getDisconnectFlags())
-								it->second->send_pool(new_txn.begin(), new_txn.end());
-						}
-					});
+	// Delta mode, so we only walk transactions we haven't taken yet
+	const std::function<size_t (const std::vector<std::pair<std::vector<unsigned char>, size_t> >&, size_t)> new_txn_for_block =
+		[&](const std::vector<std::pair<std::vector<unsigned char>, size_t> >& txn_list, size_t total_mempool_size) {
+			std::set<std::vector<unsigned char> > new_txn;
+			size_t taken = 0;
+			{
+				std::lock_guard<std::mutex> lock(mempool_mutex);
+
+				// 62500 bytes per sec == 500Kbps
+				uint64_t size_gathered = 0, size_to_gather = 62500*to_millis_lu(std::chrono::steady_clock::now() - last_mempool_request)/1000;
+				last_mempool_request = std::chrono::steady_clock::now();
+
+				for (const auto& txn : txn_list) {
+					taken++;
+					if (mempool.insert(txn.first).second) {
+						new_txn.insert(txn.first);
+						size_gathered += txn.second;
+						bytes_sent += txn.second;
+						txn_sent++;
+					}
+					if (size_gathered >= size_to_gather)
+						break;
+				}
+			}
+
+			if (++i == 0) {
+				LOG("Sent %u (%lu bytes) txn over the past %lf ms, current total mempool size %lu\n", txn_sent, bytes_sent, to_millis_double(std::chrono::steady_clock::now() - last_mempool_print), total_mempool_size);
+				last_mempool_print = std::chrono::steady_clock::now();
+				bytes_sent = 0;
+				txn_sent = 0;
+			}
+
+			if (new_txn.empty())
+				return taken;
+			auto hashes = serialize_hashes(new_txn.begin(), new_txn.end(), new_txn.size());
+
+			std::lock_guard<std::mutex> lock(map_mutex);
+			for (auto it = clientMap.begin(); it != clientMap.end(); it++) {
+				if (!it->second->getDisconnectFlags())
+					it->second->send_pool(hashes);
+			}
+			return taken;
+		};
+	RPCClient rpcTrustedP2P("127.0.0.1", std::stoul(argv[2]), new_txn_for_block);
 
 	std::thread([&](void) {
 		while (true) {
@@ -120,7 +138,7 @@ int main(int argc, char** argv) {
 				std::lock_guard<std::mutex> lock(map_mutex);
 				for (auto it = clientMap.begin(); it != clientMap.end();) {
 					if (it->second->getDisconnectFlags() & DISCONNECT_COMPLETE) {
-						fprintf(stderr, "%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
+						LOG_STDERR("%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
 						delete it->second;
 						clientMap.erase(it++);
 					} else
@@ -139,7 +157,7 @@ int main(int argc, char** argv) {
 	while (true) {
 		int new_fd;
 		if ((new_fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_size)) < 0) {
-			printf("Failed to select (%d: %s)\n", new_fd, strerror(errno));
+			LOG("Failed to select (%d: %s)\n", new_fd, strerror(errno));
 			return -1;
 		}
 
@@ -149,7 +167,7 @@ int main(int argc, char** argv) {
 				(host.length() > droppostfix.length() && !host.compare(host.length() - droppostfix.length(), droppostfix.length(), droppostfix))) {
 			if (clientMap.count(host)) {
 				const auto& client = clientMap[host];
-				fprintf(stderr, "%lld: Got duplicate connection from %s (original's disconnect status: %d)\n", (long long) time(NULL), host.c_str(), client->getDisconnectFlags());
+				LOG_STDERR("%lld: Got duplicate connection from %s (original's disconnect status: %d)\n", (long long) time(NULL), host.c_str(), client->getDisconnectFlags());
 			}
 			close(new_fd);
 		} else {
@@ -159,12 +177,12 @@ int main(int argc, char** argv) {
 
 			MempoolClient* client = new MempoolClient(new_fd, host);
 			clientMap[host] = client;
-			fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
+			LOG_STDERR("%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
 
 			int send_mutex = client->get_send_mutex();
 			{
 				std::lock_guard<std::mutex> lock(mempool_mutex);
-				client->send_pool(mempool.begin(), mempool.end(), send_mutex);
+				client->send_pool(serialize_hashes(mempool.begin(), mempool.end(), mempool.size()), send_mutex);
 			}
 			client->release_send_mutex(send_mutex);
 		}
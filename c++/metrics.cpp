@@ -0,0 +1,224 @@
+#include "metrics.h"
+#include "log.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+	#include <unistd.h>
+#endif
+
+MetricHistogram::MetricHistogram() : sum(0), max(0) {
+	for (unsigned i = 0; i < BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+uint64_t MetricHistogram::get_count() const {
+	uint64_t total = 0;
+	for (unsigned i = 0; i < BUCKETS; i++)
+		total += buckets[i].load(std::memory_order_relaxed);
+	return total;
+}
+
+uint64_t MetricHistogram::quantile(double q) const {
+	uint64_t total = 0;
+	uint64_t counts[BUCKETS];
+	for (unsigned i = 0; i < BUCKETS; i++)
+		total += (counts[i] = buckets[i].load(std::memory_order_relaxed));
+	if (!total)
+		return 0;
+
+	uint64_t target = q * total;
+	if (target >= total)
+		target = total - 1;
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < BUCKETS; i++) {
+		seen += counts[i];
+		if (seen > target) {
+			if (i < SUB_BUCKETS)
+				return i;
+			unsigned msb = i / SUB_BUCKETS + 3;
+			uint64_t low = uint64_t(SUB_BUCKETS + i % SUB_BUCKETS) << (msb - 4);
+			return std::min(low + (uint64_t(1) << (msb - 4)) - 1, get_max());
+		}
+	}
+	return get_max();
+}
+
+
+
+/******************
+ **** Registry ****
+ ******************/
+class MetricsRegistry {
+public:
+	std::mutex mutex;
+	std::map<std::string, MetricCounter*> counters;
+	std::map<std::string, MetricGauge*> gauges;
+	std::map<std::string, MetricHistogram*> histograms;
+	std::vector<std::function<void (std::string&)> > collectors;
+
+	MetricsRegistry();
+};
+
+// Leaked, so that metrics can still be recorded from other statics' destructors
+static MetricsRegistry& registry() {
+	static MetricsRegistry* reg = new MetricsRegistry();
+	return *reg;
+}
+
+template <typename T>
+static T& get_or_register(std::map<std::string, T*>& map, const std::string& name) {
+	std::lock_guard<std::mutex> lock(registry().mutex);
+	T*& res = map[name];
+	if (!res)
+		res = new T();
+	return *res;
+}
+
+MetricCounter& metrics_counter(const std::string& name) {
+	return get_or_register(registry().counters, name);
+}
+
+MetricGauge& metrics_gauge(const std::string& name) {
+	return get_or_register(registry().gauges, name);
+}
+
+MetricHistogram& metrics_histogram(const std::string& name) {
+	return get_or_register(registry().histograms, name);
+}
+
+void metrics_add_collector(const std::function<void (std::string&)>& collector) {
+	std::lock_guard<std::mutex> lock(registry().mutex);
+	registry().collectors.push_back(collector);
+}
+
+
+
+/*******************
+ **** Snapshots ****
+ *******************/
+// Splits relay_foo{a="b"} into relay_foo and a="b"
+static void split_name(const std::string& full, std::string& name, std::string& labels) {
+	size_t brace = full.find('{');
+	if (brace == std::string::npos || full.back() != '}') {
+		name = full;
+		labels.clear();
+	} else {
+		name = full.substr(0, brace);
+		labels = full.substr(brace + 1, full.size() - brace - 2);
+	}
+}
+
+static void append_sample(std::string& out, const std::string& name, const std::string& labels, const std::string& value) {
+	out += name;
+	if (!labels.empty())
+		out += "{" + labels + "}";
+	out += " " + value + "\n";
+}
+
+void metrics_append(std::string& out, const std::string& name, const std::string& labels, int64_t value) {
+	append_sample(out, name, labels, std::to_string(value));
+}
+
+template <typename T>
+static void append_all(std::string& out, const std::map<std::string, T*>& map, const char* type, const std::function<void (const std::string&, const std::string&, const T&)>& append) {
+	std::string last_name, name, labels;
+	for (const auto& it : map) {
+		split_name(it.first, name, labels);
+		if (name != last_name)
+			out += "# TYPE " + name + " " + type + "\n";
+		last_name = name;
+		append(name, labels, *it.second);
+	}
+}
+
+std::string metrics_snapshot() {
+	std::string out;
+	std::lock_guard<std::mutex> lock(registry().mutex);
+
+	append_all<MetricCounter>(out, registry().counters, "counter", [&](const std::string& name, const std::string& labels, const MetricCounter& counter) {
+		append_sample(out, name, labels, std::to_string(counter.get()));
+	});
+	append_all<MetricGauge>(out, registry().gauges, "gauge", [&](const std::string& name, const std::string& labels, const MetricGauge& gauge) {
+		append_sample(out, name, labels, std::to_string(gauge.get()));
+	});
+	append_all<MetricHistogram>(out, registry().histograms, "summary", [&](const std::string& name, const std::string& labels, const MetricHistogram& hist) {
+		const std::string prefix = labels.empty() ? "" : labels + ",";
+		for (const char* q : { "0.5", "0.9", "0.99", "0.999" })
+			append_sample(out, name, prefix + "quantile=\"" + q + "\"", std::to_string(hist.quantile(atof(q))));
+		append_sample(out, name, prefix + "quantile=\"1\"", std::to_string(hist.get_max()));
+		append_sample(out, name + "_sum", labels, std::to_string(hist.get_sum()));
+		append_sample(out, name + "_count", labels, std::to_string(hist.get_count()));
+	});
+
+	for (const auto& collector : registry().collectors)
+		collector(out);
+	return out;
+}
+
+
+
+/******************
+ **** Exporter ****
+ ******************/
+#ifndef WIN32
+static void serve_metrics(int listen_fd) {
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		// We don't care what was requested, everyone gets the snapshot
+		char buf[4096];
+		ssize_t res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		(void) res;
+
+		std::string body = metrics_snapshot();
+		std::string resp = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+		size_t written = 0;
+		while (written < resp.size()) {
+			ssize_t count = send(fd, resp.data() + written, resp.size() - written, MSG_NOSIGNAL);
+			if (count <= 0)
+				break;
+			written += count;
+		}
+		close(fd);
+	}
+}
+#endif
+
+MetricsRegistry::MetricsRegistry() {
+#ifndef WIN32
+	const char* env = getenv("RELAY_METRICS_PORT");
+	if (!env || !atoi(env))
+		return;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(env));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 16)) {
+		LOG("Failed to bind metrics port %s\n", env);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	std::thread(serve_metrics, fd).detach();
+#endif
+}
@@ -0,0 +1,89 @@
+#ifndef _RELAY_METRICS_H
+#define _RELAY_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <stdint.h>
+
+/*
+ * Metrics are registered once by name (which may carry Prometheus-style labels,
+ * eg relay_compress_ns{compressor="0"}) and then live forever, so hot paths can
+ * keep a reference and record with a handful of relaxed atomic ops and no locks.
+ *
+ * If RELAY_METRICS_PORT is set, a text snapshot of everything registered is served
+ * (Prometheus exposition format, over plain HTTP) on that port on localhost.
+ */
+
+class MetricCounter {
+private:
+	std::atomic<uint64_t> value;
+public:
+	MetricCounter() : value(0) {}
+	void add(uint64_t n=1) { value.fetch_add(n, std::memory_order_relaxed); }
+	uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+class MetricGauge {
+private:
+	std::atomic<int64_t> value;
+public:
+	MetricGauge() : value(0) {}
+	void set(int64_t n) { value.store(n, std::memory_order_relaxed); }
+	void add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+	int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// HDR-style log-linear histogram: values below 16 each get a bucket, and every power
+// of two above that is split into 16 buckets, so any quantile is within ~6%
+class MetricHistogram {
+public:
+	static const unsigned SUB_BUCKETS = 16;
+	static const unsigned BUCKETS = (64 - 3) * SUB_BUCKETS;
+
+private:
+	std::atomic<uint64_t> buckets[BUCKETS];
+	std::atomic<uint64_t> sum, max;
+
+	static unsigned bucket_of(uint64_t value) {
+		if (value < SUB_BUCKETS)
+			return value;
+		unsigned msb = 63 - __builtin_clzll(value);
+		return ((msb - 3) * SUB_BUCKETS) | ((value >> (msb - 4)) & (SUB_BUCKETS - 1));
+	}
+
+public:
+	MetricHistogram();
+
+	void record(uint64_t value) {
+		buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+		uint64_t old_max = max.load(std::memory_order_relaxed);
+		while (value > old_max && !max.compare_exchange_weak(old_max, value, std::memory_order_relaxed));
+	}
+	void record_since(const std::chrono::steady_clock::time_point& start) {
+		record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	// Upper bound of the bucket holding the q-th quantile (0 if nothing was recorded).
+	// Concurrent records may or may not be included.
+	uint64_t quantile(double q) const;
+	uint64_t get_count() const;
+	uint64_t get_sum() const { return sum.load(std::memory_order_relaxed); }
+	uint64_t get_max() const { return max.load(std::memory_order_relaxed); }
+};
+
+MetricCounter& metrics_counter(const std::string& name);
+MetricGauge& metrics_gauge(const std::string& name);
+MetricHistogram& metrics_histogram(const std::string& name);
+
+// Collectors are called on every snapshot to append samples for state which isn't
+// worth keeping in registered metrics (eg per-connection values), see metrics_append
+void metrics_add_collector(const std::function<void (std::string&)>& collector);
+void metrics_append(std::string& out, const std::string& name, const std::string& labels, int64_t value);
+
+std::string metrics_snapshot();
+
+#endif
@@ -6,8 +6,14 @@
 #define BITCOIN_MRUSET_H
 
 #include <deque>
+#include <functional>
 #include <set>
+#include <vector>
 #include <utility>
+#include <random>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
 
 /** STL-like set container that only keeps the most recent N elements. */
 template <typename T> class mruset
@@ -107,4 +113,110 @@ public:
     }
 };
 
+/** Set of 32-byte hashes that only keeps the most recent N, without any per-entry allocation.
+ * Hashes are kept in insertion order in a ring (evicting the oldest once it is full), and
+ * found through an open-addressed table of ring positions. Both grow on demand up to N. */
+class hashmruset
+{
+private:
+    struct Key { unsigned char hash[32]; };
+    std::vector<Key> ring;
+    std::vector<uint32_t> table; // ring position + 1, 0 is an empty bucket
+    size_t nMaxSize, next; // next is the oldest ring entry once the ring is full
+    unsigned int shift;
+    uint64_t salt; // So that peers can't grind hashes into one probe chain
+
+    size_t bucket(const unsigned char* hash) const {
+        uint64_t v;
+        memcpy(&v, hash, sizeof(v));
+        return ((v ^ salt) * 0x9e3779b97f4a7c15ULL) >> shift;
+    }
+
+    size_t find(const unsigned char* hash) const {
+        if (table.empty())
+            return table.size();
+        for (size_t i = bucket(hash); ; i = (i + 1) & (table.size() - 1)) {
+            if (!table[i])
+                return table.size();
+            if (!memcmp(ring[table[i] - 1].hash, hash, 32))
+                return i;
+        }
+    }
+
+    void place(uint32_t pos) {
+        size_t i = bucket(ring[pos].hash);
+        while (table[i])
+            i = (i + 1) & (table.size() - 1);
+        table[i] = pos + 1;
+    }
+
+    void erase_bucket(size_t i) {
+        // Shift later entries of the probe chain back so that lookups never need tombstones
+        const size_t mask = table.size() - 1;
+        for (size_t j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+            size_t home = bucket(ring[table[j] - 1].hash);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i] = 0;
+    }
+
+    void grow() {
+        size_t new_size = table.empty() ? 64 : table.size() * 2;
+        table.assign(new_size, 0);
+        shift = 64;
+        for (size_t s = new_size; s > 1; s >>= 1)
+            shift--;
+        for (size_t pos = 0; pos < ring.size(); pos++)
+            place(pos);
+    }
+
+public:
+    hashmruset(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), next(0), shift(64) {
+        assert(nMaxSize > 0 && nMaxSize < (1ULL << 31));
+        std::random_device rd;
+        salt = (uint64_t(rd()) << 32) | rd();
+    }
+
+    size_t size() const { return ring.size(); }
+    size_t max_size() const { return nMaxSize; }
+    void clear() { ring.clear(); table.clear(); next = 0; shift = 64; }
+
+    bool count(const unsigned char* hash) const { return find(hash) != table.size(); }
+    bool count(const std::vector<unsigned char>& hash) const { assert(hash.size() == 32); return count(&hash[0]); }
+
+    // Returns true if hash was not already in the set
+    bool insert(const unsigned char* hash) {
+        if (count(hash))
+            return false;
+        uint32_t pos;
+        if (ring.size() < nMaxSize) {
+            if ((ring.size() + 1) * 2 > table.size()) {
+                ring.emplace_back();
+                memcpy(ring.back().hash, hash, 32);
+                grow();
+                return true;
+            }
+            pos = ring.size();
+            ring.emplace_back();
+        } else {
+            pos = next;
+            next = (next + 1) % nMaxSize;
+            erase_bucket(find(ring[pos].hash));
+        }
+        memcpy(ring[pos].hash, hash, 32);
+        place(pos);
+        return true;
+    }
+    bool insert(const std::vector<unsigned char>& hash) { assert(hash.size() == 32); return insert(&hash[0]); }
+
+    // Oldest first, so that inserting them all into an empty set gives the same evictions
+    void for_each(const std::function<void (const unsigned char*)>& callback) const {
+        for (size_t i = 0; i < ring.size(); i++)
+            callback(ring[(next + i) % ring.size()].hash);
+    }
+};
+
 #endif // BITCOIN_MRUSET_H
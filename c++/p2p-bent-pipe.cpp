@@ -15,6 +15,7 @@
 #define BITCOIN_UA {'/', 'F', 'I', 'B', 'R', 'E', 'N', 'e', 't', 'w', 'o', 'r', 'k', 'P', 'i', 'p', 'e', ':', '4', '2', '/', '\0'}
 
 #include "p2ppipe.h"
+#include "log.h"
 
 class P2PClient : public P2PPipe {
 public:
@@ -34,9 +35,9 @@ private:
 
 int main(int argc, char** argv) {
 	if (argc < 5) {
-		printf("USAGE: %s BITCOIND_1_ADDRESS BITCOIND_1_PORT BITCOIND_2_ADDRESS BITCOIND_2_PORT\n", argv[0]);
-		printf("Pipes two bitcoinds together, getting around the broken addnode behavior in Bitcoin Core\n");
-		printf("  by utilizing inbound connection slots instead of outbound ones\n");
+		LOG("USAGE: %s BITCOIND_1_ADDRESS BITCOIND_1_PORT BITCOIND_2_ADDRESS BITCOIND_2_PORT\n", argv[0]);
+		LOG("Pipes two bitcoinds together, getting around the broken addnode behavior in Bitcoin Core\n");
+		LOG("  by utilizing inbound connection slots instead of outbound ones\n");
 		return -1;
 	}
 
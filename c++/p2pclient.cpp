@@ -1,4 +1,5 @@
 #include "p2pclient.h"
+#include "log.h"
 #include "utils.h"
 #include "crypto/sha2.h"
 
@@ -20,9 +21,9 @@
 	#include <fcntl.h>
 #endif // !WIN32
 
-void P2PRelayer::send_message(const char* command, unsigned char* headerAndData, size_t datalen) {
+void P2PRelayer::send_message(const char* command, unsigned char* headerAndData, size_t datalen, OutboundClass cls) {
 	prepare_message(command, headerAndData, datalen);
-	maybe_do_send_bytes((char*)headerAndData, sizeof(struct bitcoin_msg_header) + datalen);
+	maybe_do_send_bytes((char*)headerAndData, sizeof(struct bitcoin_msg_header) + datalen, 0, cls);
 }
 
 void P2PRelayer::on_disconnect() {
@@ -37,9 +38,11 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 		send_message("version", &version_msg[0], version_msg.size() - sizeof(struct bitcoin_msg_header));
 	}
 
+	// Messages are mostly small, so several of them usually come out of each view
+	BufferedReader reader([&](size_t min_bytes, size_t& avail) { return peek(min_bytes, avail); }, [&](size_t nbyte) { consume(nbyte); });
 	while (true) {
 		struct bitcoin_msg_header header;
-		if (read_all((char*)&header, sizeof(header)) != sizeof(header))
+		if (!reader.read(&header, sizeof(header)))
 			return disconnect("failed to read message header");
 
 		if (header.magic != BITCOIN_MAGIC)
@@ -53,28 +56,15 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 
 		std::chrono::system_clock::time_point read_start(std::chrono::system_clock::now());
 
-		auto msg = std::make_shared<std::vector<unsigned char> > (prependedHeaderSize + uint32_t(header.length));
+		auto msg = pooled_buffer(prependedHeaderSize + uint32_t(header.length));
 		if (check_block_msghash && strncmp(header.command, "block", strlen("block"))) {
 			uint32_t hash[8];
-			double_sha256_init(hash);
-
-			uint32_t steps = header.length / 64;
-			for (uint32_t i = 0; i < steps; i++) {
-				unsigned char* writepos = &((*msg)[prependedHeaderSize + i*64]);
-				if (read_all((char*)writepos, 64) != 64)
-					return disconnect("failed to read message");
-				double_sha256_step(writepos, 64, hash);
-			}
-
-			unsigned char* writepos = &((*msg)[prependedHeaderSize + steps*64]);
-			if (read_all((char*)writepos, header.length - steps*64) != ssize_t(header.length - steps*64))
+			if (!read_hashing(reader, &(*msg)[prependedHeaderSize], header.length, hash))
 				return disconnect("failed to read message");
-			double_sha256_done(writepos, header.length - steps*64, header.length, hash);
-
 			if (memcmp((char*)hash, header.checksum, sizeof(header.checksum)))
 				return disconnect("got invalid message checksum");
 		} else
-			if (read_all((char*)&(*msg)[prependedHeaderSize], header.length) != ssize_t(header.length))
+			if (!reader.read(&(*msg)[prependedHeaderSize], header.length))
 				return disconnect("failed to read message");
 
 		if (!strncmp(header.command, "version", strlen("version"))) {
@@ -89,14 +79,12 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 			struct bitcoin_msg_header new_header;
 			send_message("verack", (unsigned char*)&new_header, 0);
 
-			STAMPOUT();
-			printf("Connected to bitcoind with version %u\n", le32toh(their_version->protocol_version));
+			LOG_STAMPED("Connected to bitcoind with version %u\n", le32toh(their_version->protocol_version));
 			continue;
 		} else if (!strncmp(header.command, "verack", strlen("verack"))) {
 			if (connected != 1)
 				return disconnect("got invalid verack");
-			STAMPOUT();
-			printf("Finished connect handshake with bitcoind\n");
+			LOG_STAMPED("Finished connect handshake with bitcoind\n");
 			connected = 2;
 
 			if (provide_headers) {
@@ -104,7 +92,14 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 				struct bitcoin_version_start sent_version;
 				msg.insert(msg.end(), (unsigned char*)&sent_version.protocol_version, ((unsigned char*)&sent_version.protocol_version) + sizeof(sent_version.protocol_version));
 				msg.insert(msg.end(), 1, 1);
-				msg.insert(msg.end(), 64, 0);
+				std::vector<unsigned char> start;
+				if (headers_start)
+					start = headers_start();
+				if (start.size() == 32)
+					msg.insert(msg.end(), start.begin(), start.end());
+				else
+					msg.insert(msg.end(), 32, 0);
+				msg.insert(msg.end(), 32, 0);
 				send_message("getheaders", &msg[0], msg.size() - sizeof(struct bitcoin_msg_header));
 			}
 			continue;
@@ -116,7 +111,7 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 		if (!strncmp(header.command, "ping", strlen("ping"))) {
 			std::vector<unsigned char> resp(sizeof(struct bitcoin_msg_header) + header.length);
 			resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), msg->begin(), msg->end());
-			send_message("pong", &resp[0], header.length);
+			send_message("pong", &resp[0], header.length, OUTBOUND_CONTROL);
 		} else if (!strncmp(header.command, "pong", strlen("pong"))) {
 			uint64_t nonce;
 			if (msg->size() != 8)
@@ -141,9 +136,9 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 					uint32_t type;
 					memcpy(&type, &(*(it-36)), 4);
 
-					if (type == MSG_TX && txnAlreadySeen.insert(std::vector<unsigned char>(it-32, it)).second)
+					if (type == MSG_TX && txnAlreadySeen.insert(&(*(it-32))))
 						resp.insert(resp.end(), it-36, it);
-					else if (type == MSG_BLOCK && blocksAlreadySeen.insert(std::vector<unsigned char>(it-32, it)).second)
+					else if (type == MSG_BLOCK && blocksAlreadySeen.insert(&(*(it-32))))
 						resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), it-36, it);
 					else if (type != MSG_TX && type != MSG_BLOCK)
 						return disconnect("got unexpected inv type");
@@ -184,9 +179,9 @@ void P2PRelayer::receive_transaction(const std::shared_ptr<std::vector<unsigned
 	bool seen;
 	{
 		std::lock_guard<std::mutex> lock(seen_mutex);
-		std::vector<unsigned char> hash(32);
-		double_sha256(&(*tx)[0], &hash[0], tx->size());
-		seen = !txnAlreadySeen.insert(hash).second;
+		unsigned char hash[32];
+		double_sha256(&(*tx)[0], hash, tx->size());
+		seen = !txnAlreadySeen.insert(hash);
 	}
 	if (!seen) {
 		auto msg = std::vector<unsigned char>(sizeof(struct bitcoin_msg_header));
@@ -195,7 +190,7 @@ void P2PRelayer::receive_transaction(const std::shared_ptr<std::vector<unsigned
 	}
 }
 
-void P2PRelayer::receive_block(std::vector<unsigned char>& block) {
+void P2PRelayer::receive_block(std::vector<unsigned char>& block, bool header_prepared) {
 	if (connected != 2)
 		return;
 	bool seen;
@@ -203,10 +198,14 @@ void P2PRelayer::receive_block(std::vector<unsigned char>& block) {
 		std::lock_guard<std::mutex> lock(seen_mutex);
 		std::vector<unsigned char> hash(32);
 		getblockhash(hash, block, sizeof(bitcoin_msg_header));
-		seen = !blocksAlreadySeen.insert(hash).second;
+		seen = !blocksAlreadySeen.insert(hash);
 	}
-	if (!seen)
-		send_message("block", &block[0], block.size() - sizeof(bitcoin_msg_header));
+	if (seen)
+		return;
+	if (header_prepared)
+		maybe_do_send_bytes((char*)&block[0], block.size(), 0, OUTBOUND_BLOCK);
+	else
+		send_message("block", &block[0], block.size() - sizeof(bitcoin_msg_header), OUTBOUND_BLOCK);
 }
 
 void P2PRelayer::request_transaction(const std::vector<unsigned char>& tx_hash) {
@@ -223,7 +222,7 @@ void P2PRelayer::request_transaction(const std::vector<unsigned char>& tx_hash)
 void P2PRelayer::send_ping(uint64_t nonce) {
 	std::vector<unsigned char> msg(sizeof(struct bitcoin_msg_header) + 8);
 	memcpy(&msg[sizeof(struct bitcoin_msg_header)], &nonce, 8);
-	send_message("ping", &msg[0], 8);
+	send_message("ping", &msg[0], 8, OUTBOUND_CONTROL);
 }
 
 bool P2PRelayer::is_connected() const {
@@ -23,20 +23,24 @@ private:
 	std::atomic<uint8_t> connected;
 
 	std::mutex seen_mutex;
-	mruset<std::vector<unsigned char> > txnAlreadySeen;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
+	hashmruset txnAlreadySeen;
+	hashmruset blocksAlreadySeen;
 
 	const bool check_block_msghash;
+	// If set, gives the hash getheaders starts from (instead of genesis) on each (re)connect
+	const std::function<std::vector<unsigned char> ()> headers_start;
 
 public:
 	P2PRelayer(const char* serverHostIn, uint16_t serverPortIn, uint64_t ping_time_nonce,
 				const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)>& provide_block_in,
 				const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
 				const std::function<void (std::vector<unsigned char>&)> provide_headers_in = std::function<void (std::vector<unsigned char>&)>(),
-				bool check_block_msghash_in=true)
+				bool check_block_msghash_in=true,
+				const std::function<std::vector<unsigned char> ()>& headers_start_in = std::function<std::vector<unsigned char> ()>())
 			: KeepaliveOutboundPersistentConnection(serverHostIn, serverPortIn, ping_time_nonce),
 			provide_block(provide_block_in), provide_transaction(provide_transaction_in), provide_headers(provide_headers_in),
-			connected(0), txnAlreadySeen(2000), blocksAlreadySeen(100), check_block_msghash(check_block_msghash_in)
+			connected(0), txnAlreadySeen(2000), blocksAlreadySeen(100), check_block_msghash(check_block_msghash_in),
+			headers_start(headers_start_in)
 	{}
 
 protected:
@@ -44,13 +48,14 @@ protected:
 
 	void on_disconnect();
 	void net_process(const std::function<void(std::string)>& disconnect);
-	void send_message(const char* command, unsigned char* headerAndData, size_t datalen);
+	void send_message(const char* command, unsigned char* headerAndData, size_t datalen, OutboundClass cls=OUTBOUND_TX);
 
 	void send_ping(uint64_t nonce);
 
 public:
 	void receive_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
-	void receive_block(std::vector<unsigned char>& block);
+	// header_prepared means block already has a valid bitcoin message header (eg from decompress_relay_block)
+	void receive_block(std::vector<unsigned char>& block, bool header_prepared=false);
 	void request_transaction(const std::vector<unsigned char>& txhash);
 
 	bool is_connected() const;
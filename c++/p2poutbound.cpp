@@ -21,6 +21,7 @@
 #define BITCOIN_UA {'/', 'R', 'e', 'l', 'a', 'y', 'N', 'e', 't', 'w', 'o', 'r', 'k', 'O', 'u', 't', 'b', 'o', 'u', 'n', 'd', '/'}
 
 #include "crypto/sha2.h"
+#include "log.h"
 #include "utils.h"
 #include "p2pclient.h"
 
@@ -49,7 +50,7 @@ private:
 
 int main(int argc, char** argv) {
 	if (argc != 4) {
-		printf("USAGE: %s BITCOIND_ADDRESS BITCOIND_PORT LOCAL_ADDRESS\n", argv[0]);
+		LOG("USAGE: %s BITCOIND_ADDRESS BITCOIND_PORT LOCAL_ADDRESS\n", argv[0]);
 		return -1;
 	}
 
@@ -61,7 +62,7 @@ int main(int argc, char** argv) {
 
 	struct sockaddr_in6 addr;
 	if (!lookup_address(argv[1], &addr)) {
-		printf("Failed to lookup hostname\n");
+		LOG("Failed to lookup hostname\n");
 		return -1;
 	}
 	std::string host(gethostname(&addr));
@@ -75,9 +76,7 @@ int main(int argc, char** argv) {
 
 						std::vector<unsigned char> fullhash(32);
 						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
-						for (unsigned int i = 0; i < fullhash.size(); i++)
-							printf("%02x", fullhash[fullhash.size() - i - 1]);
-						printf(" recv'd %s %lu\n", argv[1], uint64_t(tv.tv_sec)*1000 + uint64_t(tv.tv_usec)/1000);
+						LOG(HASH_FORMAT" recv'd %s %lu\n", HASH_PRINT(&fullhash[0]), argv[1], uint64_t(tv.tv_sec)*1000 + uint64_t(tv.tv_usec)/1000);
 					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) { inbound->receive_transaction(bytes); });
 	inbound = new P2PClient(argv[3], 8334,
@@ -1,4 +1,5 @@
 #include "p2ppipe.h"
+#include "log.h"
 #include "utils.h"
 #include "crypto/sha2.h"
 
@@ -102,9 +103,10 @@ void P2PPipe::net_process(const std::function<void(std::string)>& disconnect) {
 		send_message("version", &version_msg[0], version_msg.size() - sizeof(struct bitcoin_msg_header));
 	}
 
+	BufferedReader reader([&](size_t min_bytes, size_t& avail) { return peek(min_bytes, avail); }, [&](size_t nbyte) { consume(nbyte); });
 	while (true) {
 		struct bitcoin_msg_header header;
-		if (read_all((char*)&header, sizeof(header)) != sizeof(header))
+		if (!reader.read(&header, sizeof(header)))
 			return disconnect("failed to read message header");
 
 		if (header.magic != BITCOIN_MAGIC)
@@ -114,32 +116,19 @@ void P2PPipe::net_process(const std::function<void(std::string)>& disconnect) {
 		if (header.length > 5000000)
 			return disconnect("got message too large");
 
-		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(header) + uint32_t(header.length));
+		auto msg = pooled_buffer(sizeof(header) + uint32_t(header.length));
 		memcpy(msg->data(), &header, sizeof(header));
 
 		bool check_msg_hash = check_block_msghash || (strncmp(header.command, "block", strlen("block")) &&
 			strncmp(header.command, "blocktxn", strlen("blocktxn")) && strncmp(header.command, "cmpctblock", strlen("cmpctblock")));
 		if (check_msg_hash) {
 			uint32_t hash[8];
-			double_sha256_init(hash);
-
-			uint32_t steps = header.length / 64;
-			for (uint32_t i = 0; i < steps; i++) {
-				unsigned char* writepos = &((*msg)[sizeof(header) + i*64]);
-				if (read_all((char*)writepos, 64) != 64)
-					return disconnect("failed to read message");
-				double_sha256_step(writepos, 64, hash);
-			}
-
-			unsigned char* writepos = &((*msg)[sizeof(header) + steps*64]);
-			if (read_all((char*)writepos, header.length - steps*64) != ssize_t(header.length - steps*64))
+			if (!read_hashing(reader, &(*msg)[sizeof(header)], header.length, hash))
 				return disconnect("failed to read message");
-			double_sha256_done(writepos, header.length - steps*64, header.length, hash);
-
 			if (memcmp((char*)hash, header.checksum, sizeof(header.checksum)))
 				return disconnect("got invalid message checksum");
 		} else
-			if (read_all((char*)&(*msg)[sizeof(header)], header.length) != ssize_t(header.length))
+			if (!reader.read(&(*msg)[sizeof(header)], header.length))
 				return disconnect("failed to read message");
 
 		if (!strncmp(header.command, "version", strlen("version"))) {
@@ -156,8 +145,7 @@ void P2PPipe::net_process(const std::function<void(std::string)>& disconnect) {
 			struct bitcoin_msg_header new_header;
 			send_message("verack", (unsigned char*)&new_header, 0);
 
-			STAMPOUT();
-			printf("Connected to bitcoind with version %u\n", le32toh(their_version.protocol_version));
+			LOG_STAMPED("Connected to bitcoind with version %u\n", le32toh(their_version.protocol_version));
 
 			provide_msg(*msg);
 
@@ -165,8 +153,7 @@ void P2PPipe::net_process(const std::function<void(std::string)>& disconnect) {
 		} else if (!strncmp(header.command, "verack", strlen("verack"))) {
 			if (connected != 1)
 				return disconnect("got invalid verack");
-			STAMPOUT();
-			printf("Finished connect handshake with bitcoind\n");
+			LOG_STAMPED("Finished connect handshake with bitcoind\n");
 			connected = 2;
 
 			for (auto& p : statefulMessagesSent)
@@ -1,18 +1,71 @@
 #include "relayprocess.h"
 
 #include "crypto/sha2.h"
+#include "log.h"
+#include "metrics.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
+
+// Metrics are kept per compressor type, numbered as in server.cpp's compressor_types
+class CompressorMetrics {
+public:
+	MetricHistogram &compress_ns, &decompress_ns;
+	MetricCounter &compress_tx_hits, &compress_tx_misses, &decompress_tx_hits, &decompress_tx_misses;
+	MetricGauge &send_cache_txn;
+
+	CompressorMetrics(const std::string& type) :
+		compress_ns(metrics_histogram("relay_compress_ns{compressor=\"" + type + "\"}")),
+		decompress_ns(metrics_histogram("relay_decompress_ns{compressor=\"" + type + "\"}")),
+		compress_tx_hits(metrics_counter("relay_compress_tx_hits_total{compressor=\"" + type + "\"}")),
+		compress_tx_misses(metrics_counter("relay_compress_tx_misses_total{compressor=\"" + type + "\"}")),
+		decompress_tx_hits(metrics_counter("relay_decompress_tx_hits_total{compressor=\"" + type + "\"}")),
+		decompress_tx_misses(metrics_counter("relay_decompress_tx_misses_total{compressor=\"" + type + "\"}")),
+		send_cache_txn(metrics_gauge("relay_send_cache_txn{compressor=\"" + type + "\"}")) {}
+};
+
+static CompressorMetrics& compressor_metrics(bool useOldFlags, bool useDeltaIndexes) {
+	static CompressorMetrics metrics[3] = { CompressorMetrics("0"), CompressorMetrics("1"), CompressorMetrics("2") };
+	return metrics[useDeltaIndexes ? 2 : (useOldFlags ? 1 : 0)];
+}
+
+/************************************
+ **** Parallel block compression ****
+ ************************************/
+// Blocks with at least this many transactions have their hashing and send_tx_cache lookups
+// split across a pool of RELAY_COMPRESS_THREADS (default one per extra core, at most 7) threads
+#define PARALLEL_COMPRESS_MIN_TXN 512
+
+static size_t compress_thread_count() {
+	unsigned long count = std::thread::hardware_concurrency();
+	count = count ? count - 1 : 0;
+	const char* env = getenv("RELAY_COMPRESS_THREADS");
+	if (env) {
+		try {
+			count = std::stoul(env);
+		} catch (std::exception& e) {}
+	}
+	return std::min(count, 7ul);
+}
+
+WorkerPool& compress_workers() {
+	static WorkerPool* workers = new WorkerPool(compress_thread_count(), "RELAY_COMPRESS_CPUS", 0, "compress");
+	return *workers;
+}
 
-std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx) {
-	std::lock_guard<std::mutex> lock(mutex);
 
+
+// Called with mutex held, adds tx to send_tx_cache if it should be relayed at all
+bool RelayNodeCompressor::add_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx) {
 	if (send_tx_cache.contains(tx))
-		return std::shared_ptr<std::vector<unsigned char> >();
+		return false;
+	size_t old_size = send_tx_cache.size();
 
 	if (!useOldFlags) {
 		if (tx->size() > MAX_RELAY_TRANSACTION_BYTES)
-			return std::shared_ptr<std::vector<unsigned char> >();
+			return false;
 		send_tx_cache.add(tx, tx->size());
 
 	}
@@ -20,18 +73,75 @@ std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_tran
 	if (useOldFlags) {
 		if (tx->size() > OLD_MAX_RELAY_TRANSACTION_BYTES &&
 				(send_tx_cache.flagCount() >= OLD_MAX_EXTRA_OVERSIZE_TRANSACTIONS || tx->size() > OLD_MAX_RELAY_OVERSIZE_TRANSACTION_BYTES))
-			return std::shared_ptr<std::vector<unsigned char> >();
+			return false;
 		send_tx_cache.add(tx, tx->size() > OLD_MAX_RELAY_TRANSACTION_BYTES);
 	}
 
+	// add() evicts from the front to make room
+	snapshot_add(tx);
+	snapshot_remove_front(old_size + 1 - send_tx_cache.size());
+	return true;
+}
+
+std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx) {
+	std::lock_guard<FiberMutex> lock(mutex);
+
+	if (!add_relay_transaction(tx))
+		return std::shared_ptr<std::vector<unsigned char> >();
+
+	compressor_metrics(useOldFlags, useDeltaIndexes).send_cache_txn.set(send_tx_cache.size());
 	return tx_to_msg(tx);
 }
 
+std::pair<std::shared_ptr<std::vector<unsigned char> >, std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::get_relay_transactions(const std::vector<std::shared_ptr<std::vector<unsigned char> > >& txn) {
+	std::lock_guard<FiberMutex> lock(mutex);
+
+	size_t bytes = 0;
+	for (const auto& tx : txn)
+		bytes += tx->size();
+
+	std::shared_ptr<std::vector<unsigned char> > msgs, batches;
+	size_t batch_start = 0;
+	auto finish_batch = [&]() {
+		struct relay_msg_header header = { RELAY_MAGIC_BYTES, TRANSACTIONS_TYPE, htonl(batches->size() - batch_start - sizeof(header)) };
+		memcpy(&(*batches)[batch_start], &header, sizeof(header));
+	};
+
+	for (const auto& tx : txn) {
+		if (!add_relay_transaction(tx))
+			continue;
+		if (!msgs) {
+			msgs = pooled_buffer(0, bytes + txn.size() * sizeof(struct relay_msg_header));
+			batches = pooled_buffer(sizeof(struct relay_msg_header), bytes + txn.size() * 4 + sizeof(struct relay_msg_header));
+		}
+
+		struct relay_msg_header header = { RELAY_MAGIC_BYTES, TRANSACTION_TYPE, htonl(tx->size()) };
+		msgs->insert(msgs->end(), (unsigned char*)&header, (unsigned char*)&header + sizeof(header));
+		msgs->insert(msgs->end(), tx->begin(), tx->end());
+
+		if (batches->size() - batch_start - sizeof(header) + 4 + tx->size() > MAX_TX_BATCH_BYTES && batches->size() != batch_start + sizeof(header)) {
+			finish_batch();
+			batch_start = batches->size();
+			batches->resize(batch_start + sizeof(header));
+		}
+		uint32_t tx_size = htonl(tx->size());
+		batches->insert(batches->end(), (unsigned char*)&tx_size, (unsigned char*)&tx_size + 4);
+		batches->insert(batches->end(), tx->begin(), tx->end());
+	}
+	if (!msgs)
+		return std::make_pair(msgs, batches);
+	finish_batch();
+
+	compressor_metrics(useOldFlags, useDeltaIndexes).send_cache_txn.set(send_tx_cache.size());
+	return std::make_pair(msgs, batches);
+}
+
 void RelayNodeCompressor::reset() {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	recv_tx_cache.clear();
 	send_tx_cache.clear();
+	send_snapshot.clear();
 }
 
 bool RelayNodeCompressor::check_recv_tx(uint32_t tx_size) {
@@ -40,71 +150,245 @@ bool RelayNodeCompressor::check_recv_tx(uint32_t tx_size) {
 }
 
 bool RelayNodeCompressor::maybe_recv_tx_of_size(uint32_t tx_size, bool debug_print) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	if (!check_recv_tx(tx_size)) {
 		if (debug_print)
-			printf("Freely relayed tx of size %u, with %lu oversize txn already present\n", tx_size, (long unsigned)recv_tx_cache.flagCount());
+			LOG("Freely relayed tx of size %u, with %lu oversize txn already present\n", tx_size, (long unsigned)recv_tx_cache.flagCount());
 		return false;
 	}
 	return true;
 }
 
 void RelayNodeCompressor::recv_tx(std::shared_ptr<std::vector<unsigned char > > tx) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	uint32_t tx_size = tx.get()->size();
 	assert(check_recv_tx(tx_size));
 	recv_tx_cache.add(tx, useOldFlags ? tx_size > OLD_MAX_RELAY_TRANSACTION_BYTES : tx_size);
 }
 
+const char* RelayNodeCompressor::recv_tx_batch(BufferedReader& reader, uint32_t message_size, std::vector<std::shared_ptr<std::vector<unsigned char> > >& txn) {
+	if (message_size > MAX_TX_BATCH_BYTES)
+		return "got transaction batch too large";
+
+	// Read without the lock, so that only the cache inserts hold it up
+	txn.clear();
+	uint32_t pos = 0;
+	while (pos < message_size) {
+		uint32_t tx_size;
+		if (message_size - pos < 4 || !reader.read(&tx_size, 4))
+			return "failed to read batched transaction length";
+		tx_size = ntohl(tx_size);
+		pos += 4;
+		if (tx_size > message_size - pos)
+			return "batched transaction overran its message";
+		auto tx = pooled_buffer(tx_size);
+		if (!reader.read(tx->data(), tx_size))
+			return "failed to read batched transaction data";
+		pos += tx_size;
+		txn.push_back(tx);
+	}
+
+	std::lock_guard<FiberMutex> lock(mutex);
+	for (const auto& tx : txn) {
+		uint32_t tx_size = tx->size();
+		if (!check_recv_tx(tx_size))
+			return "got freely relayed transaction too large";
+		recv_tx_cache.add(tx, useOldFlags ? tx_size > OLD_MAX_RELAY_TRANSACTION_BYTES : tx_size);
+	}
+	return NULL;
+}
+
 void RelayNodeCompressor::for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 	send_tx_cache.for_all_txn(callback);
 }
 
+/******************************
+ **** Send cache snapshots ****
+ ******************************/
+static const size_t SNAPSHOT_CHUNK_TXN = 1024, SNAPSHOT_CHUNK_BYTES = 512 * 1024;
+
+void RelayNodeCompressor::snapshot_add(const std::shared_ptr<std::vector<unsigned char> >& tx) {
+	if (send_snapshot.empty() || send_snapshot.back().txn.size() >= SNAPSHOT_CHUNK_TXN || send_snapshot.back().bytes >= SNAPSHOT_CHUNK_BYTES)
+		send_snapshot.push_back(SnapshotChunk { {}, 0, std::shared_ptr<std::vector<unsigned char> >() });
+	SnapshotChunk& chunk = send_snapshot.back();
+	chunk.txn.push_back(tx);
+	chunk.bytes += sizeof(struct relay_msg_header) + tx->size();
+	chunk.serialized.reset();
+}
+
+void RelayNodeCompressor::snapshot_remove_front(size_t count) {
+	while (count) {
+		assert(!send_snapshot.empty());
+		SnapshotChunk& chunk = send_snapshot.front();
+		if (chunk.txn.size() <= count) {
+			count -= chunk.txn.size();
+			send_snapshot.pop_front();
+			continue;
+		}
+		for (size_t i = 0; i < count; i++)
+			chunk.bytes -= sizeof(struct relay_msg_header) + chunk.txn[i]->size();
+		chunk.txn.erase(chunk.txn.begin(), chunk.txn.begin() + count);
+		chunk.serialized.reset();
+		count = 0;
+	}
+}
+
+void RelayNodeCompressor::snapshot_remove(const std::vector<uint32_t>& indexes) {
+	if (indexes.empty())
+		return;
+
+	// Each index was taken after the removals before it (as they go on the wire), so map
+	// them back to positions in the snapshot with a Fenwick tree of remaining entries
+	size_t total = 0;
+	for (const SnapshotChunk& chunk : send_snapshot)
+		total += chunk.txn.size();
+	std::vector<uint32_t> tree(total + 1);
+	for (size_t i = 1; i <= total; i++)
+		tree[i] = i & (~i + 1);
+	size_t top = 1;
+	while (top * 2 <= total)
+		top *= 2;
+
+	std::vector<uint32_t> positions;
+	positions.reserve(indexes.size());
+	for (uint32_t index : indexes) {
+		size_t pos = 0;
+		uint32_t remaining = index + 1;
+		for (size_t step = top; step; step >>= 1) {
+			if (pos + step <= total && tree[pos + step] < remaining) {
+				pos += step;
+				remaining -= tree[pos];
+			}
+		}
+		assert(pos < total);
+		positions.push_back(pos);
+		for (size_t i = pos + 1; i <= total; i += i & (~i + 1))
+			tree[i]--;
+	}
+	std::sort(positions.begin(), positions.end());
+
+	// Only the chunks which lost something are touched (and merged into their predecessor if
+	// both are small), everything else keeps its serialized buffer
+	size_t offset = 0;
+	auto next = positions.begin();
+	for (auto it = send_snapshot.begin(); it != send_snapshot.end() && next != positions.end();) {
+		size_t chunk_end = offset + it->txn.size();
+		if (*next >= chunk_end) {
+			offset = chunk_end;
+			it++;
+			continue;
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < it->txn.size(); i++) {
+			if (next != positions.end() && *next == offset + i) {
+				it->bytes -= sizeof(struct relay_msg_header) + it->txn[i]->size();
+				next++;
+			} else
+				it->txn[kept++] = std::move(it->txn[i]);
+		}
+		it->txn.resize(kept);
+		it->serialized.reset();
+		offset = chunk_end;
+
+		if (it->txn.empty())
+			it = send_snapshot.erase(it);
+		else if (it != send_snapshot.begin() && (it - 1)->txn.size() + it->txn.size() <= SNAPSHOT_CHUNK_TXN &&
+				(it - 1)->bytes + it->bytes <= SNAPSHOT_CHUNK_BYTES) {
+			SnapshotChunk& prev = *(it - 1);
+			prev.txn.insert(prev.txn.end(), it->txn.begin(), it->txn.end());
+			prev.bytes += it->bytes;
+			prev.serialized.reset();
+			it = send_snapshot.erase(it);
+		} else
+			it++;
+	}
+	assert(next == positions.end());
+}
+
+std::vector<std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::sent_tx_snapshot() {
+	std::lock_guard<FiberMutex> lock(mutex);
+
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > res;
+	res.reserve(send_snapshot.size());
+	size_t txn = 0;
+	for (SnapshotChunk& chunk : send_snapshot) {
+		if (!chunk.serialized) {
+			chunk.serialized = pooled_buffer(0, chunk.bytes);
+			for (const auto& tx : chunk.txn) {
+				struct relay_msg_header header = { RELAY_MAGIC_BYTES, TRANSACTION_TYPE, htonl(tx->size()) };
+				chunk.serialized->insert(chunk.serialized->end(), (unsigned char*)&header, (unsigned char*)&header + sizeof(header));
+				chunk.serialized->insert(chunk.serialized->end(), tx->begin(), tx->end());
+			}
+			assert(chunk.serialized->size() == chunk.bytes);
+		}
+		res.push_back(chunk.serialized);
+		txn += chunk.txn.size();
+	}
+	assert(txn == send_tx_cache.size());
+	(void)txn;
+	return res;
+}
+
 bool RelayNodeCompressor::block_sent(std::vector<unsigned char>& hash) {
-	std::lock_guard<std::mutex> lock(mutex);
-	return blocksAlreadySeen.insert(hash).second;
+	std::lock_guard<FiberMutex> lock(mutex);
+	return blocksAlreadySeen.insert(hash);
 }
 
 uint32_t RelayNodeCompressor::blocks_sent() {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 	return blocksAlreadySeen.size();
 }
 
+void RelayNodeCompressor::for_each_sent_block(const std::function<void (const unsigned char*)> callback) {
+	std::lock_guard<FiberMutex> lock(mutex);
+	blocksAlreadySeen.for_each(callback);
+}
+
 bool RelayNodeCompressor::was_tx_sent(const unsigned char* txhash) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 	return send_tx_cache.contains(txhash);
 }
 
-class MerkleTreeBuilder {
-private:
-	std::vector<unsigned char> hashlist;
-public:
-	MerkleTreeBuilder(uint32_t tx_count) : hashlist(tx_count * 32) {}
-	inline unsigned char* getTxHashLoc(uint32_t tx) { return &hashlist[tx * 32]; }
-	bool merkleRootMatches(const unsigned char* match) {
-		uint32_t txcount = hashlist.size() / 32;
-		uint32_t stepCount = 1, lastMax = txcount - 1;
-		for (uint32_t rowSize = txcount; rowSize > 1; rowSize = (rowSize + 1) / 2) {
-			if (!memcmp(&hashlist[32 * (lastMax - stepCount)], &hashlist[32 * lastMax], 32))
-				return false;
-
-			for (uint32_t i = 0; i < rowSize; i += 2) {
-				assert(i*stepCount < txcount && lastMax < txcount);
-				double_sha256_two_32_inputs(&hashlist[32 * i*stepCount], &hashlist[32 * std::min((i + 1)*stepCount, lastMax)], &hashlist[32 * i*stepCount]);
-			}
-			lastMax = ((rowSize - 1) & 0xfffffffe) * stepCount;
-			stepCount *= 2;
-		}
-		return !memcmp(match, &hashlist[0], 32);
+/*
+ * With useDeltaIndexes, each block entry starts with a 7-bit varint token t:
+ *  t == 0: a transaction we did not relay follows, as a varint length and then its bytes
+ *  t > 0: (t - 1) >> 1 is the zigzag-coded difference between this transaction's index and
+ *         the previous relayed transaction's index, and if (t - 1) & 1, a varint n follows
+ *         and the next n + 1 transactions are also relayed ones at that same index.
+ * Indexes are taken after the removals of earlier transactions in the block, so a run of
+ * transactions which were relayed in order all sit at the same index.
+ */
+static inline void push_index_varint(std::vector<unsigned char>& v, uint32_t n) {
+	while (n >= 0x80) {
+		v.push_back((n & 0x7f) | 0x80);
+		n >>= 7;
 	}
-};
+	v.push_back(n);
+}
+
+static inline bool read_index_varint(BufferedReader& reader, uint32_t& res, uint32_t& wire_bytes) {
+	res = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		const unsigned char* cptr = reader.take(1);
+		if (!cptr)
+			return false;
+		unsigned char c = *cptr;
+		wire_bytes++;
+		if (shift == 28 && c > 0x0f)
+			return false;
+		res |= uint32_t(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
 
 std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeCompressor::maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle) {
-	std::lock_guard<std::mutex> lock(mutex);
-	FASLockHint faslock(send_tx_cache);
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	if (check_merkle && (hash[31] != 0 || hash[30] != 0 || hash[29] != 0 || hash[28] != 0 || hash[27] != 0 || hash[26] != 0 || hash[25] != 0))
 		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "BAD_WORK");
@@ -112,8 +396,11 @@ std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeC
 	if (blocksAlreadySeen.count(hash))
 		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "SEEN");
 
-	auto compressed_block = std::make_shared<std::vector<unsigned char> >();
-	compressed_block->reserve(1100000);
+	std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+	uint32_t tx_hits = 0;
+	std::vector<uint32_t> removed_indexes;
+
+	auto compressed_block = pooled_buffer(0, 1100000);
 	struct relay_msg_header header;
 
 	try {
@@ -142,6 +429,21 @@ std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeC
 
 		MerkleTreeBuilder merkleTree(check_merkle ? txcount : 0);
 
+		int last_index = 0, run_delta = 0;
+		uint32_t run_count = 0;
+		auto flush_run = [&]() {
+			if (!run_count)
+				return;
+			uint32_t zigzag_delta = (uint32_t(run_delta) << 1) ^ uint32_t(run_delta >> 31);
+			push_index_varint(*compressed_block, ((zigzag_delta << 1) | (run_count > 1)) + 1);
+			if (run_count > 1)
+				push_index_varint(*compressed_block, run_count - 2);
+			run_count = 0;
+		};
+
+		// First find where each transaction is, which is cheap and can fail part way...
+		std::vector<std::pair<size_t, size_t> > txn;
+		txn.reserve(txcount);
 		for (uint32_t i = 0; i < txcount; i++) {
 			std::vector<unsigned char>::const_iterator txstart = readit;
 
@@ -161,87 +463,105 @@ std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeC
 
 			move_forward(readit, 4, block.end());
 
-			int index = send_tx_cache.remove(txstart, readit);
-
 			__builtin_prefetch(&(*readit), 0);
 			__builtin_prefetch(&(*readit) + 64, 0);
 			__builtin_prefetch(&(*readit) + 128, 0);
 			__builtin_prefetch(&(*readit) + 196, 0);
 			__builtin_prefetch(&(*readit) + 256, 0);
 
+			txn.emplace_back(txstart - block.begin(), readit - txstart);
+		}
+
+		// ...then hash them and look them up in send_tx_cache, which is the expensive
+		// part and doesn't depend on order, so can be done for ranges of txn in parallel...
+		std::vector<int64_t> slots(txcount);
+		send_tx_cache.start_lookups();
+		std::function<void (size_t, size_t)> lookup_range = [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				slots[i] = send_tx_cache.find_slot(block.begin() + txn[i].first, block.begin() + txn[i].first + txn[i].second);
 			if (check_merkle)
-				double_sha256(&(*txstart), merkleTree.getTxHashLoc(i), readit - txstart);
+				merkleTree.hashTxRange(block, txn, begin, end);
+		};
+		WorkerPool& workers = compress_workers();
+		if (workers.threads() && txcount >= PARALLEL_COMPRESS_MIN_TXN) {
+			size_t parts = workers.threads() + 1;
+			workers.run(parts, [&](size_t part) { lookup_range(txcount * part / parts, txcount * (part + 1) / parts); });
+		} else
+			lookup_range(0, txcount);
 
-			if (index < 0) {
+		// ...and, as send_tx_cache hasn't been touched yet, a bad block leaves it as it was
+		if (check_merkle && !merkleTree.merkleRootMatches(&(*merkle_hash_it)))
+			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_MERKLE");
+
+		// Finally, removals (and thus indexes) have to go in block order
+		for (uint32_t i = 0; i < txcount; i++) {
+			std::vector<unsigned char>::const_iterator txstart = block.begin() + txn[i].first, txend = txstart + txn[i].second;
+
+			int index = send_tx_cache.remove_found(slots[i]);
+			tx_hits += index >= 0;
+			if (index >= 0)
+				removed_indexes.push_back(index);
+
+			if (useDeltaIndexes) {
+				if (index < 0) {
+					flush_run();
+					push_index_varint(*compressed_block, 0);
+					push_index_varint(*compressed_block, txn[i].second);
+					compressed_block->insert(compressed_block->end(), txstart, txend);
+				} else if (run_count && index == last_index)
+					run_count++;
+				else {
+					flush_run();
+					run_delta = index - last_index;
+					run_count = 1;
+				}
+				if (index >= 0)
+					last_index = index;
+			} else if (index < 0) {
 				compressed_block->push_back(0xff);
 				compressed_block->push_back(0xff);
 
-				uint32_t txlen = readit - txstart;
+				uint32_t txlen = txn[i].second;
 				compressed_block->push_back((txlen >> 16) & 0xff);
 				compressed_block->push_back((txlen >>  8) & 0xff);
 				compressed_block->push_back((txlen      ) & 0xff);
 
-				compressed_block->insert(compressed_block->end(), txstart, readit);
+				compressed_block->insert(compressed_block->end(), txstart, txend);
 			} else {
 				compressed_block->push_back((index >> 8) & 0xff);
 				compressed_block->push_back((index     ) & 0xff);
 			}
 		}
-
-		if (check_merkle && !merkleTree.merkleRootMatches(&(*merkle_hash_it)))
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_MERKLE");
+		flush_run();
+		snapshot_remove(removed_indexes);
 	} catch(read_exception) {
 		return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_SIZE");
 	}
 
-	if (!blocksAlreadySeen.insert(hash).second)
+	if (!blocksAlreadySeen.insert(hash))
 		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "MUTEX_BROKEN???");
 
-	return std::make_tuple(compressed_block, (const char*)NULL);
-}
-
-struct IndexVector {
-	uint16_t index;
-	std::vector<unsigned char> data;
-};
-struct IndexPtr {
-	uint16_t index;
-	size_t pos;
-	IndexPtr(uint16_t index_in, size_t pos_in) : index(index_in), pos(pos_in) {}
-	bool operator< (const IndexPtr& o) const { return index < o.index; }
-};
+	CompressorMetrics& metrics = compressor_metrics(useOldFlags, useDeltaIndexes);
+	metrics.compress_ns.record_since(start);
+	metrics.compress_tx_hits.add(tx_hits);
+	metrics.compress_tx_misses.add(ntohl(header.length) - tx_hits);
+	metrics.send_cache_txn.set(send_tx_cache.size());
 
-void tweak_sort(std::vector<IndexPtr>& ptrs, size_t start, size_t end) {
-	if (start + 1 >= end)
-		return;
-	size_t split = (end - start) / 2 + start;
-	tweak_sort(ptrs, start, split);
-	tweak_sort(ptrs, split, end);
-
-	size_t j = 0, k = split;
-	std::vector<IndexPtr> left(ptrs.begin() + start, ptrs.begin() + split);
-	for (size_t i = start; i < end; i++) {
-		if (j < left.size() && (k >= end || left[j].index - (k - split) <= ptrs[k].index)) {
-			ptrs[i] = left[j++];
-			ptrs[i].index -= (k - split);
-		} else
-			ptrs[i] = ptrs[k++];
-	}
+	return std::make_tuple(compressed_block, (const char*)NULL);
 }
 
-std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle) {
-	std::lock_guard<std::mutex> lock(mutex);
-	FASLockHint faslock(recv_tx_cache);
+std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::decompress_relay_block(BufferedReader& reader, uint32_t message_size, bool check_merkle) {
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	if (message_size > 100000)
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got a BLOCK message with far too many transactions", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
-	uint32_t wire_bytes = 4*3;
+	std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+	uint32_t wire_bytes = 4*3, tx_hits = 0;
 
-	auto block = std::make_shared<std::vector<unsigned char> > (sizeof(bitcoin_msg_header) + 80);
-	block->reserve(1000000 + sizeof(bitcoin_msg_header));
+	auto block = pooled_buffer(sizeof(bitcoin_msg_header) + 80, 1000000 + sizeof(bitcoin_msg_header));
 
-	if (read_all((char*)&(*block)[sizeof(bitcoin_msg_header)], 80) != 80)
+	if (!reader.read(&(*block)[sizeof(bitcoin_msg_header)], 80))
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read block header", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
 #ifndef TEST_DATA
@@ -262,60 +582,154 @@ std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*,
 
 	MerkleTreeBuilder merkleTree(check_merkle ? message_size : 1);
 
-	std::vector<IndexVector> txn_data(message_size);
-	std::vector<IndexPtr> txn_ptrs;
-	txn_ptrs.reserve(message_size);
-	for (uint32_t i = 0; i < message_size; i++) {
-		uint16_t index;
-		if (read_all((char*)&index, 2) != 2)
-			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
-		index = ntohs(index);
-		wire_bytes += 2;
+	// Indexes are relative to recv_tx_cache after the removals of all previous
+	// transactions in the block, so each one can be resolved as soon as it is read.
+	// Transactions are appended to the block as they resolve and the p2p checksum
+	// is hashed as we go, leaving only the merkle check for after the last one.
+	uint32_t checksum_state[8];
+	double_sha256_init(checksum_state);
+	size_t checksum_pos = sizeof(bitcoin_msg_header);
 
-		txn_data[i].index = index;
+	uint32_t last_index = 0, run_left = 0;
 
-		if (index == 0xffff) {
-			union intbyte {
-				uint32_t i;
-				char c[4];
-			} tx_size {0};
+	for (uint32_t i = 0; i < message_size; i++) {
+		uint32_t index = 0, tx_size = 0;
+		bool have_tx = true;
 
-			if (read_all(tx_size.c + 1, 3) != 3)
-				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx length", std::shared_ptr<std::vector<unsigned char> >(NULL));
-			tx_size.i = ntohl(tx_size.i);
+		if (useDeltaIndexes) {
+			if (run_left) {
+				run_left--;
+				index = last_index;
+			} else {
+				uint32_t token;
+				if (!read_index_varint(reader, token, wire_bytes))
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
+
+				if (token == 0) {
+					have_tx = false;
+					if (!read_index_varint(reader, tx_size, wire_bytes))
+						return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx length", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				} else {
+					token--;
+					int64_t delta = int64_t(token >> 2) ^ -int64_t((token >> 1) & 1);
+					if (int64_t(last_index) + delta < 0 || int64_t(last_index) + delta >= int64_t(recv_tx_cache.size()))
+						return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+					index = last_index = last_index + delta;
+
+					if (token & 1) {
+						if (!read_index_varint(reader, run_left, wire_bytes))
+							return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index run", std::shared_ptr<std::vector<unsigned char> >(NULL));
+						if (run_left >= message_size - i - 1)
+							return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "tx index run overran block", std::shared_ptr<std::vector<unsigned char> >(NULL));
+						run_left++;
+					}
+				}
+			}
+		} else {
+			const unsigned char* short_index = reader.take(2);
+			if (!short_index)
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			index = (uint32_t(short_index[0]) << 8) | short_index[1];
+			wire_bytes += 2;
+
+			if (index == 0xffff) {
+				have_tx = false;
+				const unsigned char* tx_size_bytes = reader.take(3);
+				if (!tx_size_bytes)
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx length", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				tx_size = (uint32_t(tx_size_bytes[0]) << 16) | (uint32_t(tx_size_bytes[1]) << 8) | tx_size_bytes[2];
+				wire_bytes += 3;
+			}
+		}
 
-			if (tx_size.i > 1000000)
+		if (!have_tx) {
+			if (tx_size > 1000000)
 				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got unreasonably large tx", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
-			txn_data[i].data.resize(tx_size.i);
-			if (read_all((char*)&(txn_data[i].data[0]), tx_size.i) != int64_t(tx_size.i))
+			size_t tx_start = block->size();
+			block->resize(tx_start + tx_size);
+			if (!reader.read(&(*block)[tx_start], tx_size))
 				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read transaction data", std::shared_ptr<std::vector<unsigned char> >(NULL));
-			wire_bytes += 3 + tx_size.i;
+			wire_bytes += tx_size;
 
 			if (check_merkle)
-				double_sha256(&(txn_data[i].data[0]), merkleTree.getTxHashLoc(i), tx_size.i);
-		} else
-			txn_ptrs.emplace_back(index, i);
-	}
-
-	tweak_sort(txn_ptrs, 0, txn_ptrs.size());
-#ifndef NDEBUG
-	int32_t last = -1;
-#endif
-	for (size_t i = 0; i < txn_ptrs.size(); i++) {
-		const IndexPtr& ptr = txn_ptrs[i];
-		assert(last <= int(ptr.index) && (last = ptr.index) != -1);
+				merkleTree.queueTxHash(i, *block, tx_start, tx_size);
+		} else {
+			std::shared_ptr<std::vector<unsigned char> > tx;
+			if (!recv_tx_cache.remove(index, tx, merkleTree.getTxHashLoc(check_merkle ? i : 0)))
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			block->insert(block->end(), tx->begin(), tx->end());
+			tx_hits++;
+		}
 
-		if (!recv_tx_cache.remove(ptr.index, txn_data[ptr.pos].data, merkleTree.getTxHashLoc(check_merkle ? ptr.pos : 0)))
-			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+		size_t hash_len = (block->size() - checksum_pos) & ~size_t(63);
+		if (hash_len) {
+			double_sha256_step(&(*block)[checksum_pos], hash_len, checksum_state);
+			checksum_pos += hash_len;
+		}
 	}
 
-	for (uint32_t i = 0; i < message_size; i++)
-		block->insert(block->end(), txn_data[i].data.begin(), txn_data[i].data.end());
-
+	if (check_merkle)
+		merkleTree.hashQueued(*block);
 	if (check_merkle && !merkleTree.merkleRootMatches(&(*block)[4 + 32 + sizeof(bitcoin_msg_header)]))
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "merkle tree root did not match", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
+	size_t payload_len = block->size() - sizeof(bitcoin_msg_header);
+	double_sha256_done(&(*block)[checksum_pos], block->size() - checksum_pos, payload_len, checksum_state);
+	struct bitcoin_msg_header *msg_header = (struct bitcoin_msg_header*)&(*block)[0];
+	msg_header->magic = BITCOIN_MAGIC;
+	memset(msg_header->command, 0, sizeof(msg_header->command));
+	strcpy(msg_header->command, "block");
+	msg_header->length = htole32(payload_len);
+	memcpy(msg_header->checksum, checksum_state, sizeof(msg_header->checksum));
+
+	CompressorMetrics& metrics = compressor_metrics(useOldFlags, useDeltaIndexes);
+	metrics.decompress_ns.record_since(start);
+	metrics.decompress_tx_hits.add(tx_hits);
+	metrics.decompress_tx_misses.add(message_size - tx_hits);
+
 	return std::make_tuple(wire_bytes, block, (const char*) NULL, fullhashptr);
 }
 
+/**************************
+ **** Block sequencing ****
+ **************************/
+const char* BlockSequencer::hold_block(uint64_t seq, std::vector<unsigned char>&& msg) {
+	if (seq < txn_applied + txn.size() || (!blocks.empty() && seq < blocks.back().seq))
+		return "got BLOCK_SEQ after transactions it should have overtaken";
+	blocks.push_back(HeldBlock { seq, std::move(msg), false });
+	return NULL;
+}
+
+const char* BlockSequencer::resume(std::vector<unsigned char>&& msg, const apply_func& apply) {
+	assert(stalled());
+	blocks.front().msg = std::move(msg);
+	blocks.front().stalled = false;
+	return drain(apply);
+}
+
+const char* BlockSequencer::drain(const apply_func& apply) {
+	while (true) {
+		const char* error;
+		if (!blocks.empty() && blocks.front().seq == txn_applied) {
+			if (blocks.front().stalled)
+				return NULL;
+			bool stalled = false;
+			error = apply(blocks.front().msg, stalled);
+			if (stalled && !error) {
+				blocks.front().msg.clear();
+				blocks.front().stalled = true;
+				return NULL;
+			}
+			blocks.pop_front();
+		} else if (!txn.empty()) {
+			bool stalled = false;
+			error = apply(txn.front(), stalled);
+			txn.pop_front();
+			txn_applied++;
+		} else
+			return NULL;
+		if (error)
+			return error;
+	}
+}
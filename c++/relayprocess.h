@@ -2,13 +2,18 @@
 #define _RELAY_RELAYPROCESS_H
 
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <tuple>
 #include <thread>
 #include <mutex>
 
+#include <string.h>
+
 #include "mruset.h"
 #include "flaggedarrayset.h"
 #include "utils.h"
+#include "fiber.h"
 
 #ifdef WIN32
 	#include <winsock.h>
@@ -19,38 +24,137 @@
 #define RELAY_DECLARE_CLASS_VARS \
 private: \
 	const uint32_t VERSION_TYPE, BLOCK_TYPE, TRANSACTION_TYPE, END_BLOCK_TYPE, MAX_VERSION_TYPE, \
-					OOB_TRANSACTION_TYPE, SPONSOR_TYPE, PING_TYPE, PONG_TYPE;
+					OOB_TRANSACTION_TYPE, SPONSOR_TYPE, PING_TYPE, PONG_TYPE, \
+					UDP_REQUEST_TYPE, UDP_OFFER_TYPE, UDP_BLOCK_TYPE, TRANSACTIONS_TYPE, BLOCK_SEQ_TYPE, UDP_RESEND_TYPE;
 
 #define RELAY_DECLARE_CONSTRUCTOR_EXTENDS \
 	VERSION_TYPE(htonl(0)), BLOCK_TYPE(htonl(1)), TRANSACTION_TYPE(htonl(2)), END_BLOCK_TYPE(htonl(3)), \
-	MAX_VERSION_TYPE(htonl(4)), OOB_TRANSACTION_TYPE(htonl(5)), SPONSOR_TYPE(htonl(6)), PING_TYPE(htonl(7)), PONG_TYPE(htonl(8))
+	MAX_VERSION_TYPE(htonl(4)), OOB_TRANSACTION_TYPE(htonl(5)), SPONSOR_TYPE(htonl(6)), PING_TYPE(htonl(7)), PONG_TYPE(htonl(8)), \
+	UDP_REQUEST_TYPE(htonl(9)), UDP_OFFER_TYPE(htonl(10)), UDP_BLOCK_TYPE(htonl(11)), TRANSACTIONS_TYPE(htonl(12)), \
+	BLOCK_SEQ_TYPE(htonl(13)), UDP_RESEND_TYPE(htonl(14))
+
+class MerkleTreeBuilder {
+private:
+	uint32_t tx_count;
+	std::vector<unsigned char> hashlist;
+
+	// Transactions are hashed in batches (see double_sha256_multi), so
+	// queueTxHash only records where in the block each one lives
+	struct PendingTx {
+		uint32_t tx;
+		size_t offset;
+		uint64_t len;
+	};
+	std::vector<PendingTx> pending;
+	std::vector<const unsigned char*> pending_inputs;
+	std::vector<uint64_t> pending_lens;
+	std::vector<unsigned char*> pending_res;
+
+public:
+	MerkleTreeBuilder(uint32_t tx_count_in) : tx_count(tx_count_in), hashlist((tx_count_in + 1) * 32) {}
+	inline unsigned char* getTxHashLoc(uint32_t tx) { return &hashlist[tx * 32]; }
+
+	// block must be the same (though possibly reallocated) buffer on every call
+	void queueTxHash(uint32_t tx, const std::vector<unsigned char>& block, size_t offset, uint64_t len) {
+		pending.push_back(PendingTx { tx, offset, len });
+		if (pending.size() >= 4 * double_sha256_lanes())
+			hashQueued(block);
+	}
+
+	void hashQueued(const std::vector<unsigned char>& block) {
+		if (pending.empty())
+			return;
+		pending_inputs.resize(pending.size());
+		pending_lens.resize(pending.size());
+		pending_res.resize(pending.size());
+		for (size_t i = 0; i < pending.size(); i++) {
+			pending_inputs[i] = &block[pending[i].offset];
+			pending_lens[i] = pending[i].len;
+			pending_res[i] = getTxHashLoc(pending[i].tx);
+		}
+		double_sha256_multi(&pending_inputs[0], &pending_lens[0], &pending_res[0], pending.size());
+		pending.clear();
+	}
+
+	// Hashes txn[begin, end) (as (offset, length) pairs in block) straight away. Unlike
+	// queueTxHash, this may be called for disjoint ranges from several threads at once.
+	void hashTxRange(const std::vector<unsigned char>& block, const std::vector<std::pair<size_t, size_t> >& txn, size_t begin, size_t end) {
+		const size_t batch = 4 * double_sha256_lanes();
+		std::vector<const unsigned char*> inputs(batch);
+		std::vector<uint64_t> lens(batch);
+		std::vector<unsigned char*> res(batch);
+		while (begin < end) {
+			size_t count = std::min(batch, end - begin);
+			for (size_t i = 0; i < count; i++) {
+				inputs[i] = &block[txn[begin + i].first];
+				lens[i] = txn[begin + i].second;
+				res[i] = getTxHashLoc(begin + i);
+			}
+			double_sha256_multi(&inputs[0], &lens[0], &res[0], count);
+			begin += count;
+		}
+	}
+
+	bool merkleRootMatches(const unsigned char* match) {
+		assert(pending.empty());
+		for (uint32_t rowSize = tx_count; rowSize > 1; rowSize = (rowSize + 1) / 2) {
+			if (!memcmp(&hashlist[32 * (rowSize - 2)], &hashlist[32 * (rowSize - 1)], 32))
+				return false;
+
+			// Each level is packed at the front of hashlist, and is hashed in place
+			if (rowSize & 1)
+				memcpy(&hashlist[32 * rowSize], &hashlist[32 * (rowSize - 1)], 32);
+			double_sha256_64_multi(&hashlist[0], &hashlist[0], (rowSize + 1) / 2);
+		}
+		return !memcmp(match, &hashlist[0], 32);
+	}
+};
+
+// The RELAY_COMPRESS_THREADS workers (pinned from the start of RELAY_COMPRESS_CPUS) which
+// maybe_compress_block splits big blocks across
+WorkerPool& compress_workers();
 
 class RelayNodeCompressor {
 	RELAY_DECLARE_CLASS_VARS
 
 private:
 	bool useOldFlags;
+	// Whether blocks carry delta/run-length coded tx indexes (see maybe_compress_block)
+	bool useDeltaIndexes;
 	FlaggedArraySet send_tx_cache, recv_tx_cache;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
-	std::mutex mutex;
+	hashmruset blocksAlreadySeen;
+	// Held while reading a block off the wire, hence a FiberMutex
+	FiberMutex mutex;
+
+	// send_tx_cache, in order, split into runs of transactions which are serialized as
+	// TRANSACTION messages only when a new peer needs them (serialized is reset whenever
+	// txn changes). Chunks are immutable once built, so peers can share them.
+	struct SnapshotChunk {
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		size_t bytes;
+		std::shared_ptr<std::vector<unsigned char> > serialized;
+	};
+	std::deque<SnapshotChunk> send_snapshot;
 
 public:
-	RelayNodeCompressor(bool useOldFlagsIn)
-		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, useOldFlags(useOldFlagsIn),
+	RelayNodeCompressor(bool useOldFlagsIn, bool useDeltaIndexesIn=false)
+		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, useOldFlags(useOldFlagsIn), useDeltaIndexes(useDeltaIndexesIn),
 		  send_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE),
 		  recv_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE),
 		  blocksAlreadySeen(1000000) {}
 	RelayNodeCompressor& operator=(const RelayNodeCompressor& c) {
 		useOldFlags = c.useOldFlags;
+		useDeltaIndexes = c.useDeltaIndexes;
 		send_tx_cache = c.send_tx_cache;
 		recv_tx_cache = c.recv_tx_cache;
 		blocksAlreadySeen = c.blocksAlreadySeen;
+		send_snapshot = c.send_snapshot;
 		return *this;
 	}
 	void reset();
 
 	inline std::shared_ptr<std::vector<unsigned char> > tx_to_msg(const std::shared_ptr<std::vector<unsigned char> >& tx, bool send_oob=false, bool include_data=true) const {
-		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
+		auto msg = pooled_buffer(sizeof(struct relay_msg_header), sizeof(struct relay_msg_header) + (include_data ? tx->size() : 0));
 		struct relay_msg_header *header = (struct relay_msg_header*)&(*msg)[0];
 		header->magic = RELAY_MAGIC_BYTES;
 		if (send_oob)
@@ -63,24 +167,92 @@ public:
 		return msg;
 	}
 	std::shared_ptr<std::vector<unsigned char> > get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	// As get_relay_transaction on each of txn in turn, but under one lock. Returns the ones which
+	// should be relayed both as back-to-back TRANSACTION messages and as TRANSACTIONS messages
+	// (for peers with VERSION_FEATURE_TX_BATCH), or two nulls if there are none.
+	std::pair<std::shared_ptr<std::vector<unsigned char> >, std::shared_ptr<std::vector<unsigned char> > > get_relay_transactions(const std::vector<std::shared_ptr<std::vector<unsigned char> > >& txn);
 
 	bool maybe_recv_tx_of_size(uint32_t tx_size, bool debug_print);
 	void recv_tx(std::shared_ptr<std::vector<unsigned char > > tx);
+	// Reads the transactions out of a TRANSACTIONS message and then recv_tx's them all under one
+	// lock, in order, returning an error if the message was bogus or any of them are too large
+	const char* recv_tx_batch(BufferedReader& reader, uint32_t message_size, std::vector<std::shared_ptr<std::vector<unsigned char> > >& txn);
 
 	void for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback);
+	// The same transactions as for_each_sent_tx, as a list of ready-to-send buffers of
+	// TRANSACTION messages which are shared between everyone who asks
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > sent_tx_snapshot();
 
 	std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle);
-	std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle);
+	// Returns (wire bytes, block, error, block hash), where block is a ready-to-send bitcoin block message
+	std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > decompress_relay_block(BufferedReader& reader, uint32_t message_size, bool check_merkle);
 
 	bool block_sent(std::vector<unsigned char>& hash);
 	uint32_t blocks_sent();
+	void for_each_sent_block(const std::function<void (const unsigned char*)> callback);
 
 	bool was_tx_sent(const unsigned char* txhash);
 
 private:
 	bool check_recv_tx(uint32_t tx_size);
+	bool add_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	void snapshot_add(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	void snapshot_remove_front(size_t count);
+	void snapshot_remove(const std::vector<uint32_t>& indexes);
 
 	friend void test_compress_block(std::vector<unsigned char>&, std::vector<std::shared_ptr<std::vector<unsigned char> > >);
 };
 
+// A BLOCK_SEQ's payload is an 8 byte LE seq followed by a whole BLOCK or UDP_BLOCK message
+#define BLOCK_SEQ_HEADER_SIZE (8 + sizeof(struct relay_msg_header))
+
+/* Peers with VERSION_FEATURE_BLOCK_SEQ get compressor-tracked transactions in OUTBOUND_BULK and
+ * blocks in OUTBOUND_BLOCK, wrapped in BLOCK_SEQ messages, so that a block never waits behind
+ * a transaction backlog (eg the send cache replay on connect). A BLOCK_SEQ's seq is the number
+ * of TRANSACTION(S) messages sent before it, and as a block can only ever arrive early, the
+ * receiver holds it until it has applied that many (and holds any transactions which arrive
+ * while a block is due, as they must be applied after it).
+ * A block which is due but not here yet (a UDP_BLOCK whose chunks never came) stalls everything
+ * behind it until resume() is given the block.
+ */
+class BlockSequencer {
+public:
+	// Applies a whole held message (header included), returning an error or NULL, or setting
+	// stalled if it was a block which is not here yet
+	typedef std::function<const char* (const std::vector<unsigned char>&, bool& stalled)> apply_func;
+
+private:
+	struct HeldBlock {
+		uint64_t seq;
+		std::vector<unsigned char> msg;
+		bool stalled;
+	};
+	std::deque<HeldBlock> blocks;
+	std::deque<std::vector<unsigned char> > txn;
+	uint64_t txn_applied;
+
+public:
+	BlockSequencer() : txn_applied(0) {}
+	void reset() { blocks.clear(); txn.clear(); txn_applied = 0; }
+
+	// Whether a TRANSACTION(S) message can be applied straight off the wire (and then tx_applied())
+	bool can_apply_tx() const { return txn.empty() && (blocks.empty() || blocks.front().seq != txn_applied); }
+	void tx_applied() { txn_applied++; }
+	// Whether the block in a BLOCK_SEQ for seq can be applied straight off the wire
+	bool can_apply_block(uint64_t seq) const { return txn.empty() && blocks.empty() && seq == txn_applied; }
+
+	void hold_tx(std::vector<unsigned char>&& msg) { txn.push_back(std::move(msg)); }
+	// Returns an error if the block came after (some of) the transactions it should have overtaken
+	const char* hold_block(uint64_t seq, std::vector<unsigned char>&& msg);
+
+	// For a block which stalled when applied straight off the wire (ie after can_apply_block(seq))
+	void hold_stalled(uint64_t seq) { blocks.push_back(HeldBlock { seq, std::vector<unsigned char>(), true }); }
+	bool stalled() const { return !blocks.empty() && blocks.front().stalled; }
+	// Replaces the stalled block with msg and carries on applying everything held, as drain
+	const char* resume(std::vector<unsigned char>&& msg, const apply_func& apply);
+
+	// Applies everything held which is due, in order, returning the first error
+	const char* drain(const apply_func& apply);
+};
+
 #endif
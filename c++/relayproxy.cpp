@@ -14,6 +14,7 @@
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
 #include "relayprocess.h"
+#include "log.h"
 #include "utils.h"
 
 
@@ -28,115 +29,178 @@ class RelayNetworkClient {
 private:
 	const char* server_host;
 
-	const std::function<void (int)> provide_sock;
-
-	int sock;
-	std::mutex send_mutex;
-	std::thread* net_thread, *new_thread;
-
 public:
-	RelayNetworkClient(const char* serverHostIn,
-						const std::function<void (int)>& provide_sock_in)
-			: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, server_host(serverHostIn), provide_sock(provide_sock_in),
-			sock(0), net_thread(NULL), new_thread(NULL) {
-		send_mutex.lock();
-		new_thread = new std::thread(do_connect, this);
-		send_mutex.unlock();
-	}
-
-private:
-	void reconnect(std::string disconnectReason, bool alreadyLocked=false) {
-		printf("Closing relay socket, %s (%i: %s)\n", disconnectReason.c_str(), errno, errno ? strerror(errno) : "");
-		exit(-1);
-	}
-
-	static void do_connect(RelayNetworkClient* me) {
-		me->send_mutex.lock();
-
-		if (me->net_thread)
-			me->net_thread->join();
-		me->net_thread = me->new_thread;
+	RelayNetworkClient(const char* serverHostIn) : RELAY_DECLARE_CONSTRUCTOR_EXTENDS, server_host(serverHostIn) {}
 
+	// Connects and does the version handshake, returning a blocking socket ready to be
+	// forwarded, or -1
+	int connect() {
 		std::string error;
-		me->sock = create_connect_socket(me->server_host, 8336, error);
-		if (me->sock <= 0)
-			return me->reconnect(error, true);
-
-		fcntl(me->sock, F_SETFL, fcntl(me->sock, F_GETFL) & ~O_NONBLOCK);
+		int sock = create_connect_socket(server_host, 8336, error);
+		if (sock <= 0) {
+			LOG("Failed to connect to %s: %s\n", server_host, error.c_str());
+			return -1;
+		}
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
 
-		me->net_process();
+		const char* disconnectReason = handshake(sock);
+		if (disconnectReason) {
+			LOG("Closing relay socket to %s, %s (%i: %s)\n", server_host, disconnectReason, errno, errno ? strerror(errno) : "");
+			close(sock);
+			return -1;
+		}
+		return sock;
 	}
 
-	void net_process() {
+private:
+	const char* handshake(int sock) {
 		relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(strlen(VERSION_STRING)) };
 		if (send_all(sock, (char*)&version_header, sizeof(version_header)) != sizeof(version_header))
-			return reconnect("failed to write version header", true);
+			return "failed to write version header";
 		if (send_all(sock, VERSION_STRING, strlen(VERSION_STRING)) != strlen(VERSION_STRING))
-			return reconnect("failed to write version string", true);
+			return "failed to write version string";
 
 		int nodelay = 1;
 		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
 
-		if (errno)
-			return reconnect("error during connect", true);
-
-		send_mutex.unlock();
-
 		relay_msg_header header;
 		if (read_all(sock, (char*)&header, 4*3) != 4*3)
-			return reconnect("failed to read message header");
+			return "failed to read message header";
 
 		if (header.magic != RELAY_MAGIC_BYTES)
-			return reconnect("invalid magic bytes");
+			return "invalid magic bytes";
 		if (header.type != VERSION_TYPE)
-			return reconnect("didnt get version first");
+			return "didnt get version first";
 
 		uint32_t message_size = ntohl(header.length);
 		if (message_size > 1000000)
-			return reconnect("got message too large");
+			return "got message too large";
 
 		char msg[message_size];
 		if (read_all(sock, (char*)msg, message_size) < (int64_t)(message_size))
-			return reconnect("failed to read message data");
+			return "failed to read message data";
 
 		struct sockaddr_in6 addr;
 		socklen_t len = sizeof(addr);
 		if (getsockname(sock, (struct sockaddr*)&addr, &len) != 0)
-			return reconnect("failed to get bound host/port");
+			return "failed to get bound host/port";
 		if (len != sizeof(addr))
-			return reconnect("getsockname didnt return a sockaddr_in6?");
+			return "getsockname didnt return a sockaddr_in6?";
 
-		printf("Connected to %s local_port %d at %lu\n", server_host, addr.sin6_port, epoch_millis_lu(std::chrono::system_clock::now()));
+		LOG("Connected to %s local_port %d at %lu\n", server_host, addr.sin6_port, epoch_millis_lu(std::chrono::system_clock::now()));
+		return NULL;
+	}
+};
 
-		provide_sock(sock);
-		return reconnect("provide_sock returned");
+
+/********************
+ **** Forwarding ****
+ ********************/
+#define PROXY_BUFFER_SIZE (1024 * 1024)
+
+// Copies from -> to through userspace until either side goes away, returning bytes copied
+static uint64_t copy_loop(int from, int to) {
+	std::vector<char> buff(PROXY_BUFFER_SIZE);
+	uint64_t total = 0;
+	while (true) {
+		ssize_t res = recv(from, &buff[0], buff.size(), 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			LOG("Error reading from sock %d: %ld (%s)\n", from, (long)res, res ? strerror(errno) : "closed");
+			return total;
+		}
+		if (send_all(to, &buff[0], res) != res) {
+			LOG("Error sending to sock %d: %s\n", to, strerror(errno));
+			return total;
+		}
+		total += res;
 	}
+}
 
-public:
-	void receive_sock(int recv_sock) {
-		std::lock_guard<std::mutex> lock(send_mutex);
-		char buff[0xffff];
-		while (true) {
-			ssize_t res = recv(recv_sock, buff, sizeof(buff), 0);
-			if (res <= 0) { printf("Error reading from recv_sock %d: %ld (%s)\n", recv_sock, res, strerror(errno)); return; }
-			res = send_all(sock, buff, res);
-			if (res <= 0) { printf("Error sending to sock %d: %ld (%s)\n", sock, res, strerror(errno)); return; }
+// As copy_loop, but on Linux bytes are spliced from one socket to the other through a pipe
+// without ever being copied into userspace
+static uint64_t forward(int from, int to) {
+#ifdef __linux__
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC))
+		return copy_loop(from, to);
+	fcntl(pipefd[1], F_SETPIPE_SZ, PROXY_BUFFER_SIZE); // Capped at fs.pipe-max-size, which is fine
+	int pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		pipe_size = 65536;
+
+	uint64_t total = 0;
+	while (true) {
+		ssize_t in = splice(from, NULL, pipefd[1], NULL, pipe_size, SPLICE_F_MOVE);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in < 0 && errno == EINVAL && total == 0) {
+			// Not spliceable (old kernel, odd socket type, etc)
+			close(pipefd[0]);
+			close(pipefd[1]);
+			return copy_loop(from, to);
+		}
+		if (in <= 0) {
+			LOG("Error reading from sock %d: %ld (%s)\n", from, (long)in, in ? strerror(errno) : "closed");
+			break;
+		}
+		// No SPLICE_F_MORE, that would cork blocks behind whatever comes next
+		while (in > 0) {
+			ssize_t out = splice(pipefd[0], NULL, to, NULL, in, SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0) {
+				LOG("Error sending to sock %d: %s\n", to, strerror(errno));
+				close(pipefd[0]);
+				close(pipefd[1]);
+				return total;
+			}
+			in -= out;
+			total += out;
 		}
 	}
-};
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return total;
+#else
+	return copy_loop(from, to);
+#endif
+}
 
 
 
 
 int main(int argc, char** argv) {
 	if (argc != 3) {
-		printf("USAGE: %s RELAY_SERVER_A RELAY_SERVER_B\n", argv[0]);
+		LOG("USAGE: %s RELAY_SERVER_A RELAY_SERVER_B\n", argv[0]);
 		return -1;
 	}
 
-	RelayNetworkClient *relayClientA, *relayClientB;
-	relayClientA = new RelayNetworkClient(argv[1], [&](int sock) { relayClientB->receive_sock(sock); });
-	relayClientB = new RelayNetworkClient(argv[2], [&](int sock) { relayClientA->receive_sock(sock); });
-
-	while (true) { sleep(1000); }
+	RelayNetworkClient relayClientA(argv[1]), relayClientB(argv[2]);
+
+	// Each server's compressor state is tied to its connection, so if either side goes away
+	// mid-stream the other has to be dropped too, and both are reconnected together
+	while (true) {
+		int sockA = relayClientA.connect();
+		int sockB = sockA < 0 ? -1 : relayClientB.connect();
+		if (sockA >= 0 && sockB >= 0) {
+			uint64_t bytesAB = 0;
+			std::thread a_to_b([&]() {
+				bytesAB = forward(sockA, sockB);
+				shutdown(sockA, SHUT_RDWR);
+				shutdown(sockB, SHUT_RDWR);
+			});
+			uint64_t bytesBA = forward(sockB, sockA);
+			shutdown(sockA, SHUT_RDWR);
+			shutdown(sockB, SHUT_RDWR);
+			a_to_b.join();
+			LOG("Disconnected from %s and %s after forwarding %lu and %lu bytes, reconnecting\n", argv[1], argv[2], (unsigned long)bytesAB, (unsigned long)bytesBA);
+		}
+		if (sockA >= 0)
+			close(sockA);
+		if (sockB >= 0)
+			close(sockB);
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
 }
@@ -5,7 +5,9 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
+#include <list>
 
+#include "log.h"
 #include "utils.h"
 
 void RPCClient::on_disconnect() {
@@ -17,36 +19,317 @@ struct CTxMemPoolEntry {
 	uint64_t feePerKb;
 	uint32_t size;
 	double prio;
-	uint32_t reqCount;
+	uint32_t reqCount; // Parents not yet selected, only meaningful while selecting
 	std::vector<unsigned char> hash;
+	const std::string hexHash;
+	std::unordered_set<std::string> depHashes; // As getrawmempool last listed them
+	std::vector<CTxMemPoolEntry*> parents;
 	std::unordered_set<CTxMemPoolEntry*> setDeps;
-	CTxMemPoolEntry(uint64_t feeIn, uint32_t sizeIn, double prioIn, std::vector<unsigned char> hashIn, uint32_t reqCountIn) : feePerKb(feeIn * 1000 / sizeIn), size(sizeIn), prio(prioIn), reqCount(reqCountIn), hash(hashIn) {
-		//TODO: Parse hash?
+	uint64_t generation; // The last poll which listed it
+	bool taken; // Already given to new_txn_for_block_func
+	CTxMemPoolEntry(std::vector<unsigned char> hashIn, const std::string& hexHashIn) : hash(hashIn), hexHash(hexHashIn), generation(0), taken(false) {}
+};
+
+// The mempool as of the last getrawmempool, kept between polls so that each one only creates
+// (and links up the dependencies of) the transactions which are new or whose dependencies
+// changed, and drops the ones which are gone
+struct MempoolSnapshot {
+	//These do not move
+	std::list<CTxMemPoolEntry> txn;
+	//These index into txn, by hex hash
+	std::unordered_map<std::string, CTxMemPoolEntry*> hashToEntry;
+	uint64_t generation = 0;
+};
+
+
+
+/*****************************************
+ **** Streaming getrawmempool parsing ****
+ *****************************************/
+static const char EXPECTED_START[] = "{\"result\":{";
+static const char EXPECTED_END[] = "},\"error\":null,\"id\":1}\n";
+#define MIN_RESPONSE_LENGTH (sizeof(EXPECTED_START) - 1 + sizeof(EXPECTED_END) - 1)
+
+// Dumb JSON parser that mostly assumes valid (minimal-size) JSON...
+// It is fed the response as it is read, and only keeps the token it is in the middle of
+class MempoolParser {
+private:
+	enum State { START, TOP, TX_HASH, TX_COLON, TX_OPEN, FIELD, FIELD_NAME, FIELD_COLON, FIELD_VALUE_START, FIELD_VALUE, DEPS, DEP_HASH, FIELD_END, END, DONE };
+	State state;
+	size_t matched; // Bytes of EXPECTED_START/EXPECTED_END seen
+
+	std::string token, txHash, fieldString;
+	long tx_size; int64_t tx_fee; double tx_prio;
+	std::unordered_set<std::string> txDeps;
+
+	MempoolSnapshot& mempool;
+	std::unordered_multimap<std::string, CTxMemPoolEntry*> txnWaitingOnDeps;
+
+public:
+	// Updates mempool in place, which must be thrown away if either call ever fails
+	MempoolParser(MempoolSnapshot& mempool_in) : state(START), matched(0), tx_size(-1), tx_fee(-1), tx_prio(-1), mempool(mempool_in) {
+		mempool.generation++;
 	}
+
+	// Both return an error string, or NULL if everything is fine so far
+	const char* feed(const char* data, size_t len);
+	// Drops everything the response did not list
+	const char* finish();
+
+private:
+	const char* field_value_done();
+	const char* tx_done();
 };
 
+const char* MempoolParser::field_value_done() {
+	try {
+		if (fieldString == "size")
+			tx_size = std::stol(token);
+		else if (fieldString == "fee")
+			tx_fee = int64_t(std::stod(token) * 100000000);
+		else if (fieldString == "currentpriority")
+			tx_prio = std::stod(token);
+	} catch (std::exception& e) {
+		return "transaction field could not be parsed";
+	}
+	return NULL;
+}
+
+const char* MempoolParser::tx_done() {
+	if (tx_size <= 0)
+		return "Did not get transaction size";
+	else if (tx_fee < 0)
+		return "Did not get transaction fee";
+	else if (tx_prio < 0)
+		return "Did not get transaction prio";
+
+	CTxMemPoolEntry* e;
+	auto it = mempool.hashToEntry.find(txHash);
+	bool relink = true;
+	if (it != mempool.hashToEntry.end()) {
+		e = it->second;
+		if (e->generation == mempool.generation)
+			return "Duplicate transaction";
+		relink = e->depHashes != txDeps;
+	} else {
+		std::vector<unsigned char> hash;
+		if (!hex_str_to_reverse_vector(txHash, hash) || hash.size() != 32)
+			return "got bad hash";
+		mempool.txn.emplace_back(hash, txHash);
+		e = &mempool.txn.back();
+		mempool.hashToEntry[txHash] = e;
+	}
+	e->feePerKb = tx_fee * 1000 / tx_size;
+	e->size = tx_size;
+	e->prio = tx_prio;
+	e->generation = mempool.generation;
+
+	if (relink) {
+		for (CTxMemPoolEntry* parent : e->parents)
+			parent->setDeps.erase(e);
+		e->parents.clear();
+		for (const std::string& dep : txDeps) {
+			auto depIt = mempool.hashToEntry.find(dep);
+			if (depIt == mempool.hashToEntry.end())
+				txnWaitingOnDeps.insert(std::make_pair(dep, e));
+			else {
+				depIt->second->setDeps.insert(e);
+				e->parents.push_back(depIt->second);
+			}
+		}
+		e->depHashes.swap(txDeps);
+	}
+
+	auto waitingIts = txnWaitingOnDeps.equal_range(txHash);
+	for (auto waitingIt = waitingIts.first; waitingIt != waitingIts.second; waitingIt++) {
+		e->setDeps.insert(waitingIt->second);
+		waitingIt->second->parents.push_back(e);
+	}
+	txnWaitingOnDeps.erase(txHash);
+
+	tx_size = -1;
+	tx_fee = -1;
+	tx_prio = -1;
+	txDeps.clear();
+	return NULL;
+}
+
+const char* MempoolParser::feed(const char* data, size_t len) {
+	const char* err = NULL;
+	for (const char* end = data + len; data < end; data++) {
+		const char c = *data;
+		if (token.length() > 1024)
+			return "Got overly long JSON token";
+
+		switch (state) {
+		case START:
+			if (c != EXPECTED_START[matched])
+				return "Got result which was not an object";
+			if (++matched == sizeof(EXPECTED_START) - 1)
+				state = TOP;
+			break;
+		case TOP:
+			if (c == '"') {
+				token.clear();
+				state = TX_HASH;
+			} else if (c == '}') {
+				matched = 1;
+				state = END;
+			} else if (c != ' ' && c != ',')
+				return "Got unexpected character between transactions";
+			break;
+		case TX_HASH:
+		case FIELD_NAME:
+		case DEP_HASH:
+			if (c == '"') {
+				if (state == TX_HASH) {
+					txHash.swap(token);
+					state = TX_COLON;
+				} else if (state == FIELD_NAME) {
+					fieldString.swap(token);
+					state = FIELD_COLON;
+				} else {
+					txDeps.insert(token);
+					state = DEPS;
+				}
+				token.clear();
+			} else if (c == ':' || c == ',' || c == '{' || c == '}')
+				return "Got JSON syntax in a string (all strings should have been hex or field names)";
+			else
+				token += c;
+			break;
+		case TX_COLON:
+		case FIELD_COLON:
+			if (c == ':')
+				state = state == TX_COLON ? TX_OPEN : FIELD_VALUE_START;
+			else if (c != ' ')
+				return "Missing : after a string";
+			break;
+		case TX_OPEN:
+			if (c == '{')
+				state = FIELD;
+			else if (c != ' ')
+				return "Transaction was not an object";
+			break;
+		case FIELD:
+			if (c == '"')
+				state = FIELD_NAME;
+			else if (c == '}') {
+				if ((err = tx_done()))
+					return err;
+				state = TOP;
+			} else if (c != ' ' && c != ',')
+				return "Got unexpected character between fields";
+			break;
+		case FIELD_VALUE_START:
+			if (c == '[')
+				state = DEPS;
+			else if (c == '"')
+				return "got string as a field value";
+			else if (c == '{' || c == ',' || c == '}')
+				return "Got unexpected field value";
+			else if (c != ' ') {
+				token = c;
+				state = FIELD_VALUE;
+			}
+			break;
+		case FIELD_VALUE:
+			if (c == ',' || c == '}' || c == ' ') {
+				if ((err = field_value_done()))
+					return err;
+				token.clear();
+				state = FIELD_END;
+				data--; // Let FIELD_END handle it
+			} else
+				token += c;
+			break;
+		case DEPS:
+			if (c == '"')
+				state = DEP_HASH;
+			else if (c == ']')
+				state = FIELD_END;
+			else if (c != ' ' && c != ',')
+				return "Missing array end character (])";
+			break;
+		case FIELD_END:
+			if (c == ',')
+				state = FIELD;
+			else if (c == '}') {
+				if ((err = tx_done()))
+					return err;
+				state = TOP;
+			} else if (c != ' ')
+				return "Got unexpected character after a field";
+			break;
+		case END:
+			if (c != EXPECTED_END[matched])
+				return "JSON object was not closed at the end";
+			if (++matched == sizeof(EXPECTED_END) - 1)
+				state = DONE;
+			break;
+		case DONE:
+			return "Got data after the end of the JSON object";
+		}
+	}
+	return NULL;
+}
+
+const char* MempoolParser::finish() {
+	if (state != DONE)
+		return "JSON object was not closed at the end";
+	if (!txnWaitingOnDeps.empty())
+		return "Tx depended on another one which did not exist";
+
+	// Anything still depending on a transaction which is gone must have been listed as such
+	for (const CTxMemPoolEntry& e : mempool.txn)
+		if (e.generation != mempool.generation)
+			for (const CTxMemPoolEntry* child : e.setDeps)
+				if (child->generation == mempool.generation)
+					return "Tx depended on another one which did not exist";
+
+	for (auto it = mempool.txn.begin(); it != mempool.txn.end();) {
+		if (it->generation == mempool.generation) {
+			it++;
+			continue;
+		}
+		for (CTxMemPoolEntry* parent : it->parents)
+			if (parent->generation == mempool.generation)
+				parent->setDeps.erase(&*it);
+		mempool.hashToEntry.erase(it->hexHash);
+		it = mempool.txn.erase(it);
+	}
+	return NULL;
+}
+
+
+
 void RPCClient::net_process(const std::function<void(std::string)>& disconnect) {
 	connected = true;
+	if (!mempool)
+		mempool = std::make_shared<MempoolSnapshot>();
 
 	uint8_t count = 0;
+	millis_lu_type read_timeout(std::chrono::seconds(10));
+	BufferedReader reader([&](size_t min_bytes, size_t& avail) { return peek(min_bytes, avail, read_timeout); }, [&](size_t nbyte) { consume(nbyte); });
 	while (true) {
 		int content_length = -2;
 		bool close_after_read = false;
-		int max_read;
-		char buf[2048];
 		std::string line;
 
+		read_timeout = std::chrono::seconds(10);
 		while (true) {
 			std::string::size_type line_break;
 			while ((line_break = line.find("\r\n")) == std::string::npos) {
-				if (line.find("\r") != std::string::npos)
-					max_read = 1;
-				else
-					max_read = 2;
-
-				if (read_all(buf, max_read, std::chrono::seconds(10)) != max_read)
+				// Headers are taken a line at a time straight out of what is buffered, so
+				// we never take any of the body (or the next response) with them
+				size_t avail;
+				const unsigned char* data = reader.peek_some(avail);
+				if (!data)
 					return disconnect("Failed to read server response");
-				line.append(buf, buf + max_read);
+				const unsigned char* newline = (const unsigned char*)memchr(data, '\n', avail);
+				size_t take = newline ? newline - data + 1 : avail;
+				line.append((const char*)data, take);
+				reader.skip(take);
 
 				if (line.length() > 16384)
 					return disconnect("Got header longer than 16k!");
@@ -86,192 +369,39 @@ void RPCClient::net_process(const std::function<void(std::string)>& disconnect)
 
 		if (content_length < 0 || content_length > 1024*1024*100)
 			return disconnect("Got unreasonably large response size");
-
-		//Dumb JSON parser that mostly assumes valid (minimal-size) JSON...
-		static const std::string expected_start("{\"result\":{");
-		{
-			char resp[expected_start.length()];
-			if (read_all(resp, expected_start.length()) != (ssize_t)expected_start.length())
+		if (size_t(content_length) < MIN_RESPONSE_LENGTH || size_t(content_length) < line.length())
+			return disconnect("Got response shorter than what we already read");
+
+		// line now holds the start of the body (if a header line was split oddly), and the
+		// rest is parsed straight out of the inbound buffer as it arrives
+		MempoolParser parser(*mempool);
+		const char* err = parser.feed(line.data(), line.length());
+		size_t remaining = content_length - line.length();
+		read_timeout = millis_lu_type::max();
+		while (!err && remaining) {
+			size_t avail;
+			const unsigned char* data = reader.peek_some(avail);
+			if (!data)
 				return disconnect("Failed to read response");
-			if (memcmp(resp, &expected_start[0], expected_start.length()) != 0)
-				return disconnect("Got result which was not an object");
+			size_t read = std::min(remaining, avail);
+			err = parser.feed((const char*)data, read);
+			reader.skip(read);
+			remaining -= read;
+		}
+		if (err || (err = parser.finish())) {
+			mempool = std::make_shared<MempoolSnapshot>();
+			return disconnect(err);
 		}
 
-		std::vector<unsigned char> resp(content_length - expected_start.length());
-		if (read_all((char*)&resp[0], content_length - expected_start.length()) != content_length - (ssize_t)expected_start.length())
-			return disconnect("Failed to read response");
-		auto it = resp.begin();
-
-		//These do not move
-		std::list<CTxMemPoolEntry> txn;
-		//These index into txn
 		std::vector<CTxMemPoolEntry*> vectorToSort;
-		std::unordered_map<std::string, CTxMemPoolEntry*> hashToEntry;
-		std::unordered_multimap<std::string, CTxMemPoolEntry*> txnWaitingOnDeps;
-
-		// These are values/flags about the current status of the parser
-		int32_t stringStart = -1, fieldValueStart = -1;
-		std::string txHash, fieldString;
-		long tx_size = -1; uint64_t tx_fee = -1; double tx_prio = -1;
-		bool inTx = false, inFieldString = false, inFieldValue = false;
-		std::unordered_set<std::string> txDeps;
-
-		static const std::string expected_end("},\"error\":null,\"id\":1}\n");
-		while (it < resp.end() - expected_end.length()) {
-			while ((*it == ' ') && it < resp.end() - 1) it++;
-			switch(*it) {
-			case '"':
-				if (stringStart != -1) {
-					if (!inTx)
-						txHash = std::string(resp.begin() + stringStart, it);
-					else if (inFieldString)
-						fieldString = std::string(resp.begin() + stringStart, it);
-					else if (inFieldValue)
-						return disconnect("got string as a field value");
-					stringStart = -1;
-				} else
-					stringStart = it - resp.begin() + 1;
-				break;
-			case ':':
-				if (stringStart != -1)
-					return disconnect("Got : in a string (all strings should have been hex");
-				if (inFieldString) {
-					inFieldValue = true;
-					inFieldString = false;
-					fieldValueStart = it - resp.begin() + 1;
-				} else if (inFieldValue)
-					return disconnect("Got : in an unexpected place");
-				break;
-			case ',':
-				if (stringStart != -1)
-					return disconnect("Got , in a string (all strings should have been hex");
-				if (inFieldValue) {
-					inFieldValue = false;
-					inFieldString = true;
-					if (fieldString == "size") {
-						try {
-							tx_size = std::stol(std::string(resp.begin() + fieldValueStart, it));
-						} catch (std::exception& e) {
-							return disconnect("transaction size could not be parsed");
-						}
-					} else if (fieldString == "fee") {
-						try {
-							tx_fee = uint64_t(std::stod(std::string(resp.begin() + fieldValueStart, it)) * 100000000);
-						} catch (std::exception& e) {
-							return disconnect("transaction value could not be parsed");
-						}
-					} else if (fieldString == "currentpriority") {
-						try {
-							tx_prio = std::stod(std::string(resp.begin() + fieldValueStart, it));
-						} catch (std::exception& e) {
-							return disconnect("transaction prio could not be parsed");
-						}
-					}
-				} else if (inTx)
-					return disconnect("Got unexpected ,");
-				break;
-			case '[':
-			{
-				it++;
-				int32_t depStringStart = -1;
-				while (*it != ']' && it < resp.end() - 1) {
-					if (*it == '"') {
-						if (depStringStart != -1) {
-							txDeps.insert(std::string(resp.begin() + depStringStart, it));
-							depStringStart = -1;
-						} else
-							depStringStart = it - resp.begin() + 1;
-					}
-					it++;
-				}
-				if (*it != ']' || depStringStart != -1)
-					return disconnect("Missing array end character (])");
-				break;
-			}
-			case '{':
-				if (stringStart != -1)
-					return disconnect("Got { in a string (all strings should have been hex");
-				else if (!inTx) {
-					inTx = true;
-					inFieldString = true;
-				} else
-					return disconnect("Got JSON object start when we weren't expecting one");
-				break;
-			case '}':
-				if (inTx) {
-					if (inFieldValue) {
-						inFieldValue = false;
-						if (fieldString == "size") {
-							try {
-								tx_size = std::stol(std::string(resp.begin() + fieldValueStart, it));
-							} catch (std::exception& e) {
-								return disconnect("transaction size could not be parsed");
-							}
-						} else if (fieldString == "fee") {
-							try {
-								tx_fee = uint64_t(std::stod(std::string(resp.begin() + fieldValueStart, it)) * 100000000);
-							} catch (std::exception& e) {
-								return disconnect("transaction value could not be parsed");
-							}
-						} else if (fieldString == "currentpriority") {
-							try {
-								tx_prio = std::stod(std::string(resp.begin() + fieldValueStart, it));
-							} catch (std::exception& e) {
-								return disconnect("transaction prio could not be parsed");
-							}
-						}
-					} else
-						return disconnect("Got unepxecpted }");
-
-					if (tx_size < 0)
-						return disconnect("Did not get transaction size");
-					else if (tx_fee < 0)
-						return disconnect("Did not get transaction fee");
-					else if (tx_prio < 0)
-						return disconnect("Did not get transaction prio");
-
-					std::vector<unsigned char> hash;
-					if (!hex_str_to_reverse_vector(txHash, hash) || hash.size() != 32)
-						return disconnect("got bad hash");
-
-					txn.emplace_back(tx_fee, tx_size, tx_prio, hash, txDeps.size());
-					if (!hashToEntry.insert(std::make_pair(txHash, &txn.back())).second)
-						return disconnect("Duplicate transaction");
-
-					if (txDeps.empty())
-						vectorToSort.push_back(&txn.back());
-					else {
-						for (const std::string& dep : txDeps) {
-							auto depIt = hashToEntry.find(dep);
-							if (depIt == hashToEntry.end())
-								txnWaitingOnDeps.insert(std::make_pair(dep, &txn.back()));
-							else
-								depIt->second->setDeps.insert(&txn.back());
-						}
-					}
-
-					auto waitingIts = txnWaitingOnDeps.equal_range(txHash);
-					for (auto waitingIt = waitingIts.first; waitingIt != waitingIts.second; waitingIt++)
-						txn.back().setDeps.insert(waitingIt->second);
-					txnWaitingOnDeps.erase(txHash);
-
-					inTx = false;
-					tx_size = -1;
-					tx_fee = -1;
-					txDeps.clear();
-				} else
-					return disconnect("Global JSON object closed before the end");
-				break;
-			}
-			it++;
+		for (CTxMemPoolEntry& e : mempool->txn) {
+			e.reqCount = e.parents.size();
+			if (!e.reqCount)
+				vectorToSort.push_back(&e);
 		}
-		if (it != resp.end() - expected_end.length() || memcmp(&(*it), &expected_end[0], expected_end.length()) != 0)
-			return disconnect("JSON object was not closed at the end");
-
-		if (!txnWaitingOnDeps.empty())
-			return disconnect("Tx depended on another one which did not exist");
 
 		std::vector<std::pair<std::vector<unsigned char>, size_t> > txn_selected;
+		std::vector<CTxMemPoolEntry*> entries_selected;
 		std::function<bool (const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)> comp = [](const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) {
 			return a->feePerKb < b->feePerKb || (a->feePerKb == b->feePerKb && a->prio < b->prio);
 		};
@@ -290,7 +420,10 @@ void RPCClient::net_process(const std::function<void(std::string)>& disconnect)
 						vectorToSort.push_back(dep);
 						std::push_heap(vectorToSort.begin(), vectorToSort.end(), comp);
 					}
-				txn_selected.push_back(std::make_pair(e->hash, e->size));
+				if (!e->taken) {
+					txn_selected.push_back(std::make_pair(e->hash, e->size));
+					entries_selected.push_back(e);
+				}
 				totalSizeSelected += e->size;
 				if (e->feePerKb == minFeePerKbSelected)
 					minFeePerKbTxnCount++;
@@ -312,9 +445,14 @@ void RPCClient::net_process(const std::function<void(std::string)>& disconnect)
 		}
 
 		if (++count == 0 && minFeePerKbTxnSkipped > 1 && minFeePerKbTxnCount > 1)
-			printf("WARNING: Skipped %u txn while accepting %u identical-fee txn\n", minFeePerKbTxnSkipped, minFeePerKbTxnCount);
-
-		txn_for_block_func(txn_selected, txn.size());
+			LOG("WARNING: Skipped %u txn while accepting %u identical-fee txn\n", minFeePerKbTxnSkipped, minFeePerKbTxnCount);
+
+		if (new_txn_for_block_func) {
+			size_t taken = std::min(new_txn_for_block_func(txn_selected, mempool->txn.size()), txn_selected.size());
+			for (size_t i = 0; i < taken; i++)
+				entries_selected[i]->taken = true;
+		} else
+			txn_for_block_func(txn_selected, mempool->txn.size());
 		awaiting_response = false;
 
 		if (close_after_read)
@@ -4,20 +4,32 @@
 #include <vector>
 #include <utility>
 #include <string>
+#include <unordered_set>
 #include <stdint.h>
 
 #include "connection.h"
 
+struct MempoolSnapshot;
+
 class RPCClient : public OutboundPersistentConnection {
 private:
 	const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >&, size_t)> txn_for_block_func;
+	const std::function<size_t (const std::vector<std::pair<std::vector<unsigned char>, size_t> >&, size_t)> new_txn_for_block_func;
 
 	std::atomic_bool connected;
 	std::atomic_bool awaiting_response;
 
+	// The mempool as of the last poll (including which transactions new_txn_for_block_func
+	// took), only touched from net_process
+	std::shared_ptr<MempoolSnapshot> mempool;
+
 public:
 	RPCClient(std::string hostIn, int16_t portIn, const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >& txhashes, size_t total_mempool_size)>& txn_for_block_func_in)
 		: OutboundPersistentConnection(hostIn, portIn), txn_for_block_func(txn_for_block_func_in) { on_disconnect(); construction_done(); }
+	// Delta mode: new_txn_for_block_func is only given the selected transactions it did not
+	// take in a previous call (in the same order), and returns how many it took from the front
+	RPCClient(std::string hostIn, int16_t portIn, const std::function<size_t (const std::vector<std::pair<std::vector<unsigned char>, size_t> >& new_txhashes, size_t total_mempool_size)>& new_txn_for_block_func_in)
+		: OutboundPersistentConnection(hostIn, portIn), new_txn_for_block_func(new_txn_for_block_func_in) { on_disconnect(); construction_done(); }
 	void maybe_get_txn_for_block();
 
 private:
@@ -3,6 +3,7 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
 
 #include <assert.h>
 #include <string.h>
@@ -11,17 +12,22 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BITCOIN_UA_LENGTH 23
 #define BITCOIN_UA {'/', 'R', 'e', 'l', 'a', 'y', 'N', 'e', 't', 'w', 'o', 'r', 'k', 'S', 'e', 'r', 'v', 'e', 'r', ':', '4', '2', '/'}
 
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
+#include "log.h"
+#include "metrics.h"
 #include "relayprocess.h"
 #include "utils.h"
 #include "p2pclient.h"
 #include "connection.h"
 #include "rpcclient.h"
+#include "udprelay.h"
 
 
 
@@ -29,7 +35,7 @@
 static const char* HOST_SPONSOR;
 
 
-static const std::map<std::string, int16_t> compressor_types = {{std::string("sponsor printer"), 1}, {std::string("spammy memeater"), 0}, {std::string("the blocksize"), 1}};
+static const std::map<std::string, int16_t> compressor_types = {{std::string("sponsor printer"), 1}, {std::string("spammy memeater"), 0}, {std::string("the blocksize"), 1}, {std::string("chunky tortoise"), 2}};
 
 
 /***********************************************
@@ -49,26 +55,31 @@ private:
 
 	RelayNodeCompressor compressor;
 
+	UDPBlockSender* const udp;
+	std::shared_ptr<UDPBlockSender::Peer> udp_peer; // Set once on UDP_REQUEST, accessed atomically
+
 public:
 	time_t lastDupConnect = 0;
 	std::atomic<int16_t> compressor_type;
+	std::atomic_bool tx_batches; // Whether the client takes TRANSACTIONS messages, set (once) in VERSION_TYPE recv
+	std::atomic_bool block_seq; // Whether the client takes BLOCK_SEQ messages, also set in VERSION_TYPE recv
+	std::atomic<uint64_t> tx_msgs_sent; // TRANSACTION(S) messages queued so far, for BLOCK_SEQ
 
 	RelayNetworkClient(int sockIn, std::string hostIn,
 						const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)>& provide_block_in,
 						const std::function<void (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
-						const std::function<void (RelayNetworkClient*, int)>& connected_callback_in)
+						const std::function<void (RelayNetworkClient*, int)>& connected_callback_in,
+						UDPBlockSender* udp_in)
 			: Connection(sockIn, hostIn, NULL), connected(0),
 			provide_block(provide_block_in), provide_transaction(provide_transaction_in), connected_callback(connected_callback_in),
-			RELAY_DECLARE_CONSTRUCTOR_EXTENDS, compressor(false), compressor_type(-1) // compressor is always replaced in VERSION_TYPE recv
+			RELAY_DECLARE_CONSTRUCTOR_EXTENDS, compressor(false), udp(udp_in), compressor_type(-1), tx_batches(false), block_seq(false), tx_msgs_sent(0) // compressor is always replaced in VERSION_TYPE recv
 	{ construction_done(); }
 
 private:
 	void send_sponsor(int token=0) {
 		if (!sendSponsor || tx_sent != 0)
 			return;
-		relay_msg_header sponsor_header = { RELAY_MAGIC_BYTES, SPONSOR_TYPE, htonl(strlen(HOST_SPONSOR)) };
-		do_send_bytes((char*)&sponsor_header, sizeof(sponsor_header), token);
-		do_send_bytes(HOST_SPONSOR, strlen(HOST_SPONSOR), token);
+		do_send_bytes(relay_msg(SPONSOR_TYPE, HOST_SPONSOR, strlen(HOST_SPONSOR)), token);
 	}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
@@ -100,9 +111,7 @@ private:
 				std::string their_version(data);
 
 				if (their_version != VERSION_STRING) {
-					relay_msg_header version_header = { RELAY_MAGIC_BYTES, MAX_VERSION_TYPE, htonl(strlen(VERSION_STRING)) };
-					do_send_bytes((char*)&version_header, sizeof(version_header));
-					do_send_bytes(VERSION_STRING, strlen(VERSION_STRING));
+					do_send_bytes(relay_msg(MAX_VERSION_TYPE, VERSION_STRING, strlen(VERSION_STRING)));
 				}
 
 				std::map<std::string, int16_t>::const_iterator it = compressor_types.find(their_version);
@@ -111,7 +120,9 @@ private:
 
 				compressor_type = it->second;
 
-				if (their_version == "spammy memeater")
+				if (their_version == "chunky tortoise")
+					compressor = RelayNodeCompressor(false, true);
+				else if (their_version == "spammy memeater")
 					compressor = RelayNodeCompressor(false);
 				else
 					compressor = RelayNodeCompressor(true);
@@ -119,11 +130,12 @@ private:
 				if (their_version != "the blocksize")
 					sendSponsor = true;
 
-				relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(message_size) };
-				do_send_bytes((char*)&version_header, sizeof(version_header));
-				do_send_bytes(data, message_size);
+				tx_batches = version_has_feature(data, message_size, VERSION_FEATURE_TX_BATCH);
+				block_seq = version_has_feature(data, message_size, VERSION_FEATURE_BLOCK_SEQ);
+
+				do_send_bytes(relay_msg(VERSION_TYPE, data, message_size));
 
-				printf("%s Connected to relay node with protocol version %s\n", host.c_str(), data);
+				LOG("%s Connected to relay node with protocol version %s\n", host.c_str(), data);
 				int token = get_send_mutex();
 				connected = 2;
 				do_throttle_outbound();
@@ -137,7 +149,7 @@ private:
 					return disconnect("failed to read max_version string");
 
 				if (strncmp(VERSION_STRING, data, std::min(sizeof(VERSION_STRING), size_t(message_size))))
-					printf("%s peer sent us a MAX_VERSION message\n", host.c_str());
+					LOG("%s peer sent us a MAX_VERSION message\n", host.c_str());
 				else
 					return disconnect("got MAX_VERSION of same version as us");
 			} else if (header.type == SPONSOR_TYPE) {
@@ -146,8 +158,9 @@ private:
 					return disconnect("failed to read sponsor string");
 			} else if (header.type == BLOCK_TYPE) {
 				std::chrono::system_clock::time_point read_start(std::chrono::system_clock::now());
-				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) { return read_all(buf, count); };
-				auto res = compressor.decompress_relay_block(do_read, message_size, true);
+				BufferedReader reader([&](size_t min_bytes, size_t& avail) { return peek(min_bytes, avail); }, [&](size_t nbyte) { consume(nbyte); });
+				auto res = compressor.decompress_relay_block(reader, message_size, true);
+				reader.release();
 				if (std::get<2>(res))
 					return disconnect(std::get<2>(res));
 				std::chrono::system_clock::time_point read_finish(std::chrono::system_clock::now());
@@ -157,7 +170,7 @@ private:
 				std::chrono::system_clock::time_point send_queued(std::chrono::system_clock::now());
 
 				if (bytes_sent) {
-					printf(HASH_FORMAT" BLOCK %lu %s UNTRUSTEDRELAY %u / %lu / %u TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]),
+					LOG(HASH_FORMAT" BLOCK %lu %s UNTRUSTEDRELAY %u / %lu / %u TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]),
 													epoch_millis_lu(read_finish), host.c_str(),
 													(unsigned)std::get<0>(res), bytes_sent, (unsigned)std::get<1>(res)->size(),
 													to_millis_double(read_finish - read_start), to_millis_double(send_queued - read_finish));
@@ -167,7 +180,7 @@ private:
 				if (!compressor.maybe_recv_tx_of_size(message_size, false))
 					return disconnect("got freely relayed transaction too large");
 
-				auto tx = std::make_shared<std::vector<unsigned char> > (message_size);
+				auto tx = pooled_buffer(message_size);
 				if (read_all((char*)&(*tx)[0], message_size) < (int64_t)(message_size))
 					return disconnect("failed to read loose transaction data");
 
@@ -177,7 +190,7 @@ private:
 				if (message_size > 1000000)
 					return disconnect("got oob transaction too large");
 
-				auto tx = std::make_shared<std::vector<unsigned char> > (message_size);
+				auto tx = pooled_buffer(message_size);
 				if (read_all((char*)&(*tx)[0], message_size) < (int64_t)(message_size))
 					return disconnect("failed to read oob transaction data");
 
@@ -187,36 +200,107 @@ private:
 				if (message_size != 8 || read_all(data, 8) < 8)
 					return disconnect("failed to read 8 byte ping message");
 
-				relay_msg_header pong_msg_header = { RELAY_MAGIC_BYTES, PONG_TYPE, htonl(8) };
-
-				int token = get_send_mutex();
-				do_send_bytes((char*)&pong_msg_header, sizeof(pong_msg_header), token);
-				do_send_bytes(data, 8, token);
-				release_send_mutex(token);
+				do_send_bytes(relay_msg(PONG_TYPE, data, 8), 0, OUTBOUND_CONTROL);
+			} else if (header.type == UDP_REQUEST_TYPE) {
+				if (message_size != 0)
+					return disconnect("got bad UDP request");
+
+				// Without a UDP socket, the client just never hears back and stays on TCP. UDP_BLOCK
+				// markers are only ever sent inside BLOCK_SEQs, so older clients are left there too.
+				if (!udp->ok() || !block_seq || std::atomic_load(&udp_peer))
+					continue;
+				auto peer = udp->add_peer();
+				unsigned char offer[UDP_OFFER_SIZE];
+				uint64_t token = htole64(peer->get_token());
+				uint16_t port = htons(8336);
+				memcpy(offer, &token, 8);
+				memcpy(offer + 8, &port, 2);
+				std::atomic_store(&udp_peer, peer);
+				do_send_bytes(relay_msg(UDP_OFFER_TYPE, offer, sizeof(offer)), 0, OUTBOUND_CONTROL);
+				LOG("%s Offered to send blocks over UDP\n", host.c_str());
+			} else if (header.type == UDP_RESEND_TYPE) {
+				uint64_t id;
+				if (message_size != 8 || read_all((char*)&id, 8) < 8)
+					return disconnect("failed to read UDP resend");
+
+				// Answered in OUTBOUND_BLOCK, as the client holds everything else until it comes
+				auto block = udp->find_block(le64toh(id));
+				if (!block || !std::atomic_load(&udp_peer))
+					return disconnect("got UDP resend for a block we do not have");
+				auto msg = pooled_buffer(sizeof(struct relay_msg_header) + 8 + block->size());
+				struct relay_msg_header resend_header = { RELAY_MAGIC_BYTES, UDP_RESEND_TYPE, htonl(8 + block->size()) };
+				memcpy(msg->data(), &resend_header, sizeof(resend_header));
+				memcpy(msg->data() + sizeof(resend_header), &id, 8);
+				memcpy(msg->data() + sizeof(resend_header) + 8, block->data(), block->size());
+				do_send_bytes(msg, 0, OUTBOUND_BLOCK);
+				LOG("%s Resent a UDP block over TCP\n", host.c_str());
 			} else
 				return disconnect("got unknown message type");
 		}
 	}
 
 public:
+	// Blocks are compressed against every transaction sent before them, so older clients get
+	// both in the same (OUTBOUND_TX) queue. BLOCK_SEQ clients get transactions in OUTBOUND_BULK
+	// and blocks in OUTBOUND_BLOCK, which can overtake them (see BlockSequencer).
+	// tx must be whole TRANSACTION(S) messages.
 	void receive_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, int token=0) {
 		if (connected != 2)
 			return;
 
-		do_send_bytes(tx, token);
+		if (block_seq) {
+			uint64_t msgs = 0;
+			for (size_t pos = 0; pos < tx->size(); msgs++)
+				pos += sizeof(struct relay_msg_header) + ntohl(((struct relay_msg_header*)&(*tx)[pos])->length);
+			tx_msgs_sent += msgs;
+		}
+		do_send_bytes(tx, token, block_seq ? OUTBOUND_BULK : OUTBOUND_TX);
 		tx_sent++;
 		if (!token)
 			send_sponsor(token);
 	}
 
-	void receive_block(const std::shared_ptr<std::vector<unsigned char> >& block) {
+	// Whether blocks should go out with udp_block set
+	bool udp_ready() {
+		auto peer = std::atomic_load(&udp_peer);
+		return peer && peer->ready();
+	}
+
+	// If udp_block is set (ie block encoded for UDP), only a UDP_BLOCK marker goes in the TCP stream
+	void receive_block(const std::shared_ptr<std::vector<unsigned char> >& block, const std::shared_ptr<UDPBlockSender::Block>& udp_block) {
 		if (connected != 2)
 			return;
 
+		struct relay_msg_header end_header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
 		int token = get_send_mutex();
-		do_send_bytes(block, token);
-		struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
-		do_send_bytes((char*)&header, sizeof(header), token);
+		if (block_seq) {
+			// The BLOCK_SEQ, its block and END_BLOCK are copied into one buffer, as each outbound
+			// class only ever holds whole messages. Live relay is ordered by relay_mutex and the
+			// replay on connect by the send mutex, so no transaction is half-counted here.
+			struct relay_msg_header marker_header = { RELAY_MAGIC_BYTES, UDP_BLOCK_TYPE, htonl(sizeof(udp_block->marker)) };
+			size_t inner_len = udp_block ? sizeof(marker_header) + sizeof(udp_block->marker) : block->size();
+
+			auto msg = pooled_buffer(sizeof(struct relay_msg_header) + 8 + inner_len + sizeof(end_header));
+			struct relay_msg_header header = { RELAY_MAGIC_BYTES, BLOCK_SEQ_TYPE, htonl(8 + inner_len) };
+			uint64_t seq = htole64(tx_msgs_sent);
+			unsigned char* pos = msg->data();
+			memcpy(pos, &header, sizeof(header)); pos += sizeof(header);
+			memcpy(pos, &seq, 8); pos += 8;
+			if (udp_block) {
+				memcpy(pos, &marker_header, sizeof(marker_header));
+				memcpy(pos + sizeof(marker_header), udp_block->marker, sizeof(udp_block->marker));
+			} else
+				memcpy(pos, block->data(), inner_len);
+			pos += inner_len;
+			memcpy(pos, &end_header, sizeof(end_header));
+
+			do_send_bytes(msg, token, OUTBOUND_BLOCK);
+			if (udp_block)
+				udp->send(std::atomic_load(&udp_peer), udp_block);
+		} else {
+			do_send_bytes(block, token);
+			do_send_bytes((char*)&end_header, sizeof(end_header), token);
+		}
 		release_send_mutex(token);
 	}
 };
@@ -227,8 +311,9 @@ public:
 				const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)>& provide_block_in,
 				const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
 				const std::function<void (std::vector<unsigned char>&)>& provide_headers_in,
-				bool check_block_msghash_in) :
-			P2PRelayer(serverHostIn, serverPortIn, 60000, provide_block_in, provide_transaction_in, provide_headers_in, check_block_msghash_in)
+				bool check_block_msghash_in,
+				const std::function<std::vector<unsigned char> ()>& headers_start_in = std::function<std::vector<unsigned char> ()>()) :
+			P2PRelayer(serverHostIn, serverPortIn, 60000, provide_block_in, provide_transaction_in, provide_headers_in, check_block_msghash_in, headers_start_in)
 		{ construction_done(); }
 
 private:
@@ -244,28 +329,153 @@ private:
 class RelayNetworkCompressor : public RelayNodeCompressor {
 public:
 	RelayNetworkCompressor() : RelayNodeCompressor(false) {}
-	RelayNetworkCompressor(bool useFlagsAndSmallerMax) : RelayNodeCompressor(useFlagsAndSmallerMax) {}
+	RelayNetworkCompressor(bool useFlagsAndSmallerMax, bool useDeltaIndexes=false) : RelayNodeCompressor(useFlagsAndSmallerMax, useDeltaIndexes) {}
 
 	void relay_node_connected(RelayNetworkClient* client, int token) {
-		for_each_sent_tx([&] (const std::shared_ptr<std::vector<unsigned char> >& tx) {
-			client->receive_transaction(tx_to_msg(tx, false, false), token);
-			client->receive_transaction(tx, token);
-		});
+		for (const auto& chunk : sent_tx_snapshot())
+			client->receive_transaction(chunk, token);
 	}
 };
 
-#define COMPRESSOR_TYPES 2
+#define COMPRESSOR_TYPES 3
 static RelayNetworkCompressor compressors[COMPRESSOR_TYPES];
 class CompressorInit {
 public:
 	CompressorInit() {
 		compressors[0] = RelayNetworkCompressor(false);
 		compressors[1] = RelayNetworkCompressor(true);
+		compressors[2] = RelayNetworkCompressor(false, true);
 	}
 };
 static CompressorInit init;
 
 
+/*******************************
+ **** Warm-start state file ****
+ *******************************/
+// If RELAY_STATE_FILE is set, it is rewritten every STATE_SAVE_SECS and mapped back in on
+// startup, so that a restart only has to fetch headers newer than the last save
+#define STATE_SAVE_SECS 60
+static const char STATE_MAGIC[8] = {'R', 'N', 'S', 'T', 'A', 'T', 'E', '1'};
+
+struct WarmState {
+	std::vector<unsigned char> last_header; // Hash of the last header we were given, if any
+	std::vector<unsigned char> blocks; // compressors[0]'s seen blocks, back-to-back, oldest first
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn[COMPRESSOR_TYPES]; // Each send_tx_cache, in order
+	std::vector<std::vector<unsigned char> > waiting; // txnWaitingToBroadcast
+};
+
+static bool save_state(const std::string& path, const WarmState& state) {
+	// Written to the side and renamed over, so a crash never leaves a partial file
+	const std::string tmp_path = path + ".tmp";
+	FILE* f = fopen(tmp_path.c_str(), "wb");
+	if (!f) {
+		LOG("Failed to open state file %s: %s\n", tmp_path.c_str(), strerror(errno));
+		return false;
+	}
+	auto put = [&](const void* data, size_t len) { fwrite(data, 1, len, f); };
+	auto put_u32 = [&](uint32_t val) { val = htole32(val); put(&val, 4); };
+
+	put(STATE_MAGIC, sizeof(STATE_MAGIC));
+	put_u32(state.blocks.size() / 32);
+	put(state.blocks.data(), state.blocks.size());
+	std::vector<unsigned char> last_header(state.last_header);
+	last_header.resize(32);
+	put(&last_header[0], 32);
+	put_u32(COMPRESSOR_TYPES);
+	for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+		put_u32(state.txn[i].size());
+		for (const auto& tx : state.txn[i]) {
+			put_u32(tx->size());
+			put(tx->data(), tx->size());
+		}
+	}
+	put_u32(state.waiting.size());
+	for (const auto& hash : state.waiting) {
+		assert(hash.size() == 32);
+		put(&hash[0], 32);
+	}
+	put(STATE_MAGIC, sizeof(STATE_MAGIC));
+
+	bool ok = !ferror(f) && !fflush(f) && !fsync(fileno(f));
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+		LOG("Failed to write state file %s: %s\n", path.c_str(), strerror(errno));
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool load_state(const std::string& path, WarmState& state) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			LOG("Failed to open state file %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOG("Failed to map state file %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	const unsigned char *pos = (const unsigned char*)map, *end = pos + st.st_size;
+	auto take = [&](size_t len) {
+		if (size_t(end - pos) < len)
+			throw read_exception();
+		pos += len;
+		return pos - len;
+	};
+	auto take_u32 = [&]() {
+		uint32_t val;
+		memcpy(&val, take(4), 4);
+		return le32toh(val);
+	};
+
+	bool ok = false;
+	try {
+		if (memcmp(take(sizeof(STATE_MAGIC)), STATE_MAGIC, sizeof(STATE_MAGIC)))
+			throw read_exception();
+		size_t block_bytes = size_t(take_u32()) * 32;
+		const unsigned char* blocks = take(block_bytes);
+		state.blocks.assign(blocks, blocks + block_bytes);
+		static const unsigned char no_header[32] = {};
+		const unsigned char* last_header = take(32);
+		if (memcmp(last_header, no_header, 32))
+			state.last_header.assign(last_header, last_header + 32);
+		if (take_u32() != COMPRESSOR_TYPES)
+			throw read_exception();
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			for (uint32_t j = take_u32(); j > 0; j--) {
+				uint32_t len = take_u32();
+				const unsigned char* tx = take(len);
+				state.txn[i].push_back(std::make_shared<std::vector<unsigned char> >(tx, tx + len));
+			}
+		}
+		for (uint32_t j = take_u32(); j > 0; j--) {
+			const unsigned char* hash = take(32);
+			state.waiting.emplace_back(hash, hash + 32);
+		}
+		if (memcmp(take(sizeof(STATE_MAGIC)), STATE_MAGIC, sizeof(STATE_MAGIC)) || pos != end)
+			throw read_exception();
+		ok = true;
+	} catch (const read_exception&) {
+		LOG("State file %s is corrupt, ignoring it\n", path.c_str());
+		state = WarmState();
+	}
+	munmap(map, st.st_size);
+	return ok;
+}
+
+
 class MempoolClient : public OutboundPersistentConnection {
 private:
 	std::function<void(std::vector<unsigned char>)> on_hash;
@@ -276,11 +486,20 @@ public:
 	void on_disconnect() {}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
+		// Hashes come in large batches, so read whatever is there and split it up ourselves
+		std::vector<unsigned char> buf(32 * 2048);
+		size_t have = 0;
 		while (true) {
-			std::vector<unsigned char> hash(32);
-			if (read_all((char*)&hash[0], 32, std::chrono::seconds(10)) != 32)
+			ssize_t res = read_some((char*)&buf[have], buf.size() - have, std::chrono::seconds(10));
+			if (res <= 0)
 				return disconnect("Failed to read next hash");
-			on_hash(hash);
+			have += res;
+
+			size_t pos = 0;
+			for (; pos + 32 <= have; pos += 32)
+				on_hash(std::vector<unsigned char>(buf.begin() + pos, buf.begin() + pos + 32));
+			memmove(&buf[0], &buf[pos], have - pos);
+			have -= pos;
 		}
 	}
 
@@ -296,17 +515,18 @@ public:
 
 int main(const int argc, const char** argv) {
 	if (argc < 6) {
-		printf("USAGE: %s trusted_bitcoind_host trusted_bitcoind_port mempool_host mempool_port \"Sponsor String\" (::ffff:whitelisted prefix string)*\n", argv[0]);
+		LOG("USAGE: %s trusted_bitcoind_host trusted_bitcoind_port mempool_host mempool_port \"Sponsor String\" (::ffff:whitelisted prefix string)*\n", argv[0]);
 		return -1;
 	}
 
 	HOST_SPONSOR = argv[5];
+	LOG("Using SHA256 implementation %s\n", sha256_implementation().c_str());
 
 	int listen_fd;
 	struct sockaddr_in6 addr;
 
 	if ((listen_fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
-		printf("Failed to create socket\n");
+		LOG("Failed to create socket\n");
 		return -1;
 	}
 
@@ -319,13 +539,95 @@ int main(const int argc, const char** argv) {
 	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ||
 			bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
 			listen(listen_fd, 3) < 0) {
-		printf("Failed to bind 8336: %s\n", strerror(errno));
+		LOG("Failed to bind 8336: %s\n", strerror(errno));
 		return -1;
 	}
 
+	// map_mutex only protects clientMap (ie connection churn). Block and transaction
+	// relay instead read clients, a copy-on-write snapshot of clientMap's values which
+	// is republished whenever clientMap changes.
+	// relay_mutex[i] orders every change to compressors[i] with the sending of the
+	// matching message to clients, and must be held while reading clients. Thus culled
+	// clients can be deleted once each relay_mutex has been taken after republishing.
 	std::mutex map_mutex;
 	std::map<std::string, RelayNetworkClient*> clientMap;
+	std::shared_ptr<const std::vector<RelayNetworkClient*> > clients = std::make_shared<std::vector<RelayNetworkClient*> >();
+	std::mutex relay_mutex[COMPRESSOR_TYPES];
 	P2PClient *trustedP2P, *trustedP2PRecv;
+	UDPBlockSender udp(8336);
+
+	const std::function<void (void)> publish_clients = [&]() { // Called with map_mutex
+		auto new_clients = std::make_shared<std::vector<RelayNetworkClient*> >();
+		for (const auto& client : clientMap)
+			new_clients->push_back(client.second);
+		std::atomic_store(&clients, std::shared_ptr<const std::vector<RelayNetworkClient*> >(new_clients));
+	};
+
+	const std::function<void (uint16_t, const std::shared_ptr<std::vector<unsigned char> >&)> send_block_to_clients =
+		[&](uint16_t compressor_type, const std::shared_ptr<std::vector<unsigned char> >& msg) { // Called with relay_mutex[compressor_type]
+			auto current_clients = std::atomic_load(&clients);
+			// Only encoded (once, for everyone) if someone wants it over UDP
+			std::shared_ptr<UDPBlockSender::Block> udp_block;
+			for (RelayNetworkClient* client : *current_clients) {
+				if (!client->getDisconnectFlags() && client->compressor_type == compressor_type) {
+					if (client->udp_ready()) {
+						if (!udp_block)
+							udp_block = udp.encode(msg);
+						client->receive_block(msg, udp_block);
+					} else
+						client->receive_block(msg, std::shared_ptr<UDPBlockSender::Block>());
+				}
+			}
+		};
+
+	// msgs and batches are the same transactions, as from RelayNodeCompressor::get_relay_transactions
+	const std::function<void (uint16_t, const std::shared_ptr<std::vector<unsigned char> >&, const std::shared_ptr<std::vector<unsigned char> >&)> send_txn_to_clients =
+		[&](uint16_t compressor_type, const std::shared_ptr<std::vector<unsigned char> >& msgs, const std::shared_ptr<std::vector<unsigned char> >& batches) { // Called with relay_mutex[compressor_type]
+			auto current_clients = std::atomic_load(&clients);
+			for (RelayNetworkClient* client : *current_clients)
+				if (!client->getDisconnectFlags() && client->compressor_type == compressor_type)
+					client->receive_transaction(client->tx_batches ? batches : msgs);
+		};
+
+	// Free-relayed transactions are coalesced for up to RELAY_TX_BATCH_MS (default 10, 0 to send
+	// each as it comes) or until RELAY_TX_BATCH_BYTES (default 65536) of them are waiting, so that
+	// each client gets them in one go. They only go into the compressors when they are flushed,
+	// which has to happen before any block is compressed (see do_relay).
+	std::mutex tx_batch_mutex;
+	std::condition_variable tx_batch_cv;
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > tx_batch;
+	size_t tx_batch_bytes = 0;
+	std::chrono::steady_clock::time_point tx_batch_start;
+	const char* env = getenv("RELAY_TX_BATCH_MS");
+	const unsigned long tx_batch_ms = env ? strtoul(env, NULL, 10) : 10;
+	env = getenv("RELAY_TX_BATCH_BYTES");
+	const size_t tx_batch_max_bytes = std::min(env ? strtoul(env, NULL, 10) : 65536ul, (unsigned long)MAX_TX_BATCH_BYTES);
+
+	const std::function<void (void)> flush_tx_batch = [&]() { // Called with tx_batch_mutex
+		if (tx_batch.empty())
+			return;
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			std::lock_guard<std::mutex> lock(relay_mutex[i]);
+			auto msgs = compressors[i].get_relay_transactions(tx_batch);
+			if (msgs.first)
+				send_txn_to_clients(i, msgs.first, msgs.second);
+		}
+		tx_batch.clear();
+		tx_batch_bytes = 0;
+	};
+
+	std::thread([&]() {
+		std::unique_lock<std::mutex> lock(tx_batch_mutex);
+		while (true) {
+			const auto flush_time = tx_batch_start + std::chrono::milliseconds(tx_batch_ms);
+			if (tx_batch.empty())
+				tx_batch_cv.wait(lock);
+			else if (std::chrono::steady_clock::now() < flush_time)
+				tx_batch_cv.wait_until(lock, flush_time);
+			else
+				flush_tx_batch();
+		}
+	}).detach();
 
 	// You'll notice in the below callbacks that we have to do some header adding/removing
 	// This is because the things are setup for the relay <-> p2p case (both to optimize
@@ -334,25 +636,66 @@ int main(const int argc, const char** argv) {
 	std::mutex txn_mutex;
 	vectormruset txnWaitingToBroadcast(MAX_FAS_TOTAL_SIZE);
 
-	const std::function<std::pair<const char*, size_t> (const std::vector<unsigned char>&, const std::vector<unsigned char>&, bool)> do_relay =
-		[&](const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& bytes, bool checkMerkle) {
-			std::lock_guard<std::mutex> lock(map_mutex);
-			size_t ret;
-			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
-				auto tuple = compressors[i].maybe_compress_block(fullhash, bytes, checkMerkle);
-				const char* insane = std::get<1>(tuple);
-				if (!insane) {
-					auto block = std::get<0>(tuple);
-					for (const auto& client : clientMap) {
-						if (!client.second->getDisconnectFlags() && client.second->compressor_type == i)
-							client.second->receive_block(block);
-					}
-					if (i == 0)
-						ret = block->size();
-				} else
-					return std::make_pair(insane, (size_t)0);
+	const char* state_path = getenv("RELAY_STATE_FILE");
+	std::mutex header_mutex;
+	std::vector<unsigned char> last_header;
+	if (state_path) {
+		WarmState state;
+		if (load_state(state_path, state)) {
+			for (size_t pos = 0; pos < state.blocks.size(); pos += 32) {
+				std::vector<unsigned char> hash(state.blocks.begin() + pos, state.blocks.begin() + pos + 32);
+				for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+					compressors[i].block_sent(hash);
+			}
+			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+				for (const auto& tx : state.txn[i])
+					compressors[i].get_relay_transaction(tx);
+			for (const auto& hash : state.waiting)
+				txnWaitingToBroadcast.insert(hash);
+			last_header = state.last_header;
+			LOG("Loaded %lu blocks, %lu sent txn and %lu waiting txn from %s\n", state.blocks.size() / 32, state.txn[0].size(), state.waiting.size(), state_path);
+		}
+	}
+
+	MetricHistogram* fanout_ns[COMPRESSOR_TYPES];
+	for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+		fanout_ns[i] = &metrics_histogram("relay_block_fanout_ns{compressor=\"" + std::to_string(i) + "\"}");
+
+	// Compresses for each compressor type in parallel, sending to each type's clients as
+	// soon as its compression is done. compress_ms gets the time each compressor took.
+	// Each compressor's block is compressed and sent by one of these, pinned after the
+	// compress_workers, which maybe_compress_block in turn splits big blocks across
+	WorkerPool relay_workers(COMPRESSOR_TYPES - 1, "RELAY_COMPRESS_CPUS", compress_workers().threads(), "relay");
+	const std::function<std::pair<const char*, size_t> (const std::vector<unsigned char>&, const std::vector<unsigned char>&, bool, double*)> do_relay =
+		[&](const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& bytes, bool checkMerkle, double* compress_ms) {
+			{
+				// So that the block is compressed against (and arrives after) everything before it
+				std::lock_guard<std::mutex> lock(tx_batch_mutex);
+				flush_tx_batch();
 			}
-			return std::make_pair((const char*)0, ret);
+
+			const char* insane[COMPRESSOR_TYPES];
+			size_t sizes[COMPRESSOR_TYPES];
+			const std::function<void (size_t)> compress_and_send = [&](size_t i) {
+				std::lock_guard<std::mutex> lock(relay_mutex[i]);
+				std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+				auto tuple = compressors[i].maybe_compress_block(fullhash, bytes, checkMerkle);
+				compress_ms[i] = to_millis_double(std::chrono::steady_clock::now() - start);
+				insane[i] = std::get<1>(tuple);
+				if (!insane[i]) {
+					sizes[i] = std::get<0>(tuple)->size();
+					std::chrono::steady_clock::time_point fanout_start(std::chrono::steady_clock::now());
+					send_block_to_clients(i, std::get<0>(tuple));
+					fanout_ns[i]->record_since(fanout_start);
+				}
+			};
+
+			relay_workers.run(COMPRESSOR_TYPES, compress_and_send);
+
+			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+				if (insane[i])
+					return std::make_pair(insane[i], (size_t)0);
+			return std::make_pair((const char*)0, sizes[0]);
 		};
 
 	trustedP2P = new P2PClient(argv[1], std::stoul(argv[2]),
@@ -371,12 +714,20 @@ int main(const int argc, const char** argv) {
 
 								std::vector<unsigned char> fullhash(32);
 								getblockhash(fullhash, headers, it - 81 - headers.begin());
-								compressors[0].block_sent(fullhash);
+								// Mark it on every compressor, as they now each decide independently whether to relay
+								for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+									compressors[i].block_sent(fullhash);
+
+								std::lock_guard<std::mutex> lock(header_mutex);
+								last_header = fullhash;
 							}
 
-							printf("Added headers from trusted peers, seen %u blocks\n", compressors[0].blocks_sent());
+							LOG("Added headers from trusted peers, seen %u blocks\n", compressors[0].blocks_sent());
 						} catch (read_exception) { }
-					}, false);
+					}, false, [&]() -> std::vector<unsigned char> {
+						std::lock_guard<std::mutex> lock(header_mutex);
+						return last_header;
+					});
 
 	trustedP2PRecv = new P2PClient(argv[1], std::stoul(argv[2]),
 					[&](std::vector<unsigned char>& bytes,  const std::chrono::system_clock::time_point& read_start) {
@@ -388,16 +739,20 @@ int main(const int argc, const char** argv) {
 						std::vector<unsigned char> fullhash(32);
 						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
 
-						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, false);
+						double compress_ms[COMPRESSOR_TYPES];
+						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, false, compress_ms);
 						if (relay_res.first) {
-							printf(HASH_FORMAT" INSANE %s TRUSTEDP2P\n", HASH_PRINT(&fullhash[0]), relay_res.first);
+							LOG(HASH_FORMAT" INSANE %s TRUSTEDP2P\n", HASH_PRINT(&fullhash[0]), relay_res.first);
 							return;
 						}
 
 						std::chrono::system_clock::time_point send_end(std::chrono::system_clock::now());
-						printf(HASH_FORMAT" BLOCK %lu %s TRUSTEDP2P %lu / %lu / %lu TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]), epoch_millis_lu(send_start), argv[1],
+						std::string compress_times;
+						for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+							compress_times += " " + std::to_string(compress_ms[i]);
+						LOG(HASH_FORMAT" BLOCK %lu %s TRUSTEDP2P %lu / %lu / %lu TIMES: %lf %lf COMPRESSORS:%s\n", HASH_PRINT(&fullhash[0]), epoch_millis_lu(send_start), argv[1],
 														bytes.size(), relay_res.second, bytes.size(),
-														to_millis_double(send_start - read_start), to_millis_double(send_end - send_start));
+														to_millis_double(send_start - read_start), to_millis_double(send_end - send_start), compress_times.c_str());
 					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 						std::vector<unsigned char> hash(32);
@@ -407,22 +762,21 @@ int main(const int argc, const char** argv) {
 							if (txnWaitingToBroadcast.find(hash) == txnWaitingToBroadcast.end())
 								return;
 						}
-						std::lock_guard<std::mutex> lock(map_mutex);
-						for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
-							auto tx = compressors[i].get_relay_transaction(bytes);
-							if (tx.use_count()) {
-								for (const auto& client : clientMap) {
-									if (!client.second->getDisconnectFlags() && client.second->compressor_type == i)
-										client.second->receive_transaction(tx);
-								}
-							}
+						std::lock_guard<std::mutex> lock(tx_batch_mutex);
+						if (tx_batch.empty()) {
+							tx_batch_start = std::chrono::steady_clock::now();
+							tx_batch_cv.notify_all();
 						}
+						tx_batch.push_back(bytes);
+						tx_batch_bytes += bytes->size();
+						if (tx_batch_bytes >= tx_batch_max_bytes || !tx_batch_ms)
+							flush_tx_batch();
 					},
 					[&](std::vector<unsigned char>& headers) { }, false);
 
 	MempoolClient mempoolClient(argv[3], std::stoul(argv[4]),
 					[&](std::vector<unsigned char> txn) {
-						std::lock_guard<std::mutex> lock(map_mutex);
+						std::lock_guard<std::mutex> lock(relay_mutex[0]);
 						if (!compressors[0].was_tx_sent(&txn[0])) {
 							std::lock_guard<std::mutex> lock(txn_mutex);
 							txnWaitingToBroadcast.insert(txn);
@@ -435,7 +789,7 @@ int main(const int argc, const char** argv) {
 			if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
 				return (size_t)0;
 
-			trustedP2P->receive_block(*bytes);
+			trustedP2P->receive_block(*bytes, true);
 
 			return bytes->size();
 		};
@@ -454,21 +808,59 @@ int main(const int argc, const char** argv) {
 	std::thread([&](void) {
 		while (true) {
 			std::this_thread::sleep_for(std::chrono::seconds(10)); // Implicit new-connection rate-limit
+			std::vector<RelayNetworkClient*> culled;
 			{
 				std::lock_guard<std::mutex> lock(map_mutex);
 				for (auto it = clientMap.begin(); it != clientMap.end();) {
 					if (it->second->getDisconnectFlags() & DISCONNECT_COMPLETE) {
-						fprintf(stderr, "%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
-						delete it->second;
+						LOG_STDERR("%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
+						culled.push_back(it->second);
 						clientMap.erase(it++);
 					} else
 						it++;
 				}
+				if (!culled.empty())
+					publish_clients();
+			}
+			if (!culled.empty()) {
+				// Wait out anyone still relaying to the old snapshot
+				for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+					relay_mutex[i].lock();
+					relay_mutex[i].unlock();
+				}
+				for (RelayNetworkClient* client : culled)
+					delete client;
 			}
 			mempoolClient.keep_alive_ping();
 		}
 	}).detach();
 
+	if (state_path) {
+		std::thread([&](void) {
+			while (true) {
+				std::this_thread::sleep_for(std::chrono::seconds(STATE_SAVE_SECS));
+				WarmState state;
+				{
+					// Taken first, so every block up to here is in blocks
+					std::lock_guard<std::mutex> lock(header_mutex);
+					state.last_header = last_header;
+				}
+				compressors[0].for_each_sent_block([&](const unsigned char* hash) {
+					state.blocks.insert(state.blocks.end(), hash, hash + 32);
+				});
+				for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+					compressors[i].for_each_sent_tx([&](const std::shared_ptr<std::vector<unsigned char> >& tx) {
+						state.txn[i].push_back(tx);
+					});
+				{
+					std::lock_guard<std::mutex> lock(txn_mutex);
+					state.waiting.assign(txnWaitingToBroadcast.begin(), txnWaitingToBroadcast.end());
+				}
+				save_state(state_path, state);
+			}
+		}).detach();
+	}
+
 	std::string droppostfix(".uptimerobot.com");
 	std::vector<std::string> whitelistprefix;
 	for (int i = 6; i < argc; i++)
@@ -477,7 +869,7 @@ int main(const int argc, const char** argv) {
 	while (true) {
 		int new_fd;
 		if ((new_fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_size)) < 0) {
-			printf("Failed to select (%d: %s)\n", new_fd, strerror(errno));
+			LOG("Failed to select (%d: %s)\n", new_fd, strerror(errno));
 			return -1;
 		}
 
@@ -495,7 +887,7 @@ int main(const int argc, const char** argv) {
 				const auto& client = clientMap[host];
 				if (client->lastDupConnect < (time(NULL) - 60)) {
 					client->lastDupConnect = time(NULL);
-					fprintf(stderr, "%lld: Got duplicate connection from %s (original's disconnect status: %d)\n", (long long) time(NULL), host.c_str(), client->getDisconnectFlags());
+					LOG_STDERR("%lld: Got duplicate connection from %s (original's disconnect status: %d)\n", (long long) time(NULL), host.c_str(), client->getDisconnectFlags());
 				}
 			}
 			close(new_fd);
@@ -503,8 +895,9 @@ int main(const int argc, const char** argv) {
 			if (whitelist)
 				host += ":" + std::to_string(addr.sin6_port);
 			assert(clientMap.count(host) == 0);
-			clientMap[host] = new RelayNetworkClient(new_fd, host, relayBlock, relayTx, connected);
-			fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
+			clientMap[host] = new RelayNetworkClient(new_fd, host, relayBlock, relayTx, connected, &udp);
+			publish_clients();
+			LOG_STDERR("%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
 		}
 	}
 }
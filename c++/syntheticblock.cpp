@@ -0,0 +1,87 @@
+#include "syntheticblock.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <random>
+
+#include <math.h>
+#include <string.h>
+
+static void push_le32(std::vector<unsigned char>& v, uint32_t n) {
+	for (int i = 0; i < 4; i++)
+		v.push_back(n >> (8 * i));
+}
+
+static void push_random(std::vector<unsigned char>& v, size_t len, std::mt19937_64& rand) {
+	for (size_t i = 0; i < len; i++)
+		v.push_back(rand());
+}
+
+// A one-input, two-output transaction of exactly size bytes (if size >= 119), with the
+// input script taking up the slack
+static void append_tx(std::vector<unsigned char>& block, uint32_t size, std::mt19937_64& rand) {
+	const uint32_t fixed = 4 + 1 + 36 + 4 + 1 + 2 * (8 + 1 + 25) + 4;
+	uint32_t script_len = size > fixed + 1 ? size - fixed - 1 : 0;
+	std::vector<unsigned char> script_varint = varint(script_len);
+	while (script_len && fixed + script_varint.size() + script_len > size)
+		script_varint = varint(--script_len);
+
+	push_le32(block, 1);
+	block.push_back(1);
+	push_random(block, 36, rand);
+	block.insert(block.end(), script_varint.begin(), script_varint.end());
+	push_random(block, script_len, rand);
+	push_le32(block, 0xffffffff);
+	block.push_back(2);
+	for (int i = 0; i < 2; i++) {
+		push_random(block, 8, rand);
+		block.push_back(25);
+		push_random(block, 25, rand);
+	}
+	push_le32(block, 0);
+}
+
+SyntheticBlock generate_block(const SyntheticBlockParams& params) {
+	SyntheticBlock res;
+	std::mt19937_64 rand(params.seed);
+	std::lognormal_distribution<double> size_dist(log(double(params.tx_size)), params.tx_size_sigma);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+	std::vector<unsigned char>& block = res.block;
+	block.resize(sizeof(struct bitcoin_msg_header));
+	push_le32(block, 4);
+	push_random(block, 32, rand);
+	block.resize(block.size() + 32); // Merkle root, filled in below
+	push_le32(block, 1450000000);
+	push_le32(block, 0x1d00ffff);
+	push_le32(block, rand());
+	std::vector<unsigned char> count = varint(params.tx_count);
+	block.insert(block.end(), count.begin(), count.end());
+
+	for (uint32_t i = 0; i < params.tx_count; i++) {
+		double size = i ? size_dist(rand) : 200; // The coinbase
+		size = std::max(double(params.tx_size_min), std::min(double(params.tx_size_max), size));
+		size_t start = block.size();
+		append_tx(block, size, rand);
+		res.txn.emplace_back(start, block.size() - start);
+		if (i && unit(rand) < params.prerelay)
+			res.prerelayed.push_back(std::make_shared<std::vector<unsigned char> >(block.begin() + start, block.end()));
+	}
+	std::shuffle(res.prerelayed.begin(), res.prerelayed.end(), rand);
+
+	std::vector<unsigned char> hashes(32 * (params.tx_count + 1));
+	for (uint32_t i = 0; i < params.tx_count; i++)
+		double_sha256(&block[res.txn[i].first], &hashes[32 * i], res.txn[i].second);
+	for (uint32_t row = params.tx_count; row > 1; row = (row + 1) / 2) {
+		if (row & 1)
+			memcpy(&hashes[32 * row], &hashes[32 * (row - 1)], 32);
+		for (uint32_t i = 0; i < (row + 1) / 2; i++)
+			double_sha256_two_32_inputs(&hashes[64 * i], &hashes[64 * i + 32], &hashes[32 * i]);
+	}
+	memcpy(&block[sizeof(struct bitcoin_msg_header) + 4 + 32], &hashes[0], 32);
+
+	res.hash.resize(32);
+	getblockhash(res.hash, block, sizeof(struct bitcoin_msg_header));
+	memset(&res.hash[25], 0, 7);
+	return res;
+}
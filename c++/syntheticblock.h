@@ -0,0 +1,40 @@
+#ifndef _RELAY_SYNTHETICBLOCK_H
+#define _RELAY_SYNTHETICBLOCK_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Randomly generated (but otherwise well-formed) blocks for the benchmarks, with a
+// configurable transaction count, size distribution and share relayed ahead of time
+
+struct SyntheticBlockParams {
+	uint32_t tx_count;
+	// Transaction sizes are log-normal around tx_size, clamped to [tx_size_min, tx_size_max]
+	uint32_t tx_size, tx_size_min, tx_size_max;
+	double tx_size_sigma;
+	// Fraction of transactions which are relayed before the block (in shuffled order)
+	double prerelay;
+	uint64_t seed;
+
+	std::string json() const {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "{\"tx_count\": %u, \"tx_size\": %u, \"tx_size_sigma\": %.2f, \"prerelay\": %.2f, \"seed\": %lu}",
+				tx_count, tx_size, tx_size_sigma, prerelay, (unsigned long)seed);
+		return buf;
+	}
+};
+
+struct SyntheticBlock {
+	std::vector<unsigned char> block; // With a (zeroed) bitcoin_msg_header in front, as P2PClient provides
+	std::vector<unsigned char> hash; // Real hash with the proof-of-work bytes zeroed, so it passes maybe_compress_block's check
+	std::vector<std::pair<size_t, size_t> > txn; // (offset, length) of each transaction in block
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > prerelayed;
+};
+
+SyntheticBlock generate_block(const SyntheticBlockParams& params);
+
+#endif
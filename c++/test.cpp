@@ -2,9 +2,13 @@
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
 #include "relayprocess.h"
+#include "fec.h"
+#include "connection.h"
 
 #include <stdio.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <algorithm>
 #include <random>
 #include <string.h>
@@ -59,7 +63,7 @@ void fill_txv(std::vector<unsigned char>& block, std::vector<std::shared_ptr<std
 int pipefd[2];
 uint32_t block_tx_count;
 
-RelayNodeCompressor global_sender(false), global_receiver(false);
+RelayNodeCompressor global_sender(false), global_receiver(false), global_delta_sender(false, true), global_delta_receiver(false, true);
 std::set<std::vector<unsigned char> > globalSeenSet;
 
 static unsigned int compress_runs = 0, decompress_runs = 0;
@@ -71,13 +75,13 @@ std::shared_ptr<std::vector<unsigned char> > __attribute__((noinline)) recv_bloc
 	size_t readpos = sizeof(struct relay_msg_header);
 
 	auto start = std::chrono::steady_clock::now();
-	std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) {
-		memcpy(buf, &(*data)[readpos], count);
-		readpos += count;
-		assert(readpos <= data->size());
-		return count;
-	};
-	auto res = receiver->decompress_relay_block(do_read, block_tx_count, true);
+	BufferedReader reader([&](size_t min_bytes, size_t& avail) {
+			assert(readpos + min_bytes <= data->size());
+			avail = data->size() - readpos;
+			return &(*data)[readpos];
+		}, [&](size_t nbyte) { readpos += nbyte; });
+	auto res = receiver->decompress_relay_block(reader, block_tx_count, true);
+	reader.release();
 	auto decompressed = std::chrono::steady_clock::now();
 	if (time) {
 		total_decompress_time += decompressed - start; decompress_runs++;
@@ -88,9 +92,23 @@ std::shared_ptr<std::vector<unsigned char> > __attribute__((noinline)) recv_bloc
 	if (std::get<2>(res)) {
 		printf("ERROR Decompressing block %s\n", std::get<2>(res));
 		exit(2);
+	} else if (readpos != data->size()) {
+		printf("Decompressing block did not consume the whole message\n");
+		exit(2);
 	} else if (time)
 		PRINT_TIME("Decompressed block in %lf ms\n", to_millis_double(decompressed - start));
-	return std::get<1>(res);
+
+	// The block comes back as a complete p2p message, check its header then hand back
+	// the old zero-header form for comparison against the test data
+	std::shared_ptr<std::vector<unsigned char> > block = std::get<1>(res);
+	std::vector<unsigned char> expected_header(block->begin(), block->end());
+	prepare_message("block", &expected_header[0], block->size() - sizeof(struct bitcoin_msg_header));
+	if (memcmp(&expected_header[0], &(*block)[0], sizeof(struct bitcoin_msg_header))) {
+		printf("Decompressed block had a bad message header\n");
+		exit(3);
+	}
+	memset(&(*block)[0], 0, sizeof(struct bitcoin_msg_header));
+	return block;
 }
 
 std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> __attribute__((noinline)) do_compress_test(RelayNodeCompressor& sender, const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& data, uint32_t tx_count) {
@@ -105,19 +123,109 @@ std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> __attribut
 	return res;
 }
 
+void check_sent_tx_snapshot(RelayNodeCompressor& compressor) {
+	std::vector<unsigned char> expected, snapshot;
+	compressor.for_each_sent_tx([&](const std::shared_ptr<std::vector<unsigned char> >& tx) {
+		auto msg = compressor.tx_to_msg(tx);
+		expected.insert(expected.end(), msg->begin(), msg->end());
+	});
+	for (const auto& chunk : compressor.sent_tx_snapshot())
+		snapshot.insert(snapshot.end(), chunk->begin(), chunk->end());
+	if (snapshot != expected) {
+		printf("sent_tx_snapshot did not match for_each_sent_tx\n");
+		exit(11);
+	}
+}
+
+// Rebuilds msg from its FEC chunks after dropping drop_percent of them, with repair chunks
+// (taken from the top of the index range down, to make sure any will do) making up the rest
+void test_fec(const std::vector<unsigned char>& msg, unsigned drop_percent) {
+	FECEncoder encoder(&msg[0], msg.size());
+	FECDecoder decoder(msg.size());
+	const FECLayout& layout = encoder.get_layout();
+	unsigned char chunk[FEC_CHUNK_SIZE];
+
+	for (size_t group = 0; group < layout.groups; group++) {
+		for (size_t i = 0; i < layout.group_chunks(group); i++) {
+			if (engine() % 100 < drop_percent)
+				continue;
+			encoder.chunk(group, i, chunk);
+			if (!decoder.provide(group, i, chunk)) {
+				printf("FEC decoder refused a new data chunk\n");
+				exit(12);
+			}
+		}
+		for (size_t index = FEC_MAX_CHUNK_INDEX; decoder.needed(group); index--) {
+			encoder.chunk(group, index, chunk);
+			decoder.provide(group, index, chunk);
+		}
+		encoder.chunk(group, 0, chunk);
+		if (decoder.provide(group, 0, chunk)) {
+			printf("FEC decoder took a chunk for a finished group\n");
+			exit(12);
+		}
+	}
+
+	std::vector<unsigned char> res;
+	if (!decoder.done() || (decoder.take(res), res != msg)) {
+		printf("FEC re-constructed message did not match!\n");
+		exit(12);
+	}
+}
+
+// Feeds what get_relay_transactions returned for TRANSACTIONS peers to receiver
+void recv_tx_batches(const std::vector<unsigned char>& msgs, RelayNodeCompressor& receiver) {
+	size_t readpos = 0;
+	while (readpos < msgs.size()) {
+		struct relay_msg_header header;
+		memcpy(&header, &msgs[readpos], sizeof(header));
+		readpos += sizeof(header);
+		const size_t end = readpos + ntohl(header.length);
+		if (header.type != htonl(12) || ntohl(header.length) > MAX_TX_BATCH_BYTES || end > msgs.size()) {
+			printf("get_relay_transactions built a bad TRANSACTIONS message\n");
+			exit(13);
+		}
+
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		BufferedReader reader([&](size_t min_bytes, size_t& avail) {
+				assert(readpos + min_bytes <= msgs.size());
+				avail = msgs.size() - readpos;
+				return &msgs[readpos];
+			}, [&](size_t nbyte) { readpos += nbyte; });
+		const char* error = receiver.recv_tx_batch(reader, ntohl(header.length), txn);
+		reader.release();
+		if (error || readpos != end) {
+			printf("Failed to receive transaction batch: %s\n", error ? error : "wrong length");
+			exit(13);
+		}
+	}
+}
+
 void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shared_ptr<std::vector<unsigned char> > > txVectors) {
 	std::vector<unsigned char> fullhash(32);
 	getblockhash(fullhash, data, sizeof(struct bitcoin_msg_header));
 
 	RelayNodeCompressor sender(false), tester(false), tester2(false), receiver(false);
+	RelayNodeCompressor delta_sender(false, true), delta_receiver(false, true);
+	RelayNodeCompressor batch_sender(false, true), batch_receiver(false, true);
+	std::vector<unsigned char> delta_msgs;
 
 	for (auto v : txVectors) {
 		unsigned int made = sender.get_relay_transaction(v).use_count();
 #ifndef PRECISE_BENCH
-		v = std::make_shared<std::vector<unsigned char> >(*v); // Copy the vector to give the deduper something to do
+		v = std::make_shared<std::vector<unsigned char> >(*v); // Copy the vector so the TxStore has to match it by txid
 #endif
 		if (made)
 			receiver.recv_tx(v);
+		if (made != delta_sender.get_relay_transaction(v).use_count()) {
+			printf("get_relay_transaction behavior not consistent???\n");
+			exit(5);
+		}
+		if (made) {
+			delta_receiver.recv_tx(v);
+			auto msg = delta_sender.tx_to_msg(v);
+			delta_msgs.insert(delta_msgs.end(), msg->begin(), msg->end());
+		}
 #ifndef PRECISE_BENCH
 		v = std::make_shared<std::vector<unsigned char> >(*v);
 #endif
@@ -134,8 +242,35 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 #endif
 		if (made)
 			global_receiver.recv_tx(v);
+		if (global_delta_sender.get_relay_transaction(v).use_count())
+			global_delta_receiver.recv_tx(v);
 	}
 
+	// The same transactions in batches of a few at a time and then all at once, which mostly
+	// repeats the first ones, must leave batch_receiver exactly in sync with batch_sender
+	std::vector<unsigned char> batch_single_msgs, batch_msgs;
+	for (size_t pos = 0; pos < txVectors.size(); ) {
+		size_t count = std::min(txVectors.size() - pos, size_t(1 + pos % 7));
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn(txVectors.begin() + pos, txVectors.begin() + pos + count);
+		pos += count;
+		if (pos == txVectors.size())
+			txn = txVectors;
+		auto msgs = batch_sender.get_relay_transactions(txn);
+		if (!msgs.first != !msgs.second) {
+			printf("get_relay_transactions returned only one of its messages\n");
+			exit(13);
+		}
+		if (msgs.first) {
+			batch_single_msgs.insert(batch_single_msgs.end(), msgs.first->begin(), msgs.first->end());
+			batch_msgs.insert(batch_msgs.end(), msgs.second->begin(), msgs.second->end());
+		}
+	}
+	if (batch_single_msgs != delta_msgs) {
+		printf("get_relay_transactions behavior not consistent with get_relay_transaction\n");
+		exit(13);
+	}
+	recv_tx_batches(batch_msgs, batch_receiver);
+
 	unsigned int i = 0;
 	sender.for_each_sent_tx([&](std::shared_ptr<std::vector<unsigned char> > tx) {
 		if (*tx != *txVectors[i]) {
@@ -150,12 +285,12 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 	});
 
 	auto res = do_compress_test(sender, fullhash, data, txVectors.size());
+	check_sent_tx_snapshot(sender);
 
 	if (std::get<1>(res)) {
 		printf("Failed to compress block %s\n", std::get<1>(res));
 		exit(8);
 	}
-	std::this_thread::sleep_for(std::chrono::milliseconds(10)); // Let the deduper thread run...
 	if (*std::get<0>(tester2.maybe_compress_block(fullhash, data, true)) != *std::get<0>(res)) {
 		printf("maybe_compress_block not consistent???\n");
 		exit(9);
@@ -166,24 +301,230 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 	block_tx_count = ntohl(header.length);
 
 	auto decompressed_block = recv_block(std::get<0>(res), &receiver, true);
+	test_fec(*std::get<0>(res), 30);
 
 	if (*decompressed_block != data) {
 		printf("Re-constructed block did not match!\n");
 		exit(4);
 	}
 
+	auto delta_res = delta_sender.maybe_compress_block(fullhash, data, true);
+	if (std::get<1>(delta_res)) {
+		printf("Failed to compress block with delta indexes %s\n", std::get<1>(delta_res));
+		exit(8);
+	}
+	PRINT_TIME("Delta index coding compressed to %lu\n", std::get<0>(delta_res)->size());
+	if (std::get<0>(delta_res)->size() > std::get<0>(res)->size()) {
+		printf("Delta index coding was larger than fixed indexes\n");
+		exit(10);
+	}
+	if (*recv_block(std::get<0>(delta_res), &delta_receiver, false) != data) {
+		printf("Delta index re-constructed block did not match!\n");
+		exit(4);
+	}
+
+	auto batch_res = batch_sender.maybe_compress_block(fullhash, data, true);
+	if (std::get<1>(batch_res) || *std::get<0>(batch_res) != *std::get<0>(delta_res)) {
+		printf("Block compressed after batched transactions did not match\n");
+		exit(13);
+	}
+	if (*recv_block(std::get<0>(batch_res), &batch_receiver, false) != data) {
+		printf("Block re-constructed after batched transactions did not match!\n");
+		exit(4);
+	}
+
 	if (globalSeenSet.insert(fullhash).second) {
 		res = global_sender.maybe_compress_block(fullhash, data, true);
 		if (std::get<1>(res)) {
 			printf("Failed to compress block globally %s\n", std::get<1>(res));
 			exit(8);
 		}
+		check_sent_tx_snapshot(global_sender);
 		decompressed_block = recv_block(std::get<0>(res), &global_receiver, false);
 
 		if (*decompressed_block != data) {
 			printf("Global re-constructed block did not match!\n");
 			exit(4);
 		}
+
+		res = global_delta_sender.maybe_compress_block(fullhash, data, true);
+		if (std::get<1>(res)) {
+			printf("Failed to compress block globally with delta indexes %s\n", std::get<1>(res));
+			exit(8);
+		}
+		if (*recv_block(std::get<0>(res), &global_delta_receiver, false) != data) {
+			printf("Global delta index re-constructed block did not match!\n");
+			exit(4);
+		}
+	}
+}
+
+// Queues whatever it is given, as a server does for a client
+class QueueingConnection : public Connection {
+public:
+	QueueingConnection(int sock) : Connection(sock, "BLOCK_SEQ test", NULL) { construction_done(); }
+	void send(const std::shared_ptr<std::vector<unsigned char> >& msg, OutboundClass cls) { do_send_bytes(msg, 0, cls); }
+
+private:
+	void net_process(const std::function<void(std::string)>& disconnect) {
+		char byte;
+		read_all(&byte, 1);
+		disconnect("test done");
+	}
+};
+
+// A BLOCK_SEQ queued in OUTBOUND_BLOCK behind a send cache replay in OUTBOUND_BULK has to come
+// out ahead of some of the replay, and still decompress once BlockSequencer puts it back after
+void test_block_seq(std::vector<unsigned char>& data, const std::vector<std::shared_ptr<std::vector<unsigned char> > >& txVectors) {
+	std::vector<unsigned char> fullhash(32);
+	getblockhash(fullhash, data, sizeof(struct bitcoin_msg_header));
+
+	RelayNodeCompressor sender(false, true), receiver(false, true);
+	for (const auto& tx : txVectors)
+		sender.get_relay_transaction(tx);
+	auto replay = sender.sent_tx_snapshot();
+	uint64_t replay_msgs = 0;
+	for (const auto& chunk : replay)
+		for (size_t pos = 0; pos < chunk->size(); replay_msgs++)
+			pos += sizeof(struct relay_msg_header) + ntohl(((struct relay_msg_header*)&(*chunk)[pos])->length);
+
+	auto res = sender.maybe_compress_block(fullhash, data, true);
+	if (std::get<1>(res)) {
+		printf("Failed to compress block for BLOCK_SEQ %s\n", std::get<1>(res));
+		exit(14);
+	}
+	const std::vector<unsigned char>& block = *std::get<0>(res);
+	auto seq_msg = std::make_shared<std::vector<unsigned char> >(sizeof(struct relay_msg_header) + 8);
+	struct relay_msg_header header = { RELAY_MAGIC_BYTES, htonl(13), htonl(8 + block.size()) };
+	uint64_t seq = htole64(replay_msgs);
+	memcpy(&(*seq_msg)[0], &header, sizeof(header));
+	memcpy(&(*seq_msg)[sizeof(header)], &seq, 8);
+	seq_msg->insert(seq_msg->end(), block.begin(), block.end());
+
+	// Small socket buffers, which are never read until everything is queued, leave nearly all
+	// of the replay waiting in the connection when the block comes in
+	int fds[2], listen_fd = socket(AF_INET, SOCK_STREAM, 0), bufsize = 16384;
+	fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listen_fd < 0 || fds[1] < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 1) ||
+			getsockname(listen_fd, (struct sockaddr*)&addr, &addrlen) || setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) ||
+			connect(fds[1], (struct sockaddr*)&addr, sizeof(addr)) || (fds[0] = accept(listen_fd, NULL, NULL)) < 0 ||
+			setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize))) {
+		printf("Failed to create BLOCK_SEQ test sockets\n");
+		exit(14);
+	}
+	close(listen_fd);
+	QueueingConnection* conn = new QueueingConnection(fds[0]);
+	for (const auto& chunk : replay)
+		conn->send(chunk, OUTBOUND_BULK);
+	conn->send(seq_msg, OUTBOUND_BLOCK);
+
+	BlockSequencer sequencer;
+	uint64_t txn_seen = 0, txn_before_block = uint64_t(-1);
+	bool block_done = false;
+	bool no_stall = false;
+	const BlockSequencer::apply_func apply = [&](const std::vector<unsigned char>& msg, bool& stalled) {
+		struct relay_msg_header msg_header;
+		memcpy(&msg_header, &msg[0], sizeof(msg_header));
+		if (msg_header.type == htonl(1)) {
+			block_tx_count = ntohl(msg_header.length);
+			auto block_msg = std::make_shared<std::vector<unsigned char> >(msg);
+			if (*recv_block(block_msg, &receiver, false) != data) {
+				printf("Block re-constructed after BLOCK_SEQ did not match!\n");
+				exit(14);
+			}
+			block_done = true;
+		} else
+			receiver.recv_tx(std::make_shared<std::vector<unsigned char> >(msg.begin() + sizeof(msg_header), msg.end()));
+		return (const char*)NULL;
+	};
+
+	std::vector<unsigned char> stream;
+	size_t readpos = 0;
+	while (!block_done) {
+		unsigned char buf[65536];
+		ssize_t count = read(fds[1], buf, sizeof(buf));
+		if (count <= 0) {
+			printf("BLOCK_SEQ test connection closed early\n");
+			exit(14);
+		}
+		stream.insert(stream.end(), buf, buf + count);
+
+		while (stream.size() - readpos >= sizeof(header)) {
+			memcpy(&header, &stream[readpos], sizeof(header));
+			// Only BLOCKs' lengths are not their size, and they only come in BLOCK_SEQs
+			size_t msg_end = readpos + sizeof(header) + ntohl(header.length);
+			if (msg_end > stream.size())
+				break;
+			const char* error;
+			if (header.type == htonl(13)) {
+				memcpy(&seq, &stream[readpos + sizeof(header)], 8);
+				std::vector<unsigned char> msg(stream.begin() + readpos + sizeof(header) + 8, stream.begin() + msg_end);
+				txn_before_block = txn_seen;
+				if (sequencer.can_apply_block(le64toh(seq)))
+					error = apply(msg, no_stall);
+				else
+					error = sequencer.hold_block(le64toh(seq), std::move(msg));
+			} else {
+				std::vector<unsigned char> msg(stream.begin() + readpos, stream.begin() + msg_end);
+				txn_seen++;
+				if (sequencer.can_apply_tx()) {
+					error = apply(msg, no_stall);
+					sequencer.tx_applied();
+					if (!error)
+						error = sequencer.drain(apply);
+				} else {
+					sequencer.hold_tx(std::move(msg));
+					error = NULL;
+				}
+			}
+			if (error) {
+				printf("BlockSequencer failed: %s\n", error);
+				exit(14);
+			}
+			readpos = msg_end;
+		}
+	}
+
+	if (txn_seen != replay_msgs || txn_before_block >= replay_msgs) {
+		printf("BLOCK_SEQ did not overtake the replay (came after %lu of %lu transactions)\n", (unsigned long)txn_before_block, (unsigned long)replay_msgs);
+		exit(14);
+	}
+
+	close(fds[1]);
+	while (!(conn->getDisconnectFlags() & DISCONNECT_COMPLETE))
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	delete conn;
+
+	// A block which stalls (ie a UDP_BLOCK which never came) holds up everything behind it
+	// until it is resumed with the block (from UDP_RESEND)
+	std::string order;
+	const BlockSequencer::apply_func record = [&](const std::vector<unsigned char>& msg, bool& stalled) {
+		if (msg[0] == 'U')
+			stalled = true;
+		else
+			order += msg[0];
+		return (const char*)NULL;
+	};
+	BlockSequencer stall_sequencer;
+	stall_sequencer.hold_block(1, std::vector<unsigned char>(1, 'U'));
+	record(std::vector<unsigned char>(1, 'a'), no_stall);
+	stall_sequencer.tx_applied();
+	stall_sequencer.drain(record);
+	if (!stall_sequencer.stalled() || stall_sequencer.can_apply_tx() || stall_sequencer.hold_block(1, std::vector<unsigned char>(1, 'C'))) {
+		printf("BlockSequencer did not stall\n");
+		exit(14);
+	}
+	stall_sequencer.hold_tx(std::vector<unsigned char>(1, 'b'));
+	stall_sequencer.hold_tx(std::vector<unsigned char>(1, 'c'));
+	if (stall_sequencer.hold_block(1, std::vector<unsigned char>(1, 'D')) == NULL || order != "a" ||
+			stall_sequencer.resume(std::vector<unsigned char>(1, 'B'), record) || order != "aBCbc" || stall_sequencer.stalled()) {
+		printf("BlockSequencer applied %s around a stalled block\n", order.c_str());
+		exit(14);
 	}
 }
 
@@ -203,7 +544,13 @@ void run_test(std::vector<unsigned char>& data) {
 	test_compress_block(data, txVectors);
 }
 
-int main() {
+int run_benchmarks(int argc, const char** argv);
+
+int main(int argc, const char** argv) {
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return run_benchmarks(argc, argv);
+
+	printf("Using SHA256 implementation %s\n", sha256_implementation().c_str());
 	std::vector<unsigned char> data(sizeof(struct bitcoin_msg_header));
 	std::vector<unsigned char> lastBlock;
 
@@ -220,6 +567,8 @@ int main() {
 				for (int i = 0; i < 100; i++)
 #endif
 					run_test(data);
+				test_fec(data, 0);
+				test_fec(data, 100);
 				fill_txv(data, allTxn, 0.9);
 				lastBlock = data;
 			}
@@ -239,6 +588,7 @@ int main() {
 	for (int i = 0; i < 100; i++)
 #endif
 		test_compress_block(lastBlock, allTxn);
+	test_block_seq(lastBlock, allTxn);
 
 	printf("Total time spent compressing %u blocks: %lf ms (avg %lf, min %lf, max %lf)\n", compress_runs, to_millis_double(total_compress_time), to_millis_double(total_compress_time / compress_runs), to_millis_double(min_compress_time), to_millis_double(max_compress_time));
 	printf("Total time spent decompressing %u blocks: %lf ms (avg %lf, min %lf, max %lf)\n", decompress_runs, to_millis_double(total_decompress_time), to_millis_double(total_decompress_time / decompress_runs), to_millis_double(min_decompress_time), to_millis_double(max_decompress_time));
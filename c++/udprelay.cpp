@@ -0,0 +1,537 @@
+#include "udprelay.h"
+#include "utils.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <thread>
+#include <random>
+#include <algorithm>
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef WIN32
+	#include <sys/socket.h>
+	#include <sys/time.h>
+#endif
+
+/*************************
+ **** Packet encoding ****
+ *************************/
+// Every packet starts with a header of
+//   magic (4, LE), type (1), chunk index (1), group (2, LE), id (8, LE), length (4, LE)
+// HELLO:  id is the token
+// CHUNK:  id is the block id, length the message's length, followed by FEC_CHUNK_SIZE bytes
+// NACK:   id is the token, length the group count, followed by the block id (8, LE) and how
+//         many more chunks each group needs (1 byte each)
+#define UDP_MAGIC 0xF2BEEF43
+#define UDP_HEADER_SIZE 20
+#define UDP_CHUNK_PACKET_SIZE (UDP_HEADER_SIZE + FEC_CHUNK_SIZE)
+#define UDP_MAX_PACKET_SIZE 1500
+
+enum UDPPacketType {
+	UDP_HELLO = 1,
+	UDP_CHUNK = 2,
+	UDP_NACK = 3,
+};
+
+// Largest relay message we'll rebuild, as in net_process
+#define UDP_MAX_MESSAGE_SIZE (1000000 + sizeof(struct relay_msg_header))
+
+// Peers who haven't said hello for this long go back to getting blocks over TCP
+#define UDP_PEER_TIMEOUT_SECS 60
+// Clients say hello every UDP_HELLO_FAST_SECS for the first UDP_HELLO_FAST_COUNT times, then every UDP_HELLO_SECS
+#define UDP_HELLO_FAST_SECS 1
+#define UDP_HELLO_FAST_COUNT 10
+#define UDP_HELLO_SECS 15
+// How long a client waits on a block before asking for more chunks, and between asks after that
+#define UDP_FIRST_NACK_MS 50
+#define UDP_NACK_MS 200
+// Most chunks NACKs can get us to send for a block, as a multiple of its data chunks
+#define UDP_MAX_NACK_FACTOR 4
+// Blocks kept around by the sender for NACKs, and by the receiver (including taken ones)
+#define UDP_RECENT_BLOCKS 16
+#define UDP_RECV_BLOCKS 32
+
+struct udp_header {
+	uint8_t type, index;
+	uint16_t group;
+	uint64_t id;
+	uint32_t length;
+};
+
+static void write_header(unsigned char* buf, const udp_header& header) {
+	uint32_t magic = htole32(UDP_MAGIC), length = htole32(header.length);
+	uint16_t group = htole16(header.group);
+	uint64_t id = htole64(header.id);
+	memcpy(buf, &magic, 4);
+	buf[4] = header.type;
+	buf[5] = header.index;
+	memcpy(buf + 6, &group, 2);
+	memcpy(buf + 8, &id, 8);
+	memcpy(buf + 16, &length, 4);
+}
+
+static bool read_header(const unsigned char* buf, size_t len, udp_header& header) {
+	uint32_t magic;
+	if (len < UDP_HEADER_SIZE)
+		return false;
+	memcpy(&magic, buf, 4);
+	if (le32toh(magic) != UDP_MAGIC)
+		return false;
+	header.type = buf[4];
+	header.index = buf[5];
+	memcpy(&header.group, buf + 6, 2);
+	memcpy(&header.id, buf + 8, 8);
+	memcpy(&header.length, buf + 16, 4);
+	header.group = le16toh(header.group);
+	header.id = le64toh(header.id);
+	header.length = le32toh(header.length);
+	return true;
+}
+
+static uint64_t random_id() {
+	static std::mutex mutex;
+	static std::random_device device;
+	static std::mt19937_64 rng((uint64_t(device()) << 32) ^ device() ^ std::chrono::steady_clock::now().time_since_epoch().count());
+	std::lock_guard<std::mutex> lock(mutex);
+	return rng();
+}
+
+static bool same_address(const struct sockaddr_in6& a, const struct sockaddr_in6& b) {
+	return a.sin6_port == b.sin6_port && !memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(a.sin6_addr));
+}
+
+#ifndef WIN32
+/********************
+ **** UDP sender ****
+ ********************/
+static MetricCounter& udp_blocks_sent = metrics_counter("relay_udp_blocks_sent_total");
+static MetricCounter& udp_chunks_sent = metrics_counter("relay_udp_chunks_sent_total");
+static MetricCounter& udp_nack_chunks_sent = metrics_counter("relay_udp_nack_chunks_sent_total");
+
+bool UDPBlockSender::Peer::ready() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return have_addr && last_hello > std::chrono::steady_clock::now() - std::chrono::seconds(UDP_PEER_TIMEOUT_SECS);
+}
+
+UDPBlockSender::Block::Block(uint64_t id_in, const std::shared_ptr<std::vector<unsigned char> >& msg_in)
+		: id(id_in), msg(msg_in), encoder(&(*msg)[0], msg->size()), repairs_sent(encoder.get_layout().groups),
+		  nack_chunks_left(encoder.get_layout().chunks * UDP_MAX_NACK_FACTOR) {
+	uint64_t id_le = htole64(id);
+	uint32_t length = htole32(msg->size());
+	memcpy(marker, &id_le, 8);
+	memcpy(marker + 8, &length, 4);
+	double_sha256(&(*msg)[0], marker + 12, msg->size());
+}
+
+UDPBlockSender::UDPBlockSender(uint16_t port) : sock(-1), fec_percent(25), rate_bytes_per_ms(0) {
+	try {
+		const char* env = getenv("RELAY_UDP_FEC_PERCENT");
+		if (env)
+			fec_percent = std::min(std::stoul(env), 100ul);
+		env = getenv("RELAY_UDP_RATE_MBIT");
+		if (env)
+			rate_bytes_per_ms = std::stoull(env) * 1000 / 8;
+	} catch (std::exception& e) {}
+
+	int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		LOG("Failed to create UDP socket\n");
+		return;
+	}
+	int v6only = 0, reuse = 1, buffer = 4 * 1024 * 1024;
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		LOG("Failed to bind UDP %u: %s\n", (unsigned)port, strerror(errno));
+		close(fd);
+		return;
+	}
+	sock = fd;
+
+	std::thread(&UDPBlockSender::recv_loop, this).detach();
+	std::thread(&UDPBlockSender::send_loop, this).detach();
+}
+
+std::shared_ptr<UDPBlockSender::Peer> UDPBlockSender::add_peer() {
+	std::lock_guard<std::mutex> lock(peers_mutex);
+	for (auto it = peers.begin(); it != peers.end();) {
+		if (it->second.expired())
+			peers.erase(it++);
+		else
+			it++;
+	}
+	uint64_t token;
+	do {
+		token = random_id();
+	} while (peers.count(token));
+	auto peer = std::make_shared<Peer>(token);
+	peers[token] = peer;
+	return peer;
+}
+
+std::shared_ptr<UDPBlockSender::Block> UDPBlockSender::encode(const std::shared_ptr<std::vector<unsigned char> >& msg) {
+	auto block = std::make_shared<Block>(random_id(), msg);
+	const FECLayout& layout = block->encoder.get_layout();
+
+	// Groups are interleaved, so that a burst of loss is spread between them
+	std::vector<std::pair<uint16_t, uint8_t> > chunks;
+	size_t max_k = 0;
+	for (size_t group = 0; group < layout.groups; group++)
+		max_k = std::max(max_k, layout.group_chunks(group));
+	for (size_t i = 0; i < max_k; i++)
+		for (size_t group = 0; group < layout.groups; group++)
+			if (i < layout.group_chunks(group))
+				chunks.emplace_back(group, i);
+	for (size_t group = 0; group < layout.groups; group++) {
+		const size_t k = layout.group_chunks(group);
+		const size_t repair = fec_percent ? (k * fec_percent + 99) / 100 : 0;
+		for (size_t i = 0; i < repair; i++)
+			chunks.emplace_back(group, k + i);
+		block->repairs_sent[group] = repair;
+	}
+
+	block->packets = std::make_shared<std::vector<unsigned char> >(chunks.size() * UDP_CHUNK_PACKET_SIZE);
+	for (size_t i = 0; i < chunks.size(); i++) {
+		unsigned char* packet = &(*block->packets)[i * UDP_CHUNK_PACKET_SIZE];
+		write_header(packet, udp_header { UDP_CHUNK, chunks[i].second, chunks[i].first, block->id, uint32_t(msg->size()) });
+		block->encoder.chunk(chunks[i].first, chunks[i].second, packet + UDP_HEADER_SIZE);
+	}
+
+	std::lock_guard<std::mutex> lock(blocks_mutex);
+	recent_blocks.push_back(block);
+	if (recent_blocks.size() > UDP_RECENT_BLOCKS)
+		recent_blocks.pop_front();
+	return block;
+}
+
+std::shared_ptr<std::vector<unsigned char> > UDPBlockSender::find_block(uint64_t id) {
+	std::lock_guard<std::mutex> lock(blocks_mutex);
+	for (const auto& recent : recent_blocks)
+		if (recent->id == id)
+			return recent->msg;
+	return std::shared_ptr<std::vector<unsigned char> >();
+}
+
+void UDPBlockSender::send(const std::shared_ptr<Peer>& peer, const std::shared_ptr<Block>& block) {
+	struct sockaddr_in6 addr;
+	{
+		std::lock_guard<std::mutex> lock(peer->mutex);
+		assert(peer->have_addr);
+		addr = peer->addr;
+	}
+	udp_blocks_sent.add();
+	queue_packets(addr, block->packets);
+}
+
+std::shared_ptr<std::vector<unsigned char> > UDPBlockSender::repair_packets(Block& block, size_t group, size_t count) {
+	auto packets = std::make_shared<std::vector<unsigned char> >();
+	std::lock_guard<std::mutex> lock(block.mutex);
+	count = std::min(count, block.nack_chunks_left);
+	block.nack_chunks_left -= count;
+	packets->resize(count * UDP_CHUNK_PACKET_SIZE);
+
+	// Fresh repair indexes until they run out, then around again, as the peer will still
+	// want whichever of those it lost
+	const size_t k = block.encoder.get_layout().group_chunks(group);
+	for (size_t i = 0; i < count; i++) {
+		unsigned char* packet = &(*packets)[i * UDP_CHUNK_PACKET_SIZE];
+		const uint8_t index = k + block.repairs_sent[group]++ % (FEC_MAX_CHUNK_INDEX + 1 - k);
+		write_header(packet, udp_header { UDP_CHUNK, index, uint16_t(group), block.id, uint32_t(block.encoder.get_layout().bytes) });
+		block.encoder.chunk(group, index, packet + UDP_HEADER_SIZE);
+	}
+	return packets;
+}
+
+void UDPBlockSender::queue_packets(const struct sockaddr_in6& addr, const std::shared_ptr<std::vector<unsigned char> >& packets) {
+	if (packets->empty())
+		return;
+	std::lock_guard<std::mutex> lock(send_mutex);
+	send_queue.emplace_back(addr, packets);
+	send_cv.notify_one();
+}
+
+// Waits until bytes more can go out at rate_bytes_per_ms, given that everything before could
+// go once next_write came around
+void UDPBlockSender::pace(std::chrono::steady_clock::time_point& next_write, size_t bytes) {
+	std::chrono::steady_clock::time_point now(std::chrono::steady_clock::now());
+	if (next_write > now)
+		std::this_thread::sleep_until(next_write);
+	else
+		next_write = now;
+	next_write += std::chrono::microseconds(bytes * 1000 / rate_bytes_per_ms);
+}
+
+void UDPBlockSender::send_loop() {
+	std::chrono::steady_clock::time_point next_write(std::chrono::steady_clock::now());
+	while (true) {
+		std::pair<struct sockaddr_in6, std::shared_ptr<std::vector<unsigned char> > > job;
+		{
+			std::unique_lock<std::mutex> lock(send_mutex);
+			while (send_queue.empty())
+				send_cv.wait(lock);
+			job = send_queue.front();
+			send_queue.pop_front();
+		}
+
+		const size_t count = job.second->size() / UDP_CHUNK_PACKET_SIZE;
+		udp_chunks_sent.add(count);
+#ifdef __linux__
+		// In batches of sendmmsg, as a block is often hundreds of packets
+		struct mmsghdr msgs[64];
+		struct iovec iovs[64];
+		for (size_t sent = 0; sent < count;) {
+			const size_t batch = std::min(count - sent, size_t(64));
+			for (size_t i = 0; i < batch; i++) {
+				iovs[i].iov_base = &(*job.second)[(sent + i) * UDP_CHUNK_PACKET_SIZE];
+				iovs[i].iov_len = UDP_CHUNK_PACKET_SIZE;
+				memset(&msgs[i], 0, sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_name = &job.first;
+				msgs[i].msg_hdr.msg_namelen = sizeof(job.first);
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			if (rate_bytes_per_ms)
+				pace(next_write, batch * UDP_CHUNK_PACKET_SIZE);
+			int res = sendmmsg(sock, msgs, batch, 0);
+			if (res <= 0) {
+				if (errno == EINTR)
+					continue;
+				break; // Anything lost is up to FEC/NACKs
+			}
+			sent += res;
+		}
+#else
+		for (size_t i = 0; i < count; i++) {
+			if (rate_bytes_per_ms)
+				pace(next_write, UDP_CHUNK_PACKET_SIZE);
+			sendto(sock, &(*job.second)[i * UDP_CHUNK_PACKET_SIZE], UDP_CHUNK_PACKET_SIZE, 0, (struct sockaddr*)&job.first, sizeof(job.first));
+		}
+#endif
+	}
+}
+
+void UDPBlockSender::recv_loop() {
+	unsigned char buf[UDP_MAX_PACKET_SIZE];
+	while (true) {
+		struct sockaddr_in6 from;
+		socklen_t from_len = sizeof(from);
+		ssize_t res = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+		udp_header header;
+		if (res < 0 || from_len != sizeof(from) || !read_header(buf, res, header))
+			continue;
+
+		std::shared_ptr<Peer> peer;
+		{
+			std::lock_guard<std::mutex> lock(peers_mutex);
+			auto it = peers.find(header.id);
+			if (it != peers.end())
+				peer = it->second.lock();
+		}
+		if (!peer)
+			continue;
+
+		if (header.type == UDP_HELLO) {
+			// The latest hello wins, in case a NAT has moved the peer
+			std::lock_guard<std::mutex> lock(peer->mutex);
+			peer->addr = from;
+			peer->have_addr = true;
+			peer->last_hello = std::chrono::steady_clock::now();
+		} else if (header.type == UDP_NACK) {
+			{
+				std::lock_guard<std::mutex> lock(peer->mutex);
+				if (!peer->have_addr || !same_address(peer->addr, from))
+					continue;
+			}
+			if (size_t(res) != UDP_HEADER_SIZE + 8 + header.length)
+				continue;
+			uint64_t block_id;
+			memcpy(&block_id, buf + UDP_HEADER_SIZE, 8);
+			block_id = le64toh(block_id);
+
+			std::shared_ptr<Block> block;
+			{
+				std::lock_guard<std::mutex> lock(blocks_mutex);
+				for (const auto& recent : recent_blocks)
+					if (recent->id == block_id)
+						block = recent;
+			}
+			if (!block || header.length != block->encoder.get_layout().groups)
+				continue;
+
+			// Send half again as many as asked for, as some of those may be lost too. Each
+			// repair index is only ever sent once, which bounds what any peer can make us send.
+			for (size_t group = 0; group < header.length; group++) {
+				const size_t needed = buf[UDP_HEADER_SIZE + 8 + group];
+				if (!needed)
+					continue;
+				auto packets = repair_packets(*block, group, needed + needed / 2 + 1);
+				udp_nack_chunks_sent.add(packets->size() / UDP_CHUNK_PACKET_SIZE);
+				queue_packets(from, packets);
+			}
+		}
+	}
+}
+#else // WIN32
+bool UDPBlockSender::Peer::ready() { return false; }
+UDPBlockSender::Block::Block(uint64_t id_in, const std::shared_ptr<std::vector<unsigned char> >& msg_in) : id(id_in), msg(msg_in), encoder(&(*msg)[0], msg->size()), nack_chunks_left(0) {}
+UDPBlockSender::UDPBlockSender(uint16_t port) : sock(-1), fec_percent(0), rate_bytes_per_ms(0) {}
+std::shared_ptr<UDPBlockSender::Peer> UDPBlockSender::add_peer() { return std::shared_ptr<Peer>(); }
+std::shared_ptr<UDPBlockSender::Block> UDPBlockSender::encode(const std::shared_ptr<std::vector<unsigned char> >& msg) { return std::shared_ptr<Block>(); }
+std::shared_ptr<std::vector<unsigned char> > UDPBlockSender::find_block(uint64_t id) { return std::shared_ptr<std::vector<unsigned char> >(); }
+void UDPBlockSender::send(const std::shared_ptr<Peer>& peer, const std::shared_ptr<Block>& block) {}
+#endif // WIN32
+
+/**********************
+ **** UDP receiver ****
+ **********************/
+static MetricCounter& udp_blocks_received = metrics_counter("relay_udp_blocks_received_total");
+static MetricCounter& udp_block_timeouts = metrics_counter("relay_udp_block_timeouts_total");
+
+UDPBlockReceiver::UDPBlockReceiver(int sock_in, const struct sockaddr_in6& server_in, uint64_t token_in)
+	: sock(sock_in), server(server_in), token(token_in), stopped(false), waiting_for(0) {}
+
+UDPBlockReceiver::~UDPBlockReceiver() {
+	close(sock);
+}
+
+std::shared_ptr<UDPBlockReceiver> UDPBlockReceiver::start(const struct sockaddr_in6& server, uint64_t token) {
+	int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return std::shared_ptr<UDPBlockReceiver>();
+	int v6only = 0, buffer = 4 * 1024 * 1024;
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&v6only, sizeof(v6only));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char*)&buffer, sizeof(buffer));
+	// Wake up every so often to notice stop()
+#ifdef WIN32
+	DWORD timeout = 1000;
+#else
+	struct timeval timeout = { 1, 0 };
+#endif
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+	// The threads keep their own reference, and go away by themselves once stopped
+	std::shared_ptr<UDPBlockReceiver> receiver(new UDPBlockReceiver(fd, server, token));
+	std::thread([receiver]() { receiver->recv_loop(); }).detach();
+	std::thread([receiver]() { receiver->hello_loop(); }).detach();
+	return receiver;
+}
+
+bool UDPBlockReceiver::parse_marker(const unsigned char marker[UDP_BLOCK_MARKER_SIZE], uint64_t& id, uint32_t& length, unsigned char hash[32]) {
+	memcpy(&id, marker, 8);
+	memcpy(&length, marker + 8, 4);
+	id = le64toh(id);
+	length = le32toh(length);
+	memcpy(hash, marker + 12, 32);
+	return length > 0 && length <= UDP_MAX_MESSAGE_SIZE;
+}
+
+// Called with mutex held
+UDPBlockReceiver::Entry* UDPBlockReceiver::get_entry(uint64_t id, uint32_t length) {
+	auto it = blocks.find(id);
+	if (it != blocks.end()) {
+		if (it->second.decoder && it->second.decoder->get_layout().bytes != length)
+			return NULL;
+		return &it->second;
+	}
+	if (length == 0 || length > UDP_MAX_MESSAGE_SIZE)
+		return NULL;
+
+	while (block_order.size() >= UDP_RECV_BLOCKS) {
+		if (block_order.front() == waiting_for) {
+			block_order.push_back(block_order.front());
+			block_order.pop_front();
+		}
+		blocks.erase(block_order.front());
+		block_order.pop_front();
+	}
+	Entry& entry = blocks[id];
+	entry.decoder.reset(new FECDecoder(length));
+	entry.taken = false;
+	block_order.push_back(id);
+	return &entry;
+}
+
+void UDPBlockReceiver::send_nack(uint64_t id, const FECDecoder& decoder) {
+	const size_t groups = decoder.get_layout().groups;
+	unsigned char buf[UDP_HEADER_SIZE + 8 + groups];
+	write_header(buf, udp_header { UDP_NACK, 0, 0, token, uint32_t(groups) });
+	uint64_t id_le = htole64(id);
+	memcpy(buf + UDP_HEADER_SIZE, &id_le, 8);
+	for (size_t group = 0; group < groups; group++)
+		buf[UDP_HEADER_SIZE + 8 + group] = std::min(decoder.needed(group), size_t(255));
+	sendto(sock, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&server, sizeof(server));
+}
+
+void UDPBlockReceiver::recv_loop() {
+	unsigned char buf[UDP_MAX_PACKET_SIZE];
+	while (!stopped) {
+		struct sockaddr_in6 from;
+		socklen_t from_len = sizeof(from);
+		ssize_t res = recvfrom(sock, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+		udp_header header;
+		if (res != UDP_CHUNK_PACKET_SIZE || from_len != sizeof(from) || !same_address(from, server) ||
+				!read_header(buf, res, header) || header.type != UDP_CHUNK)
+			continue;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry* entry = get_entry(header.id, header.length);
+		if (!entry || !entry->decoder)
+			continue;
+		if (entry->decoder->provide(header.group, header.index, buf + UDP_HEADER_SIZE) && entry->decoder->done()) {
+			entry->decoder->take(entry->msg);
+			entry->decoder.reset();
+			block_done.notify_all();
+		}
+	}
+}
+
+void UDPBlockReceiver::hello_loop() {
+	unsigned char buf[UDP_HEADER_SIZE];
+	write_header(buf, udp_header { UDP_HELLO, 0, 0, token, 0 });
+	for (unsigned count = 0; !stopped; count++) {
+		sendto(sock, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&server, sizeof(server));
+		const unsigned secs = count < UDP_HELLO_FAST_COUNT ? UDP_HELLO_FAST_SECS : UDP_HELLO_SECS;
+		for (unsigned i = 0; i < secs && !stopped; i++)
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+}
+
+bool UDPBlockReceiver::wait_block(uint64_t id, uint32_t length, std::vector<unsigned char>& msg, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock(mutex);
+	Entry* entry = get_entry(id, length);
+	if (!entry || entry->taken)
+		return false;
+	waiting_for = id;
+
+	const std::chrono::system_clock::time_point start(std::chrono::system_clock::now()), deadline(start + timeout);
+	std::chrono::system_clock::time_point next_nack(start + std::chrono::milliseconds(UDP_FIRST_NACK_MS));
+	while (entry->decoder) {
+		std::chrono::system_clock::time_point now(std::chrono::system_clock::now());
+		if (now >= deadline) {
+			udp_block_timeouts.add();
+			waiting_for = 0;
+			return false;
+		}
+		if (now >= next_nack) {
+			send_nack(id, *entry->decoder);
+			next_nack = now + std::chrono::milliseconds(UDP_NACK_MS);
+		}
+		block_done.wait_until(lock, std::min(next_nack, deadline));
+	}
+
+	msg.swap(entry->msg);
+	entry->msg = std::vector<unsigned char>();
+	entry->taken = true;
+	waiting_for = 0;
+	udp_blocks_received.add();
+	return true;
+}
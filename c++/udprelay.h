@@ -0,0 +1,157 @@
+#ifndef _RELAY_UDPRELAY_H
+#define _RELAY_UDPRELAY_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+#ifdef WIN32
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <netinet/in.h>
+#endif
+
+#include "fec.h"
+#include "fiber.h"
+
+/* Blocks can be sent as FEC-coded UDP chunks (see fec.h) instead of over TCP, so that a lost
+ * packet costs a repair chunk rather than a round trip of head-of-line blocking.
+ *
+ * TCP still carries everything else and decides ordering: a client which wants UDP sends
+ * UDP_REQUEST, the server answers with UDP_OFFER (a random token and its UDP port), and the
+ * client then says hello from its UDP socket with that token every so often (which also keeps
+ * any NAT mapping open). Once the server has heard a hello, blocks to that client are sent
+ * over UDP and replaced in the TCP stream by a UDP_BLOCK message (see UDP_BLOCK_MARKER_SIZE),
+ * at which point the client waits for the block to be rebuilt, asking for more repair chunks
+ * as it goes. If that never happens, the client asks for the block with a UDP_RESEND, which
+ * the server answers over TCP from its last UDP_RECENT_BLOCKS, and holds everything after it
+ * in the meantime (see BlockSequencer).
+ *
+ * Chunks are only accepted from the server's address and the rebuilt message has to match the
+ * hash in UDP_BLOCK, so a spoofed chunk can at worst force a resend over TCP. */
+
+// UDP_BLOCK's payload: block id (8 bytes LE), message length (4 bytes LE) and its double-SHA256
+#define UDP_BLOCK_MARKER_SIZE (8 + 4 + 32)
+// UDP_OFFER's payload: token (8 bytes LE) and UDP port (2 bytes BE)
+#define UDP_OFFER_SIZE (8 + 2)
+// How long a client waits on a UDP_BLOCK before asking for it over TCP
+#define UDP_BLOCK_TIMEOUT_SECS 10
+// UDP_RESEND's payload is a block id (8 bytes LE), and from the server that is followed by the
+// whole BLOCK message, as in a BLOCK_SEQ
+
+// Server side, one per process, with any number of peers
+class UDPBlockSender {
+public:
+	class Peer {
+	private:
+		const uint64_t token;
+		std::mutex mutex;
+		struct sockaddr_in6 addr;
+		std::chrono::steady_clock::time_point last_hello;
+		bool have_addr;
+		friend class UDPBlockSender;
+
+	public:
+		Peer(uint64_t token_in) : token(token_in), have_addr(false) {}
+		uint64_t get_token() const { return token; }
+		// Whether the peer has said hello recently enough that blocks should go over UDP
+		bool ready();
+	};
+
+	// An encoded relay message, shared by every peer it is sent to
+	class Block {
+	private:
+		const uint64_t id;
+		const std::shared_ptr<std::vector<unsigned char> > msg; // For UDP_RESEND
+		const FECEncoder encoder;
+		std::shared_ptr<std::vector<unsigned char> > packets; // All data chunks plus the first repair chunks
+		std::mutex mutex;
+		std::vector<size_t> repairs_sent; // Per group, which picks the next repair index (see repair_packets)
+		size_t nack_chunks_left;
+		friend class UDPBlockSender;
+
+	public:
+		Block(uint64_t id_in, const std::shared_ptr<std::vector<unsigned char> >& msg_in);
+		unsigned char marker[UDP_BLOCK_MARKER_SIZE];
+	};
+
+private:
+	int sock;
+	unsigned fec_percent;
+	uint64_t rate_bytes_per_ms; // 0 if unpaced
+
+	std::mutex peers_mutex;
+	std::map<uint64_t, std::weak_ptr<Peer> > peers;
+
+	std::mutex blocks_mutex;
+	std::deque<std::shared_ptr<Block> > recent_blocks; // For answering NACKs and UDP_RESENDs
+
+	std::mutex send_mutex;
+	std::condition_variable send_cv;
+	std::deque<std::pair<struct sockaddr_in6, std::shared_ptr<std::vector<unsigned char> > > > send_queue;
+
+	void recv_loop();
+	void send_loop();
+	void pace(std::chrono::steady_clock::time_point& next_write, size_t bytes);
+	std::shared_ptr<std::vector<unsigned char> > repair_packets(Block& block, size_t group, size_t count);
+	void queue_packets(const struct sockaddr_in6& addr, const std::shared_ptr<std::vector<unsigned char> >& packets);
+
+public:
+	// Listens on port, with RELAY_UDP_FEC_PERCENT (default 25) extra repair chunks sent with each
+	// block. If RELAY_UDP_RATE_MBIT is set, everything sent is paced to that rate.
+	UDPBlockSender(uint16_t port);
+	bool ok() const { return sock >= 0; }
+
+	std::shared_ptr<Peer> add_peer();
+	std::shared_ptr<Block> encode(const std::shared_ptr<std::vector<unsigned char> >& msg);
+	// The message of a recently encoded block, or null if it is too old
+	std::shared_ptr<std::vector<unsigned char> > find_block(uint64_t id);
+	// Queues block to go out to peer, which must be ready()
+	void send(const std::shared_ptr<Peer>& peer, const std::shared_ptr<Block>& block);
+};
+
+// Client side, one per connection to a server
+class UDPBlockReceiver {
+private:
+	int sock;
+	const struct sockaddr_in6 server;
+	const uint64_t token;
+	std::atomic_bool stopped;
+
+	struct Entry {
+		std::unique_ptr<FECDecoder> decoder;
+		std::vector<unsigned char> msg;
+		bool taken; // Kept around after wait_block so that late chunks are dropped
+	};
+	std::mutex mutex;
+	FiberCondition block_done;
+	std::map<uint64_t, Entry> blocks;
+	std::deque<uint64_t> block_order;
+	uint64_t waiting_for;
+
+	UDPBlockReceiver(int sock_in, const struct sockaddr_in6& server_in, uint64_t token_in);
+	Entry* get_entry(uint64_t id, uint32_t length);
+	void recv_loop();
+	void hello_loop();
+	void send_nack(uint64_t id, const FECDecoder& decoder);
+
+public:
+	// server is the address (and UDP port) of the server, token is as given in UDP_OFFER
+	static std::shared_ptr<UDPBlockReceiver> start(const struct sockaddr_in6& server, uint64_t token);
+	// Stops hellos and receiving, which must be done when the TCP connection goes away
+	void stop() { stopped = true; }
+	~UDPBlockReceiver();
+
+	static bool parse_marker(const unsigned char marker[UDP_BLOCK_MARKER_SIZE], uint64_t& id, uint32_t& length, unsigned char hash[32]);
+	// Waits up to timeout for block id (of length bytes, as given in UDP_BLOCK) to be rebuilt.
+	// Only one thread may wait at once.
+	bool wait_block(uint64_t id, uint32_t length, std::vector<unsigned char>& msg, std::chrono::milliseconds timeout);
+};
+
+#endif
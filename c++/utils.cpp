@@ -1,10 +1,16 @@
 #include "utils.h"
+#include "log.h"
 #include "crypto/sha2.h"
+#include "crypto/sha256_multi.h"
+#include "crypto/sha256_shani.h"
 
 #include <vector>
+#include <algorithm>
+#include <thread>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifdef WIN32
 	// MinGW doesnt have this line (copied from Wine) for licensing reasons
@@ -26,6 +32,162 @@
 	#include <arpa/nameser_compat.h>
 #endif
 
+#ifdef __linux__
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+/***********************
+ **** Buffer pooling ****
+ ***********************/
+#define BUFFER_POOL_CLASSES 17
+#define BUFFER_POOL_MIN_SIZE 64
+#define BUFFER_POOL_CLASS_BYTES (2 * 1024 * 1024)
+// Classes up to 64KB also keep a few buffers per thread, skipping the class mutex
+#define BUFFER_POOL_LOCAL_CLASSES 11
+#define BUFFER_POOL_LOCAL_COUNT 8
+// shared_ptr control blocks are recycled per thread as well
+#define BUFFER_POOL_CTRL_SIZE 64
+#define BUFFER_POOL_CTRL_COUNT 256
+
+class BufferPool {
+private:
+	// Class i holds buffers with capacity >= 64 * 2^i
+	struct SizeClass {
+		std::mutex mutex;
+		std::vector<std::vector<unsigned char>*> free;
+		size_t max_free;
+	} classes[BUFFER_POOL_CLASSES];
+
+	struct LocalCache {
+		std::vector<unsigned char>* bufs[BUFFER_POOL_LOCAL_CLASSES][BUFFER_POOL_LOCAL_COUNT];
+		uint32_t count[BUFFER_POOL_LOCAL_CLASSES];
+		void* ctrl_free;
+		uint32_t ctrl_count;
+
+		LocalCache() : ctrl_free(NULL), ctrl_count(0) { memset(count, 0, sizeof(count)); }
+		~LocalCache();
+	};
+	static thread_local LocalCache local;
+
+	static size_t class_size(size_t i) { return size_t(BUFFER_POOL_MIN_SIZE) << i; }
+
+	std::vector<unsigned char>* take(size_t i) {
+		if (i < BUFFER_POOL_LOCAL_CLASSES && local.count[i])
+			return local.bufs[i][--local.count[i]];
+		SizeClass& c = classes[i];
+		std::lock_guard<std::mutex> lock(c.mutex);
+		if (c.free.empty())
+			return NULL;
+		std::vector<unsigned char>* buf = c.free.back();
+		c.free.pop_back();
+		return buf;
+	}
+
+public:
+	void release(std::vector<unsigned char>* buf, bool allow_local=true) {
+		// Cache it in the largest class it can serve
+		size_t i = 0;
+		while (i + 1 < BUFFER_POOL_CLASSES && buf->capacity() >= class_size(i + 1))
+			i++;
+		if (buf->capacity() >= class_size(i)) {
+			buf->clear();
+			if (allow_local && i < BUFFER_POOL_LOCAL_CLASSES && local.count[i] < BUFFER_POOL_LOCAL_COUNT) {
+				local.bufs[i][local.count[i]++] = buf;
+				return;
+			}
+			SizeClass& c = classes[i];
+			std::lock_guard<std::mutex> lock(c.mutex);
+			if (c.free.size() < c.max_free) {
+				c.free.push_back(buf);
+				return;
+			}
+		}
+		delete buf;
+	}
+
+	static void* ctrl_alloc(size_t size) {
+		if (size > BUFFER_POOL_CTRL_SIZE)
+			return ::operator new(size);
+		if (local.ctrl_free) {
+			void* res = local.ctrl_free;
+			local.ctrl_free = *(void**)res;
+			local.ctrl_count--;
+			return res;
+		}
+		return ::operator new(BUFFER_POOL_CTRL_SIZE);
+	}
+
+	static void ctrl_free(void* p, size_t size) {
+		if (size > BUFFER_POOL_CTRL_SIZE || local.ctrl_count >= BUFFER_POOL_CTRL_COUNT)
+			return ::operator delete(p);
+		*(void**)p = local.ctrl_free;
+		local.ctrl_free = p;
+		local.ctrl_count++;
+	}
+
+	BufferPool() {
+		for (size_t i = 0; i < BUFFER_POOL_CLASSES; i++)
+			classes[i].max_free = std::min(size_t(1024), std::max(size_t(4), BUFFER_POOL_CLASS_BYTES / class_size(i)));
+	}
+
+	std::shared_ptr<std::vector<unsigned char> > get(size_t size, size_t capacity);
+};
+
+static BufferPool* buffer_pool() {
+	// Never destroyed, as buffers may be released by other threads during shutdown
+	static BufferPool* pool = new BufferPool();
+	return pool;
+}
+thread_local BufferPool::LocalCache BufferPool::local;
+
+BufferPool::LocalCache::~LocalCache() {
+	for (size_t i = 0; i < BUFFER_POOL_LOCAL_CLASSES; i++)
+		while (count[i])
+			buffer_pool()->release(bufs[i][--count[i]], false);
+	while (ctrl_free) {
+		void* next = *(void**)ctrl_free;
+		::operator delete(ctrl_free);
+		ctrl_free = next;
+	}
+	ctrl_count = 0;
+}
+
+template <typename T> struct BufferPoolCtrlAllocator {
+	typedef T value_type;
+	BufferPoolCtrlAllocator() {}
+	template <typename U> BufferPoolCtrlAllocator(const BufferPoolCtrlAllocator<U>&) {}
+	T* allocate(size_t n) { return (T*)BufferPool::ctrl_alloc(n * sizeof(T)); }
+	void deallocate(T* p, size_t n) { BufferPool::ctrl_free(p, n * sizeof(T)); }
+	template <typename U> bool operator==(const BufferPoolCtrlAllocator<U>&) const { return true; }
+	template <typename U> bool operator!=(const BufferPoolCtrlAllocator<U>&) const { return false; }
+};
+
+std::shared_ptr<std::vector<unsigned char> > BufferPool::get(size_t size, size_t capacity) {
+	capacity = std::max(size, capacity);
+	size_t i = 0;
+	while (i < BUFFER_POOL_CLASSES && class_size(i) < capacity)
+		i++;
+	if (i == BUFFER_POOL_CLASSES) {
+		auto res = std::make_shared<std::vector<unsigned char> >(size);
+		res->reserve(capacity);
+		return res;
+	}
+
+	std::vector<unsigned char>* buf = take(i);
+	if (!buf) {
+		buf = new std::vector<unsigned char>();
+		buf->reserve(class_size(i));
+	}
+	buf->resize(size);
+	return std::shared_ptr<std::vector<unsigned char> >(buf, [](std::vector<unsigned char>* b) { buffer_pool()->release(b); },
+			BufferPoolCtrlAllocator<std::vector<unsigned char> >());
+}
+
+std::shared_ptr<std::vector<unsigned char> > pooled_buffer(size_t size, size_t capacity) {
+	return buffer_pool()->get(size, capacity);
+}
+
 /***************************
  **** Varint processing ****
  ***************************/
@@ -82,6 +244,45 @@ std::vector<unsigned char> varint(uint32_t size) {
 /***********************
  **** Network utils ****
  ***********************/
+bool BufferedReader::read(void* buf, size_t nbyte) {
+	unsigned char* out = (unsigned char*)buf;
+	while (nbyte) {
+		size_t avail;
+		const unsigned char* data = peek_some(avail);
+		if (!data)
+			return false;
+		size_t count = std::min(avail, nbyte);
+		memcpy(out, data, count);
+		skip(count);
+		out += count;
+		nbyte -= count;
+	}
+	return true;
+}
+
+bool read_hashing(BufferedReader& reader, unsigned char* buf, size_t nbyte, uint32_t hash[8]) {
+	double_sha256_init(hash);
+	size_t done = 0, hashed = 0;
+	while (done < nbyte) {
+		size_t avail;
+		const unsigned char* data = reader.peek_some(avail);
+		if (!data)
+			return false;
+		size_t count = std::min(avail, nbyte - done);
+		memcpy(buf + done, data, count);
+		reader.skip(count);
+		done += count;
+
+		size_t step = (done - hashed) & ~size_t(63);
+		if (step) {
+			double_sha256_step(buf + hashed, step, hash);
+			hashed += step;
+		}
+	}
+	double_sha256_done(buf + hashed, nbyte - hashed, nbyte, hash);
+	return true;
+}
+
 ssize_t read_all(int filedes, char *buf, size_t nbyte) {
 	if (nbyte <= 0)
 		return 0;
@@ -140,7 +341,7 @@ bool lookup_address(const char* addr, struct sockaddr_in6* res) {
 
 	int gaires = getaddrinfo(addr, NULL, &hints, &server);
 	if (gaires) {
-		printf("Unable to lookup hostname: %d (%s)\n", gaires, gai_strerror(gaires));
+		LOG("Unable to lookup hostname: %d (%s)\n", gaires, gai_strerror(gaires));
 		if (server)
 			freeaddrinfo(server);
 		return false;
@@ -184,6 +385,15 @@ void prepare_message(const char* command, unsigned char* headerAndData, size_t d
 	memcpy(header->checksum, fullhash, sizeof(header->checksum));
 }
 
+std::shared_ptr<std::vector<unsigned char> > relay_msg(uint32_t type, const void* data, size_t datalen) {
+	auto msg = pooled_buffer(sizeof(struct relay_msg_header) + datalen);
+	struct relay_msg_header header = { RELAY_MAGIC_BYTES, type, htonl(datalen) };
+	memcpy(&(*msg)[0], &header, sizeof(header));
+	if (datalen)
+		memcpy(&(*msg)[sizeof(header)], data, datalen);
+	return msg;
+}
+
 #ifndef WIN32
 static int read_dn_name(unsigned char* answer, unsigned char* answerend, unsigned char*& it, char buf[1024]) {
 	int len = dn_expand(answer, answerend, it, buf, 1024);
@@ -256,12 +466,207 @@ int create_connect_socket(const std::string& serverHost, const uint16_t serverPo
 	return sock;
 }
 
+bool version_has_feature(const char* data, size_t len, const char* feature) {
+	const char* end = data + len;
+	const char* pos = (const char*)memchr(data, 0, len);
+	if (!pos)
+		return false;
+	const size_t feature_len = strlen(feature);
+	while (pos < end) {
+		pos++;
+		const char* word_end = std::find(pos, end, ' ');
+		if (size_t(word_end - pos) == feature_len && !memcmp(pos, feature, feature_len))
+			return true;
+		pos = word_end;
+	}
+	return false;
+}
+
+/************************
+ *** Thread placement ***
+ ************************/
+#ifdef __linux__
+// Parses a list like "0,2,4-7"
+static std::vector<int> parse_cpu_list(const char* list) {
+	std::vector<int> cpus;
+	while (*list) {
+		char* end;
+		long first = strtol(list, &end, 10), last = first;
+		if (end == list)
+			break;
+		if (*end == '-') {
+			const char* range_end = end + 1;
+			last = strtol(range_end, &end, 10);
+			if (end == range_end)
+				break;
+		}
+		for (long cpu = std::max(first, 0l); cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			cpus.push_back(cpu);
+		if (*end != ',')
+			break;
+		list = end + 1;
+	}
+	return cpus;
+}
+#endif
+
+void pin_thread(const char* cpus_env, size_t index, const char* name) {
+#ifdef __linux__
+	const char* env = getenv(cpus_env);
+	if (!env)
+		return;
+	std::vector<int> cpus = parse_cpu_list(env);
+	if (cpus.empty()) {
+		LOG("Ignoring %s, which isn't a list of CPUs\n", cpus_env);
+		return;
+	}
+
+	int cpu = cpus[index % cpus.size()];
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+		LOG("Failed to pin %s thread %lu to CPU %d: %s\n", name, (unsigned long)index, cpu, strerror(err));
+
+	// Only pinned threads go real-time, so that a spinning thread can't take over a core
+	// someone else was counting on
+	const char* fifo = getenv("RELAY_SCHED_FIFO");
+	if (fifo && atoi(fifo) > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = std::min(atoi(fifo), sched_get_priority_max(SCHED_FIFO));
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err)
+			LOG("Failed to make %s thread %lu SCHED_FIFO: %s\n", name, (unsigned long)index, strerror(err));
+	}
+#endif
+}
+
+WorkerPool::WorkerPool(size_t threads, const char* cpus_env, size_t first_cpu, const char* name)
+		: job(NULL), job_parts(0), next_part(0), parts_done(0), thread_count(threads) {
+	for (size_t i = 0; i < thread_count; i++)
+		std::thread(&WorkerPool::worker, this, cpus_env, first_cpu + i, name).detach();
+}
+
+// Called with mutex held, runs parts of the current job until there are none left to start
+void WorkerPool::do_parts(std::unique_lock<std::mutex>& lock) {
+	while (job && next_part < job_parts) {
+		size_t part = next_part++;
+		const std::function<void (size_t)>& func = *job;
+		lock.unlock();
+		func(part);
+		lock.lock();
+		if (++parts_done == job_parts)
+			done_cv.notify_all();
+	}
+}
+
+void WorkerPool::worker(const char* cpus_env, size_t cpu, const char* name) {
+	pin_thread(cpus_env, cpu, name);
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		while (!job || next_part >= job_parts)
+			work_cv.wait(lock);
+		do_parts(lock);
+	}
+}
+
+void WorkerPool::run(size_t parts, const std::function<void (size_t)>& func) {
+	std::lock_guard<std::mutex> run_lock(run_mutex);
+	std::unique_lock<std::mutex> lock(mutex);
+	job = &func;
+	job_parts = parts;
+	next_part = parts_done = 0;
+	work_cv.notify_all();
+	do_parts(lock);
+	while (parts_done < job_parts)
+		done_cv.wait(lock);
+	job = NULL;
+}
+
 /********************
  *** Random stuff ***
  ********************/
-#ifdef SHA256
-extern "C" void SHA256(void *, uint32_t[8], uint64_t);
+// All the SHA-256 kernels we have are linked in and one is picked at startup,
+// the fastest the CPU supports unless RELAY_SHA256 names one explicitly
+typedef void (*sha256_transform_fn)(void*, uint32_t[8], uint64_t);
+
+#ifdef SHA256_ASM
+extern "C" void sha256_sse4(void *, uint32_t[8], uint64_t);
+extern "C" void sha256_avx(void *, uint32_t[8], uint64_t);
+extern "C" void sha256_rorx(void *, uint32_t[8], uint64_t);
+#endif
+
+static void sha256_generic(void* input, uint32_t state[8], uint64_t blocks) {
+	CSHA256 hash;
+	for (uint8_t i = 0; i < 8; i++)
+		hash.s[i] = state[i];
+	hash.Write((const unsigned char*)input, blocks * 64);
+	for (uint8_t i = 0; i < 8; i++)
+		state[i] = hash.s[i];
+}
+
+struct Sha256Impl {
+	sha256_transform_fn transform;
+	const char* name;
+};
+
+static std::vector<Sha256Impl> available_sha256_impls() {
+	std::vector<Sha256Impl> available; // Slowest first
+	available.push_back(Sha256Impl { sha256_generic, "generic" });
+#ifdef CPU_FEATURES_X86
+	const CpuFeatures& cpu = cpu_features();
+#ifdef SHA256_ASM
+	if (cpu.sse41)
+		available.push_back(Sha256Impl { sha256_sse4, "sse4" });
+	if (cpu.avx)
+		available.push_back(Sha256Impl { sha256_avx, "avx" });
+	if (cpu.avx2 && cpu.bmi2)
+		available.push_back(Sha256Impl { sha256_rorx, "rorx" });
+#endif
+	if (cpu.sha)
+		available.push_back(Sha256Impl { sha256_shani, "shani" });
+#endif
+	return available;
+}
+
+static Sha256Impl select_sha256_impl() {
+	std::vector<Sha256Impl> available = available_sha256_impls();
+	Sha256Impl chosen = available.back();
+	const char* forced = getenv("RELAY_SHA256");
+	if (forced && *forced) {
+		auto it = std::find_if(available.begin(), available.end(), [&](const Sha256Impl& impl) { return !strcmp(impl.name, forced); });
+		if (it != available.end())
+			chosen = *it;
+		else
+			LOG("RELAY_SHA256=%s is not available on this machine, ignoring it\n", forced);
+	}
+#ifdef SHA256_ASM
+	LOG("Using the %s SHA-256 kernel\n", chosen.name);
+#else
+	LOG("Using the %s SHA-256 kernel (built without the asm kernels)\n", chosen.name);
 #endif
+	return chosen;
+}
+
+static inline const Sha256Impl& sha256_impl() {
+	static const Sha256Impl impl = select_sha256_impl();
+	return impl;
+}
+
+static inline void sha256_transform(void* input, uint32_t state[8], uint64_t blocks) {
+	sha256_impl().transform(input, state, blocks);
+}
+
+std::string sha256_implementation() {
+	return std::string(sha256_impl().name) + " (" + std::to_string(sha256_multi::lanes()) + "-lane " + sha256_multi::name() + " for batches)";
+}
+
+void sha256_for_each_implementation(const std::function<void (const char*, void (*)(void*, uint32_t[8], uint64_t))>& callback) {
+	for (const Sha256Impl& impl : available_sha256_impls())
+		callback(impl.name, impl.transform);
+}
 
 void static inline WriteBE64(unsigned char *ptr, uint64_t x) {
 	ptr[0] = x >> 56; ptr[1] = x >> 48; ptr[2] = x >> 40; ptr[3] = x >> 32;
@@ -295,13 +700,6 @@ void static inline sha256_done(unsigned char* res, uint32_t state[8]) {
 }
 
 void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte_count) {
-#ifndef SHA256
-	CSHA256 hash;
-	if (byte_count)
-		hash.Write(input, byte_count);
-	hash.Finalize(res);
-	hash.Reset().Write(res, 32).Finalize(res);
-#else
 	uint64_t pad_count = 1 + ((119 - (byte_count % 64)) % 64);
 	std::vector<unsigned char> data(byte_count + pad_count + 8);
 
@@ -314,7 +712,7 @@ void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte
 	sha256_init(state);
 
 	assert((byte_count + pad_count + 8) % 64 == 0);
-	SHA256(&data[0], state, (byte_count + pad_count + 8) / 64);
+	sha256_transform(&data[0], state, (byte_count + pad_count + 8) / 64);
 	sha256_done(&data[0], state);
 
 	data[32] = 0x80;
@@ -322,17 +720,11 @@ void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte
 	WriteBE64(&data[64 - 8], 32 << 3);
 	sha256_init(state);
 
-	SHA256(&data[0], state, 1);
+	sha256_transform(&data[0], state, 1);
 	sha256_done(res, state);
-#endif
 }
 
 void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char* input2, unsigned char* res) {
-#ifndef SHA256
-	CSHA256 hash;
-	hash.Write(input, 32).Write(input2, 32).Finalize(res);
-	hash.Reset().Write(res, 32).Finalize(res);
-#else
 	unsigned char data[128];
 
 	memcpy(data,      input,  32);
@@ -344,7 +736,7 @@ void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char
 	uint32_t state[8];
 	sha256_init(state);
 
-	SHA256(&data[0], state, 2);
+	sha256_transform(&data[0], state, 2);
 	sha256_done(data, state);
 
 	data[32] = 0x80;
@@ -352,51 +744,22 @@ void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char
 	WriteBE64(data + 64 - 8, 32 << 3);
 	sha256_init(state);
 
-	SHA256(data, state, 1);
+	sha256_transform(data, state, 1);
 	sha256_done(res, state);
-#endif
 }
 
 void double_sha256_init(uint32_t state[8]) {
-#ifndef SHA256
-	CSHA256 hash;
-	for (uint8_t i = 0; i < 8; i++)
-		state[i] = hash.s[i];
-#else
 	sha256_init(state);
-#endif
 }
 
 void double_sha256_step(const unsigned char* input, uint64_t byte_count, uint32_t state[8]) {
 	assert(byte_count % 64 == 0);
-#ifndef SHA256
-	if (byte_count) {
-		CSHA256 hash;
-		for (uint8_t i = 0; i < 8; i++)
-			hash.s[i] = state[i];
-		hash.Write(input, byte_count);
-		for (uint8_t i = 0; i < 8; i++)
-			state[i] = hash.s[i];
-	}
-#else
-	SHA256(const_cast<unsigned char*>(input), state, byte_count / 64);
-#endif
+	if (byte_count)
+		sha256_transform(const_cast<unsigned char*>(input), state, byte_count / 64);
 }
 
 void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_t total_byte_count, uint32_t state[8]) {
 	assert((total_byte_count - byte_count) % 64 == 0);
-#ifndef SHA256
-	CSHA256 hash;
-	if ((total_byte_count - byte_count) != 0) {
-		for (uint8_t i = 0; i < 8; i++)
-			hash.s[i] = state[i];
-		hash.bytes = total_byte_count - byte_count;
-	}
-	if (byte_count)
-		hash.Write(input, byte_count);
-	hash.Finalize((unsigned char*)state);
-	hash.Reset().Write((unsigned char*)state, 32).Finalize((unsigned char*)state);
-#else
 	uint64_t pad_count = 1 + ((119 - (total_byte_count % 64)) % 64);
 	assert(1 + ((119 - (byte_count % 64)) % 64) == pad_count);
 	unsigned char data[byte_count + pad_count + 8];
@@ -407,7 +770,7 @@ void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_
 	WriteBE64(&data[byte_count + pad_count], total_byte_count << 3);
 
 	assert((byte_count + pad_count + 8) % 64 == 0);
-	SHA256(&data[0], state, (byte_count + pad_count + 8) / 64);
+	sha256_transform(&data[0], state, (byte_count + pad_count + 8) / 64);
 	sha256_done(&data[0], state);
 
 	data[32] = 0x80;
@@ -415,9 +778,121 @@ void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_
 	WriteBE64(&data[64 - 8], 32 << 3);
 	sha256_init(state);
 
-	SHA256(&data[0], state, 1);
+	sha256_transform(&data[0], state, 1);
 	sha256_done((unsigned char*)state, state);
-#endif
+}
+
+size_t double_sha256_lanes() {
+	return sha256_multi::lanes();
+}
+
+void double_sha256_multi(const unsigned char* const* inputs, const uint64_t* byte_counts, unsigned char* const* res, size_t count) {
+	const size_t lanes = sha256_multi::lanes();
+	if (lanes == 1) {
+		for (size_t i = 0; i < count; i++)
+			double_sha256(inputs[i], res[i], byte_counts[i]);
+		return;
+	}
+
+	static const unsigned char idle_block[64] = {0};
+	static const size_t IDLE = size_t(-1);
+
+	// Each lane works through its message and then its padded tail, picking up
+	// the next message as soon as it finishes. The first-round digests are
+	// written out as padded blocks for the second round.
+	std::vector<unsigned char> digests(64 * count);
+	uint32_t state[8 * SHA256_MULTI_MAX_LANES];
+	const unsigned char* blocks[SHA256_MULTI_MAX_LANES];
+	unsigned char tails[SHA256_MULTI_MAX_LANES][128];
+	size_t lane_msg[SHA256_MULTI_MAX_LANES];
+	const unsigned char* lane_pos[SHA256_MULTI_MAX_LANES];
+	uint64_t lane_full_blocks[SHA256_MULTI_MAX_LANES];
+	uint32_t lane_tail_pos[SHA256_MULTI_MAX_LANES], lane_tail_blocks[SHA256_MULTI_MAX_LANES];
+
+	uint32_t init_state[8];
+	sha256_init(init_state);
+
+	size_t next_msg = 0, active = 0;
+	auto start_lane = [&](size_t l) {
+		if (next_msg == count) {
+			lane_msg[l] = IDLE;
+			return;
+		}
+		size_t i = next_msg++;
+		uint64_t rem = byte_counts[i] % 64;
+		lane_msg[l] = i;
+		lane_pos[l] = inputs[i];
+		lane_full_blocks[l] = byte_counts[i] / 64;
+		lane_tail_pos[l] = 0;
+		lane_tail_blocks[l] = rem + 1 + 8 > 64 ? 2 : 1;
+
+		memcpy(tails[l], inputs[i] + byte_counts[i] - rem, rem);
+		tails[l][rem] = 0x80;
+		memset(tails[l] + rem + 1, 0, lane_tail_blocks[l] * 64 - 8 - rem - 1);
+		WriteBE64(tails[l] + lane_tail_blocks[l] * 64 - 8, byte_counts[i] << 3);
+
+		for (int w = 0; w < 8; w++)
+			state[w * lanes + l] = init_state[w];
+		active++;
+	};
+
+	for (size_t l = 0; l < lanes; l++)
+		start_lane(l);
+
+	while (active) {
+		for (size_t l = 0; l < lanes; l++) {
+			if (lane_msg[l] == IDLE)
+				blocks[l] = idle_block;
+			else if (lane_full_blocks[l]) {
+				blocks[l] = lane_pos[l];
+				lane_pos[l] += 64;
+				lane_full_blocks[l]--;
+			} else
+				blocks[l] = tails[l] + 64 * lane_tail_pos[l]++;
+		}
+
+		sha256_multi::transform(state, blocks);
+
+		for (size_t l = 0; l < lanes; l++) {
+			if (lane_msg[l] == IDLE || lane_full_blocks[l] || lane_tail_pos[l] != lane_tail_blocks[l])
+				continue;
+			unsigned char* digest = &digests[64 * lane_msg[l]];
+			for (int w = 0; w < 8; w++)
+				WriteBE32(digest + 4*w, state[w * lanes + l]);
+			digest[32] = 0x80;
+			memset(digest + 32 + 1, 0, 32 - 8 - 1);
+			WriteBE64(digest + 64 - 8, 32 << 3);
+			active--;
+			start_lane(l);
+		}
+	}
+
+	for (size_t i = 0; i < count; i += lanes) {
+		for (size_t l = 0; l < lanes; l++) {
+			blocks[l] = i + l < count ? &digests[64 * (i + l)] : idle_block;
+			for (int w = 0; w < 8; w++)
+				state[w * lanes + l] = init_state[w];
+		}
+
+		sha256_multi::transform(state, blocks);
+
+		for (size_t l = 0; l < lanes && i + l < count; l++)
+			for (int w = 0; w < 8; w++)
+				WriteBE32(res[i + l] + 4*w, state[w * lanes + l]);
+	}
+}
+
+void double_sha256_64_multi(const unsigned char* inputs, unsigned char* res, size_t count) {
+	if (!count)
+		return;
+	std::vector<const unsigned char*> input_ptrs(count);
+	std::vector<uint64_t> byte_counts(count, 64);
+	std::vector<unsigned char*> res_ptrs(count);
+	for (size_t i = 0; i < count; i++) {
+		input_ptrs[i] = inputs + 64 * i;
+		res_ptrs[i] = res + 32 * i;
+	}
+	double_sha256_multi(&input_ptrs[0], &byte_counts[0], &res_ptrs[0], count);
 }
 
 void getblockhash(std::vector<unsigned char>& hashRes, const std::vector<unsigned char>& block, size_t offset) {
@@ -457,7 +932,7 @@ std::string asciifyString(const std::string& str) {
 
 void do_assert(bool flag, const char* file, unsigned long line) {
 	if (!flag) {
-		fprintf(stderr, "Assertion failed: %s:%lu\n", file, line);
+		LOG_STDERR("Assertion failed: %s:%lu\n", file, line);
 		exit(1);
 	}
 }
@@ -3,9 +3,12 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <functional>
 #include <assert.h>
 #include <unistd.h>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <sys/time.h>
 
@@ -61,9 +64,16 @@ struct relay_msg_header {
 };
 
 #define RELAY_MAGIC_BYTES htonl(0xF2BEEF42)
-#define VERSION_STRING "spammy memeater"
+#define VERSION_STRING "chunky tortoise"
+// Optional features go in VERSION after VERSION_STRING and a NUL, space-separated, where older
+// peers never look. A client listing this gets transactions as TRANSACTIONS messages.
+#define VERSION_FEATURE_TX_BATCH "txbatch"
+// A client listing this gets blocks as BLOCK_SEQ messages, which can overtake transactions (see BlockSequencer)
+#define VERSION_FEATURE_BLOCK_SEQ "blockseq"
 #define MAX_RELAY_TRANSACTION_BYTES 100000
 #define MAX_FAS_TOTAL_SIZE 5000000
+// Each TRANSACTIONS message carries (4 byte BE length, transaction)s totalling at most this
+#define MAX_TX_BATCH_BYTES 500000
 
 #define OLD_MAX_RELAY_TRANSACTION_BYTES 10000
 #define OLD_MAX_RELAY_OVERSIZE_TRANSACTION_BYTES 200000
@@ -72,6 +82,12 @@ struct relay_msg_header {
 
 // Limit outbound to avg 2Mbps worst-case (2Mb / 1000 ms)
 #define OUTBOUND_THROTTLE_BYTES_PER_MS 250
+// Default token bucket size for that throttle, overridable with RELAY_THROTTLE_BURST_BYTES
+#define OUTBOUND_THROTTLE_BURST_BYTES 65536
+
+// Per-connection inbound ring starts at SO_RCVBUF clamped to these and grows on bursts
+#define INBOUND_BUFFER_MIN_SIZE 65536
+#define INBOUND_BUFFER_MAX_SIZE 2000000
 
 
 
@@ -121,6 +137,16 @@ static_assert(sizeof(struct bitcoin_version_start) == 4 + 8 + 8 + 26 + 26 + 8 +
 #endif // BITCOIN_UA
 
 
+/***********************
+ **** Buffer pooling ****
+ ***********************/
+// Message buffers come from size-classed freelists (64 bytes to 4MB) so that the
+// hot paths don't each go back to malloc. They are plain shared_ptr<vector>s, so
+// they can go anywhere a message can, and go back to the pool when the last
+// reference is dropped. The vector starts out with size bytes (zeroed) and
+// room for at least capacity without reallocating.
+std::shared_ptr<std::vector<unsigned char> > pooled_buffer(size_t size, size_t capacity=0);
+
 /***************************
  **** Varint processing ****
  ***************************/
@@ -142,7 +168,71 @@ std::string gethostname(struct sockaddr_in6 *addr);
 bool lookup_address(const char* addr, struct sockaddr_in6* res);
 bool lookup_cname(const char* host, std::string& cname);
 void prepare_message(const char* command, unsigned char* headerAndData, size_t datalen);
+// A whole relay message (type is as in RELAY_DECLARE_CLASS_VARS) in one buffer
+std::shared_ptr<std::vector<unsigned char> > relay_msg(uint32_t type, const void* data, size_t datalen);
 int create_connect_socket(const std::string& serverHost, const uint16_t serverPort, std::string& error);
+// Whether a VERSION message's data (of len bytes) lists feature (see VERSION_FEATURE_TX_BATCH)
+bool version_has_feature(const char* data, size_t len, const char* feature);
+
+/* Parses a stream in place out of views of its already-buffered bytes (eg Connection::peek),
+ * so that many small fields cost one lock (or copy) between them instead of one each.
+ * peek(min_bytes, avail) must return a view of at least min_bytes (which is never more than
+ * INBOUND_BUFFER_MIN_SIZE) unread bytes, waiting for them if need be, and set avail to the
+ * size of the view, or return NULL on error. consume(nbyte) drops the first nbyte unread
+ * bytes and invalidates the view. Any pointer returned is only valid until the next call. */
+class BufferedReader {
+public:
+	typedef std::function<const unsigned char* (size_t, size_t&)> peek_func;
+	typedef std::function<void (size_t)> consume_func;
+
+private:
+	const peek_func peek;
+	const consume_func consume;
+	const unsigned char *view, *pos, *end;
+
+	bool refill(size_t min_bytes) {
+		release();
+		size_t avail = 0;
+		view = pos = peek(min_bytes, avail);
+		end = pos ? pos + avail : NULL;
+		return pos != NULL;
+	}
+
+public:
+	BufferedReader(const peek_func& peek_in, const consume_func& consume_in)
+		: peek(peek_in), consume(consume_in), view(NULL), pos(NULL), end(NULL) {}
+	BufferedReader(const BufferedReader&) = delete;
+	~BufferedReader() { release(); }
+
+	// The next nbyte (<= INBOUND_BUFFER_MIN_SIZE) bytes, or NULL
+	const unsigned char* take(size_t nbyte) {
+		if (unlikely(size_t(end - pos) < nbyte) && !refill(nbyte))
+			return NULL;
+		pos += nbyte;
+		return pos - nbyte;
+	}
+	// Whatever is buffered (at least one byte), without taking it, or NULL
+	const unsigned char* peek_some(size_t& avail) {
+		if (pos == end && !refill(1))
+			return NULL;
+		avail = end - pos;
+		return pos;
+	}
+	// Takes nbyte of what peek_some returned
+	void skip(size_t nbyte) { assert(nbyte <= size_t(end - pos)); pos += nbyte; }
+	// Copies out nbyte bytes, which can be any number, returning false on error
+	bool read(void* buf, size_t nbyte);
+
+	// Gives back everything taken so far, which must be done before reading the stream
+	// any other way (and is done on destruction)
+	void release() {
+		if (view)
+			consume(pos - view);
+		view = pos = end = NULL;
+	}
+};
+// Reads nbyte into buf, double-SHA256ing it into hash as it comes in
+bool read_hashing(BufferedReader& reader, unsigned char* buf, size_t nbyte, uint32_t hash[8]);
 
 /*********************
  *** Hashing utils ***
@@ -155,6 +245,48 @@ void double_sha256_init(uint32_t state[8]);
 void double_sha256_step(const unsigned char* input, uint64_t byte_count, uint32_t state[8]);
 void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_t total_byte_count, uint32_t state[8]);
 
+// Which SHA-256 kernels were picked for this CPU, for the startup log
+std::string sha256_implementation();
+// Calls callback with every single-message SHA-256 transform this machine can run (for benchmarks)
+void sha256_for_each_implementation(const std::function<void (const char*, void (*)(void*, uint32_t[8], uint64_t))>& callback);
+
+// Hash count independent messages at once, double_sha256_lanes() of them per SIMD pass.
+// res may overlap the inputs (they are all read before any result is written).
+size_t double_sha256_lanes();
+void double_sha256_multi(const unsigned char* const* inputs, const uint64_t* byte_counts, unsigned char* const* res, size_t count);
+void double_sha256_64_multi(const unsigned char* inputs, unsigned char* res, size_t count);
+
+/************************
+ *** Thread placement ***
+ ************************/
+// Pins the calling thread to the index'th (wrapping around) CPU listed in the cpus_env
+// environment variable (eg "2,3" or "4-7"), and, if RELAY_SCHED_FIFO is set to a priority,
+// switches it to SCHED_FIFO. Does nothing if cpus_env is unset or we aren't on Linux.
+void pin_thread(const char* cpus_env, size_t index, const char* name);
+
+/* A fixed set of threads, started once and pinned with pin_thread(cpus_env, first_cpu + i, name),
+ * which run the parts of one job at a time alongside whoever hands it over. A job must not
+ * run() another on the same pool, as only one job runs at once. */
+class WorkerPool {
+private:
+	std::mutex run_mutex, mutex;
+	std::condition_variable work_cv, done_cv;
+	const std::function<void (size_t)>* job;
+	size_t job_parts, next_part, parts_done;
+	const size_t thread_count;
+
+	void do_parts(std::unique_lock<std::mutex>& lock);
+	void worker(const char* cpus_env, size_t cpu, const char* name);
+
+public:
+	WorkerPool(size_t threads, const char* cpus_env, size_t first_cpu, const char* name);
+	WorkerPool(const WorkerPool&) = delete;
+	size_t threads() const { return thread_count; }
+
+	// Runs func(0) through func(parts - 1) on the workers and the calling thread
+	void run(size_t parts, const std::function<void (size_t)>& func);
+};
+
 /********************
  *** Random stuff ***
  ********************/
@@ -179,54 +311,4 @@ void do_assert(bool flag, const char* file, unsigned long line);
 #define ALWAYS_ASSERT assert
 #endif
 
-#define STAMPOUT() do { \
-		struct timeval now_tv; \
-		struct tm tm; \
-		int ms; \
-		gettimeofday(&now_tv, NULL); \
-		ms = (int)(now_tv.tv_usec / 1000); \
-		gmtime_r(&(now_tv.tv_sec), &tm); \
-		printf("[%d-%02d-%02d %02d:%02d:%02d.%03d+00] ", \
-			tm.tm_year + 1900, \
-			tm.tm_mon + 1, \
-			tm.tm_mday, \
-			tm.tm_hour, \
-			tm.tm_min, \
-			tm.tm_sec, \
-			ms); \
-	} while(0)
-
-/****************************************************************
- *** A mutex that gives acess to the count of waiting threads ***
- ****************************************************************/
-class WaitCountMutex {
-private:
-	std::mutex mutex;
-	std::atomic_int waitCount;
-
-	friend class WaitCountHint;
-public:
-	WaitCountMutex() { waitCount = 0; }
-	void lock() {
-		if (unlikely(!mutex.try_lock())) {
-			waitCount.fetch_add(1, std::memory_order_release);
-			mutex.lock();
-			waitCount.fetch_sub(1, std::memory_order_relaxed);
-		}
-	}
-	bool try_lock() { return mutex.try_lock(); }
-	void unlock() { return mutex.unlock(); }
-	int wait_count() { return waitCount.load(std::memory_order_acquire); }
-};
-
-class WaitCountHint {
-private:
-	WaitCountMutex* mutex;
-public:
-	WaitCountHint(WaitCountMutex& mutexIn)
-		: mutex(&mutexIn)
-		{ mutex->waitCount.fetch_add(1, std::memory_order_release); }
-	~WaitCountHint() { mutex->waitCount.fetch_sub(1, std::memory_order_relaxed); }
-};
-
 #endif